@@ -14,7 +14,13 @@ public class DiscordGame : ModuleRules
 			"CoreUObject",
 			"DiscordGameSDK",
 			"Engine",
+			"NetCore",
+			"PacketHandler",
 			"Projects",
+			"Sockets",
 		});
+
+		// zlib for preset-dictionary compression of small network messages
+		AddEngineThirdPartyPrivateStaticDependencies(Target, "zlib");
 	}
 }
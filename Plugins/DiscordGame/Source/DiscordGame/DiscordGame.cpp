@@ -1,6 +1,7 @@
 // Copyright (c) 2024 xist.gg
 
 #include "DiscordGame.h"
+#include "DiscordSaveGameSystem.h"
 #include "Modules/ModuleManager.h"
 #include "Interfaces/IPluginManager.h"  // IWYU pragma: keep
 
@@ -29,10 +30,15 @@ void FDiscordGameModule::StartupModule()
 			UE_LOG(LogDiscord, Error, TEXT("Failed to load Discord GameSDK DLL [%s]"), *LibraryPath);
 		}
 	}
+
+	// Cheap until it has storage; created up front so the subsystem can hand it storage whenever Discord connects
+	SaveGameSystem = MakeShared<FDiscordSaveGameSystem>();
 }
 
 void FDiscordGameModule::ShutdownModule()
 {
+	SaveGameSystem.Reset();
+
 	if (DiscordGameSDKHandle)
 	{
 		// Free the dll handle
@@ -41,6 +47,11 @@ void FDiscordGameModule::ShutdownModule()
 	}
 }
 
+ISaveGameSystem* FDiscordGameModule::GetSaveGameSystem()
+{
+	return SaveGameSystem.Get();
+}
+
 FString FDiscordGameModule::GetPathToDLL() const
 {
 	// Add on the relative location of the third party dll and load it
@@ -3,10 +3,13 @@
 #pragma once
 
 #include "Modules/ModuleManager.h"
+#include "PlatformFeatures.h"
 
 DECLARE_LOG_CATEGORY_EXTERN(LogDiscord, Log, All);
 
-class FDiscordGameModule : public IModuleInterface
+class FDiscordSaveGameSystem;
+
+class FDiscordGameModule : public ISaveGameSystemModule
 {
 public:
 	/** Name of this module */
@@ -25,11 +28,22 @@ public:
 	 */
 	FORCEINLINE bool IsDiscordSDKLoaded() const { return DiscordGameSDKHandle != nullptr; }
 
+	/**
+	 * Get the Discord storage backed save game system.
+	 * UGameplayStatics only uses it if DefaultEngine.ini sets [PlatformFeatures] SaveGameSystemModule=DiscordGame
+	 * @return The save game system, or nullptr if the module isn't started
+	 */
+	FDiscordSaveGameSystem* GetDiscordSaveGameSystem() const { return SaveGameSystem.Get(); }
+
 	//~IModuleInterface interface
 	virtual void StartupModule() override;
 	virtual void ShutdownModule() override;
 	//~End of IModuleInterface interface
 
+	//~ISaveGameSystemModule interface
+	virtual ISaveGameSystem* GetSaveGameSystem() override;
+	//~End of ISaveGameSystemModule interface
+
 protected:
 	/**
 	 * Get the path to the Discord GameSDK DLL for the current platform.
@@ -41,4 +55,7 @@ private:
 	/** Handle to the dll we will load */
 	void* DiscordGameSDKHandle {nullptr};
 
+	/** Save game system, given storage by UDiscordGameSubsystem while Discord is running */
+	TSharedPtr<FDiscordSaveGameSystem> SaveGameSystem;
+
 };
@@ -2,6 +2,7 @@
 
 #include "DiscordGameSubsystem.h"
 #include "DiscordGame.h"
+#include "DiscordSaveGameSystem.h"
 
 UDiscordGameSubsystem::UDiscordGameSubsystem()
 {
@@ -67,10 +68,21 @@ void UDiscordGameSubsystem::NativeOnDiscordCoreCreated()
 	// In case we get disconnected and we need to try to reconnect,
 	// make sure we'll log any future connection errors.
 	bLogConnectionErrors = true;
+
+	// Save games can go to Discord storage now
+	if (FDiscordSaveGameSystem* SaveGameSystem = DiscordGameModule ? DiscordGameModule->GetDiscordSaveGameSystem() : nullptr)
+	{
+		SaveGameSystem->SetStorage(Storage);
+	}
 }
 
 void UDiscordGameSubsystem::NativeOnDiscordCoreReset()
 {
+	// The save game system's storage holds a reference into the DiscordCore, which is gone
+	if (FDiscordSaveGameSystem* SaveGameSystem = DiscordGameModule ? DiscordGameModule->GetDiscordSaveGameSystem() : nullptr)
+	{
+		SaveGameSystem->SetStorage(nullptr);
+	}
 }
 
 void UDiscordGameSubsystem::NativeOnDiscordConnectError(discord::Result Result)
@@ -200,7 +212,12 @@ void UDiscordGameSubsystem::TryCreateDiscordCore(float DeltaTime)
 		{
 		case discord::Result::Ok:
 			UE_LOG(LogDiscord, Log, TEXT("Created Discord Core"));
+
+			// One storage per DiscordCore, shared by everything; see GetStorage
+			Storage = MakeShared<FDiscordStorage>(*DiscordCorePtr);
+
 			NativeOnDiscordCoreCreated();
+			OnDiscordCoreCreated.Broadcast();
 			break;
 
 		default:
@@ -227,8 +244,14 @@ void UDiscordGameSubsystem::ResetDiscordCore()
 		//-- delete DiscordCorePtr;
 		DiscordCorePtr = nullptr;
 
+		// Let anything that was using the DiscordCore know that it's gone
+		OnDiscordCoreReset.Broadcast();
+
 		// Allow child classes the opportunity to react to this event
 		NativeOnDiscordCoreReset();
+
+		// Everything built on the storage has let it go by now
+		Storage.Reset();
 	}
 
 	// Ensure that next tick we'll immediately try reconnecting (if still ticking)
@@ -5,6 +5,7 @@
 #include "CoreMinimal.h"
 #include "discord-cpp/discord.h"
 #include "DiscordGame.h"
+#include "DiscordStorage.h"
 #include "Subsystems/EngineSubsystem.h"
 #include "Engine/Engine.h"
 #include "Containers/Ticker.h"
@@ -90,6 +91,36 @@ public:
 		return *DiscordCorePtr;
 	}
 
+	/**
+	 * Get the Discord storage for the current DiscordCore.
+	 *
+	 * Storage helpers (write cache, index, journal, ...) and the save game system
+	 * should all share this one, since each FDiscordStorage recovers interrupted
+	 * atomic writes when it's created; a second one would race the first one's writes.
+	 *
+	 * It's created before NativeOnDiscordCoreCreated and let go after NativeOnDiscordCoreReset,
+	 * so anything built on it MUST let it go no later than that.
+	 *
+	 * @return The storage, or nullptr if Discord is not running
+	 */
+	TSharedPtr<FDiscordStorage> GetStorage() const { return Storage; }
+
+	/**
+	 * Broadcast any time we gain a new connection to Discord, after NativeOnDiscordCoreCreated.
+	 *
+	 * Use this to (re)create objects that keep references into DiscordCore()
+	 * when you aren't in a position to override the Native hooks.
+	 */
+	FSimpleMulticastDelegate OnDiscordCoreCreated;
+
+	/**
+	 * Broadcast any time the DiscordCore is reset, before NativeOnDiscordCoreReset.
+	 *
+	 * Anything holding references into DiscordCore() MUST let them go here,
+	 * they are no longer valid.
+	 */
+	FSimpleMulticastDelegate OnDiscordCoreReset;
+
 protected:
 	/**
 	 * Called any time we gain a new connection to Discord running on the local machine.
@@ -205,6 +236,9 @@ private:
 	/** Currently-connected DiscordCore, if any */
 	discord::Core* DiscordCorePtr {nullptr};
 
+	/** Storage for the current DiscordCore, shared by everything that uses it */
+	TSharedPtr<FDiscordStorage> Storage;
+
 	/** Tick delegate, if ticking is currently enabled */
 	FTSTicker::FDelegateHandle TickDelegateHandle;
 
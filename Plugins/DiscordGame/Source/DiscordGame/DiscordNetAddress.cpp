@@ -0,0 +1,50 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetAddress.h"
+
+const FName FInternetAddrDiscord::ProtocolType (TEXT("Discord"));
+
+void FInternetAddrDiscord::SetIp(const TCHAR* InAddr, bool& bIsValid)
+{
+	// The only "IP" format we understand is the decimal peer id, as written by ToString
+	bIsValid = InAddr && *InAddr && FCString::IsNumeric(InAddr);
+	PeerId = bIsValid ? FCString::Strtoui64(InAddr, nullptr, 10) : 0;
+}
+
+void FInternetAddrDiscord::SetRawIp(const TArray<uint8>& RawAddr)
+{
+	PeerId = 0;
+	if (RawAddr.Num() == sizeof(PeerId))
+	{
+		FMemory::Memcpy(&PeerId, RawAddr.GetData(), sizeof(PeerId));
+	}
+}
+
+TArray<uint8> FInternetAddrDiscord::GetRawIp() const
+{
+	TArray<uint8> RawAddr;
+	RawAddr.Append(reinterpret_cast<const uint8*>(&PeerId), sizeof(PeerId));
+	return RawAddr;
+}
+
+FString FInternetAddrDiscord::ToString(bool bAppendPort) const
+{
+	// Discord peers don't have ports
+	return FString::Printf(TEXT("%llu"), PeerId);
+}
+
+bool FInternetAddrDiscord::operator==(const FInternetAddr& Other) const
+{
+	return Other.GetProtocolType() == ProtocolType
+		&& static_cast<const FInternetAddrDiscord&>(Other).PeerId == PeerId;
+}
+
+uint32 FInternetAddrDiscord::GetTypeHash() const
+{
+	return ::GetTypeHash(PeerId);
+}
+
+TSharedRef<FInternetAddr> FInternetAddrDiscord::Clone() const
+{
+	return MakeShared<FInternetAddrDiscord>(PeerId);
+}
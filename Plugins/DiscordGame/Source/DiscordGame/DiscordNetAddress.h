@@ -0,0 +1,54 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "IPAddress.h"
+
+/**
+ * Internet Address for Discord Peers
+ *
+ * Unreal's networking identifies remote endpoints with FInternetAddr.
+ * Discord doesn't use IP addresses, it uses a peer id, so this wraps
+ * the peer id in an FInternetAddr for UDiscordNetDriver.
+ *
+ * The "IP" functions are not meaningful for Discord peers and do nothing.
+ */
+class DISCORDGAME_API FInternetAddrDiscord : public FInternetAddr
+{
+public:
+	/** Protocol type reported by GetProtocolType */
+	static const FName ProtocolType;
+
+	FInternetAddrDiscord() = default;
+	explicit FInternetAddrDiscord(uint64 InPeerId) : PeerId(InPeerId) {}
+
+	/** @return The Discord peer id of this address */
+	uint64 GetPeerId() const { return PeerId; }
+
+	/** Set the Discord peer id of this address */
+	void SetPeerId(uint64 InPeerId) { PeerId = InPeerId; }
+
+	//~FInternetAddr interface
+	virtual void SetIp(uint32 InAddr) override {}
+	virtual void SetIp(const TCHAR* InAddr, bool& bIsValid) override;
+	virtual void GetIp(uint32& OutAddr) const override { OutAddr = 0; }
+	virtual void SetPort(int32 InPort) override {}
+	virtual int32 GetPort() const override { return 0; }
+	virtual void SetRawIp(const TArray<uint8>& RawAddr) override;
+	virtual TArray<uint8> GetRawIp() const override;
+	virtual void SetAnyAddress() override { PeerId = 0; }
+	virtual void SetBroadcastAddress() override { PeerId = 0; }
+	virtual void SetLoopbackAddress() override { PeerId = 0; }
+	virtual FString ToString(bool bAppendPort) const override;
+	virtual bool operator==(const FInternetAddr& Other) const override;
+	virtual uint32 GetTypeHash() const override;
+	virtual bool IsValid() const override { return PeerId != 0; }
+	virtual TSharedRef<FInternetAddr> Clone() const override;
+	virtual FName GetProtocolType() const override { return ProtocolType; }
+	//~End of FInternetAddr interface
+
+private:
+	/** The Discord peer id */
+	uint64 PeerId {0};
+};
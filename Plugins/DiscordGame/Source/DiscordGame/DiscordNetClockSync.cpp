@@ -0,0 +1,195 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetClockSync.h"
+#include "DiscordGame.h"
+
+namespace DiscordNetClockSync
+{
+	/** Type byte + T0 */
+	static constexpr uint32 RequestSize = 1 + sizeof(double);
+
+	/** Type byte + T0, T1, T2 */
+	static constexpr uint32 ResponseSize = 1 + 3 * sizeof(double);
+}
+
+FDiscordNetClockSync::FDiscordNetClockSync(const TSharedRef<IDiscordNetTransport>& InTransport, uint8 InChannelId, const FDiscordNetClockSyncSettings& InSettings)
+	: Transport(InTransport)
+	, ChannelId(InChannelId)
+	, Settings(InSettings)
+{
+	Settings.SampleWindow = FMath::Max(Settings.SampleWindow, 1);
+	Settings.OffsetSmoothing = FMath::Clamp(Settings.OffsetSmoothing, 0.01f, 1.f);
+
+	MessageHandle = Transport->OnMessage().AddRaw(this, &FDiscordNetClockSync::HandleMessage);
+}
+
+FDiscordNetClockSync::~FDiscordNetClockSync()
+{
+	Transport->OnMessage().Remove(MessageHandle);
+}
+
+void FDiscordNetClockSync::AddPeer(uint64 PeerId)
+{
+	Peers.FindOrAdd(PeerId);
+}
+
+void FDiscordNetClockSync::RemovePeer(uint64 PeerId)
+{
+	Peers.Remove(PeerId);
+}
+
+void FDiscordNetClockSync::Tick()
+{
+	const double Now = GetLocalTime();
+
+	for (TPair<uint64, FPeerClock>& It : Peers)
+	{
+		FPeerClock& Peer = It.Value;
+
+		const float Interval = Peer.NumRequestsSent < Settings.InitialBurstCount ? Settings.BurstIntervalSeconds : Settings.SyncIntervalSeconds;
+		if (Peer.NumRequestsSent > 0 && Now - Peer.LastRequestTime < Interval)
+		{
+			continue;
+		}
+
+		uint8 Message[DiscordNetClockSync::RequestSize];
+		Message[0] = static_cast<uint8>(EMessageType::Request);
+		FMemory::Memcpy(Message + 1, &Now, sizeof(double));
+
+		const discord::Result Result = Transport->SendMessage(It.Key, ChannelId, Message, sizeof(Message));
+		if (Result != discord::Result::Ok)
+		{
+			UE_LOG(LogDiscord, Verbose, TEXT("Error(%i) Sending clock sync request to peer %llu"), Result, It.Key);
+		}
+
+		++Peer.NumRequestsSent;
+		Peer.LastRequestTime = Now;
+	}
+
+	// Answer requests last, so T2 is as close to the transport's Flush as we can get it
+	for (const FPendingResponse& Pending : PendingResponses)
+	{
+		const double T2 = GetLocalTime();
+
+		uint8 Response[DiscordNetClockSync::ResponseSize];
+		Response[0] = static_cast<uint8>(EMessageType::Response);
+		FMemory::Memcpy(Response + 1, &Pending.T0, sizeof(double));
+		FMemory::Memcpy(Response + 1 + sizeof(double), &Pending.T1, sizeof(double));
+		FMemory::Memcpy(Response + 1 + 2 * sizeof(double), &T2, sizeof(double));
+
+		const discord::Result Result = Transport->SendMessage(Pending.PeerId, ChannelId, Response, sizeof(Response));
+		if (Result != discord::Result::Ok)
+		{
+			UE_LOG(LogDiscord, Verbose, TEXT("Error(%i) Sending clock sync response to peer %llu"), Result, Pending.PeerId);
+		}
+	}
+	PendingResponses.Reset();
+}
+
+bool FDiscordNetClockSync::IsSynchronized(uint64 PeerId) const
+{
+	const FPeerClock* Peer = Peers.Find(PeerId);
+	return Peer && Peer->BestRtt >= 0.;
+}
+
+double FDiscordNetClockSync::GetOffsetSeconds(uint64 PeerId) const
+{
+	const FPeerClock* Peer = Peers.Find(PeerId);
+	return Peer ? Peer->SmoothedOffset : 0.;
+}
+
+double FDiscordNetClockSync::GetRttSeconds(uint64 PeerId) const
+{
+	const FPeerClock* Peer = Peers.Find(PeerId);
+	return Peer ? Peer->BestRtt : -1.;
+}
+
+double FDiscordNetClockSync::GetServerTime() const
+{
+	if (ServerPeerId == 0 || ServerPeerId == Transport->GetLocalPeerId())
+	{
+		return GetLocalTime();
+	}
+
+	return GetPeerTime(ServerPeerId);
+}
+
+void FDiscordNetClockSync::HandleMessage(uint64 PeerId, uint8 MessageChannelId, const uint8* Data, uint32 DataLength)
+{
+	using namespace DiscordNetClockSync;
+
+	if (MessageChannelId != ChannelId || DataLength < 1)
+	{
+		return;
+	}
+
+	// Stamp arrival before doing anything else
+	const double Now = GetLocalTime();
+
+	if (Data[0] == static_cast<uint8>(EMessageType::Request) && DataLength == RequestSize)
+	{
+		// Answer anyone who asks, whether or not we're syncing with them.
+		// A message sent now would only go out at the next Flush, and the time it waits
+		// for that must count as ours (T2 - T1), not the network's, so answer it in Tick.
+		FPendingResponse& Pending = PendingResponses.AddDefaulted_GetRef();
+		Pending.PeerId = PeerId;
+		FMemory::Memcpy(&Pending.T0, Data + 1, sizeof(double));
+		Pending.T1 = Now;
+	}
+	else if (Data[0] == static_cast<uint8>(EMessageType::Response) && DataLength == ResponseSize)
+	{
+		FPeerClock* Peer = Peers.Find(PeerId);
+		if (!Peer)
+		{
+			return;
+		}
+
+		double T0, T1, T2;
+		FMemory::Memcpy(&T0, Data + 1, sizeof(double));
+		FMemory::Memcpy(&T1, Data + 1 + sizeof(double), sizeof(double));
+		FMemory::Memcpy(&T2, Data + 1 + 2 * sizeof(double), sizeof(double));
+
+		AddSample(*Peer, T0, T1, T2, Now);
+	}
+	else
+	{
+		UE_LOG(LogDiscord, Verbose, TEXT("Ignoring malformed clock sync message (%u bytes) from peer %llu"), DataLength, PeerId);
+	}
+}
+
+void FDiscordNetClockSync::AddSample(FPeerClock& Peer, double T0, double T1, double T2, double T3)
+{
+	FSample Sample;
+	Sample.Rtt = (T3 - T0) - (T2 - T1);
+	Sample.Offset = ((T1 - T0) + (T2 - T3)) * 0.5;
+
+	if (Sample.Rtt < 0.)
+	{
+		// Only a corrupt or forged response can take negative time
+		return;
+	}
+
+	if (Peer.Samples.Num() < Settings.SampleWindow)
+	{
+		Peer.Samples.Add(Sample);
+	}
+	else
+	{
+		Peer.Samples[Peer.NextSample] = Sample;
+	}
+	Peer.NextSample = (Peer.NextSample + 1) % Settings.SampleWindow;
+
+	// The least delayed sample in the window has the tightest error bound, so trust that one
+	const FSample* Best = &Peer.Samples[0];
+	for (const FSample& Candidate : Peer.Samples)
+	{
+		if (Candidate.Rtt < Best->Rtt)
+		{
+			Best = &Candidate;
+		}
+	}
+
+	const bool bFirstSample = Peer.BestRtt < 0.;
+	Peer.BestRtt = Best->Rtt;
+	Peer.SmoothedOffset = bFirstSample ? Best->Offset : FMath::Lerp(Peer.SmoothedOffset, Best->Offset, static_cast<double>(Settings.OffsetSmoothing));
+}
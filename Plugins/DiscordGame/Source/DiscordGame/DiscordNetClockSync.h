@@ -0,0 +1,144 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordNetTransport.h"
+
+/**
+ * Settings for FDiscordNetClockSync
+ */
+struct DISCORDGAME_API FDiscordNetClockSyncSettings
+{
+	/** Seconds between sync requests to each peer, once synchronized */
+	float SyncIntervalSeconds {1.f};
+
+	/** Number of quick requests sent to a new peer, to synchronize fast */
+	int32 InitialBurstCount {8};
+
+	/** Seconds between the quick requests sent to a new peer */
+	float BurstIntervalSeconds {0.1f};
+
+	/** Number of recent samples to pick the best (lowest RTT) one from */
+	int32 SampleWindow {16};
+
+	/** How far [0..1] the smoothed offset moves toward the best sample each time a sample arrives */
+	float OffsetSmoothing {0.2f};
+};
+
+/**
+ * Discord Network Clock Synchronization
+ *
+ * Estimates the offset between our clock (FPlatformTime::Seconds) and each
+ * peer's, by exchanging timestamped requests and responses on a dedicated
+ * unreliable channel, NTP style:
+ *
+ *   Offset = ((T1 - T0) + (T2 - T3)) / 2       RTT = (T3 - T0) - (T2 - T1)
+ *
+ * where T0/T3 are our send/receive times and T1/T2 the peer's receive/send times.
+ * A sample's error is at most half its RTT, and most of the noise is queueing
+ * delay that only ever makes RTT longer, so the offset comes from the lowest RTT
+ * sample in a recent window, smoothed so it doesn't jump between samples.
+ *
+ * Every peer must run one of these on the same channel, and open that channel
+ * (unreliable) to each other.  Call Tick() once per frame, right before the transport's
+ * Flush: requests and responses are stamped with their send time in Tick, so any time
+ * between Tick and Flush reads as network delay and skews the offset.
+ */
+class DISCORDGAME_API FDiscordNetClockSync
+{
+public:
+	/**
+	 * @param InTransport Transport to sync over; usually an FDiscordPeerNetTransport
+	 * @param InChannelId Channel reserved for clock sync messages
+	 * @param InSettings Sync rate and filtering settings
+	 */
+	FDiscordNetClockSync(const TSharedRef<IDiscordNetTransport>& InTransport, uint8 InChannelId, const FDiscordNetClockSyncSettings& InSettings = FDiscordNetClockSyncSettings());
+	~FDiscordNetClockSync();
+
+	/** Start synchronizing with a peer */
+	void AddPeer(uint64 PeerId);
+
+	/** Stop synchronizing with a peer */
+	void RemovePeer(uint64 PeerId);
+
+	/** Send any sync requests that are due, and responses to the requests we got; call once per frame */
+	void Tick();
+
+	/** @return TRUE if we have at least one sample from this peer */
+	bool IsSynchronized(uint64 PeerId) const;
+
+	/** @return Smoothed (peer clock - our clock) in seconds, or 0 if not synchronized */
+	double GetOffsetSeconds(uint64 PeerId) const;
+
+	/** @return Lowest round trip time in the recent sample window, or negative if not synchronized */
+	double GetRttSeconds(uint64 PeerId) const;
+
+	/** @return Our best estimate of a peer's clock right now */
+	double GetPeerTime(uint64 PeerId) const { return GetLocalTime() + GetOffsetSeconds(PeerId); }
+
+	/** @return Our own clock */
+	static double GetLocalTime() { return FPlatformTime::Seconds(); }
+
+	/** Choose the peer whose clock is the shared "server" clock; 0 (or our own peer id) means us */
+	void SetServerPeer(uint64 PeerId) { ServerPeerId = PeerId; }
+
+	/** @return Our best estimate of the server clock right now */
+	double GetServerTime() const;
+
+private:
+	/** Message types */
+	enum class EMessageType : uint8
+	{
+		Request = 1,
+		Response = 2,
+	};
+
+	struct FSample
+	{
+		double Offset {0.};
+		double Rtt {0.};
+	};
+
+	struct FPeerClock
+	{
+		/** Recent samples, as a ring */
+		TArray<FSample> Samples;
+		int32 NextSample {0};
+
+		double SmoothedOffset {0.};
+		double BestRtt {-1.};
+
+		int32 NumRequestsSent {0};
+		double LastRequestTime {0.};
+	};
+
+	/** A request we got, to answer in the next Tick */
+	struct FPendingResponse
+	{
+		uint64 PeerId {0};
+
+		/** Their send time, and our receive time */
+		double T0 {0.};
+		double T1 {0.};
+	};
+
+	/** Called by the transport for every message */
+	void HandleMessage(uint64 PeerId, uint8 MessageChannelId, const uint8* Data, uint32 DataLength);
+
+	/** Add a sample from a response, and update the peer's offset */
+	void AddSample(FPeerClock& Peer, double T0, double T1, double T2, double T3);
+
+	TSharedRef<IDiscordNetTransport> Transport;
+	uint8 ChannelId {0};
+	FDiscordNetClockSyncSettings Settings;
+
+	TMap<uint64, FPeerClock> Peers;
+
+	/** Requests not yet answered; T2 is stamped when Tick sends the answer, just before the Flush */
+	TArray<FPendingResponse> PendingResponses;
+
+	uint64 ServerPeerId {0};
+
+	FDelegateHandle MessageHandle;
+};
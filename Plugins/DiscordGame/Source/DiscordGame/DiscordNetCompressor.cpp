@@ -0,0 +1,358 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetCompressor.h"
+#include "DiscordGame.h"
+#include "HAL/IConsoleManager.h"
+#include "Misc/Compression.h"
+
+THIRD_PARTY_INCLUDES_START
+#include "zlib.h"
+THIRD_PARTY_INCLUDES_END
+
+namespace DiscordNetCompressor
+{
+	/** First byte of every message on a compressed channel */
+	enum class EMethod : uint8
+	{
+		Raw = 0,
+		Format = 1,
+		Dictionary = 2,
+	};
+
+	/** Most bytes a 32-bit varint can take */
+	static constexpr int32 MaxVarIntBytes = 5;
+
+	/** Every FDiscordNetCompressor currently alive */
+	static TArray<FDiscordNetCompressor*>& GetRegistry()
+	{
+		static TArray<FDiscordNetCompressor*> Registry;
+		return Registry;
+	}
+
+	/** Write a 7-bits-per-byte varint; @return Number of bytes written */
+	static int32 WriteVarInt(uint8* Out, uint32 Value)
+	{
+		int32 NumBytes {0};
+		while (Value >= 0x80)
+		{
+			Out[NumBytes++] = static_cast<uint8>(Value | 0x80);
+			Value >>= 7;
+		}
+		Out[NumBytes++] = static_cast<uint8>(Value);
+		return NumBytes;
+	}
+
+	/** Read a varint written by WriteVarInt; @return Number of bytes read, or 0 if malformed */
+	static int32 ReadVarInt(const uint8* In, uint32 InLength, uint32& OutValue)
+	{
+		OutValue = 0;
+		for (int32 Index = 0; Index < MaxVarIntBytes && static_cast<uint32>(Index) < InLength; ++Index)
+		{
+			OutValue |= static_cast<uint32>(In[Index] & 0x7f) << (7 * Index);
+			if ((In[Index] & 0x80) == 0)
+			{
+				return Index + 1;
+			}
+		}
+		return 0;
+	}
+
+	static FAutoConsoleCommand CmdCompression(
+		TEXT("Discord.Net.Compression"),
+		TEXT("Log compression ratio and CPU cost for every compressed Discord channel"),
+		FConsoleCommandDelegate::CreateLambda([]()
+		{
+			if (GetRegistry().Num() == 0)
+			{
+				UE_LOG(LogDiscord, Display, TEXT("No Discord channels are compressed"));
+				return;
+			}
+
+			for (int32 Index = 0; Index < GetRegistry().Num(); ++Index)
+			{
+				const FDiscordNetCompressor* Compressor = GetRegistry()[Index];
+				for (const uint8 ChannelId : Compressor->GetCompressedChannels())
+				{
+					const FDiscordNetCompressionStats& Stats = *Compressor->GetChannelStats(ChannelId);
+					const uint64 NumSent = Stats.MessagesCompressed + Stats.MessagesSentRaw;
+
+					UE_LOG(LogDiscord, Display, TEXT("Compressor %i Channel %u: Ratio=%.3f (%llu -> %llu bytes) Compressed=%llu Raw=%llu Compress=%.3fms (%.2fus/msg) Decompressed=%llu Decompress=%.3fms Errors=%llu"),
+						Index, ChannelId,
+						Stats.GetRatio(), Stats.BytesIn, Stats.BytesOut,
+						Stats.MessagesCompressed, Stats.MessagesSentRaw,
+						FPlatformTime::ToMilliseconds64(Stats.CompressCycles),
+						NumSent > 0 ? FPlatformTime::ToMilliseconds64(Stats.CompressCycles) * 1000. / NumSent : 0.,
+						Stats.MessagesDecompressed,
+						FPlatformTime::ToMilliseconds64(Stats.DecompressCycles),
+						Stats.DecompressErrors);
+				}
+			}
+		}));
+}
+
+FDiscordNetCompressor::FDiscordNetCompressor(const TSharedRef<IDiscordNetTransport>& InInner)
+	: FDiscordNetTransportDecorator(InInner)
+{
+	DiscordNetCompressor::GetRegistry().Add(this);
+}
+
+FDiscordNetCompressor::~FDiscordNetCompressor()
+{
+	DiscordNetCompressor::GetRegistry().RemoveSingleSwap(this);
+
+	for (TPair<uint8, FChannelState>& It : Channels)
+	{
+		FreeStreams(It.Value);
+	}
+}
+
+const TArray<FDiscordNetCompressor*>& FDiscordNetCompressor::GetAllCompressors()
+{
+	return DiscordNetCompressor::GetRegistry();
+}
+
+void FDiscordNetCompressor::SetChannelCompression(uint8 ChannelId, const FDiscordNetCompressionSettings& Settings)
+{
+	FChannelState& State = Channels.FindOrAdd(ChannelId);
+
+	// Streams are created lazily, for whichever dictionary is current
+	FreeStreams(State);
+	State.Settings = Settings;
+}
+
+void FDiscordNetCompressor::ClearChannelCompression(uint8 ChannelId)
+{
+	if (FChannelState* State = Channels.Find(ChannelId))
+	{
+		FreeStreams(*State);
+		Channels.Remove(ChannelId);
+	}
+}
+
+const FDiscordNetCompressionStats* FDiscordNetCompressor::GetChannelStats(uint8 ChannelId) const
+{
+	const FChannelState* State = Channels.Find(ChannelId);
+	return State ? &State->Stats : nullptr;
+}
+
+TArray<uint8> FDiscordNetCompressor::GetCompressedChannels() const
+{
+	TArray<uint8> Result;
+	Channels.GenerateKeyArray(Result);
+	Result.Sort();
+	return Result;
+}
+
+discord::Result FDiscordNetCompressor::SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	using namespace DiscordNetCompressor;
+
+	FChannelState* State = Channels.Find(ChannelId);
+	if (!State)
+	{
+		return Super::SendMessage(PeerId, ChannelId, Data, DataLength);
+	}
+
+	State->Stats.BytesIn += DataLength;
+
+	if (DataLength >= static_cast<uint32>(FMath::Max(State->Settings.MinSizeBytes, 1)) && Compress(*State, Data, DataLength))
+	{
+		++State->Stats.MessagesCompressed;
+	}
+	else
+	{
+		// Raw: just our header byte in front of the original message
+		SendScratch.SetNumUninitialized(1 + DataLength, EAllowShrinking::No);
+		SendScratch[0] = static_cast<uint8>(EMethod::Raw);
+		FMemory::Memcpy(SendScratch.GetData() + 1, Data, DataLength);
+
+		++State->Stats.MessagesSentRaw;
+	}
+
+	State->Stats.BytesOut += SendScratch.Num();
+
+	return Super::SendMessage(PeerId, ChannelId, SendScratch.GetData(), SendScratch.Num());
+}
+
+void FDiscordNetCompressor::HandleInnerMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	using namespace DiscordNetCompressor;
+
+	FChannelState* State = Channels.Find(ChannelId);
+	if (!State)
+	{
+		Super::HandleInnerMessage(PeerId, ChannelId, Data, DataLength);
+		return;
+	}
+
+	if (DataLength < 1)
+	{
+		++State->Stats.DecompressErrors;
+		UE_LOG(LogDiscord, Verbose, TEXT("Dropping empty message from peer %llu on compressed channel %u"), PeerId, ChannelId);
+		return;
+	}
+
+	const uint8 Method = Data[0];
+	if (Method == static_cast<uint8>(EMethod::Raw))
+	{
+		Super::HandleInnerMessage(PeerId, ChannelId, Data + 1, DataLength - 1);
+		return;
+	}
+
+	uint32 UncompressedSize {0};
+	const int32 SizeBytes = ReadVarInt(Data + 1, DataLength - 1, UncompressedSize);
+	if (SizeBytes == 0 || UncompressedSize > static_cast<uint32>(State->Settings.MaxUncompressedBytes))
+	{
+		++State->Stats.DecompressErrors;
+		UE_LOG(LogDiscord, Verbose, TEXT("Dropping malformed compressed message from peer %llu on channel %u"), PeerId, ChannelId);
+		return;
+	}
+
+	const uint32 HeaderSize = 1 + SizeBytes;
+	if (!Decompress(*State, Method, Data + HeaderSize, DataLength - HeaderSize, UncompressedSize))
+	{
+		++State->Stats.DecompressErrors;
+		UE_LOG(LogDiscord, Verbose, TEXT("Dropping message from peer %llu on channel %u that failed to decompress"), PeerId, ChannelId);
+		return;
+	}
+
+	++State->Stats.MessagesDecompressed;
+	Super::HandleInnerMessage(PeerId, ChannelId, ReceiveScratch.GetData(), ReceiveScratch.Num());
+}
+
+bool FDiscordNetCompressor::Compress(FChannelState& State, const uint8* Data, uint32 DataLength)
+{
+	using namespace DiscordNetCompressor;
+
+	const uint64 StartCycles = FPlatformTime::Cycles64();
+	const bool bUseDictionary = State.Settings.Dictionary.Num() > 0;
+
+	// Only output smaller than the input is worth sending, so never give the compressor more room than that
+	uint8 Header[1 + MaxVarIntBytes];
+	Header[0] = static_cast<uint8>(bUseDictionary ? EMethod::Dictionary : EMethod::Format);
+	const int32 HeaderSize = 1 + WriteVarInt(Header + 1, DataLength);
+	const int32 MaxCompressedSize = static_cast<int32>(DataLength) - HeaderSize;
+
+	bool bSuccess {false};
+	int32 CompressedSize {0};
+
+	if (MaxCompressedSize > 0)
+	{
+		if (bUseDictionary)
+		{
+			if (!State.Deflate)
+			{
+				State.Deflate = new z_stream_s();
+				if (deflateInit2(State.Deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+				{
+					UE_LOG(LogDiscord, Error, TEXT("Failed to initialize deflate for Discord channel compression"));
+					delete State.Deflate;
+					State.Deflate = nullptr;
+				}
+			}
+
+			if (State.Deflate)
+			{
+				SendScratch.SetNumUninitialized(HeaderSize + MaxCompressedSize, EAllowShrinking::No);
+
+				z_stream_s& Stream = *State.Deflate;
+				deflateReset(&Stream);
+				deflateSetDictionary(&Stream, State.Settings.Dictionary.GetData(), State.Settings.Dictionary.Num());
+
+				Stream.next_in = const_cast<Bytef*>(Data);
+				Stream.avail_in = DataLength;
+				Stream.next_out = SendScratch.GetData() + HeaderSize;
+				Stream.avail_out = MaxCompressedSize;
+
+				// Anything but Z_STREAM_END means it didn't fit, i.e. it didn't shrink
+				if (deflate(&Stream, Z_FINISH) == Z_STREAM_END)
+				{
+					CompressedSize = MaxCompressedSize - Stream.avail_out;
+					bSuccess = true;
+				}
+			}
+		}
+		else
+		{
+			const int32 Bound = FCompression::CompressMemoryBound(State.Settings.Format, DataLength);
+			SendScratch.SetNumUninitialized(HeaderSize + Bound, EAllowShrinking::No);
+
+			CompressedSize = Bound;
+			bSuccess = FCompression::CompressMemory(State.Settings.Format, SendScratch.GetData() + HeaderSize, CompressedSize, Data, DataLength)
+				&& CompressedSize <= MaxCompressedSize;
+		}
+	}
+
+	if (bSuccess)
+	{
+		FMemory::Memcpy(SendScratch.GetData(), Header, HeaderSize);
+		SendScratch.SetNum(HeaderSize + CompressedSize, EAllowShrinking::No);
+	}
+
+	State.Stats.CompressCycles += FPlatformTime::Cycles64() - StartCycles;
+	return bSuccess;
+}
+
+bool FDiscordNetCompressor::Decompress(FChannelState& State, uint8 Method, const uint8* Data, uint32 DataLength, uint32 UncompressedSize)
+{
+	using namespace DiscordNetCompressor;
+
+	const uint64 StartCycles = FPlatformTime::Cycles64();
+	ReceiveScratch.SetNumUninitialized(UncompressedSize, EAllowShrinking::No);
+
+	bool bSuccess {false};
+
+	if (Method == static_cast<uint8>(EMethod::Dictionary) && State.Settings.Dictionary.Num() > 0)
+	{
+		if (!State.Inflate)
+		{
+			State.Inflate = new z_stream_s();
+			if (inflateInit2(State.Inflate, -MAX_WBITS) != Z_OK)
+			{
+				UE_LOG(LogDiscord, Error, TEXT("Failed to initialize inflate for Discord channel compression"));
+				delete State.Inflate;
+				State.Inflate = nullptr;
+			}
+		}
+
+		if (State.Inflate)
+		{
+			z_stream_s& Stream = *State.Inflate;
+			inflateReset(&Stream);
+
+			// Raw inflate takes the dictionary up front, rather than when it asks for it
+			inflateSetDictionary(&Stream, State.Settings.Dictionary.GetData(), State.Settings.Dictionary.Num());
+
+			Stream.next_in = const_cast<Bytef*>(Data);
+			Stream.avail_in = DataLength;
+			Stream.next_out = ReceiveScratch.GetData();
+			Stream.avail_out = UncompressedSize;
+
+			bSuccess = inflate(&Stream, Z_FINISH) == Z_STREAM_END && Stream.avail_out == 0;
+		}
+	}
+	else if (Method == static_cast<uint8>(EMethod::Format) && State.Settings.Dictionary.Num() == 0)
+	{
+		bSuccess = FCompression::UncompressMemory(State.Settings.Format, ReceiveScratch.GetData(), UncompressedSize, Data, DataLength);
+	}
+
+	State.Stats.DecompressCycles += FPlatformTime::Cycles64() - StartCycles;
+	return bSuccess;
+}
+
+void FDiscordNetCompressor::FreeStreams(FChannelState& State)
+{
+	if (State.Deflate)
+	{
+		deflateEnd(State.Deflate);
+		delete State.Deflate;
+		State.Deflate = nullptr;
+	}
+
+	if (State.Inflate)
+	{
+		inflateEnd(State.Inflate);
+		delete State.Inflate;
+		State.Inflate = nullptr;
+	}
+}
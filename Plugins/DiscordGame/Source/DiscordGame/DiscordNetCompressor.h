@@ -0,0 +1,141 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordNetTransport.h"
+
+struct z_stream_s;
+
+/**
+ * How to compress one channel
+ */
+struct DISCORDGAME_API FDiscordNetCompressionSettings
+{
+	/** Engine compression format (see FCompression), used when there is no Dictionary */
+	FName Format {NAME_Oodle};
+
+	/** Messages smaller than this many bytes are sent raw */
+	int32 MinSizeBytes {64};
+
+	/**
+	 * Optional preset dictionary: bytes that typical messages on this channel have in common.
+	 *
+	 * Small messages hardly compress on their own, since there's nothing earlier in the
+	 * message for the compressor to refer back to.  With a dictionary (e.g. a few
+	 * representative messages concatenated) they can refer back to that instead.
+	 * When set, messages are compressed with raw deflate using this dictionary, and
+	 * Format is ignored.  Both ends MUST use exactly the same dictionary.
+	 */
+	TArray<uint8> Dictionary;
+
+	/** Received messages claiming to decompress to more than this are dropped */
+	int32 MaxUncompressedBytes {1024 * 1024};
+};
+
+/**
+ * Compression counters for one channel
+ */
+struct DISCORDGAME_API FDiscordNetCompressionStats
+{
+	/** Messages sent compressed, and sent raw (too small, or didn't shrink) */
+	uint64 MessagesCompressed {0};
+	uint64 MessagesSentRaw {0};
+
+	/** Bytes given to SendMessage, and bytes actually sent (including our header) */
+	uint64 BytesIn {0};
+	uint64 BytesOut {0};
+
+	uint64 MessagesDecompressed {0};
+	uint64 DecompressErrors {0};
+
+	/** CPU time spent compressing and decompressing, in FPlatformTime cycles */
+	uint64 CompressCycles {0};
+	uint64 DecompressCycles {0};
+
+	/** @return Bytes sent per byte given to SendMessage; lower is better */
+	double GetRatio() const { return BytesIn > 0 ? static_cast<double>(BytesOut) / BytesIn : 1.; }
+};
+
+/**
+ * Discord Network Compressor
+ *
+ * Transport decorator that compresses messages on the channels you opt in with
+ * SetChannelCompression, and decompresses them on the way back in.  Channels
+ * that aren't opted in pass through untouched.
+ *
+ * Both ends must configure a channel identically, since every message on a
+ * compressed channel carries a one byte header saying how it was compressed.
+ * Messages smaller than MinSizeBytes, or that don't shrink, are sent raw
+ * (costing just that header byte).
+ *
+ * Ratio and CPU cost per channel are available from GetChannelStats, or
+ * the `Discord.Net.Compression` console command.
+ */
+class DISCORDGAME_API FDiscordNetCompressor : public FDiscordNetTransportDecorator
+{
+	using Super = FDiscordNetTransportDecorator;
+
+public:
+	explicit FDiscordNetCompressor(const TSharedRef<IDiscordNetTransport>& InInner);
+	virtual ~FDiscordNetCompressor() override;
+
+	/** Compress a channel, or change how it is compressed */
+	void SetChannelCompression(uint8 ChannelId, const FDiscordNetCompressionSettings& Settings);
+
+	/** Stop compressing a channel */
+	void ClearChannelCompression(uint8 ChannelId);
+
+	/** @return The channel's counters, or nullptr if it isn't compressed */
+	const FDiscordNetCompressionStats* GetChannelStats(uint8 ChannelId) const;
+
+	/** @return Every channel that is compressed */
+	TArray<uint8> GetCompressedChannels() const;
+
+	/** @return Every FDiscordNetCompressor currently alive */
+	static const TArray<FDiscordNetCompressor*>& GetAllCompressors();
+
+	//~IDiscordNetTransport interface
+	virtual discord::Result SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) override;
+	//~End of IDiscordNetTransport interface
+
+protected:
+	//~FDiscordNetTransportDecorator interface
+	virtual void HandleInnerMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) override;
+	//~End of FDiscordNetTransportDecorator interface
+
+private:
+	struct FChannelState
+	{
+		FDiscordNetCompressionSettings Settings;
+		FDiscordNetCompressionStats Stats;
+
+		/** zlib streams for dictionary compression, kept and reset per message to avoid reallocating */
+		z_stream_s* Deflate {nullptr};
+		z_stream_s* Inflate {nullptr};
+	};
+
+	/**
+	 * Compress a message into SendScratch, after our header.
+	 * @return TRUE if it compressed to something smaller than the input
+	 */
+	bool Compress(FChannelState& State, const uint8* Data, uint32 DataLength);
+
+	/**
+	 * Decompress a message body into ReceiveScratch.
+	 * @return TRUE on success
+	 */
+	bool Decompress(FChannelState& State, uint8 Method, const uint8* Data, uint32 DataLength, uint32 UncompressedSize);
+
+	/** Free a channel's zlib streams */
+	static void FreeStreams(FChannelState& State);
+
+	/** State for every compressed channel */
+	TMap<uint8, FChannelState> Channels;
+
+	/** Reused for every message we compress */
+	TArray<uint8> SendScratch;
+
+	/** Reused for every message we decompress; separate, since receive handlers may send */
+	TArray<uint8> ReceiveScratch;
+};
@@ -0,0 +1,257 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetCongestionControl.h"
+#include "DiscordGame.h"
+
+namespace DiscordNetCongestionControl
+{
+	/** Type byte + messages sent + send time */
+	static constexpr uint32 MarkSize = 1 + sizeof(uint32) + sizeof(double);
+
+	/** Type byte + messages sent (echoed) + messages received + send time (echoed) */
+	static constexpr uint32 FeedbackSize = 1 + 2 * sizeof(uint32) + sizeof(double);
+
+	/** Weight of each new sample in the smoothed loss and RTT */
+	static constexpr double Smoothing = 0.25;
+}
+
+FDiscordNetCongestionControl::FDiscordNetCongestionControl(const TSharedRef<IDiscordNetTransport>& InInner, uint8 InControlChannelId, const FDiscordNetCongestionSettings& InSettings)
+	: FDiscordNetTransportDecorator(InInner)
+	, ControlChannelId(InControlChannelId)
+	, Settings(InSettings)
+	, ReliableChannels(false, 256)
+{
+	Settings.MinBytesPerSecond = FMath::Max(Settings.MinBytesPerSecond, 1);
+	Settings.MaxBytesPerSecond = FMath::Max(Settings.MaxBytesPerSecond, Settings.MinBytesPerSecond);
+	Settings.InitialBytesPerSecond = FMath::Clamp(Settings.InitialBytesPerSecond, Settings.MinBytesPerSecond, Settings.MaxBytesPerSecond);
+	Settings.DecreaseFactor = FMath::Clamp(Settings.DecreaseFactor, 0.1f, 1.f);
+}
+
+int32 FDiscordNetCongestionControl::GetAllowedBytesPerSecond(uint64 PeerId) const
+{
+	const FPeerState* Peer = Peers.Find(PeerId);
+	return Peer ? FMath::FloorToInt32(Peer->BytesPerSecond) : Settings.InitialBytesPerSecond;
+}
+
+float FDiscordNetCongestionControl::GetLossRate(uint64 PeerId) const
+{
+	const FPeerState* Peer = Peers.Find(PeerId);
+	return Peer ? static_cast<float>(Peer->SmoothedLoss) : 0.f;
+}
+
+double FDiscordNetCongestionControl::GetRttSeconds(uint64 PeerId) const
+{
+	const FPeerState* Peer = Peers.Find(PeerId);
+	return Peer ? Peer->SmoothedRtt : -1.;
+}
+
+FDiscordNetCongestionControl::FPeerState& FDiscordNetCongestionControl::FindOrAddPeer(uint64 PeerId)
+{
+	if (FPeerState* Existing = Peers.Find(PeerId))
+	{
+		return *Existing;
+	}
+
+	FPeerState& Peer = Peers.Add(PeerId);
+	Peer.BytesPerSecond = Settings.InitialBytesPerSecond;
+	Peer.Tokens = Settings.InitialBytesPerSecond * Settings.BurstSeconds;
+	Peer.LastRefillTime = FPlatformTime::Seconds();
+	return Peer;
+}
+
+discord::Result FDiscordNetCongestionControl::ClosePeer(uint64 PeerId)
+{
+	// A reopened peer starts over at the initial rate, and its counts start over too
+	Peers.Remove(PeerId);
+
+	return Super::ClosePeer(PeerId);
+}
+
+discord::Result FDiscordNetCongestionControl::OpenChannel(uint64 PeerId, uint8 ChannelId, bool bReliable)
+{
+	ReliableChannels[ChannelId] = bReliable;
+	FindOrAddPeer(PeerId);
+
+	return Super::OpenChannel(PeerId, ChannelId, bReliable);
+}
+
+discord::Result FDiscordNetCongestionControl::SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	if (ChannelId == ControlChannelId)
+	{
+		UE_LOG(LogDiscord, Warning, TEXT("Channel %u is reserved for congestion control; not sending to peer %llu"), ChannelId, PeerId);
+		return discord::Result::InvalidPayload;
+	}
+
+	FPeerState& Peer = FindOrAddPeer(PeerId);
+
+	const double Now = FPlatformTime::Seconds();
+	const double MaxTokens = Peer.BytesPerSecond * Settings.BurstSeconds;
+	Peer.Tokens = FMath::Min(Peer.Tokens + (Now - Peer.LastRefillTime) * Peer.BytesPerSecond, MaxTokens);
+	Peer.LastRefillTime = Now;
+
+	const bool bReliable = ReliableChannels[ChannelId];
+
+	// Any positive balance lets a message through, so messages bigger than the
+	// burst still go out; the debt is paid back before the next one can.
+	if (!bReliable && Peer.Tokens <= 0.)
+	{
+		++NumRateLimited;
+		return discord::Result::RateLimited;
+	}
+
+	const discord::Result Result = Super::SendMessage(PeerId, ChannelId, Data, DataLength);
+	if (Result == discord::Result::Ok)
+	{
+		Peer.Tokens -= DataLength;
+		if (!bReliable)
+		{
+			++Peer.NumSent;
+		}
+	}
+
+	return Result;
+}
+
+discord::Result FDiscordNetCongestionControl::Flush()
+{
+	using namespace DiscordNetCongestionControl;
+
+	const double Now = FPlatformTime::Seconds();
+
+	for (TPair<uint64, FPeerState>& It : Peers)
+	{
+		FPeerState& Peer = It.Value;
+		if (Now - Peer.LastMarkTime < Settings.FeedbackIntervalSeconds)
+		{
+			continue;
+		}
+
+		uint8 Message[MarkSize];
+		Message[0] = static_cast<uint8>(EControlType::Mark);
+		FMemory::Memcpy(Message + 1, &Peer.NumSent, sizeof(uint32));
+		FMemory::Memcpy(Message + 1 + sizeof(uint32), &Now, sizeof(double));
+
+		const discord::Result Result = Super::SendMessage(It.Key, ControlChannelId, Message, sizeof(Message));
+		if (Result != discord::Result::Ok)
+		{
+			UE_LOG(LogDiscord, Verbose, TEXT("Error(%i) Sending congestion mark to peer %llu"), Result, It.Key);
+		}
+
+		Peer.LastMarkTime = Now;
+	}
+
+	return Super::Flush();
+}
+
+void FDiscordNetCongestionControl::HandleInnerMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	if (ChannelId == ControlChannelId)
+	{
+		HandleControlMessage(PeerId, Data, DataLength);
+		return;
+	}
+
+	if (!ReliableChannels[ChannelId])
+	{
+		++FindOrAddPeer(PeerId).NumReceived;
+	}
+
+	Super::HandleInnerMessage(PeerId, ChannelId, Data, DataLength);
+}
+
+void FDiscordNetCongestionControl::HandleControlMessage(uint64 PeerId, const uint8* Data, uint32 DataLength)
+{
+	using namespace DiscordNetCongestionControl;
+
+	if (DataLength == MarkSize && Data[0] == static_cast<uint8>(EControlType::Mark))
+	{
+		// Answer with how many of the peer's messages we've had so far, echoing its count and time
+		FPeerState& Peer = FindOrAddPeer(PeerId);
+
+		uint8 Message[FeedbackSize];
+		Message[0] = static_cast<uint8>(EControlType::Feedback);
+		FMemory::Memcpy(Message + 1, Data + 1, sizeof(uint32));
+		FMemory::Memcpy(Message + 1 + sizeof(uint32), &Peer.NumReceived, sizeof(uint32));
+		FMemory::Memcpy(Message + 1 + 2 * sizeof(uint32), Data + 1 + sizeof(uint32), sizeof(double));
+
+		const discord::Result Result = Super::SendMessage(PeerId, ControlChannelId, Message, sizeof(Message));
+		if (Result != discord::Result::Ok)
+		{
+			UE_LOG(LogDiscord, Verbose, TEXT("Error(%i) Sending congestion feedback to peer %llu"), Result, PeerId);
+		}
+		return;
+	}
+
+	if (DataLength == FeedbackSize && Data[0] == static_cast<uint8>(EControlType::Feedback))
+	{
+		uint32 FeedbackSent;
+		uint32 FeedbackReceived;
+		double MarkTime;
+		FMemory::Memcpy(&FeedbackSent, Data + 1, sizeof(uint32));
+		FMemory::Memcpy(&FeedbackReceived, Data + 1 + sizeof(uint32), sizeof(uint32));
+		FMemory::Memcpy(&MarkTime, Data + 1 + 2 * sizeof(uint32), sizeof(double));
+
+		HandleFeedback(PeerId, FindOrAddPeer(PeerId), FeedbackSent, FeedbackReceived, MarkTime);
+		return;
+	}
+
+	UE_LOG(LogDiscord, Verbose, TEXT("Dropping malformed congestion control message (%u bytes) from peer %llu"), DataLength, PeerId);
+}
+
+void FDiscordNetCongestionControl::HandleFeedback(uint64 PeerId, FPeerState& Peer, uint32 FeedbackSent, uint32 FeedbackReceived, double MarkTime)
+{
+	using namespace DiscordNetCongestionControl;
+
+	const double Now = FPlatformTime::Seconds();
+
+	// The RTT includes however long the peer took to get to our mark, up to a frame
+	const double Rtt = FMath::Max(Now - MarkTime, 0.);
+	Peer.SmoothedRtt = Peer.SmoothedRtt < 0. ? Rtt : FMath::Lerp(Peer.SmoothedRtt, Rtt, Smoothing);
+	Peer.MinRtt = Peer.MinRtt < 0. ? Rtt : FMath::Min(Peer.MinRtt, Rtt);
+
+	if (!Peer.bHasFeedback)
+	{
+		// Nothing to compare to yet
+		Peer.LastFeedbackSent = FeedbackSent;
+		Peer.LastFeedbackReceived = FeedbackReceived;
+		Peer.bHasFeedback = true;
+		return;
+	}
+
+	// Feedback arriving out of order tells us nothing new about loss
+	const int32 DeltaSent = static_cast<int32>(FeedbackSent - Peer.LastFeedbackSent);
+	if (DeltaSent <= 0)
+	{
+		return;
+	}
+
+	// Messages that were in flight as the mark overtook them show up as lost here
+	// and as extra received next time, which the smoothing evens out.
+	const int32 DeltaReceived = static_cast<int32>(FeedbackReceived - Peer.LastFeedbackReceived);
+	const double Loss = FMath::Clamp(1. - static_cast<double>(DeltaReceived) / DeltaSent, 0., 1.);
+	Peer.SmoothedLoss = FMath::Lerp(Peer.SmoothedLoss, Loss, Smoothing);
+
+	Peer.LastFeedbackSent = FeedbackSent;
+	Peer.LastFeedbackReceived = FeedbackReceived;
+
+	const bool bLossy = Peer.SmoothedLoss > Settings.LossThreshold;
+	const bool bQueueing = Peer.SmoothedRtt > Peer.MinRtt * Settings.RttInflation + Settings.RttSlackSeconds;
+
+	if (bLossy || bQueueing)
+	{
+		// Back off once per RTT, since feedback in the next RTT still describes the old rate
+		if (Now - Peer.LastDecreaseTime >= Peer.SmoothedRtt)
+		{
+			Peer.BytesPerSecond = FMath::Max(Peer.BytesPerSecond * Settings.DecreaseFactor, static_cast<double>(Settings.MinBytesPerSecond));
+			Peer.LastDecreaseTime = Now;
+
+			UE_LOG(LogDiscord, Verbose, TEXT("Peer %llu congested (loss %.1f%%, rtt %.0f ms); rate now %.0f bytes/s"),
+				PeerId, Peer.SmoothedLoss * 100., Peer.SmoothedRtt * 1000., Peer.BytesPerSecond);
+		}
+	}
+	else
+	{
+		Peer.BytesPerSecond = FMath::Min(Peer.BytesPerSecond + Settings.IncreaseBytesPerSecond, static_cast<double>(Settings.MaxBytesPerSecond));
+	}
+}
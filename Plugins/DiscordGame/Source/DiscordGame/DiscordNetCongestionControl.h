@@ -0,0 +1,151 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordNetTransport.h"
+
+/**
+ * Settings for FDiscordNetCongestionControl
+ */
+struct DISCORDGAME_API FDiscordNetCongestionSettings
+{
+	/** Unreliable send rate each peer starts at, in bytes/second */
+	int32 InitialBytesPerSecond {32 * 1024};
+
+	/** The send rate never drops below this, in bytes/second */
+	int32 MinBytesPerSecond {4 * 1024};
+
+	/** The send rate never rises above this, in bytes/second */
+	int32 MaxBytesPerSecond {256 * 1024};
+
+	/** Bytes/second added to the rate for every feedback that shows no congestion */
+	int32 IncreaseBytesPerSecond {2 * 1024};
+
+	/** The rate is multiplied by this on congestion, at most once per RTT */
+	float DecreaseFactor {0.7f};
+
+	/** Loss [0..1] above this means congestion */
+	float LossThreshold {0.05f};
+
+	/** RTT above the lowest seen RTT times this (plus RttSlackSeconds) means congestion */
+	float RttInflation {2.f};
+
+	/** Slack added to the RTT threshold so tiny RTTs don't trigger on noise */
+	float RttSlackSeconds {0.02f};
+
+	/** Seconds between feedback requests to each peer */
+	float FeedbackIntervalSeconds {0.1f};
+
+	/** Seconds of the current rate that may be sent in one burst */
+	float BurstSeconds {0.1f};
+};
+
+/**
+ * Discord Network Congestion Control
+ *
+ * Transport decorator that limits the rate of unreliable sends to each peer,
+ * and adapts that rate to the connection: additive increase while things look
+ * fine, multiplicative decrease when loss or latency shows the link is overloaded.
+ *
+ * Loss and RTT come from lightweight feedback on a dedicated unreliable control
+ * channel: every FeedbackIntervalSeconds we tell each peer how many unreliable
+ * messages we've sent it so far, and it answers with how many it has received.
+ * No per-message headers are added, so this works with any message format.
+ *
+ * Unreliable messages over a peer's budget are dropped here, and SendMessage
+ * returns RateLimited, instead of being allowed to queue up in the network and
+ * add latency to everything.  Use GetAllowedBytesPerSecond to scale what you
+ * send (e.g. snapshot rate) to what the link can take.  Reliable channels are
+ * never limited, but their traffic still counts against the budget.
+ *
+ * Both ends need one of these with the same control channel, and must open that
+ * channel (unreliable) to each other.  Call Flush() once per frame as usual.
+ */
+class DISCORDGAME_API FDiscordNetCongestionControl : public FDiscordNetTransportDecorator
+{
+	using Super = FDiscordNetTransportDecorator;
+
+public:
+	/**
+	 * @param InInner Transport to control
+	 * @param InControlChannelId Channel reserved for feedback messages
+	 * @param InSettings Rate limits and congestion thresholds
+	 */
+	FDiscordNetCongestionControl(const TSharedRef<IDiscordNetTransport>& InInner, uint8 InControlChannelId, const FDiscordNetCongestionSettings& InSettings = FDiscordNetCongestionSettings());
+
+	/** @return The current unreliable send budget for a peer, in bytes/second */
+	int32 GetAllowedBytesPerSecond(uint64 PeerId) const;
+
+	/** @return Smoothed loss rate [0..1] to a peer */
+	float GetLossRate(uint64 PeerId) const;
+
+	/** @return Smoothed RTT to a peer in seconds, or negative if unknown */
+	double GetRttSeconds(uint64 PeerId) const;
+
+	/** Unreliable messages dropped because a peer was over budget */
+	uint64 NumRateLimited {0};
+
+	//~IDiscordNetTransport interface
+	virtual discord::Result ClosePeer(uint64 PeerId) override;
+	virtual discord::Result OpenChannel(uint64 PeerId, uint8 ChannelId, bool bReliable) override;
+	virtual discord::Result SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) override;
+	virtual discord::Result Flush() override;
+	//~End of IDiscordNetTransport interface
+
+protected:
+	//~FDiscordNetTransportDecorator interface
+	virtual void HandleInnerMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) override;
+	//~End of FDiscordNetTransportDecorator interface
+
+private:
+	/** Control message types */
+	enum class EControlType : uint8
+	{
+		/** Sender -> receiver: how many unreliable messages I've sent you */
+		Mark = 1,
+		/** Receiver -> sender: how many of them I've received */
+		Feedback = 2,
+	};
+
+	struct FPeerState
+	{
+		/** Current unreliable budget, and the token bucket enforcing it */
+		double BytesPerSecond {0.};
+		double Tokens {0.};
+		double LastRefillTime {0.};
+
+		/** Unreliable messages we've sent this peer, and it has sent us */
+		uint32 NumSent {0};
+		uint32 NumReceived {0};
+
+		/** Counts from the previous feedback, to measure loss between feedbacks */
+		uint32 LastFeedbackSent {0};
+		uint32 LastFeedbackReceived {0};
+		bool bHasFeedback {false};
+
+		double SmoothedLoss {0.};
+		double SmoothedRtt {-1.};
+		double MinRtt {-1.};
+
+		double LastMarkTime {0.};
+		double LastDecreaseTime {0.};
+	};
+
+	/** @return State for a peer, added if new */
+	FPeerState& FindOrAddPeer(uint64 PeerId);
+
+	/** Handle a message on the control channel */
+	void HandleControlMessage(uint64 PeerId, const uint8* Data, uint32 DataLength);
+
+	/** Adjust a peer's rate from a feedback message */
+	void HandleFeedback(uint64 PeerId, FPeerState& Peer, uint32 FeedbackSent, uint32 FeedbackReceived, double MarkTime);
+
+	uint8 ControlChannelId {0};
+	FDiscordNetCongestionSettings Settings;
+
+	TMap<uint64, FPeerState> Peers;
+
+	/** Which channels were opened as reliable */
+	TBitArray<> ReliableChannels;
+};
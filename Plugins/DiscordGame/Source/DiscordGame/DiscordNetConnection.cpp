@@ -0,0 +1,91 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetConnection.h"
+#include "DiscordGame.h"
+#include "DiscordNetAddress.h"
+#include "DiscordNetDriver.h"
+#include "PacketHandler.h"
+
+void UDiscordNetConnection::InitLocalConnection(UNetDriver* InDriver, FSocket* InSocket, const FURL& InURL, EConnectionState InState, int32 InMaxPacket, int32 InPacketOverhead)
+{
+	InitBase(InDriver, InSocket, InURL, InState, InMaxPacket, InPacketOverhead);
+
+	// Local connections are made by clients; the URL host is the server's peer id
+	bool bIsValid {false};
+	const TSharedRef<FInternetAddrDiscord> ServerAddr = MakeShared<FInternetAddrDiscord>();
+	ServerAddr->SetIp(*InURL.Host, bIsValid);
+	ensureMsgf(bIsValid, TEXT("Expect URL host [%s] to be a Discord peer id"), *InURL.Host);
+
+	RemotePeerId = ServerAddr->GetPeerId();
+	RemoteAddr = ServerAddr;
+
+	// Initialize our send bunch
+	InitSendBuffer();
+}
+
+void UDiscordNetConnection::InitRemoteConnection(UNetDriver* InDriver, FSocket* InSocket, const FURL& InURL, const FInternetAddr& InRemoteAddr, EConnectionState InState, int32 InMaxPacket, int32 InPacketOverhead)
+{
+	InitBase(InDriver, InSocket, InURL, InState, InMaxPacket, InPacketOverhead);
+
+	check(InRemoteAddr.GetProtocolType() == FInternetAddrDiscord::ProtocolType);
+	RemotePeerId = static_cast<const FInternetAddrDiscord&>(InRemoteAddr).GetPeerId();
+	RemoteAddr = InRemoteAddr.Clone();
+	URL.Host = RemoteAddr->ToString(false);
+
+	// Initialize our send bunch
+	InitSendBuffer();
+
+	// This is for a client that needs to log in, setup ClientLoginState and ExpectedClientLoginMsgType to reflect that
+	SetClientLoginState(EClientLoginState::LoggingIn);
+	SetExpectedClientLoginMsgType(NMT_Hello);
+}
+
+void UDiscordNetConnection::LowLevelSend(void* Data, int32 CountBits, FOutPacketTraits& Traits)
+{
+	const uint8* DataToSend = static_cast<uint8*>(Data);
+
+	// Give the packet handler components (handshake, encryption, etc) a chance to process the packet
+	if (Handler.IsValid() && !Handler->GetRawSend())
+	{
+		const ProcessedPacket ProcessedData = Handler->Outgoing(static_cast<uint8*>(Data), CountBits, Traits);
+		if (!ProcessedData.bError)
+		{
+			DataToSend = ProcessedData.Data;
+			CountBits = ProcessedData.CountBits;
+		}
+		else
+		{
+			CountBits = 0;
+		}
+	}
+
+	const int32 CountBytes = FMath::DivideAndRoundUp(CountBits, 8);
+	if (CountBytes > 0)
+	{
+		if (UDiscordNetDriver* DiscordDriver = Cast<UDiscordNetDriver>(Driver))
+		{
+			DiscordDriver->SendPacket(RemotePeerId, DataToSend, CountBytes);
+		}
+	}
+}
+
+FString UDiscordNetConnection::LowLevelGetRemoteAddress(bool bAppendPort)
+{
+	return RemoteAddr.IsValid() ? RemoteAddr->ToString(bAppendPort) : FString();
+}
+
+FString UDiscordNetConnection::LowLevelDescribe()
+{
+	return FString::Printf(TEXT("Discord peer %llu, state: %i"), RemotePeerId, static_cast<int32>(GetConnectionState()));
+}
+
+void UDiscordNetConnection::CleanUp()
+{
+	// Let the driver forget about us before the base class detaches us from it
+	if (UDiscordNetDriver* DiscordDriver = Cast<UDiscordNetDriver>(Driver))
+	{
+		DiscordDriver->NotifyConnectionClosed(this);
+	}
+
+	Super::CleanUp();
+}
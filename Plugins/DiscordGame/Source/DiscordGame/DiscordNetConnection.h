@@ -0,0 +1,36 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Engine/NetConnection.h"
+#include "DiscordNetConnection.generated.h"
+
+/**
+ * Discord Net Connection
+ *
+ * A connection to a single Discord peer, owned by UDiscordNetDriver.
+ * The remote address is an FInternetAddrDiscord holding the peer id.
+ */
+UCLASS(Transient, Config=Engine)
+class DISCORDGAME_API UDiscordNetConnection : public UNetConnection
+{
+	GENERATED_BODY()
+
+public:
+	/** @return The Discord peer id at the other end of this connection */
+	uint64 GetRemotePeerId() const { return RemotePeerId; }
+
+	//~UNetConnection interface
+	virtual void InitLocalConnection(UNetDriver* InDriver, FSocket* InSocket, const FURL& InURL, EConnectionState InState, int32 InMaxPacket = 0, int32 InPacketOverhead = 0) override;
+	virtual void InitRemoteConnection(UNetDriver* InDriver, FSocket* InSocket, const FURL& InURL, const FInternetAddr& InRemoteAddr, EConnectionState InState, int32 InMaxPacket = 0, int32 InPacketOverhead = 0) override;
+	virtual void LowLevelSend(void* Data, int32 CountBits, FOutPacketTraits& Traits) override;
+	virtual FString LowLevelGetRemoteAddress(bool bAppendPort = false) override;
+	virtual FString LowLevelDescribe() override;
+	virtual void CleanUp() override;
+	//~End of UNetConnection interface
+
+private:
+	/** The Discord peer id at the other end of this connection */
+	uint64 RemotePeerId {0};
+};
@@ -0,0 +1,503 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetDriver.h"
+#include "DiscordGame.h"
+#include "DiscordGameSubsystem.h"
+#include "DiscordNetAddress.h"
+#include "DiscordNetConnection.h"
+#include "DiscordNetStats.h"
+#include "Engine/World.h"
+#include "Misc/Base64.h"
+#include "PacketHandler.h"
+#include "PacketHandlers/StatelessConnectHandlerComponent.h"
+
+/** URL option holding the server's Base64 encoded route data */
+static const TCHAR* DiscordRouteOption = TEXT("DiscordRoute=");
+
+UDiscordNetDriver::UDiscordNetDriver()
+{
+	NetConnectionClassName = TEXT("/Script/DiscordGame.DiscordNetConnection");
+	PacketChannelId = 0;
+	ControlChannelId = 1;
+	CloseLingerSeconds = 1.f;
+}
+
+FString UDiscordNetDriver::MakeConnectURL(uint64 ServerPeerId, const FString& ServerRouteData)
+{
+	// Route data is JSON, which doesn't survive being put into a URL; encode it
+	const FString EncodedRoute = FBase64::Encode(ServerRouteData, EBase64Mode::UrlSafe);
+	return FString::Printf(TEXT("%llu?%s%s"), ServerPeerId, DiscordRouteOption, *EncodedRoute);
+}
+
+bool UDiscordNetDriver::AcceptPeer(uint64 PeerId, const FString& RouteData)
+{
+	if (!ensureMsgf(IsServer(), TEXT("Only servers accept peers; clients connect via MakeConnectURL")))
+	{
+		return false;
+	}
+
+	return OpenPeerAndChannels(PeerId, RouteData);
+}
+
+bool UDiscordNetDriver::UpdatePeerRoute(uint64 PeerId, const FString& RouteData)
+{
+	if (!Transport.IsValid() || !OpenPeers.Contains(PeerId))
+	{
+		return false;
+	}
+
+	const discord::Result Result = Transport->UpdatePeer(PeerId, RouteData);
+	if (Result != discord::Result::Ok)
+	{
+		UE_LOG(LogDiscord, Warning, TEXT("Error(%i) Updating route for peer %llu"), Result, PeerId);
+		return false;
+	}
+
+	return true;
+}
+
+uint64 UDiscordNetDriver::GetLocalPeerId() const
+{
+	return Transport.IsValid() ? Transport->GetLocalPeerId() : 0;
+}
+
+void UDiscordNetDriver::NotifyConnectionClosed(UDiscordNetConnection* Connection)
+{
+	const uint64 PeerId = Connection->GetRemotePeerId();
+
+	if (Transport.IsValid() && OpenPeers.Contains(PeerId))
+	{
+		// Tell the other side right away, rather than letting it time out
+		const uint8 Message = static_cast<uint8>(EControlMessage::Close);
+		Transport->SendMessage(PeerId, ControlChannelId, &Message, sizeof(Message));
+		Transport->Flush();
+
+		// Closing the peer now could drop the message before it's delivered; TickFlush closes it later
+		OpenPeers.Remove(PeerId);
+		ClosingPeers.Add(PeerId, FPlatformTime::Seconds() + CloseLingerSeconds);
+	}
+
+	PeerConnections.Remove(PeerId);
+}
+
+void UDiscordNetDriver::SendPacket(uint64 PeerId, const uint8* Data, int32 CountBytes)
+{
+	if (Transport.IsValid())
+	{
+		const discord::Result Result = Transport->SendMessage(PeerId, PacketChannelId, Data, CountBytes);
+		if (Result != discord::Result::Ok)
+		{
+			UE_LOG(LogDiscord, Verbose, TEXT("Error(%i) Sending %i byte packet to peer %llu"), Result, CountBytes, PeerId);
+		}
+	}
+}
+
+bool UDiscordNetDriver::IsAvailable() const
+{
+	const UDiscordGameSubsystem* DiscordSubsystem = UDiscordGameSubsystem::Get();
+	return DiscordSubsystem && DiscordSubsystem->IsDiscordRunning();
+}
+
+bool UDiscordNetDriver::InitBase(bool bInitAsClient, FNetworkNotify* InNotify, const FURL& URL, bool bReuseAddressAndPort, FString& Error)
+{
+	if (!Super::InitBase(bInitAsClient, InNotify, URL, bReuseAddressAndPort, Error))
+	{
+		return false;
+	}
+
+	Transport = CreateTransport();
+	if (!Transport.IsValid())
+	{
+		Error = TEXT("Discord is not running");
+		return false;
+	}
+
+	MessageHandle = Transport->OnMessage().AddUObject(this, &ThisClass::HandleMessage);
+	RouteUpdateHandle = Transport->OnRouteUpdate().AddUObject(this, &ThisClass::HandleRouteUpdate);
+
+	if (UDiscordGameSubsystem* DiscordSubsystem = UDiscordGameSubsystem::Get())
+	{
+		CoreResetHandle = DiscordSubsystem->OnDiscordCoreReset.AddUObject(this, &ThisClass::HandleDiscordCoreReset);
+	}
+
+	return true;
+}
+
+bool UDiscordNetDriver::InitConnect(FNetworkNotify* InNotify, const FURL& ConnectURL, FString& Error)
+{
+	if (!InitBase(true, InNotify, ConnectURL, false, Error))
+	{
+		UE_LOG(LogDiscord, Warning, TEXT("Failed to init Discord net driver for connect: %s"), *Error);
+		return false;
+	}
+
+	// The URL host is the server's peer id, and the route is passed as an option
+	bool bIsValidPeerId {false};
+	FInternetAddrDiscord ServerAddr;
+	ServerAddr.SetIp(*ConnectURL.Host, bIsValidPeerId);
+
+	FString ServerRouteData;
+	if (const TCHAR* EncodedRoute = ConnectURL.GetOption(DiscordRouteOption, nullptr))
+	{
+		FBase64::Decode(FString(EncodedRoute), ServerRouteData, EBase64Mode::UrlSafe);
+	}
+
+	if (!bIsValidPeerId || ServerRouteData.IsEmpty())
+	{
+		Error = FString::Printf(TEXT("Invalid Discord connect URL [%s]; use UDiscordNetDriver::MakeConnectURL"), *ConnectURL.ToString());
+		return false;
+	}
+
+	if (!OpenPeerAndChannels(ServerAddr.GetPeerId(), ServerRouteData))
+	{
+		Error = FString::Printf(TEXT("Failed to open Discord peer %llu"), ServerAddr.GetPeerId());
+		return false;
+	}
+
+	// Create new connection
+	ServerConnection = NewObject<UNetConnection>(GetTransientPackage(), NetConnectionClass);
+	ServerConnection->InitLocalConnection(this, nullptr, ConnectURL, USOCK_Pending);
+	PeerConnections.Add(ServerAddr.GetPeerId(), ServerConnection.Get());
+
+	UE_LOG(LogDiscord, Log, TEXT("Game client on Discord peer %llu, connecting to peer %llu"), GetLocalPeerId(), ServerAddr.GetPeerId());
+
+	// Create the control channel so we can send the Hello message
+	CreateInitialClientChannels();
+
+	return true;
+}
+
+bool UDiscordNetDriver::InitListen(FNetworkNotify* InNotify, FURL& LocalURL, bool bReuseAddressAndPort, FString& Error)
+{
+	if (!InitBase(false, InNotify, LocalURL, bReuseAddressAndPort, Error))
+	{
+		UE_LOG(LogDiscord, Warning, TEXT("Failed to init Discord net driver for listen: %s"), *Error);
+		return false;
+	}
+
+	// Clients go through the stateless handshake before we create a connection for them
+	InitConnectionlessHandler();
+
+	UE_LOG(LogDiscord, Log, TEXT("Game server listening on Discord peer %llu"), GetLocalPeerId());
+
+	return true;
+}
+
+void UDiscordNetDriver::TickDispatch(float DeltaTime)
+{
+	Super::TickDispatch(DeltaTime);
+
+	// Swap the queue out, in case dispatching a packet results in more messages
+	TArray<FReceivedMessage> Messages = MoveTemp(ReceivedMessages);
+	ReceivedMessages.Reset();
+
+	for (FReceivedMessage& Message : Messages)
+	{
+		if (Message.ChannelId == ControlChannelId)
+		{
+			ProcessControlMessage(Message.PeerId, Message.Data);
+		}
+		else if (Message.ChannelId == PacketChannelId)
+		{
+			if (UNetConnection* Connection = FindConnection(Message.PeerId))
+			{
+				Connection->ReceivedRawPacket(Message.Data.GetData(), Message.Data.Num());
+			}
+			else if (IsServer())
+			{
+				ProcessConnectionlessPacket(Message.PeerId, Message.Data.GetData(), Message.Data.Num());
+			}
+		}
+	}
+}
+
+void UDiscordNetDriver::TickFlush(float DeltaSeconds)
+{
+	Super::TickFlush(DeltaSeconds);
+
+	// Everything Unreal wanted to send this frame has been sent; push it out to Discord
+	if (Transport.IsValid())
+	{
+		const discord::Result Result = Transport->Flush();
+		if (Result != discord::Result::Ok)
+		{
+			UE_LOG(LogDiscord, Verbose, TEXT("Error(%i) Flushing Discord network"), Result);
+		}
+
+		CloseLingeringPeers(FPlatformTime::Seconds());
+	}
+}
+
+void UDiscordNetDriver::LowLevelSend(TSharedPtr<const FInternetAddr> Address, void* Data, int32 CountBits, FOutPacketTraits& Traits)
+{
+	// This is only used for connectionless packets (the stateless handshake)
+	if (!Address.IsValid() || Address->GetProtocolType() != FInternetAddrDiscord::ProtocolType)
+	{
+		return;
+	}
+
+	const uint64 PeerId = StaticCastSharedPtr<const FInternetAddrDiscord>(Address)->GetPeerId();
+	const uint8* DataToSend = static_cast<uint8*>(Data);
+
+	if (ConnectionlessHandler.IsValid())
+	{
+		const ProcessedPacket ProcessedData = ConnectionlessHandler->OutgoingConnectionless(Address, static_cast<uint8*>(Data), CountBits, Traits);
+		if (ProcessedData.bError)
+		{
+			return;
+		}
+
+		DataToSend = ProcessedData.Data;
+		CountBits = ProcessedData.CountBits;
+	}
+
+	const int32 CountBytes = FMath::DivideAndRoundUp(CountBits, 8);
+	if (CountBytes > 0)
+	{
+		SendPacket(PeerId, DataToSend, CountBytes);
+	}
+}
+
+FString UDiscordNetDriver::LowLevelGetNetworkNumber()
+{
+	return FString::Printf(TEXT("%llu"), GetLocalPeerId());
+}
+
+void UDiscordNetDriver::LowLevelDestroy()
+{
+	Super::LowLevelDestroy();
+
+	if (UDiscordGameSubsystem* DiscordSubsystem = UDiscordGameSubsystem::Get())
+	{
+		DiscordSubsystem->OnDiscordCoreReset.Remove(CoreResetHandle);
+	}
+
+	if (Transport.IsValid())
+	{
+		for (const uint64 PeerId : OpenPeers)
+		{
+			Transport->ClosePeer(PeerId);
+		}
+
+		// We're going away, so we can't linger any longer
+		for (const TPair<uint64, double>& It : ClosingPeers)
+		{
+			Transport->ClosePeer(It.Key);
+		}
+
+		Transport->OnMessage().Remove(MessageHandle);
+		Transport->OnRouteUpdate().Remove(RouteUpdateHandle);
+		Transport.Reset();
+	}
+
+	OpenPeers.Reset();
+	ClosingPeers.Reset();
+	PeerConnections.Reset();
+	ReceivedMessages.Reset();
+}
+
+bool UDiscordNetDriver::IsNetResourceValid()
+{
+	return Transport.IsValid();
+}
+
+ISocketSubsystem* UDiscordNetDriver::GetSocketSubsystem()
+{
+	// We don't use sockets
+	return nullptr;
+}
+
+TSharedPtr<IDiscordNetTransport> UDiscordNetDriver::CreateTransport()
+{
+	UDiscordGameSubsystem* DiscordSubsystem = UDiscordGameSubsystem::Get();
+	if (DiscordSubsystem && DiscordSubsystem->IsDiscordRunning())
+	{
+		// Wrap in stats so the driver's traffic shows up in `stat DiscordNet` and `Discord.Net.Stats`
+		const TSharedRef<IDiscordNetTransport> PeerTransport = MakeShared<FDiscordPeerNetTransport>(DiscordSubsystem->DiscordCore());
+		return MakeShared<FDiscordNetStats>(PeerTransport, GetName());
+	}
+
+	return nullptr;
+}
+
+bool UDiscordNetDriver::OpenPeerAndChannels(uint64 PeerId, const FString& RouteData)
+{
+	if (!Transport.IsValid())
+	{
+		return false;
+	}
+
+	if (ClosingPeers.Remove(PeerId) > 0)
+	{
+		// Reconnecting while we were still lingering; the peer and its channels are still open
+		OpenPeers.Add(PeerId);
+	}
+
+	if (OpenPeers.Contains(PeerId))
+	{
+		// Already open; treat this as a route update
+		return UpdatePeerRoute(PeerId, RouteData);
+	}
+
+	discord::Result Result = Transport->OpenPeer(PeerId, RouteData);
+	if (Result == discord::Result::Ok)
+	{
+		OpenPeers.Add(PeerId);
+
+		Result = Transport->OpenChannel(PeerId, PacketChannelId, false);
+		if (Result == discord::Result::Ok)
+		{
+			Result = Transport->OpenChannel(PeerId, ControlChannelId, true);
+		}
+	}
+
+	if (Result != discord::Result::Ok)
+	{
+		UE_LOG(LogDiscord, Warning, TEXT("Error(%i) Opening Discord peer %llu"), Result, PeerId);
+		return false;
+	}
+
+	return true;
+}
+
+void UDiscordNetDriver::HandleMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	// We're inside the Discord callbacks here; hold on to it until TickDispatch
+	FReceivedMessage& Message = ReceivedMessages.AddDefaulted_GetRef();
+	Message.PeerId = PeerId;
+	Message.ChannelId = ChannelId;
+	Message.Data.Append(Data, DataLength);
+}
+
+void UDiscordNetDriver::HandleRouteUpdate(const FString& RouteData)
+{
+	LocalRouteData = RouteData;
+	RouteUpdateEvent.Broadcast(LocalRouteData);
+}
+
+void UDiscordNetDriver::ProcessConnectionlessPacket(uint64 PeerId, uint8* Data, int32 CountBytes)
+{
+	// Only peers that we explicitly accepted can connect
+	if (!OpenPeers.Contains(PeerId) || !Notify || !ConnectionlessHandler.IsValid() || !StatelessConnectComponent.IsValid())
+	{
+		return;
+	}
+
+	if (Notify->NotifyAcceptingConnection() != EAcceptConnection::Accept)
+	{
+		return;
+	}
+
+	const TSharedPtr<const FInternetAddr> Address = MakeShared<FInternetAddrDiscord>(PeerId);
+	const TSharedPtr<StatelessConnectHandlerComponent> StatelessConnect = StatelessConnectComponent.Pin();
+
+	FReceivedPacketView PacketView;
+	PacketView.DataView = FPacketDataView(Data, CountBytes, ECountUnits::Bytes);
+	PacketView.Address = Address;
+	PacketView.Traits.bConnectionlessPacket = true;
+
+	if (ConnectionlessHandler->IncomingConnectionless(PacketView) != EIncomingResult::Success)
+	{
+		return;
+	}
+
+	bool bRestartedHandshake {false};
+	if (!StatelessConnect->HasPassedChallenge(Address, bRestartedHandshake) || bRestartedHandshake)
+	{
+		// Still handshaking (or restarting a handshake on a connection we've already dropped)
+		return;
+	}
+
+	// The client passed the handshake; create its connection
+	UNetConnection* Connection = NewObject<UNetConnection>(GetTransientPackage(), NetConnectionClass);
+	check(Connection);
+	Connection->InitRemoteConnection(this, nullptr, World ? World->URL : FURL(), *Address, USOCK_Open);
+
+	// Set the initial packet sequence from the handshake data
+	int32 ServerSequence {0};
+	int32 ClientSequence {0};
+	StatelessConnect->GetChallengeSequence(ServerSequence, ClientSequence);
+	Connection->InitSequence(ClientSequence, ServerSequence);
+
+	if (Connection->Handler.IsValid())
+	{
+		Connection->Handler->BeginHandshaking();
+	}
+
+	Notify->NotifyAcceptedConnection(Connection);
+	AddClientConnection(Connection);
+	PeerConnections.Add(PeerId, Connection);
+
+	StatelessConnect->ResetChallengeData();
+
+	UE_LOG(LogDiscord, Log, TEXT("Accepted Unreal connection from Discord peer %llu"), PeerId);
+}
+
+void UDiscordNetDriver::ProcessControlMessage(uint64 PeerId, const TArray<uint8>& Data)
+{
+	if (Data.Num() < 1)
+	{
+		return;
+	}
+
+	switch (static_cast<EControlMessage>(Data[0]))
+	{
+	case EControlMessage::Close:
+		if (UNetConnection* Connection = FindConnection(PeerId))
+		{
+			UE_LOG(LogDiscord, Log, TEXT("Discord peer %llu closed its connection"), PeerId);
+			Connection->Close(ENetCloseResult::ConnectionLost);
+		}
+		break;
+
+	default:
+		UE_LOG(LogDiscord, Warning, TEXT("Unknown control message %u from Discord peer %llu"), Data[0], PeerId);
+		break;
+	}
+}
+
+void UDiscordNetDriver::CloseLingeringPeers(double Now)
+{
+	for (auto It = ClosingPeers.CreateIterator(); It; ++It)
+	{
+		if (Now >= It.Value())
+		{
+			Transport->ClosePeer(It.Key());
+			It.RemoveCurrent();
+		}
+	}
+}
+
+UNetConnection* UDiscordNetDriver::FindConnection(uint64 PeerId) const
+{
+	const TWeakObjectPtr<UNetConnection>* Connection = PeerConnections.Find(PeerId);
+	return Connection ? Connection->Get() : nullptr;
+}
+
+void UDiscordNetDriver::HandleDiscordCoreReset()
+{
+	UE_LOG(LogDiscord, Warning, TEXT("Discord went away; closing all Discord net connections"));
+
+	// The transport refers into the DiscordCore, which is no longer valid.
+	// Don't try to tell anyone anything, just let it go.
+	if (Transport.IsValid())
+	{
+		Transport->OnMessage().Remove(MessageHandle);
+		Transport->OnRouteUpdate().Remove(RouteUpdateHandle);
+		Transport.Reset();
+	}
+	OpenPeers.Reset();
+	ClosingPeers.Reset();
+	ReceivedMessages.Reset();
+
+	// Copy, since closing a connection removes it from the map
+	TArray<TWeakObjectPtr<UNetConnection>> Connections;
+	PeerConnections.GenerateValueArray(Connections);
+	for (const TWeakObjectPtr<UNetConnection>& Connection : Connections)
+	{
+		if (Connection.IsValid())
+		{
+			Connection->Close(ENetCloseResult::ConnectionLost);
+		}
+	}
+}
@@ -0,0 +1,203 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordNetTransport.h"
+#include "Engine/NetDriver.h"
+#include "DiscordNetDriver.generated.h"
+
+class UDiscordNetConnection;
+
+/**
+ * Discord Net Driver
+ *
+ * Unreal NetDriver that uses the Discord GameSDK peer network (via IDiscordNetTransport)
+ * instead of IP sockets, so replication happens peer-to-peer through Discord's relays.
+ *
+ * Discord requires BOTH sides of a connection to know each other's peer id and
+ * route data before they can exchange messages.  You are expected to share these
+ * out-of-band, for example through Discord lobby metadata:
+ *
+ *   - The listen server calls AcceptPeer() for each client that wants to join
+ *   - Clients travel to the URL returned by MakeConnectURL() for the server
+ *
+ * Use GetLocalPeerId() and GetLocalRouteData() (and OnRouteUpdate(), since the
+ * route can change at any time) to find out what to publish for the local process.
+ *
+ * Unreal's packet layer already provides its own reliability and ordering for
+ * reliable bunches, so all Unreal packets are sent on an unreliable Discord channel.
+ * Putting them on a reliable channel would stack two retransmit layers and add
+ * head-of-line blocking to unreliable bunches.  The reliable Discord channel only
+ * carries the driver's own control messages, so a peer that closes its connection
+ * is noticed immediately rather than after a timeout.
+ *
+ * Messages received from Discord are delivered during the UDiscordGameSubsystem tick
+ * (in RunCallbacks).  They are queued and then dispatched in TickDispatch, and the
+ * transport is flushed at the end of every TickFlush.
+ *
+ * To use it, configure a NetDriverDefinition in DefaultEngine.ini such as:
+ *
+ *   [/Script/Engine.GameEngine]
+ *   !NetDriverDefinitions=ClearArray
+ *   +NetDriverDefinitions=(DefName="GameNetDriver",DriverClassName="/Script/DiscordGame.DiscordNetDriver",DriverClassNameFallback="/Script/OnlineSubsystemUtils.IpNetDriver")
+ *
+ *   [/Script/DiscordGame.DiscordNetDriver]
+ *   NetConnectionClassName=/Script/DiscordGame.DiscordNetConnection
+ */
+UCLASS(Transient, Config=Engine)
+class DISCORDGAME_API UDiscordNetDriver : public UNetDriver
+{
+	GENERATED_BODY()
+
+public:
+	// Set Class Defaults
+	UDiscordNetDriver();
+
+	/**
+	 * Build a URL that a client can travel to in order to connect to a server using this driver.
+	 *
+	 * @param ServerPeerId The server's Discord peer id
+	 * @param ServerRouteData The server's Discord route data
+	 * @return URL to pass to ClientTravel/open
+	 */
+	static FString MakeConnectURL(uint64 ServerPeerId, const FString& ServerRouteData);
+
+	/**
+	 * Server only: Open a Discord peer connection to a client that wants to join.
+	 *
+	 * This must be done before the client can reach us.  The Unreal connection itself
+	 * is created once the client completes the stateless handshake.
+	 *
+	 * @param PeerId The client's Discord peer id
+	 * @param RouteData The client's Discord route data
+	 * @return TRUE if the peer was opened, else FALSE
+	 */
+	bool AcceptPeer(uint64 PeerId, const FString& RouteData);
+
+	/**
+	 * Update the route data for a peer we have already opened, whenever
+	 * that peer publishes a new route.
+	 */
+	bool UpdatePeerRoute(uint64 PeerId, const FString& RouteData);
+
+	/** @return The local Discord peer id, or 0 if the transport is not valid */
+	uint64 GetLocalPeerId() const;
+
+	/** @return The most recent local route data, or empty if Discord hasn't told us yet */
+	const FString& GetLocalRouteData() const { return LocalRouteData; }
+
+	/** Broadcast any time the local route data changes */
+	FOnDiscordNetRouteUpdate& OnRouteUpdate() { return RouteUpdateEvent; }
+
+	/** Called by UDiscordNetConnection when it is cleaned up */
+	void NotifyConnectionClosed(UDiscordNetConnection* Connection);
+
+	/** Send a packet to a peer on the packet channel */
+	void SendPacket(uint64 PeerId, const uint8* Data, int32 CountBytes);
+
+	//~UNetDriver interface
+	virtual bool IsAvailable() const override;
+	virtual bool InitBase(bool bInitAsClient, FNetworkNotify* InNotify, const FURL& URL, bool bReuseAddressAndPort, FString& Error) override;
+	virtual bool InitConnect(FNetworkNotify* InNotify, const FURL& ConnectURL, FString& Error) override;
+	virtual bool InitListen(FNetworkNotify* InNotify, FURL& LocalURL, bool bReuseAddressAndPort, FString& Error) override;
+	virtual void TickDispatch(float DeltaTime) override;
+	virtual void TickFlush(float DeltaSeconds) override;
+	virtual void LowLevelSend(TSharedPtr<const FInternetAddr> Address, void* Data, int32 CountBits, FOutPacketTraits& Traits) override;
+	virtual FString LowLevelGetNetworkNumber() override;
+	virtual void LowLevelDestroy() override;
+	virtual bool IsNetResourceValid() override;
+	virtual class ISocketSubsystem* GetSocketSubsystem() override;
+	//~End of UNetDriver interface
+
+protected:
+	/**
+	 * Create the transport this driver sends through.
+	 *
+	 * The default implementation uses discord::NetworkManager.  Override this
+	 * to insert decorators (scheduling, stats, etc) or to use a different transport.
+	 *
+	 * @return The transport, or nullptr if Discord is not available
+	 */
+	virtual TSharedPtr<IDiscordNetTransport> CreateTransport();
+
+	/** Discord channel id that carries Unreal packets (unreliable) */
+	UPROPERTY(Config)
+	uint8 PacketChannelId;
+
+	/** Discord channel id that carries driver control messages (reliable) */
+	UPROPERTY(Config)
+	uint8 ControlChannelId;
+
+	/**
+	 * Seconds a peer stays open after its connection closes, so our Close control
+	 * message can be delivered (and resent if need be) before the peer goes away.
+	 */
+	UPROPERTY(Config)
+	float CloseLingerSeconds;
+
+private:
+	/** A message received from Discord, waiting for TickDispatch */
+	struct FReceivedMessage
+	{
+		uint64 PeerId {0};
+		uint8 ChannelId {0};
+		TArray<uint8> Data;
+	};
+
+	/** Driver control message types, sent on ControlChannelId */
+	enum class EControlMessage : uint8
+	{
+		/** The sender has closed its connection to us */
+		Close = 1,
+	};
+
+	/** Open a peer and both of our channels to it */
+	bool OpenPeerAndChannels(uint64 PeerId, const FString& RouteData);
+
+	/** Handle a message received from the transport; queues it for TickDispatch */
+	void HandleMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength);
+
+	/** Handle the local route changing */
+	void HandleRouteUpdate(const FString& RouteData);
+
+	/** Handle a packet from a peer that has no connection yet (server only) */
+	void ProcessConnectionlessPacket(uint64 PeerId, uint8* Data, int32 CountBytes);
+
+	/** Handle a control message from a peer */
+	void ProcessControlMessage(uint64 PeerId, const TArray<uint8>& Data);
+
+	/** ClosePeer every closing peer whose linger is over */
+	void CloseLingeringPeers(double Now);
+
+	/** @return The connection for this peer, if any */
+	UNetConnection* FindConnection(uint64 PeerId) const;
+
+	/** Drop the transport and every connection, e.g. because Discord went away */
+	void HandleDiscordCoreReset();
+
+	/** The transport we are sending through */
+	TSharedPtr<IDiscordNetTransport> Transport;
+
+	/** Messages received since the last TickDispatch */
+	TArray<FReceivedMessage> ReceivedMessages;
+
+	/** Client connections, by their Discord peer id */
+	TMap<uint64, TWeakObjectPtr<UNetConnection>> PeerConnections;
+
+	/** Peers we have opened via the transport */
+	TSet<uint64> OpenPeers;
+
+	/** Peers whose connection closed, still open until their Close message is delivered; value is when to close them */
+	TMap<uint64, double> ClosingPeers;
+
+	/** Most recent local route data */
+	FString LocalRouteData;
+
+	/** Broadcast any time the local route data changes */
+	FOnDiscordNetRouteUpdate RouteUpdateEvent;
+
+	FDelegateHandle MessageHandle;
+	FDelegateHandle RouteUpdateHandle;
+	FDelegateHandle CoreResetHandle;
+};
@@ -0,0 +1,412 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetEmulator.h"
+#include "DiscordGame.h"
+#include "HAL/IConsoleManager.h"
+
+#if !UE_BUILD_SHIPPING
+
+namespace DiscordNetEmulator
+{
+	static TAutoConsoleVariable<bool> CVarEnable(
+		TEXT("Discord.Net.Emu.Enable"),
+		false,
+		TEXT("Apply the default emulated network conditions to every Discord channel without its own overrides"),
+		ECVF_Cheat);
+
+	static TAutoConsoleVariable<float> CVarLatencyMs(
+		TEXT("Discord.Net.Emu.LatencyMs"),
+		0.f,
+		TEXT("Default emulated latency in each direction, in milliseconds"),
+		ECVF_Cheat);
+
+	static TAutoConsoleVariable<float> CVarJitterMs(
+		TEXT("Discord.Net.Emu.JitterMs"),
+		0.f,
+		TEXT("Default emulated random extra latency in each direction, in milliseconds"),
+		ECVF_Cheat);
+
+	static TAutoConsoleVariable<float> CVarLossPct(
+		TEXT("Discord.Net.Emu.LossPct"),
+		0.f,
+		TEXT("Default emulated percent of messages lost in each direction"),
+		ECVF_Cheat);
+
+	static TAutoConsoleVariable<float> CVarDupPct(
+		TEXT("Discord.Net.Emu.DupPct"),
+		0.f,
+		TEXT("Default emulated percent of messages duplicated in each direction"),
+		ECVF_Cheat);
+
+	static TAutoConsoleVariable<float> CVarReorderPct(
+		TEXT("Discord.Net.Emu.ReorderPct"),
+		0.f,
+		TEXT("Default emulated percent of messages reordered in each direction"),
+		ECVF_Cheat);
+
+	static TAutoConsoleVariable<int32> CVarBandwidthBps(
+		TEXT("Discord.Net.Emu.BandwidthBps"),
+		0,
+		TEXT("Default emulated bandwidth cap per channel in each direction, in bytes/second (0 = unlimited)"),
+		ECVF_Cheat);
+
+	/** Per channel, per direction overrides set by SetChannelSettings */
+	static TOptional<FDiscordNetEmulationSettings> ChannelOverrides[256][static_cast<int32>(EDiscordNetDirection::Num)];
+
+	/** Extra delay for a "lost" message on a reliable channel, on top of a round trip */
+	static constexpr double RetransmitDelaySeconds = 0.05;
+
+	/** Minimum extra delay for a reordered message, so something has a chance to overtake it */
+	static constexpr double MinReorderDelaySeconds = 0.02;
+
+	/** @return The default conditions set by the CVars, whether or not they are enabled */
+	static FDiscordNetEmulationSettings GetDefaultSettings()
+	{
+		FDiscordNetEmulationSettings Settings;
+		Settings.LatencyMs = CVarLatencyMs.GetValueOnGameThread();
+		Settings.JitterMs = CVarJitterMs.GetValueOnGameThread();
+		Settings.LossPercent = CVarLossPct.GetValueOnGameThread();
+		Settings.DuplicatePercent = CVarDupPct.GetValueOnGameThread();
+		Settings.ReorderPercent = CVarReorderPct.GetValueOnGameThread();
+		Settings.BandwidthBytesPerSecond = CVarBandwidthBps.GetValueOnGameThread();
+		return Settings;
+	}
+
+	/** Parse "Name=Value" console arguments into settings, starting from the given settings */
+	static void ParseSettings(const TArray<FString>& Args, FDiscordNetEmulationSettings& Settings)
+	{
+		for (const FString& Arg : Args)
+		{
+			FParse::Value(*Arg, TEXT("Latency="), Settings.LatencyMs);
+			FParse::Value(*Arg, TEXT("Jitter="), Settings.JitterMs);
+			FParse::Value(*Arg, TEXT("Loss="), Settings.LossPercent);
+			FParse::Value(*Arg, TEXT("Dup="), Settings.DuplicatePercent);
+			FParse::Value(*Arg, TEXT("Reorder="), Settings.ReorderPercent);
+			FParse::Value(*Arg, TEXT("Bandwidth="), Settings.BandwidthBytesPerSecond);
+		}
+	}
+
+	static FAutoConsoleCommand CmdChannel(
+		TEXT("Discord.Net.Emu.Channel"),
+		TEXT("Override emulated network conditions for one Discord channel.\n")
+		TEXT("Usage: Discord.Net.Emu.Channel <ChannelId> [Send|Receive|Both] [Latency=ms] [Jitter=ms] [Loss=pct] [Dup=pct] [Reorder=pct] [Bandwidth=bytes/s]\n")
+		TEXT("       Discord.Net.Emu.Channel <ChannelId> Clear"),
+		FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+		{
+			if (Args.Num() < 1 || !Args[0].IsNumeric())
+			{
+				UE_LOG(LogDiscord, Warning, TEXT("Usage: Discord.Net.Emu.Channel <ChannelId> [Send|Receive|Both] [Name=Value...] | Clear"));
+				return;
+			}
+
+			const uint8 ChannelId = static_cast<uint8>(FCString::Atoi(*Args[0]));
+
+			if (Args.Num() > 1 && Args[1] == TEXT("Clear"))
+			{
+				FDiscordNetEmulator::ClearChannelSettings(ChannelId);
+				UE_LOG(LogDiscord, Display, TEXT("Cleared emulation overrides for channel %u"), ChannelId);
+				return;
+			}
+
+			bool bSend {true};
+			bool bReceive {true};
+			if (Args.Num() > 1)
+			{
+				bSend = Args[1] != TEXT("Receive");
+				bReceive = Args[1] != TEXT("Send");
+			}
+
+			for (int32 Direction = 0; Direction < static_cast<int32>(EDiscordNetDirection::Num); ++Direction)
+			{
+				const EDiscordNetDirection Dir = static_cast<EDiscordNetDirection>(Direction);
+				if ((Dir == EDiscordNetDirection::Send && bSend) || (Dir == EDiscordNetDirection::Receive && bReceive))
+				{
+					// Start from whatever applies now, so you can change one value at a time
+					FDiscordNetEmulationSettings Settings = FDiscordNetEmulator::GetEffectiveSettings(ChannelId, Dir);
+					ParseSettings(Args, Settings);
+					FDiscordNetEmulator::SetChannelSettings(ChannelId, Dir, Settings);
+
+					UE_LOG(LogDiscord, Display, TEXT("Channel %u %s: %s"), ChannelId, Dir == EDiscordNetDirection::Send ? TEXT("Send") : TEXT("Receive"), *Settings.ToString());
+				}
+			}
+		}));
+
+	static FAutoConsoleCommand CmdStatus(
+		TEXT("Discord.Net.Emu.Status"),
+		TEXT("Log the emulated network conditions for every Discord channel that has them"),
+		FConsoleCommandDelegate::CreateLambda([]()
+		{
+			UE_LOG(LogDiscord, Display, TEXT("Default (%s): %s"),
+				CVarEnable.GetValueOnGameThread() ? TEXT("enabled") : TEXT("disabled"),
+				*GetDefaultSettings().ToString());
+
+			for (int32 ChannelId = 0; ChannelId < 256; ++ChannelId)
+			{
+				for (int32 Direction = 0; Direction < static_cast<int32>(EDiscordNetDirection::Num); ++Direction)
+				{
+					if (ChannelOverrides[ChannelId][Direction].IsSet())
+					{
+						UE_LOG(LogDiscord, Display, TEXT("Channel %i %s: %s"), ChannelId,
+							Direction == static_cast<int32>(EDiscordNetDirection::Send) ? TEXT("Send") : TEXT("Receive"),
+							*ChannelOverrides[ChannelId][Direction]->ToString());
+					}
+				}
+			}
+		}));
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// FDiscordNetEmulationSettings
+
+bool FDiscordNetEmulationSettings::IsActive() const
+{
+	return LatencyMs > 0.f
+		|| JitterMs > 0.f
+		|| LossPercent > 0.f
+		|| DuplicatePercent > 0.f
+		|| ReorderPercent > 0.f
+		|| BandwidthBytesPerSecond > 0;
+}
+
+FString FDiscordNetEmulationSettings::ToString() const
+{
+	return FString::Printf(TEXT("Latency=%.0f Jitter=%.0f Loss=%.1f Dup=%.1f Reorder=%.1f Bandwidth=%i"),
+		LatencyMs, JitterMs, LossPercent, DuplicatePercent, ReorderPercent, BandwidthBytesPerSecond);
+}
+
+//////////////////////////////////////////////////////////////////////
+// FDiscordNetEmulator
+
+FDiscordNetEmulator::FDiscordNetEmulator(const TSharedRef<IDiscordNetTransport>& InInner)
+	: FDiscordNetTransportDecorator(InInner)
+	, ReliableChannels(false, 256)
+	, Random(static_cast<int32>(FPlatformTime::Cycles()))
+{
+}
+
+void FDiscordNetEmulator::SetChannelSettings(uint8 ChannelId, EDiscordNetDirection Direction, const FDiscordNetEmulationSettings& Settings)
+{
+#if !UE_BUILD_SHIPPING
+	check(Direction < EDiscordNetDirection::Num);
+	DiscordNetEmulator::ChannelOverrides[ChannelId][static_cast<int32>(Direction)] = Settings;
+#endif
+}
+
+void FDiscordNetEmulator::ClearChannelSettings(uint8 ChannelId)
+{
+#if !UE_BUILD_SHIPPING
+	for (TOptional<FDiscordNetEmulationSettings>& Override : DiscordNetEmulator::ChannelOverrides[ChannelId])
+	{
+		Override.Reset();
+	}
+#endif
+}
+
+FDiscordNetEmulationSettings FDiscordNetEmulator::GetEffectiveSettings(uint8 ChannelId, EDiscordNetDirection Direction)
+{
+	FDiscordNetEmulationSettings Settings;
+
+#if !UE_BUILD_SHIPPING
+	using namespace DiscordNetEmulator;
+
+	if (const TOptional<FDiscordNetEmulationSettings>& Override = ChannelOverrides[ChannelId][static_cast<int32>(Direction)]; Override.IsSet())
+	{
+		Settings = Override.GetValue();
+	}
+	else if (CVarEnable.GetValueOnGameThread())
+	{
+		Settings = GetDefaultSettings();
+	}
+#endif
+
+	return Settings;
+}
+
+discord::Result FDiscordNetEmulator::OpenChannel(uint64 PeerId, uint8 ChannelId, bool bReliable)
+{
+	// Remember which channels are reliable so we never break their guarantees
+	ReliableChannels[ChannelId] = bReliable;
+
+	return Super::OpenChannel(PeerId, ChannelId, bReliable);
+}
+
+discord::Result FDiscordNetEmulator::SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	if (Enqueue(EDiscordNetDirection::Send, PeerId, ChannelId, Data, DataLength))
+	{
+		// From the caller's point of view, the message was sent (even if we're going to "lose" it)
+		return discord::Result::Ok;
+	}
+
+	return Super::SendMessage(PeerId, ChannelId, Data, DataLength);
+}
+
+discord::Result FDiscordNetEmulator::Flush()
+{
+	Release(EDiscordNetDirection::Send);
+	Release(EDiscordNetDirection::Receive);
+
+	return Super::Flush();
+}
+
+void FDiscordNetEmulator::HandleInnerMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	if (!Enqueue(EDiscordNetDirection::Receive, PeerId, ChannelId, Data, DataLength))
+	{
+		Super::HandleInnerMessage(PeerId, ChannelId, Data, DataLength);
+	}
+}
+
+bool FDiscordNetEmulator::Enqueue(EDiscordNetDirection Direction, uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+#if UE_BUILD_SHIPPING
+	return false;
+#else
+	const FDiscordNetEmulationSettings Settings = GetEffectiveSettings(ChannelId, Direction);
+	FDirectionState& State = Directions[static_cast<int32>(Direction)];
+
+	// Once conditions are cleared, keep queueing until the backlog has drained so nothing is reordered
+	if (!Settings.IsActive() && State.Delayed.Num() == 0 && !State.Backlogs.Contains(ChannelId))
+	{
+		return false;
+	}
+
+	const bool bReliable = ReliableChannels[ChannelId];
+	const double LatencySeconds = Settings.LatencyMs / 1000.;
+	double Delay = LatencySeconds + Random.GetFraction() * Settings.JitterMs / 1000.;
+	int32 NumCopies {1};
+
+	if (Random.GetFraction() * 100.f < Settings.LossPercent)
+	{
+		if (!bReliable)
+		{
+			++NumLost;
+			return true;
+		}
+
+		// Reliable messages aren't lost, they're retransmitted, which costs at least another round trip
+		Delay += 2. * LatencySeconds + DiscordNetEmulator::RetransmitDelaySeconds;
+	}
+
+	if (!bReliable)
+	{
+		if (Random.GetFraction() * 100.f < Settings.DuplicatePercent)
+		{
+			++NumDuplicated;
+			NumCopies = 2;
+		}
+
+		if (Random.GetFraction() * 100.f < Settings.ReorderPercent)
+		{
+			++NumReordered;
+			Delay += FMath::Max(2. * Settings.JitterMs / 1000., DiscordNetEmulator::MinReorderDelaySeconds);
+		}
+	}
+
+	double ReleaseTime = FPlatformTime::Seconds() + Delay;
+
+	if (bReliable)
+	{
+		// Reliable channels are ordered; never release before a message that came earlier
+		double& LastReleaseTime = State.ReliableReleaseTimes.FindOrAdd(MakeTuple(PeerId, ChannelId), 0.);
+		ReleaseTime = FMath::Max(ReleaseTime, LastReleaseTime);
+		LastReleaseTime = ReleaseTime;
+	}
+
+	for (int32 Copy = 0; Copy < NumCopies; ++Copy)
+	{
+		FDelayedMessage Message;
+		Message.ReleaseTime = ReleaseTime;
+		Message.Sequence = NextSequence++;
+		Message.PeerId = PeerId;
+		Message.ChannelId = ChannelId;
+		Message.Payload.Append(Data, DataLength);
+
+		State.Delayed.HeapPush(MoveTemp(Message), [](const FDelayedMessage& A, const FDelayedMessage& B)
+		{
+			return A.ReleaseTime != B.ReleaseTime ? A.ReleaseTime < B.ReleaseTime : A.Sequence < B.Sequence;
+		});
+	}
+
+	return true;
+#endif
+}
+
+void FDiscordNetEmulator::Release(EDiscordNetDirection Direction)
+{
+	FDirectionState& State = Directions[static_cast<int32>(Direction)];
+
+	const double Now = FPlatformTime::Seconds();
+	const double DeltaTime = State.LastReleaseTime > 0. ? Now - State.LastReleaseTime : 0.;
+	State.LastReleaseTime = Now;
+
+	// Move everything that has waited out its latency into the bandwidth backlogs
+	while (State.Delayed.Num() > 0 && State.Delayed.HeapTop().ReleaseTime <= Now)
+	{
+		FDelayedMessage Message;
+		State.Delayed.HeapPop(Message, [](const FDelayedMessage& A, const FDelayedMessage& B)
+		{
+			return A.ReleaseTime != B.ReleaseTime ? A.ReleaseTime < B.ReleaseTime : A.Sequence < B.Sequence;
+		}, EAllowShrinking::No);
+
+		State.Backlogs.FindOrAdd(Message.ChannelId).Add(MoveTemp(Message));
+	}
+
+	// Take the backlogs out before delivering, since receive handlers may send (or even flush)
+	TMap<uint8, TArray<FDelayedMessage>> Backlogs = MoveTemp(State.Backlogs);
+	State.Backlogs.Reset();
+
+	for (TPair<uint8, TArray<FDelayedMessage>>& It : Backlogs)
+	{
+		const int32 BandwidthBytesPerSecond = GetEffectiveSettings(It.Key, Direction).BandwidthBytesPerSecond;
+
+		int32 NumReleased {0};
+		if (BandwidthBytesPerSecond > 0)
+		{
+			// Allow bursts of up to 100ms worth of bandwidth
+			double& Tokens = State.Tokens.FindOrAdd(It.Key, 0.);
+			Tokens = FMath::Min<double>(BandwidthBytesPerSecond * 0.1, Tokens + BandwidthBytesPerSecond * DeltaTime);
+
+			while (NumReleased < It.Value.Num() && Tokens > 0.)
+			{
+				Tokens -= It.Value[NumReleased].Payload.Num();
+				Deliver(Direction, It.Value[NumReleased]);
+				++NumReleased;
+			}
+		}
+		else
+		{
+			for (const FDelayedMessage& Message : It.Value)
+			{
+				Deliver(Direction, Message);
+			}
+			NumReleased = It.Value.Num();
+		}
+
+		// Whatever didn't fit goes back to the front of the backlog, ahead of anything added meanwhile
+		if (NumReleased < It.Value.Num())
+		{
+			It.Value.RemoveAt(0, NumReleased, EAllowShrinking::No);
+			TArray<FDelayedMessage>& Backlog = State.Backlogs.FindOrAdd(It.Key);
+			Backlog.Insert(MoveTemp(It.Value), 0);
+		}
+	}
+}
+
+void FDiscordNetEmulator::Deliver(EDiscordNetDirection Direction, const FDelayedMessage& Message)
+{
+	if (Direction == EDiscordNetDirection::Send)
+	{
+		const discord::Result Result = Inner->SendMessage(Message.PeerId, Message.ChannelId, Message.Payload.GetData(), Message.Payload.Num());
+		if (Result != discord::Result::Ok)
+		{
+			UE_LOG(LogDiscord, Verbose, TEXT("Error(%i) Sending emulated message to peer %llu on channel %u"), Result, Message.PeerId, Message.ChannelId);
+		}
+	}
+	else
+	{
+		MessageEvent.Broadcast(Message.PeerId, Message.ChannelId, Message.Payload.GetData(), Message.Payload.Num());
+	}
+}
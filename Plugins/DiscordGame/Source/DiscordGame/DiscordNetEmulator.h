@@ -0,0 +1,153 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordNetTransport.h"
+#include "Math/RandomStream.h"
+
+/** Direction of traffic through an FDiscordNetEmulator */
+enum class EDiscordNetDirection : uint8
+{
+	Send,
+	Receive,
+
+	Num
+};
+
+/**
+ * Network conditions to emulate on a channel, in one direction
+ */
+struct DISCORDGAME_API FDiscordNetEmulationSettings
+{
+	/** Latency added to every message, in milliseconds */
+	float LatencyMs {0.f};
+
+	/** Up to this many milliseconds of random extra latency is added to every message */
+	float JitterMs {0.f};
+
+	/** Percent [0..100] of messages that are lost */
+	float LossPercent {0.f};
+
+	/** Percent [0..100] of messages that are delivered twice */
+	float DuplicatePercent {0.f};
+
+	/** Percent [0..100] of messages that are held back so later messages overtake them */
+	float ReorderPercent {0.f};
+
+	/** Maximum bytes/second that may pass; <= 0 means unlimited */
+	int32 BandwidthBytesPerSecond {0};
+
+	/** @return TRUE if these settings would change anything at all */
+	bool IsActive() const;
+
+	/** @return Human readable description, in the same format the console command accepts */
+	FString ToString() const;
+};
+
+/**
+ * Discord Network Condition Emulator
+ *
+ * Transport decorator that degrades traffic in both directions, so you can see how
+ * your netcode behaves with latency, jitter, loss, duplication, reordering and
+ * limited bandwidth, without any external tools.  It works with any transport
+ * underneath, including FDiscordLoopbackNetwork peers.
+ *
+ * Conditions are global, so every emulator in the process picks them up.
+ * They can be set from code with SetChannelSettings, or from the console:
+ *
+ *   Discord.Net.Emu.Enable 1          Apply the default conditions below to every channel
+ *   Discord.Net.Emu.LatencyMs 100     (also JitterMs, LossPct, DupPct, ReorderPct, BandwidthBps)
+ *   Discord.Net.Emu.Channel 3 Send Latency=150 Loss=5      Override one channel/direction
+ *   Discord.Net.Emu.Channel 3 Clear                        Remove a channel's overrides
+ *   Discord.Net.Emu.Status            Log the current conditions
+ *
+ * Reliable channels keep their guarantees: instead of losing, duplicating or
+ * reordering messages, a "lost" message on a reliable channel is delayed as if
+ * it had been retransmitted.
+ *
+ * Sends are released to the Inner transport at Flush(), and delayed receives are
+ * broadcast at Flush(), so call it once per frame as usual.
+ *
+ * Emulation is compiled out of Shipping builds, where this is a plain pass-through.
+ */
+class DISCORDGAME_API FDiscordNetEmulator : public FDiscordNetTransportDecorator
+{
+	using Super = FDiscordNetTransportDecorator;
+
+public:
+	explicit FDiscordNetEmulator(const TSharedRef<IDiscordNetTransport>& InInner);
+
+	/** Override the conditions for one channel in one direction, for every emulator */
+	static void SetChannelSettings(uint8 ChannelId, EDiscordNetDirection Direction, const FDiscordNetEmulationSettings& Settings);
+
+	/** Remove a channel's overrides in both directions, so it goes back to the defaults */
+	static void ClearChannelSettings(uint8 ChannelId);
+
+	/** @return The conditions currently applied to a channel in one direction */
+	static FDiscordNetEmulationSettings GetEffectiveSettings(uint8 ChannelId, EDiscordNetDirection Direction);
+
+	/** Counters since the emulator was created */
+	uint64 NumLost {0};
+	uint64 NumDuplicated {0};
+	uint64 NumReordered {0};
+
+	//~IDiscordNetTransport interface
+	virtual discord::Result OpenChannel(uint64 PeerId, uint8 ChannelId, bool bReliable) override;
+	virtual discord::Result SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) override;
+	virtual discord::Result Flush() override;
+	//~End of IDiscordNetTransport interface
+
+protected:
+	//~FDiscordNetTransportDecorator interface
+	virtual void HandleInnerMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) override;
+	//~End of FDiscordNetTransportDecorator interface
+
+private:
+	struct FDelayedMessage
+	{
+		double ReleaseTime {0.};
+		uint64 Sequence {0};
+		uint64 PeerId {0};
+		uint8 ChannelId {0};
+		TArray<uint8> Payload;
+	};
+
+	/** Everything held back in one direction */
+	struct FDirectionState
+	{
+		/** Messages waiting out their latency, as a heap ordered by ReleaseTime */
+		TArray<FDelayedMessage> Delayed;
+
+		/** Messages past their latency, waiting for bandwidth, per channel */
+		TMap<uint8, TArray<FDelayedMessage>> Backlogs;
+
+		/** Bandwidth tokens per channel */
+		TMap<uint8, double> Tokens;
+
+		/** Latest release time per (PeerId, ChannelId) for reliable channels, to keep them in order */
+		TMap<TTuple<uint64, uint8>, double> ReliableReleaseTimes;
+
+		double LastReleaseTime {0.};
+	};
+
+	/**
+	 * Apply the emulated conditions to a message and hold on to it.
+	 * @return FALSE if the message should bypass emulation entirely
+	 */
+	bool Enqueue(EDiscordNetDirection Direction, uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength);
+
+	/** Release every message in this direction that is due, subject to bandwidth */
+	void Release(EDiscordNetDirection Direction);
+
+	/** Actually send or broadcast a message */
+	void Deliver(EDiscordNetDirection Direction, const FDelayedMessage& Message);
+
+	FDirectionState Directions[static_cast<int32>(EDiscordNetDirection::Num)];
+
+	/** Which channels were opened as reliable */
+	TBitArray<> ReliableChannels;
+
+	FRandomStream Random;
+	uint64 NextSequence {0};
+};
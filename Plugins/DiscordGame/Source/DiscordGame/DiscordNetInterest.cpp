@@ -0,0 +1,178 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetInterest.h"
+#include "DiscordGame.h"
+
+FDiscordNetInterestManager::FDiscordNetInterestManager(const TSharedRef<IDiscordNetTransport>& InTransport)
+	: Transport(InTransport)
+{
+}
+
+void FDiscordNetInterestManager::SetMember(uint64 PeerId, const FVector& Location, int32 Team, uint32 InterestFlags)
+{
+	int32 Index;
+	if (const int32* Existing = MemberIndices.Find(PeerId))
+	{
+		Index = *Existing;
+	}
+	else
+	{
+		Index = PeerIds.Add(PeerId);
+		Locations.AddUninitialized();
+		Teams.AddUninitialized();
+		Flags.AddUninitialized();
+		MemberIndices.Add(PeerId, Index);
+	}
+
+	Locations[Index] = FVector3f(Location);
+	Teams[Index] = Team;
+	Flags[Index] = InterestFlags;
+}
+
+void FDiscordNetInterestManager::SetMemberLocation(uint64 PeerId, const FVector& Location)
+{
+	if (const int32* Index = MemberIndices.Find(PeerId))
+	{
+		Locations[*Index] = FVector3f(Location);
+	}
+}
+
+void FDiscordNetInterestManager::RemoveMember(uint64 PeerId)
+{
+	int32 Index;
+	if (!MemberIndices.RemoveAndCopyValue(PeerId, Index))
+	{
+		return;
+	}
+
+	// Swap the last member into the hole, to keep the arrays packed
+	PeerIds.RemoveAtSwap(Index, 1, EAllowShrinking::No);
+	Locations.RemoveAtSwap(Index, 1, EAllowShrinking::No);
+	Teams.RemoveAtSwap(Index, 1, EAllowShrinking::No);
+	Flags.RemoveAtSwap(Index, 1, EAllowShrinking::No);
+
+	if (Index < PeerIds.Num())
+	{
+		MemberIndices[PeerIds[Index]] = Index;
+	}
+}
+
+int32 FDiscordNetInterestManager::AddPredicate(FPredicate&& Predicate)
+{
+	return Predicates.Add(MoveTemp(Predicate));
+}
+
+void FDiscordNetInterestManager::QueueMessage(const FDiscordNetInterest& Interest, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	FQueuedMessage& Message = Queue.AddDefaulted_GetRef();
+	Message.Interest = Interest;
+	Message.ChannelId = ChannelId;
+	Message.PayloadOffset = Payloads.Num();
+	Message.PayloadLength = DataLength;
+
+	Payloads.Append(Data, DataLength);
+	++NumMessagesQueued;
+}
+
+void FDiscordNetInterestManager::Flush()
+{
+	for (const FQueuedMessage& Message : Queue)
+	{
+		Evaluate(Message.Interest);
+
+		const uint8* Data = Payloads.GetData() + Message.PayloadOffset;
+		for (int32 Index = 0; Index < PeerIds.Num(); ++Index)
+		{
+			if (!Relevant[Index])
+			{
+				++NumSendsFiltered;
+				continue;
+			}
+
+			const discord::Result Result = Transport->SendMessage(PeerIds[Index], Message.ChannelId, Data, Message.PayloadLength);
+			if (Result != discord::Result::Ok)
+			{
+				UE_LOG(LogDiscord, Verbose, TEXT("Error(%i) Sending message to peer %llu on channel %u"), Result, PeerIds[Index], Message.ChannelId);
+			}
+			++NumSends;
+		}
+	}
+
+	// Keep the allocations for next frame
+	Queue.Reset();
+	Payloads.Reset();
+}
+
+void FDiscordNetInterestManager::GetRelevantMembers(const FDiscordNetInterest& Interest, TArray<uint64>& OutPeerIds)
+{
+	Evaluate(Interest);
+
+	OutPeerIds.Reset();
+	for (TConstSetBitIterator<> It(Relevant); It; ++It)
+	{
+		OutPeerIds.Add(PeerIds[It.GetIndex()]);
+	}
+}
+
+void FDiscordNetInterestManager::Evaluate(const FDiscordNetInterest& Interest)
+{
+	const int32 NumMembers = PeerIds.Num();
+	Relevant.Init(true, NumMembers);
+
+	// Each test is its own branch-light loop over one packed array; only the predicate skips members already ruled out
+
+	if (Interest.RequiredFlags != 0)
+	{
+		for (int32 Index = 0; Index < NumMembers; ++Index)
+		{
+			if ((Flags[Index] & Interest.RequiredFlags) != Interest.RequiredFlags)
+			{
+				Relevant[Index] = false;
+			}
+		}
+	}
+
+	if (Interest.TeamRule != EDiscordNetTeamRule::Any)
+	{
+		const bool bWantSameTeam = Interest.TeamRule == EDiscordNetTeamRule::SameTeam;
+		for (int32 Index = 0; Index < NumMembers; ++Index)
+		{
+			if ((Teams[Index] == Interest.Team) != bWantSameTeam)
+			{
+				Relevant[Index] = false;
+			}
+		}
+	}
+
+	if (Interest.MaxDistance > 0.f)
+	{
+		const FVector3f Origin(Interest.Origin);
+		const float MaxDistanceSquared = FMath::Square(Interest.MaxDistance);
+		for (int32 Index = 0; Index < NumMembers; ++Index)
+		{
+			if (FVector3f::DistSquared(Locations[Index], Origin) > MaxDistanceSquared)
+			{
+				Relevant[Index] = false;
+			}
+		}
+	}
+
+	if (Interest.Predicate != INDEX_NONE)
+	{
+		if (!Predicates.IsValidIndex(Interest.Predicate))
+		{
+			UE_LOG(LogDiscord, Warning, TEXT("Unknown interest predicate %i; message is relevant to nobody"), Interest.Predicate);
+			Relevant.Init(false, NumMembers);
+			return;
+		}
+
+		const FPredicate& Predicate = Predicates[Interest.Predicate];
+		for (TConstSetBitIterator<> It(Relevant); It; ++It)
+		{
+			if (!Predicate(PeerIds[It.GetIndex()]))
+			{
+				Relevant[It.GetIndex()] = false;
+			}
+		}
+	}
+}
@@ -0,0 +1,125 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordNetTransport.h"
+
+/** How a message's Team restricts its recipients */
+enum class EDiscordNetTeamRule : uint8
+{
+	/** Team doesn't matter */
+	Any,
+	/** Only members on the same team */
+	SameTeam,
+	/** Only members on other teams */
+	OtherTeams,
+};
+
+/**
+ * Who a message is relevant to.  Every test that is set must pass.
+ */
+struct DISCORDGAME_API FDiscordNetInterest
+{
+	/** Where the message happens */
+	FVector Origin {FVector::ZeroVector};
+
+	/** Only members within this distance of Origin; <= 0 means any distance */
+	float MaxDistance {0.f};
+
+	/** Team the message belongs to, used by TeamRule */
+	int32 Team {INDEX_NONE};
+
+	EDiscordNetTeamRule TeamRule {EDiscordNetTeamRule::Any};
+
+	/** Only members whose interest flags include all of these */
+	uint32 RequiredFlags {0};
+
+	/** Only members this custom predicate (from AddPredicate) accepts; INDEX_NONE for none */
+	int32 Predicate {INDEX_NONE};
+};
+
+/**
+ * Discord Network Interest Manager
+ *
+ * Sends each gameplay message only to the lobby members it is relevant to,
+ * instead of broadcasting everything to everyone.
+ *
+ * Keep each member's location, team and interest flags up to date, and queue
+ * messages with an FDiscordNetInterest describing who should get them.  At
+ * Flush(), every queued message is tested against every member in one batched
+ * pass over tightly packed member data (cheapest tests first, custom predicates
+ * last and only for members that passed everything else), and only the relevant
+ * sends reach the transport.
+ *
+ * Call Flush() once per frame, before the transport's Flush().
+ */
+class DISCORDGAME_API FDiscordNetInterestManager
+{
+public:
+	/** Custom relevancy test: (PeerId) -> TRUE if relevant */
+	using FPredicate = TFunction<bool(uint64 /*PeerId*/)>;
+
+	explicit FDiscordNetInterestManager(const TSharedRef<IDiscordNetTransport>& InTransport);
+
+	/** Add a member, or update everything about one */
+	void SetMember(uint64 PeerId, const FVector& Location, int32 Team = INDEX_NONE, uint32 InterestFlags = ~0u);
+
+	/** Update just a member's location; call this each frame for members that move */
+	void SetMemberLocation(uint64 PeerId, const FVector& Location);
+
+	/** Stop sending to a member */
+	void RemoveMember(uint64 PeerId);
+
+	/** @return Index to use as FDiscordNetInterest::Predicate */
+	int32 AddPredicate(FPredicate&& Predicate);
+
+	/** Queue a message for every member it's relevant to; the data is copied */
+	void QueueMessage(const FDiscordNetInterest& Interest, uint8 ChannelId, const uint8* Data, uint32 DataLength);
+
+	/** Send every queued message to the members it's relevant to */
+	void Flush();
+
+	/** Get the members a message would be sent to, without sending anything */
+	void GetRelevantMembers(const FDiscordNetInterest& Interest, TArray<uint64>& OutPeerIds);
+
+	/** @return Number of members */
+	int32 GetNumMembers() const { return PeerIds.Num(); }
+
+	/** Counters since this was created */
+	uint64 NumMessagesQueued {0};
+	uint64 NumSends {0};
+	uint64 NumSendsFiltered {0};
+
+private:
+	struct FQueuedMessage
+	{
+		FDiscordNetInterest Interest;
+		uint8 ChannelId {0};
+		int32 PayloadOffset {0};
+		uint32 PayloadLength {0};
+	};
+
+	/** Mark Relevant[i] for every member i the message is relevant to */
+	void Evaluate(const FDiscordNetInterest& Interest);
+
+	TSharedRef<IDiscordNetTransport> Transport;
+
+	/** Member data, one entry per member in each array, packed for the batched pass */
+	TArray<uint64> PeerIds;
+	TArray<FVector3f> Locations;
+	TArray<int32> Teams;
+	TArray<uint32> Flags;
+
+	/** Index of each member in the arrays above */
+	TMap<uint64, int32> MemberIndices;
+
+	TArray<FPredicate> Predicates;
+
+	/** Messages waiting for Flush, and all of their payloads back to back */
+	TArray<FQueuedMessage> Queue;
+	TArray<uint8> Payloads;
+
+	/** Result of Evaluate, one per member */
+	TBitArray<> Relevant;
+};
@@ -0,0 +1,301 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetLockstep.h"
+#include "DiscordGame.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+
+namespace DiscordNetLockstep
+{
+	/** Weight of each new sample in the smoothed RTT and frame advantage */
+	static constexpr double Smoothing = 0.1;
+}
+
+FDiscordNetLockstep::FDiscordNetLockstep(const TSharedRef<IDiscordNetTransport>& InTransport, uint8 InChannelId, int32 InInputSize, const FDiscordNetLockstepSettings& InSettings)
+	: Transport(InTransport)
+	, ChannelId(InChannelId)
+	, InputSize(FMath::Max(InInputSize, 1))
+	, Settings(InSettings)
+{
+	Settings.FrameSeconds = FMath::Max(Settings.FrameSeconds, UE_KINDA_SMALL_NUMBER);
+	Settings.MinInputDelay = FMath::Max(Settings.MinInputDelay, 0);
+	Settings.MaxInputDelay = FMath::Max(Settings.MaxInputDelay, Settings.MinInputDelay);
+	Settings.MaxRedundantFrames = FMath::Clamp(Settings.MaxRedundantFrames, 1, 255);
+
+	// Frames still being resent, or scheduled ahead, must never share a ring slot
+	Settings.BufferFrames = FMath::Max(Settings.BufferFrames, Settings.MaxInputDelay + Settings.MaxRedundantFrames + 2);
+
+	LocalPeerId = Transport->GetLocalPeerId();
+	InputDelay = Settings.MinInputDelay;
+
+	Local.Inputs.SetNumZeroed(Settings.BufferFrames * InputSize);
+	LastLocalInput.SetNumZeroed(InputSize);
+	LocalSendTimes.SetNumZeroed(Settings.BufferFrames);
+
+	MessageHandle = Transport->OnMessage().AddRaw(this, &FDiscordNetLockstep::HandleMessage);
+}
+
+FDiscordNetLockstep::~FDiscordNetLockstep()
+{
+	Transport->OnMessage().Remove(MessageHandle);
+}
+
+void FDiscordNetLockstep::AddPeer(uint64 PeerId)
+{
+	if (PeerId != LocalPeerId && !Peers.Contains(PeerId))
+	{
+		FPeerState& Peer = Peers.Add(PeerId);
+		Peer.Received.Inputs.SetNumZeroed(Settings.BufferFrames * InputSize);
+	}
+}
+
+void FDiscordNetLockstep::RemovePeer(uint64 PeerId)
+{
+	Peers.Remove(PeerId);
+}
+
+void FDiscordNetLockstep::SetLocalInput(const void* Input)
+{
+	UpdateInputDelay();
+
+	const uint32 TargetFrame = CurrentFrame + InputDelay;
+	if (TargetFrame < Local.EndFrame)
+	{
+		// The delay just shrank, so this frame already has an input; skipping this one keeps every frame's input unique
+		FMemory::Memcpy(LastLocalInput.GetData(), Input, InputSize);
+		return;
+	}
+
+	// The delay just grew (or this is the start), so repeat the last input over the frames in between
+	while (Local.EndFrame < TargetFrame)
+	{
+		FMemory::Memcpy(GetSlot(Local, Local.EndFrame), LastLocalInput.GetData(), InputSize);
+		++Local.EndFrame;
+	}
+
+	FMemory::Memcpy(GetSlot(Local, TargetFrame), Input, InputSize);
+	FMemory::Memcpy(LastLocalInput.GetData(), Input, InputSize);
+	Local.EndFrame = TargetFrame + 1;
+}
+
+void FDiscordNetLockstep::SendInputs()
+{
+	const double Now = FPlatformTime::Seconds();
+
+	while (LocalSentEndFrame < Local.EndFrame)
+	{
+		LocalSendTimes[LocalSentEndFrame % Settings.BufferFrames] = Now;
+		++LocalSentEndFrame;
+	}
+
+	for (TPair<uint64, FPeerState>& It : Peers)
+	{
+		FPeerState& Peer = It.Value;
+
+		// Everything the peer hasn't acknowledged, as far back as we still have it
+		const uint32 OldestKept = Local.EndFrame > static_cast<uint32>(Settings.BufferFrames) ? Local.EndFrame - Settings.BufferFrames : 0;
+		uint32 StartFrame = FMath::Max(Peer.AckedEndFrame, OldestKept);
+		uint8 Count = static_cast<uint8>(FMath::Min<uint32>(Local.EndFrame - FMath::Min(StartFrame, Local.EndFrame), Settings.MaxRedundantFrames));
+
+		MessageBuffer.Reset();
+		FMemoryWriter Writer(MessageBuffer);
+
+		uint32 SenderFrame = CurrentFrame;
+		uint32 AckEndFrame = Peer.Received.EndFrame;
+		Writer << SenderFrame;
+		Writer << AckEndFrame;
+		Writer << StartFrame;
+		Writer << Count;
+
+		for (uint32 Frame = StartFrame; Frame < StartFrame + Count; ++Frame)
+		{
+			Writer.Serialize(GetSlot(Local, Frame), InputSize);
+		}
+
+		// Send even with no inputs, so acks and frame numbers keep flowing
+		const discord::Result Result = Transport->SendMessage(It.Key, ChannelId, MessageBuffer.GetData(), MessageBuffer.Num());
+		if (Result != discord::Result::Ok)
+		{
+			UE_LOG(LogDiscord, Verbose, TEXT("Error(%i) Sending lockstep inputs to peer %llu"), Result, It.Key);
+			continue;
+		}
+
+		++NumMessagesSent;
+		NumInputsSent += Count;
+	}
+}
+
+bool FDiscordNetLockstep::IsFrameReady() const
+{
+	if (Local.EndFrame <= CurrentFrame)
+	{
+		return false;
+	}
+
+	for (const TPair<uint64, FPeerState>& It : Peers)
+	{
+		if (It.Value.Received.EndFrame <= CurrentFrame)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+const uint8* FDiscordNetLockstep::GetInput(uint64 PeerId) const
+{
+	if (PeerId == LocalPeerId)
+	{
+		return Local.EndFrame > CurrentFrame ? GetSlot(Local, CurrentFrame) : nullptr;
+	}
+
+	const FPeerState* Peer = Peers.Find(PeerId);
+	return Peer && Peer->Received.EndFrame > CurrentFrame ? GetSlot(Peer->Received, CurrentFrame) : nullptr;
+}
+
+void FDiscordNetLockstep::AdvanceFrame()
+{
+	check(IsFrameReady());
+	++CurrentFrame;
+}
+
+float FDiscordNetLockstep::GetFrameAdvantage(uint64 PeerId) const
+{
+	const FPeerState* Peer = Peers.Find(PeerId);
+	return Peer ? Peer->SmoothedAdvantage : 0.f;
+}
+
+float FDiscordNetLockstep::GetMaxFrameAdvantage() const
+{
+	float MaxAdvantage {0.f};
+	for (const TPair<uint64, FPeerState>& It : Peers)
+	{
+		MaxAdvantage = FMath::Max(MaxAdvantage, It.Value.SmoothedAdvantage);
+	}
+	return MaxAdvantage;
+}
+
+double FDiscordNetLockstep::GetRttSeconds(uint64 PeerId) const
+{
+	const FPeerState* Peer = Peers.Find(PeerId);
+	return Peer ? Peer->SmoothedRtt : -1.;
+}
+
+void FDiscordNetLockstep::HandleMessage(uint64 PeerId, uint8 MessageChannelId, const uint8* Data, uint32 DataLength)
+{
+	using namespace DiscordNetLockstep;
+
+	if (MessageChannelId != ChannelId)
+	{
+		return;
+	}
+
+	FPeerState* Peer = Peers.Find(PeerId);
+	if (!Peer)
+	{
+		// Not part of this session
+		return;
+	}
+
+	FMemoryReaderView Reader(MakeArrayView(Data, DataLength));
+
+	uint32 SenderFrame {0};
+	uint32 AckEndFrame {0};
+	uint32 StartFrame {0};
+	uint8 Count {0};
+	Reader << SenderFrame;
+	Reader << AckEndFrame;
+	Reader << StartFrame;
+	Reader << Count;
+
+	if (Reader.IsError() || DataLength != Reader.Tell() + static_cast<int64>(Count) * InputSize)
+	{
+		UE_LOG(LogDiscord, Verbose, TEXT("Dropping malformed lockstep message (%u bytes) from peer %llu"), DataLength, PeerId);
+		return;
+	}
+
+	const double Now = FPlatformTime::Seconds();
+
+	// Newly acknowledged frames give us an RTT sample: from when the newest of them was first sent
+	if (AckEndFrame > Peer->AckedEndFrame && AckEndFrame <= LocalSentEndFrame)
+	{
+		const double Rtt = Now - LocalSendTimes[(AckEndFrame - 1) % Settings.BufferFrames];
+		Peer->SmoothedRtt = Peer->SmoothedRtt < 0. ? Rtt : FMath::Lerp(Peer->SmoothedRtt, Rtt, Smoothing);
+		Peer->AckedEndFrame = AckEndFrame;
+	}
+
+	// The peer was on SenderFrame half an RTT ago, so it's probably that much further along now
+	if (!Peer->bHasRemoteFrame || static_cast<int32>(SenderFrame - Peer->RemoteFrame) > 0)
+	{
+		const double OneWayFrames = FMath::Max(Peer->SmoothedRtt, 0.) * 0.5 / Settings.FrameSeconds;
+		const float Advantage = static_cast<float>(static_cast<double>(static_cast<int32>(CurrentFrame - SenderFrame)) - OneWayFrames);
+
+		Peer->SmoothedAdvantage = Peer->bHasRemoteFrame ? FMath::Lerp(Peer->SmoothedAdvantage, Advantage, static_cast<float>(Smoothing)) : Advantage;
+		Peer->RemoteFrame = SenderFrame;
+		Peer->bHasRemoteFrame = true;
+	}
+
+	// Take every input that extends what we have; anything before it is a redundant copy
+	const uint8* Inputs = Data + Reader.Tell();
+	for (uint32 Index = 0; Index < Count; ++Index)
+	{
+		const uint32 Frame = StartFrame + Index;
+		if (Frame < Peer->Received.EndFrame)
+		{
+			++NumRedundantInputs;
+			continue;
+		}
+
+		// A gap (can't happen while they send from our ack) or no room until we catch up; they'll resend
+		if (Frame > Peer->Received.EndFrame || Frame >= CurrentFrame + Settings.BufferFrames)
+		{
+			break;
+		}
+
+		FMemory::Memcpy(GetSlot(Peer->Received, Frame), Inputs + Index * InputSize, InputSize);
+		++Peer->Received.EndFrame;
+		++NumInputsReceived;
+	}
+}
+
+void FDiscordNetLockstep::UpdateInputDelay()
+{
+	double WorstRtt {-1.};
+	for (const TPair<uint64, FPeerState>& It : Peers)
+	{
+		WorstRtt = FMath::Max(WorstRtt, It.Value.SmoothedRtt);
+	}
+
+	if (WorstRtt < 0.)
+	{
+		// No measurements yet
+		return;
+	}
+
+	// Inputs must arrive before they're needed: one way trip plus a margin, in whole frames
+	const int32 TargetDelay = FMath::Clamp(
+		FMath::CeilToInt32((WorstRtt * 0.5 + Settings.JitterMarginSeconds) / Settings.FrameSeconds),
+		Settings.MinInputDelay,
+		Settings.MaxInputDelay);
+
+	// Grow right away, but only shrink once we're two frames over, so it doesn't flap on the boundary
+	if (TargetDelay > InputDelay)
+	{
+		++InputDelay;
+	}
+	else if (TargetDelay < InputDelay - 1)
+	{
+		--InputDelay;
+	}
+}
+
+uint8* FDiscordNetLockstep::GetSlot(FInputBuffer& Buffer, uint32 Frame) const
+{
+	return Buffer.Inputs.GetData() + (Frame % Settings.BufferFrames) * InputSize;
+}
+
+const uint8* FDiscordNetLockstep::GetSlot(const FInputBuffer& Buffer, uint32 Frame) const
+{
+	return Buffer.Inputs.GetData() + (Frame % Settings.BufferFrames) * InputSize;
+}
@@ -0,0 +1,184 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordNetTransport.h"
+
+/**
+ * Settings for FDiscordNetLockstep
+ */
+struct DISCORDGAME_API FDiscordNetLockstepSettings
+{
+	/** Length of one simulation frame in seconds */
+	float FrameSeconds {1.f / 60.f};
+
+	/** Fewest frames between reading an input and simulating it */
+	int32 MinInputDelay {1};
+
+	/** Most frames between reading an input and simulating it */
+	int32 MaxInputDelay {8};
+
+	/** Extra one-way delay to allow for, on top of half the RTT, when choosing the input delay */
+	float JitterMarginSeconds {0.01f};
+
+	/** Most unacknowledged frames of input repeated in each message (at most 255) */
+	int32 MaxRedundantFrames {32};
+
+	/** Frames of input kept per peer; must comfortably exceed MaxInputDelay + MaxRedundantFrames */
+	int32 BufferFrames {128};
+};
+
+/**
+ * Discord Network Lockstep
+ *
+ * Exchanges per-frame inputs between peers for deterministic lockstep simulation.
+ * Frame N may only be simulated once every peer's input for frame N is known.
+ *
+ * Inputs go over an unreliable channel, and every message repeats all of the
+ * inputs the receiver hasn't acknowledged yet, so a lost message is covered by
+ * the next one instead of waiting for a retransmit.  Acks ride along in the
+ * messages going the other way.
+ *
+ * Input delay adapts to the connection: each input is scheduled for a frame far
+ * enough in the future that it should reach every peer in time, based on the
+ * measured RTT.  When it changes, we repeat or skip a frame of our own input,
+ * which all peers see identically, so the simulation stays deterministic.
+ *
+ * Frame advantage (how far ahead of each peer we are running) is tracked so the
+ * game can stall a frame when it gets ahead, rather than every peer waiting on the
+ * slowest at random.
+ *
+ * Each frame:
+ *
+ *   Lockstep.SetLocalInput(&MyInput);
+ *   Lockstep.SendInputs();
+ *   while (Lockstep.IsFrameReady()) { Simulate(Lockstep.GetCurrentFrame()); Lockstep.AdvanceFrame(); }
+ *
+ * Designed for an unreliable lobby channel (FDiscordLobbyNetTransport), but works on
+ * any transport.  Every peer must use the same ChannelId, InputSize and FrameSeconds.
+ */
+class DISCORDGAME_API FDiscordNetLockstep
+{
+public:
+	/**
+	 * @param InTransport Transport to exchange inputs on
+	 * @param InChannelId Channel reserved for inputs; open it (unreliable) to every peer
+	 * @param InInputSize Size of one frame of input in bytes
+	 * @param InSettings Timing and buffering settings
+	 */
+	FDiscordNetLockstep(const TSharedRef<IDiscordNetTransport>& InTransport, uint8 InChannelId, int32 InInputSize, const FDiscordNetLockstepSettings& InSettings = FDiscordNetLockstepSettings());
+	~FDiscordNetLockstep();
+
+	/** Add a peer to the session; do this on every peer before frame 0 is simulated */
+	void AddPeer(uint64 PeerId);
+
+	/** Remove a peer from the session (e.g. they left); we stop waiting for their input */
+	void RemovePeer(uint64 PeerId);
+
+	/** Schedule our input (InputSize bytes) for GetCurrentFrame() + GetInputDelay() */
+	void SetLocalInput(const void* Input);
+
+	/** Send every peer the inputs they haven't acknowledged; call once per frame */
+	void SendInputs();
+
+	/** @return TRUE if every peer's input for the current frame is known */
+	bool IsFrameReady() const;
+
+	/**
+	 * @param PeerId A peer, or our own GetLocalPeerId()
+	 * @return The peer's input (InputSize bytes) for the current frame, or nullptr if not known
+	 */
+	const uint8* GetInput(uint64 PeerId) const;
+
+	/** Move on to the next frame; only valid when IsFrameReady() */
+	void AdvanceFrame();
+
+	/** @return The frame to simulate next */
+	uint32 GetCurrentFrame() const { return CurrentFrame; }
+
+	/** @return Frames between reading an input and simulating it */
+	int32 GetInputDelay() const { return InputDelay; }
+
+	/** @return Smoothed estimate of how many frames ahead of this peer we are (negative if behind) */
+	float GetFrameAdvantage(uint64 PeerId) const;
+
+	/** @return How many frames ahead of the slowest peer we are; stall a frame if this exceeds ~1 */
+	float GetMaxFrameAdvantage() const;
+
+	/** @return Smoothed RTT to a peer in seconds, or negative if unknown */
+	double GetRttSeconds(uint64 PeerId) const;
+
+	/** @return The peer id our own input is stored under */
+	uint64 GetLocalPeerId() const { return LocalPeerId; }
+
+	/** Counters since this was created */
+	uint64 NumMessagesSent {0};
+	uint64 NumInputsSent {0};
+	uint64 NumInputsReceived {0};
+	uint64 NumRedundantInputs {0};
+
+private:
+	/** Inputs for a run of frames, as a ring */
+	struct FInputBuffer
+	{
+		TArray<uint8> Inputs;
+
+		/** Every frame below this is known */
+		uint32 EndFrame {0};
+	};
+
+	struct FPeerState
+	{
+		/** Inputs received from this peer */
+		FInputBuffer Received;
+
+		/** Every one of our frames below this has been received by the peer */
+		uint32 AckedEndFrame {0};
+
+		/** The peer's last reported current frame */
+		uint32 RemoteFrame {0};
+		bool bHasRemoteFrame {false};
+
+		float SmoothedAdvantage {0.f};
+		double SmoothedRtt {-1.};
+	};
+
+	/** Called by the transport for every message */
+	void HandleMessage(uint64 PeerId, uint8 MessageChannelId, const uint8* Data, uint32 DataLength);
+
+	/** Choose the input delay from the worst peer's RTT, moving at most one frame at a time */
+	void UpdateInputDelay();
+
+	/** @return Pointer to a frame's slot in a buffer */
+	uint8* GetSlot(FInputBuffer& Buffer, uint32 Frame) const;
+	const uint8* GetSlot(const FInputBuffer& Buffer, uint32 Frame) const;
+
+	TSharedRef<IDiscordNetTransport> Transport;
+	uint8 ChannelId {0};
+	int32 InputSize {0};
+	FDiscordNetLockstepSettings Settings;
+
+	uint64 LocalPeerId {0};
+	uint32 CurrentFrame {0};
+	int32 InputDelay {0};
+
+	/** Our own inputs */
+	FInputBuffer Local;
+
+	/** Our most recent input, repeated when the input delay grows */
+	TArray<uint8> LastLocalInput;
+
+	/** When each of our frames was first sent, for RTT samples */
+	TArray<double> LocalSendTimes;
+
+	/** Every one of our frames below this has been sent at least once */
+	uint32 LocalSentEndFrame {0};
+
+	TMap<uint64, FPeerState> Peers;
+
+	/** Reused for every message */
+	TArray<uint8> MessageBuffer;
+
+	FDelegateHandle MessageHandle;
+};
@@ -0,0 +1,350 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetLoopback.h"
+#include "DiscordGame.h"
+#include "HAL/IConsoleManager.h"
+
+namespace DiscordNetLoopback
+{
+	/** Heap predicate: earliest delivery first, then in the order they were sent */
+	struct FDeliveryOrder
+	{
+		template <typename T>
+		bool operator()(const T& A, const T& B) const
+		{
+			return A.DeliveryTime != B.DeliveryTime ? A.DeliveryTime < B.DeliveryTime : A.Sequence < B.Sequence;
+		}
+	};
+}
+
+//////////////////////////////////////////////////////////////////////
+// FDiscordLoopbackNetwork
+
+FDiscordLoopbackNetwork::FDiscordLoopbackNetwork(const FDiscordLoopbackSettings& InSettings)
+	: Settings(InSettings)
+	, Random(InSettings.Seed)
+{
+}
+
+TSharedRef<IDiscordNetTransport> FDiscordLoopbackNetwork::CreatePeer()
+{
+	const uint64 PeerId = NextPeerId++;
+
+	TSharedRef<FDiscordLoopbackNetTransport> Transport = MakeShared<FDiscordLoopbackNetTransport>(AsShared(), PeerId);
+
+	FPeerState& Peer = Peers.Add(PeerId);
+	Peer.Transport = &Transport.Get();
+
+	return Transport;
+}
+
+void FDiscordLoopbackNetwork::ChangeRoute(uint64 PeerId)
+{
+	if (FPeerState* Peer = Peers.Find(PeerId))
+	{
+		++Peer->RouteGeneration;
+		Peer->bRouteAnnounced = false;
+	}
+}
+
+void FDiscordLoopbackNetwork::SetSettings(const FDiscordLoopbackSettings& InSettings)
+{
+	if (InSettings.Seed != Settings.Seed)
+	{
+		Random.Initialize(InSettings.Seed);
+	}
+	Settings = InSettings;
+}
+
+void FDiscordLoopbackNetwork::RunCallbacks()
+{
+	// Announce any new routes first, like Discord does when a peer comes online
+	for (TPair<uint64, FPeerState>& It : Peers)
+	{
+		if (!It.Value.bRouteAnnounced)
+		{
+			It.Value.bRouteAnnounced = true;
+			It.Value.Transport->OnRouteUpdate().Broadcast(MakeRouteData(It.Key, It.Value.RouteGeneration));
+		}
+	}
+
+	const double Now = FPlatformTime::Seconds();
+
+	while (InFlight.Num() > 0 && InFlight.HeapTop().DeliveryTime <= Now)
+	{
+		FInFlightMessage Message;
+		InFlight.HeapPop(Message, DiscordNetLoopback::FDeliveryOrder(), EAllowShrinking::No);
+
+		// The receiver must still exist, and must have opened this channel with the sender
+		const FPeerState* Receiver = Peers.Find(Message.ToPeerId);
+		const FRemotePeer* Sender = Receiver ? Receiver->Remotes.Find(Message.FromPeerId) : nullptr;
+
+		if (Sender && Sender->OpenChannels[Message.ChannelId])
+		{
+			++NumMessagesDelivered;
+			NumBytesDelivered += Message.Payload.Num();
+
+			Receiver->Transport->OnMessage().Broadcast(Message.FromPeerId, Message.ChannelId, Message.Payload.GetData(), Message.Payload.Num());
+		}
+		else
+		{
+			++NumMessagesLost;
+		}
+
+		Message.Payload.Reset();
+		SparePayloads.Add(MoveTemp(Message.Payload));
+	}
+}
+
+FString FDiscordLoopbackNetwork::MakeRouteData(uint64 PeerId, int32 RouteGeneration)
+{
+	return FString::Printf(TEXT("{\"loopback\":%llu,\"generation\":%i}"), PeerId, RouteGeneration);
+}
+
+void FDiscordLoopbackNetwork::RemovePeer(uint64 PeerId)
+{
+	Peers.Remove(PeerId);
+
+	// Anything still in flight to this peer is lost when it would have been delivered
+}
+
+void FDiscordLoopbackNetwork::Submit(uint64 FromPeerId, uint64 ToPeerId, uint8 ChannelId, TArray<uint8>&& Payload)
+{
+	++NumMessagesSent;
+
+	const FPeerState* From = Peers.Find(FromPeerId);
+	const FPeerState* To = Peers.Find(ToPeerId);
+	const FRemotePeer* Remote = From ? From->Remotes.Find(ToPeerId) : nullptr;
+
+	// Messages sent with stale route data never arrive
+	const bool bRouteValid = To && Remote && Remote->RouteData == MakeRouteData(ToPeerId, To->RouteGeneration);
+	const bool bReliable = Remote && Remote->ReliableChannels[ChannelId];
+
+	if (!bRouteValid || (!bReliable && Settings.LossRate > 0.f && Random.GetFraction() < Settings.LossRate))
+	{
+		++NumMessagesLost;
+		Payload.Reset();
+		SparePayloads.Add(MoveTemp(Payload));
+		return;
+	}
+
+	double DeliveryTime = FPlatformTime::Seconds() + Settings.LatencySeconds + Random.GetFraction() * Settings.JitterSeconds;
+
+	if (bReliable)
+	{
+		// Reliable channels are ordered; never deliver before a message that was sent earlier
+		double& LastDeliveryTime = ReliableDeliveryTimes.FindOrAdd(MakeTuple(FromPeerId, ToPeerId, ChannelId), 0.);
+		DeliveryTime = FMath::Max(DeliveryTime, LastDeliveryTime);
+		LastDeliveryTime = DeliveryTime;
+	}
+
+	FInFlightMessage Message;
+	Message.DeliveryTime = DeliveryTime;
+	Message.Sequence = NextSequence++;
+	Message.FromPeerId = FromPeerId;
+	Message.ToPeerId = ToPeerId;
+	Message.ChannelId = ChannelId;
+	Message.Payload = MoveTemp(Payload);
+
+	InFlight.HeapPush(MoveTemp(Message), DiscordNetLoopback::FDeliveryOrder());
+}
+
+TArray<uint8> FDiscordLoopbackNetwork::AcquirePayload()
+{
+	return SparePayloads.Num() > 0 ? SparePayloads.Pop(EAllowShrinking::No) : TArray<uint8>();
+}
+
+//////////////////////////////////////////////////////////////////////
+// FDiscordLoopbackNetTransport
+
+FDiscordLoopbackNetTransport::FDiscordLoopbackNetTransport(const TSharedRef<FDiscordLoopbackNetwork>& InNetwork, uint64 InPeerId)
+	: Network(InNetwork)
+	, PeerId(InPeerId)
+{
+}
+
+FDiscordLoopbackNetTransport::~FDiscordLoopbackNetTransport()
+{
+	Network->RemovePeer(PeerId);
+}
+
+discord::Result FDiscordLoopbackNetTransport::OpenPeer(uint64 RemotePeerId, const FString& RouteData)
+{
+	FDiscordLoopbackNetwork::FPeerState& Self = Network->Peers.FindChecked(PeerId);
+	if (Self.Remotes.Contains(RemotePeerId))
+	{
+		return discord::Result::Conflict;
+	}
+
+	Self.Remotes.Add(RemotePeerId).RouteData = RouteData;
+	return discord::Result::Ok;
+}
+
+discord::Result FDiscordLoopbackNetTransport::UpdatePeer(uint64 RemotePeerId, const FString& RouteData)
+{
+	FDiscordLoopbackNetwork::FRemotePeer* Remote = Network->Peers.FindChecked(PeerId).Remotes.Find(RemotePeerId);
+	if (!Remote)
+	{
+		return discord::Result::NotFound;
+	}
+
+	Remote->RouteData = RouteData;
+	return discord::Result::Ok;
+}
+
+discord::Result FDiscordLoopbackNetTransport::ClosePeer(uint64 RemotePeerId)
+{
+	return Network->Peers.FindChecked(PeerId).Remotes.Remove(RemotePeerId) > 0 ? discord::Result::Ok : discord::Result::NotFound;
+}
+
+discord::Result FDiscordLoopbackNetTransport::OpenChannel(uint64 RemotePeerId, uint8 ChannelId, bool bReliable)
+{
+	FDiscordLoopbackNetwork::FRemotePeer* Remote = Network->Peers.FindChecked(PeerId).Remotes.Find(RemotePeerId);
+	if (!Remote)
+	{
+		return discord::Result::NotFound;
+	}
+
+	Remote->OpenChannels[ChannelId] = true;
+	Remote->ReliableChannels[ChannelId] = bReliable;
+	return discord::Result::Ok;
+}
+
+discord::Result FDiscordLoopbackNetTransport::CloseChannel(uint64 RemotePeerId, uint8 ChannelId)
+{
+	FDiscordLoopbackNetwork::FRemotePeer* Remote = Network->Peers.FindChecked(PeerId).Remotes.Find(RemotePeerId);
+	if (!Remote)
+	{
+		return discord::Result::NotFound;
+	}
+
+	Remote->OpenChannels[ChannelId] = false;
+	return discord::Result::Ok;
+}
+
+discord::Result FDiscordLoopbackNetTransport::SendMessage(uint64 RemotePeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	const FDiscordLoopbackNetwork::FRemotePeer* Remote = Network->Peers.FindChecked(PeerId).Remotes.Find(RemotePeerId);
+	if (!Remote)
+	{
+		return discord::Result::NotFound;
+	}
+	if (!Remote->OpenChannels[ChannelId])
+	{
+		return discord::Result::InvalidChannel;
+	}
+
+	FPendingMessage& Message = PendingMessages.AddDefaulted_GetRef();
+	Message.ToPeerId = RemotePeerId;
+	Message.ChannelId = ChannelId;
+	Message.Payload = Network->AcquirePayload();
+	Message.Payload.Append(Data, DataLength);
+
+	return discord::Result::Ok;
+}
+
+discord::Result FDiscordLoopbackNetTransport::Flush()
+{
+	for (FPendingMessage& Message : PendingMessages)
+	{
+		Network->Submit(PeerId, Message.ToPeerId, Message.ChannelId, MoveTemp(Message.Payload));
+	}
+	PendingMessages.Reset();
+
+	return discord::Result::Ok;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Console commands
+
+static FAutoConsoleCommand CmdDiscordNetLoopbackBenchmark(
+	TEXT("Discord.Net.LoopbackBenchmark"),
+	TEXT("Run a full-mesh message throughput benchmark on a loopback network, blocking the game thread.\n")
+	TEXT("Usage: Discord.Net.LoopbackBenchmark [Peers=64] [Seconds=5] [Bytes=64] [Latency=0] [Jitter=0] [Loss=0] [Reliable=0]"),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		int32 NumPeers {64};
+		float Seconds {5.f};
+		int32 MessageBytes {64};
+		bool bReliable {false};
+		FDiscordLoopbackSettings Settings;
+
+		for (const FString& Arg : Args)
+		{
+			FParse::Value(*Arg, TEXT("Peers="), NumPeers);
+			FParse::Value(*Arg, TEXT("Seconds="), Seconds);
+			FParse::Value(*Arg, TEXT("Bytes="), MessageBytes);
+			FParse::Value(*Arg, TEXT("Latency="), Settings.LatencySeconds);
+			FParse::Value(*Arg, TEXT("Jitter="), Settings.JitterSeconds);
+			FParse::Value(*Arg, TEXT("Loss="), Settings.LossRate);
+			FParse::Bool(*Arg, TEXT("Reliable="), bReliable);
+		}
+
+		NumPeers = FMath::Clamp(NumPeers, 2, 1024);
+		MessageBytes = FMath::Clamp(MessageBytes, 1, 64 * 1024);
+
+		const TSharedRef<FDiscordLoopbackNetwork> Network = MakeShared<FDiscordLoopbackNetwork>(Settings);
+
+		TArray<TSharedRef<IDiscordNetTransport>> Transports;
+		TArray<FString> Routes;
+		for (int32 i = 0; i < NumPeers; ++i)
+		{
+			TSharedRef<IDiscordNetTransport> Transport = Transports.Add_GetRef(Network->CreatePeer());
+			Routes.AddDefaulted();
+			Transport->OnRouteUpdate().AddLambda([&Routes, i](const FString& RouteData) { Routes[i] = RouteData; });
+		}
+
+		// Learn everybody's route, then build the full mesh
+		Network->RunCallbacks();
+		for (int32 i = 0; i < NumPeers; ++i)
+		{
+			for (int32 j = 0; j < NumPeers; ++j)
+			{
+				if (i != j)
+				{
+					const uint64 RemotePeerId = Transports[j]->GetLocalPeerId();
+					Transports[i]->OpenPeer(RemotePeerId, Routes[j]);
+					Transports[i]->OpenChannel(RemotePeerId, 0, bReliable);
+				}
+			}
+		}
+
+		uint64 NumReceived {0};
+		for (const TSharedRef<IDiscordNetTransport>& Transport : Transports)
+		{
+			Transport->OnMessage().AddLambda([&NumReceived](uint64, uint8, const uint8*, uint32) { ++NumReceived; });
+		}
+
+		TArray<uint8> Payload;
+		Payload.SetNumZeroed(MessageBytes);
+
+		// Every frame, every peer sends one message to every other peer
+		uint64 NumFrames {0};
+		const double StartTime = FPlatformTime::Seconds();
+		const double EndTime = StartTime + Seconds;
+		while (FPlatformTime::Seconds() < EndTime)
+		{
+			for (const TSharedRef<IDiscordNetTransport>& Sender : Transports)
+			{
+				for (const TSharedRef<IDiscordNetTransport>& Receiver : Transports)
+				{
+					if (&Sender.Get() != &Receiver.Get())
+					{
+						Sender->SendMessage(Receiver->GetLocalPeerId(), 0, Payload.GetData(), Payload.Num());
+					}
+				}
+				Sender->Flush();
+			}
+
+			Network->RunCallbacks();
+			++NumFrames;
+		}
+		const double Elapsed = FPlatformTime::Seconds() - StartTime;
+
+		UE_LOG(LogDiscord, Display, TEXT("Loopback benchmark: %i peers, %i byte messages, %llu frames in %.2fs (%.1f frames/s)"),
+			NumPeers, MessageBytes, NumFrames, Elapsed, NumFrames / Elapsed);
+		UE_LOG(LogDiscord, Display, TEXT("  Sent %llu, delivered %llu (received %llu), lost %llu, in flight %i"),
+			Network->NumMessagesSent, Network->NumMessagesDelivered, NumReceived, Network->NumMessagesLost, Network->GetNumInFlight());
+		UE_LOG(LogDiscord, Display, TEXT("  %.0f messages/s, %.2f MB/s delivered"),
+			Network->NumMessagesDelivered / Elapsed, Network->NumBytesDelivered / Elapsed / (1024. * 1024.));
+	}));
@@ -0,0 +1,186 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordNetTransport.h"
+#include "Math/RandomStream.h"
+
+class FDiscordLoopbackNetTransport;
+
+/**
+ * Settings for FDiscordLoopbackNetwork
+ */
+struct DISCORDGAME_API FDiscordLoopbackSettings
+{
+	/** One-way latency added to every message, in seconds */
+	float LatencySeconds {0.f};
+
+	/** Up to this many seconds of random extra latency is added to every message */
+	float JitterSeconds {0.f};
+
+	/** Probability [0..1] that a message on an unreliable channel is lost */
+	float LossRate {0.f};
+
+	/** Random seed, so runs with loss and jitter are repeatable */
+	int32 Seed {0};
+};
+
+/**
+ * Discord Loopback Network
+ *
+ * An in-process stand-in for the Discord peer network, hosting any number of
+ * simulated peers.  Each peer is an IDiscordNetTransport, so code written against
+ * the transport interface can be exercised without any Discord clients at all,
+ * for example to benchmark many peers on a single machine.
+ *
+ * This mimics the parts of Discord's behavior that matter to message code:
+ *
+ *   - Messages are only sent when the sender calls Flush()
+ *   - Messages are only delivered during RunCallbacks(), like discord::Core::RunCallbacks
+ *   - Both sides must OpenPeer and OpenChannel before messages get through
+ *   - Peers must be opened with the target's current route data; see ChangeRoute()
+ *   - Reliable channels never lose or reorder messages; unreliable channels may do both
+ *
+ * Everything happens on the calling thread; this is not thread safe.
+ */
+class DISCORDGAME_API FDiscordLoopbackNetwork : public TSharedFromThis<FDiscordLoopbackNetwork>
+{
+public:
+	explicit FDiscordLoopbackNetwork(const FDiscordLoopbackSettings& InSettings = FDiscordLoopbackSettings());
+
+	/**
+	 * Create a new simulated peer.
+	 *
+	 * The peer's route is announced via its OnRouteUpdate at the next RunCallbacks().
+	 * The peer leaves the network when the returned transport is destroyed.
+	 */
+	TSharedRef<IDiscordNetTransport> CreatePeer();
+
+	/**
+	 * Simulate a peer's route changing (e.g. a NAT rebinding).
+	 *
+	 * The peer gets a new route via OnRouteUpdate at the next RunCallbacks(), and
+	 * messages sent to it with the old route data are lost until the sender calls UpdatePeer.
+	 */
+	void ChangeRoute(uint64 PeerId);
+
+	/** Deliver every message (and route update) that is due; call once per frame */
+	void RunCallbacks();
+
+	/** Replace the network settings; affects messages flushed after this */
+	void SetSettings(const FDiscordLoopbackSettings& InSettings);
+
+	/** @return Current network settings */
+	const FDiscordLoopbackSettings& GetSettings() const { return Settings; }
+
+	/** @return Number of messages currently in flight */
+	int32 GetNumInFlight() const { return InFlight.Num(); }
+
+	/** Counters since the network was created */
+	uint64 NumMessagesSent {0};
+	uint64 NumMessagesDelivered {0};
+	uint64 NumMessagesLost {0};
+	uint64 NumBytesDelivered {0};
+
+private:
+	friend class FDiscordLoopbackNetTransport;
+
+	/** A message that has been flushed and is on its way */
+	struct FInFlightMessage
+	{
+		double DeliveryTime {0.};
+		uint64 Sequence {0};
+		uint64 FromPeerId {0};
+		uint64 ToPeerId {0};
+		uint8 ChannelId {0};
+		TArray<uint8> Payload;
+	};
+
+	/** What one peer knows about another peer it has opened */
+	struct FRemotePeer
+	{
+		FString RouteData;
+		TBitArray<> OpenChannels {false, 256};
+		TBitArray<> ReliableChannels {false, 256};
+	};
+
+	struct FPeerState
+	{
+		FDiscordLoopbackNetTransport* Transport {nullptr};
+		int32 RouteGeneration {0};
+		bool bRouteAnnounced {false};
+		TMap<uint64, FRemotePeer> Remotes;
+	};
+
+	/** @return The route data a peer currently has */
+	static FString MakeRouteData(uint64 PeerId, int32 RouteGeneration);
+
+	/** Called by a transport when it is destroyed */
+	void RemovePeer(uint64 PeerId);
+
+	/** Called by a transport when it flushes a message */
+	void Submit(uint64 FromPeerId, uint64 ToPeerId, uint8 ChannelId, TArray<uint8>&& Payload);
+
+	/** @return A payload buffer to reuse, if we have one */
+	TArray<uint8> AcquirePayload();
+
+	FDiscordLoopbackSettings Settings;
+	FRandomStream Random;
+
+	/** Every peer on the network, by peer id */
+	TMap<uint64, FPeerState> Peers;
+
+	/** Flushed messages, as a heap ordered by delivery time */
+	TArray<FInFlightMessage> InFlight;
+
+	/** Latest delivery time for each reliable (From, To, Channel), to keep them in order */
+	TMap<TTuple<uint64, uint64, uint8>, double> ReliableDeliveryTimes;
+
+	/** Payload buffers of delivered messages, kept to be reused */
+	TArray<TArray<uint8>> SparePayloads;
+
+	uint64 NextPeerId {1};
+	uint64 NextSequence {0};
+};
+
+/**
+ * Discord Loopback Network Transport
+ *
+ * A single simulated peer on an FDiscordLoopbackNetwork.
+ * Create these with FDiscordLoopbackNetwork::CreatePeer.
+ */
+class DISCORDGAME_API FDiscordLoopbackNetTransport : public IDiscordNetTransport
+{
+public:
+	FDiscordLoopbackNetTransport(const TSharedRef<FDiscordLoopbackNetwork>& InNetwork, uint64 InPeerId);
+	virtual ~FDiscordLoopbackNetTransport() override;
+
+	//~IDiscordNetTransport interface
+	virtual uint64 GetLocalPeerId() const override { return PeerId; }
+	virtual discord::Result OpenPeer(uint64 RemotePeerId, const FString& RouteData) override;
+	virtual discord::Result UpdatePeer(uint64 RemotePeerId, const FString& RouteData) override;
+	virtual discord::Result ClosePeer(uint64 RemotePeerId) override;
+	virtual discord::Result OpenChannel(uint64 RemotePeerId, uint8 ChannelId, bool bReliable) override;
+	virtual discord::Result CloseChannel(uint64 RemotePeerId, uint8 ChannelId) override;
+	virtual discord::Result SendMessage(uint64 RemotePeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) override;
+	virtual discord::Result Flush() override;
+	//~End of IDiscordNetTransport interface
+
+private:
+	friend class FDiscordLoopbackNetwork;
+
+	/** A message waiting for Flush() */
+	struct FPendingMessage
+	{
+		uint64 ToPeerId {0};
+		uint8 ChannelId {0};
+		TArray<uint8> Payload;
+	};
+
+	TSharedRef<FDiscordLoopbackNetwork> Network;
+	uint64 PeerId {0};
+
+	/** Messages sent since the last Flush() */
+	TArray<FPendingMessage> PendingMessages;
+};
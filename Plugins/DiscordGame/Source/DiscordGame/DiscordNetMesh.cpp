@@ -0,0 +1,261 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetMesh.h"
+#include "DiscordGame.h"
+
+FDiscordNetMesh::FDiscordNetMesh(discord::Core& InCore, discord::LobbyId InLobbyId, const TSharedRef<IDiscordNetTransport>& InTransport, const FDiscordNetMeshSettings& InSettings)
+	: Core(InCore)
+	, LobbyId(InLobbyId)
+	, Transport(InTransport)
+	, Settings(InSettings)
+	, RouteManager(MakeShared<FDiscordNetRouteManager>(InCore, InLobbyId, InTransport, InSettings.RouteSettings))
+{
+	for (const FDiscordNetMeshChannel& Channel : Settings.Channels)
+	{
+		if (Channel.ChannelId == Settings.HandshakeChannelId)
+		{
+			UE_LOG(LogDiscord, Error, TEXT("Mesh channel %u is also the handshake channel; mesh handshakes will not work"), Channel.ChannelId);
+		}
+	}
+
+	MemberRouteHandle = RouteManager->OnMemberRouteChanged().AddRaw(this, &FDiscordNetMesh::HandleMemberRouteChanged);
+	MessageHandle = Transport->OnMessage().AddRaw(this, &FDiscordNetMesh::HandleMessage);
+
+	MemberDisconnectToken = Core.LobbyManager().OnMemberDisconnect.Connect([this](std::int64_t MemberLobbyId, std::int64_t UserId)
+	{
+		HandleMemberDisconnect(MemberLobbyId, UserId);
+	});
+}
+
+FDiscordNetMesh::~FDiscordNetMesh()
+{
+	RouteManager->OnMemberRouteChanged().Remove(MemberRouteHandle);
+	Transport->OnMessage().Remove(MessageHandle);
+	Core.LobbyManager().OnMemberDisconnect.Disconnect(MemberDisconnectToken);
+
+	// Leave the transport as we found it
+	for (const TPair<uint64, FMeshPeer>& It : Peers)
+	{
+		Transport->ClosePeer(It.Value.PeerId);
+	}
+}
+
+void FDiscordNetMesh::Tick()
+{
+	// Every member whose route arrived since last Tick gets opened in here, back to back
+	RouteManager->Tick();
+
+	const double Now = FPlatformTime::Seconds();
+
+	TArray<uint64, TInlineAllocator<8>> TimedOut;
+	for (TPair<uint64, FMeshPeer>& It : Peers)
+	{
+		FMeshPeer& Peer = It.Value;
+		if (Peer.State != EDiscordNetMeshPeerState::Connecting)
+		{
+			continue;
+		}
+
+		if (Now - Peer.OpenTime >= Settings.ConnectTimeoutSeconds)
+		{
+			TimedOut.Add(It.Key);
+			continue;
+		}
+
+		if (Now - Peer.LastHandshakeTime >= Settings.HandshakeIntervalSeconds)
+		{
+			SendHandshake(Peer, Now);
+		}
+	}
+
+	for (const uint64 UserId : TimedOut)
+	{
+		++NumPeerTimeouts;
+
+		uint64 PeerId;
+		FString RouteData;
+		if (!RouteManager->GetMemberRoute(UserId, PeerId, RouteData))
+		{
+			CloseMeshPeer(UserId);
+			continue;
+		}
+
+		UE_LOG(LogDiscord, Warning, TEXT("Mesh peer %llu (user %llu) not ready after %.1f s; reopening"), PeerId, UserId, Settings.ConnectTimeoutSeconds);
+
+		CloseMeshPeer(UserId);
+		OpenMeshPeer(UserId, PeerId, RouteData);
+	}
+}
+
+EDiscordNetMeshPeerState FDiscordNetMesh::GetPeerState(uint64 UserId) const
+{
+	const FMeshPeer* Peer = Peers.Find(UserId);
+	return Peer ? Peer->State : EDiscordNetMeshPeerState::None;
+}
+
+uint64 FDiscordNetMesh::GetPeerId(uint64 UserId) const
+{
+	const FMeshPeer* Peer = Peers.Find(UserId);
+	return Peer ? Peer->PeerId : 0;
+}
+
+int32 FDiscordNetMesh::GetNumReadyPeers() const
+{
+	int32 NumReady {0};
+	for (const TPair<uint64, FMeshPeer>& It : Peers)
+	{
+		if (It.Value.State == EDiscordNetMeshPeerState::Ready)
+		{
+			++NumReady;
+		}
+	}
+	return NumReady;
+}
+
+bool FDiscordNetMesh::AreAllPeersReady() const
+{
+	std::int32_t MemberCount {0};
+	if (Core.LobbyManager().MemberCount(LobbyId, &MemberCount) != discord::Result::Ok)
+	{
+		return false;
+	}
+
+	// Everyone but ourselves
+	return GetNumReadyPeers() >= MemberCount - 1;
+}
+
+void FDiscordNetMesh::HandleMemberRouteChanged(uint64 UserId, uint64 PeerId, const FString& RouteData)
+{
+	if (FMeshPeer* Existing = Peers.Find(UserId))
+	{
+		if (Existing->PeerId == PeerId)
+		{
+			// Same peer with a new route; the route manager has already called UpdatePeer
+			return;
+		}
+
+		// The member restarted their network with a new peer id; start over with them
+		CloseMeshPeer(UserId);
+	}
+
+	OpenMeshPeer(UserId, PeerId, RouteData);
+}
+
+void FDiscordNetMesh::HandleMemberDisconnect(int64 MemberLobbyId, int64 UserId)
+{
+	if (MemberLobbyId == LobbyId)
+	{
+		CloseMeshPeer(static_cast<uint64>(UserId));
+	}
+}
+
+void FDiscordNetMesh::HandleMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	if (ChannelId != Settings.HandshakeChannelId || DataLength != 1)
+	{
+		return;
+	}
+
+	const uint64* UserId = PeerUserIds.Find(PeerId);
+	if (!UserId)
+	{
+		// We haven't seen their route yet; they'll hear from us once we have
+		return;
+	}
+
+	FMeshPeer& Peer = Peers[*UserId];
+	const bool bFirstHeard = !Peer.bHeardThem;
+	Peer.bHeardThem = true;
+
+	if (Data[0] & HeardYou)
+	{
+		Peer.bTheyHeardUs = true;
+	}
+
+	// Tell them right away that we heard them, rather than waiting for the next interval.
+	// Every hello is answered, even once we're Ready: they only keep sending hellos while
+	// they're Connecting, so our last answer must have been lost.  An answer is only answered
+	// if it's the first we've heard of them, since they may still be waiting on our HeardYou.
+	if (bFirstHeard || !(Data[0] & Reply))
+	{
+		SendHandshake(Peer, FPlatformTime::Seconds(), true);
+	}
+
+	if (Peer.State == EDiscordNetMeshPeerState::Connecting && Peer.bTheyHeardUs)
+	{
+		Peer.State = EDiscordNetMeshPeerState::Ready;
+		++NumPeersReady;
+
+		UE_LOG(LogDiscord, Log, TEXT("Mesh peer %llu (user %llu) ready after %.0f ms"), PeerId, *UserId, (FPlatformTime::Seconds() - Peer.OpenTime) * 1000.);
+
+		PeerReadyEvent.Broadcast(*UserId, PeerId);
+	}
+}
+
+void FDiscordNetMesh::OpenMeshPeer(uint64 UserId, uint64 PeerId, const FString& RouteData)
+{
+	discord::Result Result = Transport->OpenPeer(PeerId, RouteData);
+	if (Result != discord::Result::Ok)
+	{
+		// Leave it Connecting, so the timeout retries it
+		UE_LOG(LogDiscord, Error, TEXT("Error(%i) OpenPeer(%llu) for lobby member %llu"), Result, PeerId, UserId);
+	}
+
+	// Channels don't wait on each other, or on the peer connecting
+	Result = Transport->OpenChannel(PeerId, Settings.HandshakeChannelId, false);
+	if (Result != discord::Result::Ok)
+	{
+		UE_LOG(LogDiscord, Error, TEXT("Error(%i) OpenChannel(%llu, %u) for mesh handshake"), Result, PeerId, Settings.HandshakeChannelId);
+	}
+
+	for (const FDiscordNetMeshChannel& Channel : Settings.Channels)
+	{
+		Result = Transport->OpenChannel(PeerId, Channel.ChannelId, Channel.bReliable);
+		if (Result != discord::Result::Ok)
+		{
+			UE_LOG(LogDiscord, Error, TEXT("Error(%i) OpenChannel(%llu, %u) for lobby member %llu"), Result, PeerId, Channel.ChannelId, UserId);
+		}
+	}
+
+	const double Now = FPlatformTime::Seconds();
+	FMeshPeer& Peer = Peers.Add(UserId);
+	Peer.PeerId = PeerId;
+	Peer.State = EDiscordNetMeshPeerState::Connecting;
+	Peer.OpenTime = Now;
+	PeerUserIds.Add(PeerId, UserId);
+	++NumPeersOpened;
+
+	SendHandshake(Peer, Now);
+}
+
+void FDiscordNetMesh::CloseMeshPeer(uint64 UserId)
+{
+	FMeshPeer Peer;
+	if (!Peers.RemoveAndCopyValue(UserId, Peer))
+	{
+		return;
+	}
+
+	PeerUserIds.Remove(Peer.PeerId);
+
+	const discord::Result Result = Transport->ClosePeer(Peer.PeerId);
+	if (Result != discord::Result::Ok)
+	{
+		UE_LOG(LogDiscord, Verbose, TEXT("Error(%i) ClosePeer(%llu) for lobby member %llu"), Result, Peer.PeerId, UserId);
+	}
+
+	PeerClosedEvent.Broadcast(UserId, Peer.PeerId);
+}
+
+void FDiscordNetMesh::SendHandshake(FMeshPeer& Peer, double Now, bool bReply)
+{
+	const uint8 Message = (Peer.bHeardThem ? HeardYou : 0) | (bReply ? Reply : 0);
+
+	const discord::Result Result = Transport->SendMessage(Peer.PeerId, Settings.HandshakeChannelId, &Message, 1);
+	if (Result != discord::Result::Ok)
+	{
+		UE_LOG(LogDiscord, Verbose, TEXT("Error(%i) Sending mesh handshake to peer %llu"), Result, Peer.PeerId);
+	}
+
+	Peer.LastHandshakeTime = Now;
+}
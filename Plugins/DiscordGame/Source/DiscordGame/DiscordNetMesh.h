@@ -0,0 +1,177 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordNetRouteManager.h"
+
+/** Broadcast when a mesh peer becomes ready, or is closed: (UserId, PeerId) */
+DECLARE_MULTICAST_DELEGATE_TwoParams(FOnDiscordNetMeshPeer, uint64 /*UserId*/, uint64 /*PeerId*/);
+
+/** Where a lobby member is in mesh setup */
+enum class EDiscordNetMeshPeerState : uint8
+{
+	/** We don't know their route yet, or they aren't in the lobby */
+	None,
+	/** Peer and channels are open, waiting to hear from them */
+	Connecting,
+	/** Both sides have heard from each other; safe to send */
+	Ready,
+};
+
+/**
+ * A channel the mesh opens to every peer
+ */
+struct DISCORDGAME_API FDiscordNetMeshChannel
+{
+	uint8 ChannelId {0};
+	bool bReliable {false};
+};
+
+/**
+ * Settings for FDiscordNetMesh
+ */
+struct DISCORDGAME_API FDiscordNetMeshSettings
+{
+	/** Channels to open to every peer */
+	TArray<FDiscordNetMeshChannel> Channels;
+
+	/** Unreliable channel reserved for the readiness handshake */
+	uint8 HandshakeChannelId {255};
+
+	/** Seconds between handshake messages to a peer that isn't ready yet */
+	float HandshakeIntervalSeconds {0.1f};
+
+	/** Close and reopen a peer that hasn't become ready after this long */
+	float ConnectTimeoutSeconds {10.f};
+
+	/** Settings for the route manager the mesh exchanges routes with */
+	FDiscordNetRouteSettings RouteSettings;
+};
+
+/**
+ * Discord Network Mesh
+ *
+ * Builds and maintains a full mesh of peer connections between the members of
+ * a lobby, on a discord::NetworkManager transport (FDiscordPeerNetTransport).
+ *
+ * Routes are exchanged through lobby member metadata by an FDiscordNetRouteManager.
+ * As soon as a member's route is known, the mesh calls OpenPeer and OpenChannel
+ * for every configured channel, for all new members in the same Tick rather than
+ * one member at a time.  When a member leaves the lobby its peer is closed, and a
+ * member who comes back with a new peer id is reopened from scratch.
+ *
+ * OpenPeer returning Ok doesn't mean the connection is up, so each peer does a
+ * small handshake on a reserved channel: both sides repeat a hello until each has
+ * heard the other say it has heard them.  Only then is the peer Ready, and
+ * OnPeerReady is broadcast.  Peers that don't get there in time are reopened.
+ *
+ * This holds a reference into the DiscordCore, so you MUST destroy it
+ * no later than UDiscordGameSubsystem::NativeOnDiscordCoreReset.
+ */
+class DISCORDGAME_API FDiscordNetMesh
+{
+public:
+	/**
+	 * @param InCore Discord Core
+	 * @param InLobbyId Lobby whose members to connect; we must already be a member
+	 * @param InTransport Peer transport to open peers and channels on
+	 * @param InSettings Channels to open, and handshake settings
+	 */
+	FDiscordNetMesh(discord::Core& InCore, discord::LobbyId InLobbyId, const TSharedRef<IDiscordNetTransport>& InTransport, const FDiscordNetMeshSettings& InSettings);
+	~FDiscordNetMesh();
+
+	/** Exchange routes, open new peers and run handshakes; call once per frame, before the transport's Flush() */
+	void Tick();
+
+	/** @return Where a lobby member is in mesh setup */
+	EDiscordNetMeshPeerState GetPeerState(uint64 UserId) const;
+
+	/** @return TRUE if a lobby member is Ready */
+	bool IsPeerReady(uint64 UserId) const { return GetPeerState(UserId) == EDiscordNetMeshPeerState::Ready; }
+
+	/** @return The NetworkPeerId of a lobby member, or 0 if we don't know it */
+	uint64 GetPeerId(uint64 UserId) const;
+
+	/** @return Number of other lobby members that are Ready */
+	int32 GetNumReadyPeers() const;
+
+	/** @return TRUE if every other lobby member is Ready */
+	bool AreAllPeersReady() const;
+
+	/** Event broadcast when a peer becomes Ready */
+	FOnDiscordNetMeshPeer& OnPeerReady() { return PeerReadyEvent; }
+
+	/** Event broadcast when a peer is closed, because its member left or it timed out */
+	FOnDiscordNetMeshPeer& OnPeerClosed() { return PeerClosedEvent; }
+
+	/** @return The route manager the mesh exchanges routes with */
+	FDiscordNetRouteManager& GetRouteManager() const { return *RouteManager; }
+
+	/** Counters since the mesh was created */
+	uint64 NumPeersOpened {0};
+	uint64 NumPeersReady {0};
+	uint64 NumPeerTimeouts {0};
+
+private:
+	/** Handshake message flags */
+	enum EHandshakeFlags : uint8
+	{
+		/** The sender has heard from the receiver */
+		HeardYou = 1 << 0,
+
+		/** An answer to a hello; answers are never answered, so they can't bounce back and forth */
+		Reply = 1 << 1,
+	};
+
+	struct FMeshPeer
+	{
+		uint64 PeerId {0};
+		EDiscordNetMeshPeerState State {EDiscordNetMeshPeerState::None};
+
+		/** TRUE once we've had a hello from them, and once they've had one from us */
+		bool bHeardThem {false};
+		bool bTheyHeardUs {false};
+
+		double OpenTime {0.};
+		double LastHandshakeTime {0.};
+	};
+
+	/** Called by the route manager when a member's route is known or changes */
+	void HandleMemberRouteChanged(uint64 UserId, uint64 PeerId, const FString& RouteData);
+
+	/** Called by the LobbyManager when a member leaves */
+	void HandleMemberDisconnect(int64 MemberLobbyId, int64 UserId);
+
+	/** Called by the transport for every message; we only want the handshake channel */
+	void HandleMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength);
+
+	/** OpenPeer and OpenChannel for every channel, and start the handshake */
+	void OpenMeshPeer(uint64 UserId, uint64 PeerId, const FString& RouteData);
+
+	/** ClosePeer and forget about the member */
+	void CloseMeshPeer(uint64 UserId);
+
+	/** Send a hello to a peer, or with bReply, an answer to one of theirs */
+	void SendHandshake(FMeshPeer& Peer, double Now, bool bReply = false);
+
+	discord::Core& Core;
+	discord::LobbyId LobbyId;
+	TSharedRef<IDiscordNetTransport> Transport;
+	FDiscordNetMeshSettings Settings;
+
+	TSharedRef<FDiscordNetRouteManager> RouteManager;
+
+	/** Every lobby member we know a route for */
+	TMap<uint64, FMeshPeer> Peers;
+
+	/** UserId of each open PeerId, to attribute handshake messages */
+	TMap<uint64, uint64> PeerUserIds;
+
+	FOnDiscordNetMeshPeer PeerReadyEvent;
+	FOnDiscordNetMeshPeer PeerClosedEvent;
+
+	FDelegateHandle MemberRouteHandle;
+	FDelegateHandle MessageHandle;
+	int32 MemberDisconnectToken {0};
+};
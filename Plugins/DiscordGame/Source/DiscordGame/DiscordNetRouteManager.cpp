@@ -0,0 +1,232 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetRouteManager.h"
+#include "DiscordGame.h"
+
+FDiscordNetRouteManager::FDiscordNetRouteManager(discord::Core& InCore, discord::LobbyId InLobbyId, const TSharedRef<IDiscordNetTransport>& InTransport, const FDiscordNetRouteSettings& InSettings)
+	: Core(InCore)
+	, LobbyId(InLobbyId)
+	, Transport(InTransport)
+	, Settings(InSettings)
+{
+	RouteUpdateHandle = Transport->OnRouteUpdate().AddRaw(this, &FDiscordNetRouteManager::HandleLocalRouteUpdate);
+
+	discord::LobbyManager& LobbyManager = Core.LobbyManager();
+	MemberConnectToken = LobbyManager.OnMemberConnect.Connect([this](std::int64_t MemberLobbyId, std::int64_t UserId)
+	{
+		HandleMemberUpdate(MemberLobbyId, UserId);
+	});
+	MemberUpdateToken = LobbyManager.OnMemberUpdate.Connect([this](std::int64_t MemberLobbyId, std::int64_t UserId)
+	{
+		HandleMemberUpdate(MemberLobbyId, UserId);
+	});
+	MemberDisconnectToken = LobbyManager.OnMemberDisconnect.Connect([this](std::int64_t MemberLobbyId, std::int64_t UserId)
+	{
+		HandleMemberDisconnect(MemberLobbyId, UserId);
+	});
+
+	// Pick up everyone who was already in the lobby before we were created
+	std::int32_t MemberCount {0};
+	if (LobbyManager.MemberCount(LobbyId, &MemberCount) == discord::Result::Ok)
+	{
+		for (std::int32_t Index = 0; Index < MemberCount; ++Index)
+		{
+			discord::UserId UserId {0};
+			if (LobbyManager.GetMemberUserId(LobbyId, Index, &UserId) == discord::Result::Ok)
+			{
+				HandleMemberUpdate(LobbyId, UserId);
+			}
+		}
+	}
+}
+
+FDiscordNetRouteManager::~FDiscordNetRouteManager()
+{
+	Transport->OnRouteUpdate().Remove(RouteUpdateHandle);
+
+	discord::LobbyManager& LobbyManager = Core.LobbyManager();
+	LobbyManager.OnMemberConnect.Disconnect(MemberConnectToken);
+	LobbyManager.OnMemberUpdate.Disconnect(MemberUpdateToken);
+	LobbyManager.OnMemberDisconnect.Disconnect(MemberDisconnectToken);
+}
+
+void FDiscordNetRouteManager::Tick()
+{
+	const double Now = FPlatformTime::Seconds();
+
+	// Publish once the route has settled, or it has been unsettled for too long
+	if (bHasPendingRoute && !bPublishInFlight)
+	{
+		if (Now - LastPendingTime >= Settings.DebounceSeconds || Now - FirstPendingTime >= Settings.MaxDelaySeconds)
+		{
+			PublishLocalRoute();
+		}
+	}
+
+	// Each member that changed is read once, no matter how many updates it sent since last Tick
+	int32 NumRefreshed {0};
+	for (auto It = DirtyMembers.CreateIterator(); It; ++It)
+	{
+		if (Settings.MaxPeerUpdatesPerTick > 0 && NumRefreshed >= Settings.MaxPeerUpdatesPerTick)
+		{
+			break;
+		}
+
+		const uint64 UserId = *It;
+		It.RemoveCurrent();
+
+		RefreshMember(UserId);
+		++NumRefreshed;
+	}
+}
+
+bool FDiscordNetRouteManager::GetMemberRoute(uint64 UserId, uint64& OutPeerId, FString& OutRouteData) const
+{
+	if (const FMemberRoute* Route = MemberRoutes.Find(UserId))
+	{
+		OutPeerId = Route->PeerId;
+		OutRouteData = Route->RouteData;
+		return true;
+	}
+
+	return false;
+}
+
+void FDiscordNetRouteManager::HandleLocalRouteUpdate(const FString& RouteData)
+{
+	++NumLocalRouteUpdates;
+
+	const double Now = FPlatformTime::Seconds();
+	if (!bHasPendingRoute)
+	{
+		FirstPendingTime = Now;
+	}
+	LastPendingTime = Now;
+
+	PendingRoute = RouteData;
+	bHasPendingRoute = true;
+}
+
+void FDiscordNetRouteManager::HandleMemberUpdate(int64 MemberLobbyId, int64 UserId)
+{
+	// The LobbyManager broadcasts for every lobby we're in; we only want ours, and not ourselves
+	if (MemberLobbyId == LobbyId && static_cast<uint64>(UserId) != GetLocalUserId())
+	{
+		DirtyMembers.Add(static_cast<uint64>(UserId));
+	}
+}
+
+void FDiscordNetRouteManager::HandleMemberDisconnect(int64 MemberLobbyId, int64 UserId)
+{
+	if (MemberLobbyId == LobbyId)
+	{
+		DirtyMembers.Remove(static_cast<uint64>(UserId));
+		MemberRoutes.Remove(static_cast<uint64>(UserId));
+	}
+}
+
+void FDiscordNetRouteManager::PublishLocalRoute()
+{
+	const uint64 LocalUserId = GetLocalUserId();
+	if (LocalUserId == 0)
+	{
+		// Try again next Tick, once the current user is known
+		return;
+	}
+
+	discord::LobbyManager& LobbyManager = Core.LobbyManager();
+
+	discord::LobbyMemberTransaction Transaction {};
+	discord::Result Result = LobbyManager.GetMemberUpdateTransaction(LobbyId, LocalUserId, &Transaction);
+	if (Result != discord::Result::Ok)
+	{
+		UE_LOG(LogDiscord, Error, TEXT("Error(%i) Lobby(%lld) GetMemberUpdateTransaction for route"), Result, LobbyId);
+		return;
+	}
+
+	// Peer id and route go in the same transaction, so remote members see them change together
+	const FString PeerId = FString::Printf(TEXT("%llu"), Transport->GetLocalPeerId());
+	Transaction.SetMetadata(PeerIdMetadataKey, TCHAR_TO_UTF8(*PeerId));
+	Transaction.SetMetadata(RouteMetadataKey, TCHAR_TO_UTF8(*PendingRoute));
+
+	const FString PublishedRoute = MoveTemp(PendingRoute);
+	PendingRoute.Reset();
+	bHasPendingRoute = false;
+	bPublishInFlight = true;
+	++NumMetadataWrites;
+
+	LobbyManager.UpdateMember(LobbyId, LocalUserId, Transaction, [WeakThis = AsWeak(), PublishedRoute](discord::Result Result)
+	{
+		const TSharedPtr<FDiscordNetRouteManager> This = WeakThis.Pin();
+		if (!This.IsValid())
+		{
+			return;
+		}
+
+		This->bPublishInFlight = false;
+
+		if (Result != discord::Result::Ok)
+		{
+			UE_LOG(LogDiscord, Warning, TEXT("Error(%i) Lobby(%lld) UpdateMember with route; will retry"), Result, This->LobbyId);
+
+			// Retry after another debounce, unless a newer route is already waiting
+			if (!This->bHasPendingRoute)
+			{
+				This->HandleLocalRouteUpdate(PublishedRoute);
+			}
+		}
+	});
+}
+
+void FDiscordNetRouteManager::RefreshMember(uint64 UserId)
+{
+	discord::LobbyManager& LobbyManager = Core.LobbyManager();
+
+	char Value[4096];
+	if (LobbyManager.GetMemberMetadataValue(LobbyId, UserId, PeerIdMetadataKey, Value) != discord::Result::Ok)
+	{
+		// This member hasn't published a route (yet)
+		return;
+	}
+	const uint64 PeerId = FCString::Strtoui64(UTF8_TO_TCHAR(Value), nullptr, 10);
+
+	if (LobbyManager.GetMemberMetadataValue(LobbyId, UserId, RouteMetadataKey, Value) != discord::Result::Ok)
+	{
+		return;
+	}
+	const FString RouteData = UTF8_TO_TCHAR(Value);
+
+	FMemberRoute* Known = MemberRoutes.Find(UserId);
+	if (Known && Known->PeerId == PeerId && Known->RouteData == RouteData)
+	{
+		// Some other metadata changed; nothing for us to do
+		return;
+	}
+
+	if (Known && Known->PeerId == PeerId)
+	{
+		const discord::Result Result = Transport->UpdatePeer(PeerId, RouteData);
+		if (Result != discord::Result::Ok)
+		{
+			UE_LOG(LogDiscord, Warning, TEXT("Error(%i) UpdatePeer(%llu) for lobby member %llu"), Result, PeerId, UserId);
+		}
+		++NumPeerUpdates;
+	}
+
+	FMemberRoute& Route = Known ? *Known : MemberRoutes.Add(UserId);
+	Route.PeerId = PeerId;
+	Route.RouteData = RouteData;
+
+	MemberRouteChangedEvent.Broadcast(UserId, PeerId, RouteData);
+}
+
+uint64 FDiscordNetRouteManager::GetLocalUserId() const
+{
+	discord::User CurrentUser {};
+	if (Core.UserManager().GetCurrentUser(&CurrentUser) == discord::Result::Ok)
+	{
+		return static_cast<uint64>(CurrentUser.GetId());
+	}
+
+	return 0;
+}
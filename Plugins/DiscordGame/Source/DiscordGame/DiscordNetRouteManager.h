@@ -0,0 +1,145 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordNetTransport.h"
+
+/** Broadcast when a lobby member's peer id or route changes: (UserId, PeerId, RouteData) */
+DECLARE_MULTICAST_DELEGATE_ThreeParams(FOnDiscordNetMemberRoute, uint64 /*UserId*/, uint64 /*PeerId*/, const FString& /*RouteData*/);
+
+/**
+ * Settings for FDiscordNetRouteManager
+ */
+struct DISCORDGAME_API FDiscordNetRouteSettings
+{
+	/** Wait until our route has been stable this long before publishing it */
+	float DebounceSeconds {0.5f};
+
+	/** Publish anyway once our route has been changing for this long */
+	float MaxDelaySeconds {2.f};
+
+	/** Most remote peers to UpdatePeer per Tick; <= 0 means unlimited */
+	int32 MaxPeerUpdatesPerTick {0};
+};
+
+/**
+ * Discord Network Route Manager
+ *
+ * Keeps the route data of every member of a lobby up to date, for use with
+ * a discord::NetworkManager transport (FDiscordPeerNetTransport).
+ *
+ * NetworkManager::OnRouteUpdate can fire several times in quick succession while
+ * NAT routes settle, and every change has to reach every other member, who then
+ * has to call UpdatePeer.  Doing that naively for each update in a full lobby is
+ * an O(n^2) storm of metadata writes and UpdatePeer calls.  Instead:
+ *
+ *   - Local route updates are debounced, then published with a single UpdateMember
+ *     write of our own member metadata (peer id + route together)
+ *   - Remote member updates are coalesced per member, and at Tick each changed member
+ *     is read once and gets at most one UpdatePeer
+ *
+ * Members whose route we see for the first time are not opened here; bind to
+ * OnMemberRouteChanged and call OpenPeer yourself for the members you want.
+ *
+ * Create this with MakeShared, since async SDK callbacks hold weak references to it.
+ *
+ * This holds a reference into the DiscordCore, so you MUST destroy it
+ * no later than UDiscordGameSubsystem::NativeOnDiscordCoreReset.
+ */
+class DISCORDGAME_API FDiscordNetRouteManager : public TSharedFromThis<FDiscordNetRouteManager>
+{
+public:
+	/** Member metadata key holding each member's NetworkPeerId */
+	static constexpr const char* PeerIdMetadataKey = "discord.net.peer_id";
+
+	/** Member metadata key holding each member's route data */
+	static constexpr const char* RouteMetadataKey = "discord.net.route";
+
+	/**
+	 * @param InCore Discord Core
+	 * @param InLobbyId Lobby to exchange routes through; we must already be a member
+	 * @param InTransport Peer transport whose route we publish, and whose peers we update
+	 * @param InSettings Debounce and batching settings
+	 */
+	FDiscordNetRouteManager(discord::Core& InCore, discord::LobbyId InLobbyId, const TSharedRef<IDiscordNetTransport>& InTransport, const FDiscordNetRouteSettings& InSettings = FDiscordNetRouteSettings());
+	~FDiscordNetRouteManager();
+
+	/** Publish our route and update remote peers as needed; call once per frame */
+	void Tick();
+
+	/**
+	 * Publish a route we already had before this manager was created.
+	 * Later changes are picked up from the transport's OnRouteUpdate automatically.
+	 */
+	void SetLocalRoute(const FString& RouteData) { HandleLocalRouteUpdate(RouteData); }
+
+	/**
+	 * Get the last known route of a lobby member.
+	 * @return TRUE if we know the member's route, in which case OutPeerId and OutRouteData are set
+	 */
+	bool GetMemberRoute(uint64 UserId, uint64& OutPeerId, FString& OutRouteData) const;
+
+	/** Event broadcast when a lobby member's peer id or route changes, including the first time we see it */
+	FOnDiscordNetMemberRoute& OnMemberRouteChanged() { return MemberRouteChangedEvent; }
+
+	/** @return The lobby we exchange routes through */
+	discord::LobbyId GetLobbyId() const { return LobbyId; }
+
+	/** Counters since the manager was created */
+	uint64 NumLocalRouteUpdates {0};
+	uint64 NumMetadataWrites {0};
+	uint64 NumPeerUpdates {0};
+
+private:
+	struct FMemberRoute
+	{
+		uint64 PeerId {0};
+		FString RouteData;
+	};
+
+	/** Called by the transport when our route changes */
+	void HandleLocalRouteUpdate(const FString& RouteData);
+
+	/** Called by the LobbyManager when a member joins or changes their metadata */
+	void HandleMemberUpdate(int64 MemberLobbyId, int64 UserId);
+
+	/** Called by the LobbyManager when a member leaves */
+	void HandleMemberDisconnect(int64 MemberLobbyId, int64 UserId);
+
+	/** Write our pending route to our member metadata */
+	void PublishLocalRoute();
+
+	/** Read a member's metadata, and UpdatePeer if their route changed */
+	void RefreshMember(uint64 UserId);
+
+	/** @return Our own UserId, or 0 if not yet known */
+	uint64 GetLocalUserId() const;
+
+	discord::Core& Core;
+	discord::LobbyId LobbyId;
+	TSharedRef<IDiscordNetTransport> Transport;
+	FDiscordNetRouteSettings Settings;
+
+	/** Route waiting to be published */
+	FString PendingRoute;
+	bool bHasPendingRoute {false};
+	double FirstPendingTime {0.};
+	double LastPendingTime {0.};
+
+	/** TRUE while an UpdateMember write is in flight; we never have two at once */
+	bool bPublishInFlight {false};
+
+	/** Last known route of every member */
+	TMap<uint64, FMemberRoute> MemberRoutes;
+
+	/** Members whose metadata changed since we last read it */
+	TSet<uint64> DirtyMembers;
+
+	FOnDiscordNetMemberRoute MemberRouteChangedEvent;
+
+	FDelegateHandle RouteUpdateHandle;
+	int32 MemberConnectToken {0};
+	int32 MemberUpdateToken {0};
+	int32 MemberDisconnectToken {0};
+};
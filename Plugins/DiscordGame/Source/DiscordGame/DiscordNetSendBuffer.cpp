@@ -0,0 +1,165 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetSendBuffer.h"
+#include "DiscordGame.h"
+
+//////////////////////////////////////////////////////////////////////
+// FDiscordNetSendBuffer
+
+FDiscordNetSendBuffer::FDiscordNetSendBuffer(FDiscordNetSendBuffer&& Other)
+	: Pool(Other.Pool)
+	, ChannelId(Other.ChannelId)
+	, Block(Other.Block)
+{
+	Other.Pool = nullptr;
+	Other.Block = nullptr;
+}
+
+FDiscordNetSendBuffer& FDiscordNetSendBuffer::operator=(FDiscordNetSendBuffer&& Other)
+{
+	if (this != &Other)
+	{
+		Release();
+
+		Pool = Other.Pool;
+		ChannelId = Other.ChannelId;
+		Block = Other.Block;
+
+		Other.Pool = nullptr;
+		Other.Block = nullptr;
+	}
+	return *this;
+}
+
+FDiscordNetSendBuffer::~FDiscordNetSendBuffer()
+{
+	Release();
+}
+
+void FDiscordNetSendBuffer::Release()
+{
+	if (Block)
+	{
+		check(Pool);
+		Pool->ReleaseBlock(ChannelId, Block);
+
+		Pool = nullptr;
+		Block = nullptr;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// FDiscordNetSendBufferPool
+
+FDiscordNetSendBufferPool::FDiscordNetSendBufferPool(const TSharedRef<IDiscordNetTransport>& InTransport, int32 InDefaultBlockSize)
+	: Transport(InTransport)
+	, DefaultBlockSize(FMath::Max(InDefaultBlockSize, 1))
+{
+}
+
+FDiscordNetSendBufferPool::~FDiscordNetSendBufferPool()
+{
+	// Outstanding buffers would return their blocks to a pool that no longer exists
+	ensureMsgf(NumOutstanding == 0, TEXT("Destroying Discord send buffer pool with %i buffers still acquired"), NumOutstanding);
+}
+
+void FDiscordNetSendBufferPool::SetChannelBlockSize(uint8 ChannelId, int32 BlockSize, int32 NumPreallocate)
+{
+	FChannelPool& Channel = Channels[ChannelId];
+	Channel.BlockSize = FMath::Max(BlockSize, 1);
+
+	// Blocks of the old size are no use any more
+	const int64 MaxBits = static_cast<int64>(Channel.BlockSize) * 8;
+	Channel.FreeBlocks.RemoveAll([MaxBits](const TUniquePtr<FBitWriter>& Block)
+	{
+		return Block->GetMaxBits() != MaxBits;
+	});
+
+	Channel.FreeBlocks.Reserve(NumPreallocate);
+	while (Channel.FreeBlocks.Num() < NumPreallocate)
+	{
+		Channel.FreeBlocks.Add(AllocateBlock(ChannelId));
+	}
+}
+
+FDiscordNetSendBuffer FDiscordNetSendBufferPool::Acquire(uint8 ChannelId)
+{
+	FChannelPool& Channel = Channels[ChannelId];
+
+	TUniquePtr<FBitWriter> Block = Channel.FreeBlocks.Num() > 0
+		? Channel.FreeBlocks.Pop(EAllowShrinking::No)
+		: AllocateBlock(ChannelId);
+
+	++NumOutstanding;
+	return FDiscordNetSendBuffer(this, ChannelId, Block.Release());
+}
+
+discord::Result FDiscordNetSendBufferPool::Submit(FDiscordNetSendBuffer&& Buffer, uint64 PeerId)
+{
+	return Submit(MoveTemp(Buffer), MakeArrayView(&PeerId, 1));
+}
+
+discord::Result FDiscordNetSendBufferPool::Submit(FDiscordNetSendBuffer&& Buffer, TConstArrayView<uint64> PeerIds)
+{
+	// Take ownership, so the block is recycled however we leave
+	FDiscordNetSendBuffer Submitted = MoveTemp(Buffer);
+
+	if (!Submitted.IsValid())
+	{
+		return discord::Result::InvalidPayload;
+	}
+
+	check(Submitted.Pool == this);
+
+	if (Submitted.IsOverflowed())
+	{
+		UE_LOG(LogDiscord, Warning, TEXT("Discarding message on channel %u: larger than the %i byte block"), Submitted.ChannelId, GetBlockSize(Submitted.ChannelId));
+		return discord::Result::InsufficientBuffer;
+	}
+
+	const uint8* Data = Submitted.GetWriter().GetData();
+	const uint32 DataLength = static_cast<uint32>(Submitted.GetNumBytes());
+
+	discord::Result FirstError = discord::Result::Ok;
+	for (const uint64 PeerId : PeerIds)
+	{
+		const discord::Result Result = Transport->SendMessage(PeerId, Submitted.ChannelId, Data, DataLength);
+		if (Result != discord::Result::Ok && FirstError == discord::Result::Ok)
+		{
+			FirstError = Result;
+		}
+	}
+
+	return FirstError;
+}
+
+int32 FDiscordNetSendBufferPool::GetBlockSize(uint8 ChannelId) const
+{
+	return Channels[ChannelId].BlockSize > 0 ? Channels[ChannelId].BlockSize : DefaultBlockSize;
+}
+
+TUniquePtr<FBitWriter> FDiscordNetSendBufferPool::AllocateBlock(uint8 ChannelId)
+{
+	++NumAllocated;
+
+	// Fixed size; writing past the end sets the error flag rather than growing
+	return MakeUnique<FBitWriter>(static_cast<int64>(GetBlockSize(ChannelId)) * 8, false);
+}
+
+void FDiscordNetSendBufferPool::ReleaseBlock(uint8 ChannelId, FBitWriter* Block)
+{
+	check(NumOutstanding > 0);
+	--NumOutstanding;
+
+	TUniquePtr<FBitWriter> Owned(Block);
+
+	// The channel's block size may have changed while this was out
+	if (Owned->GetMaxBits() != static_cast<int64>(GetBlockSize(ChannelId)) * 8)
+	{
+		return;
+	}
+
+	// Reset keeps the allocation, and clears the error flag from any overflow
+	Owned->Reset();
+	Channels[ChannelId].FreeBlocks.Add(MoveTemp(Owned));
+}
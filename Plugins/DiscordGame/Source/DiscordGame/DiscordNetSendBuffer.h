@@ -0,0 +1,153 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordNetTransport.h"
+#include "Serialization/BitWriter.h"
+
+class FDiscordNetSendBufferPool;
+
+/**
+ * Discord Network Send Buffer
+ *
+ * A pooled, fixed-size block to serialize one message into.  Get one from
+ * FDiscordNetSendBufferPool::Acquire, write to it as an FArchive (bytes or bits),
+ * then hand it back with FDiscordNetSendBufferPool::Submit.
+ *
+ *   FDiscordNetSendBuffer Buffer = Pool->Acquire(ChannelId);
+ *   Buffer.GetWriter() << Health;
+ *   Buffer.GetWriter().WriteBit(bIsCrouched);
+ *   Pool->Submit(MoveTemp(Buffer), PeerId);
+ *
+ * A buffer that is destroyed without being submitted goes back to the pool unsent.
+ * Writing past the end of the block sets the writer's error flag, and Submit refuses it.
+ */
+class DISCORDGAME_API FDiscordNetSendBuffer
+{
+public:
+	FDiscordNetSendBuffer() = default;
+	FDiscordNetSendBuffer(FDiscordNetSendBuffer&& Other);
+	FDiscordNetSendBuffer& operator=(FDiscordNetSendBuffer&& Other);
+	~FDiscordNetSendBuffer();
+
+	FDiscordNetSendBuffer(const FDiscordNetSendBuffer&) = delete;
+	FDiscordNetSendBuffer& operator=(const FDiscordNetSendBuffer&) = delete;
+
+	/** @return TRUE if this holds a block */
+	bool IsValid() const { return Block != nullptr; }
+
+	/** @return Archive to serialize the message with */
+	FBitWriter& GetWriter() const { check(Block); return *Block; }
+
+	/** @return Channel this buffer was acquired for */
+	uint8 GetChannelId() const { return ChannelId; }
+
+	/** @return Number of bytes written so far (partial bytes round up) */
+	int64 GetNumBytes() const { return Block ? Block->GetNumBytes() : 0; }
+
+	/** @return TRUE if anything was written past the end of the block */
+	bool IsOverflowed() const { return Block && Block->IsError(); }
+
+private:
+	friend class FDiscordNetSendBufferPool;
+
+	FDiscordNetSendBuffer(FDiscordNetSendBufferPool* InPool, uint8 InChannelId, FBitWriter* InBlock)
+		: Pool(InPool)
+		, ChannelId(InChannelId)
+		, Block(InBlock)
+	{
+	}
+
+	/** Return the block to the pool, if we have one */
+	void Release();
+
+	FDiscordNetSendBufferPool* Pool {nullptr};
+	uint8 ChannelId {0};
+	FBitWriter* Block {nullptr};
+};
+
+/**
+ * Discord Network Send Buffer Pool
+ *
+ * Recycles fixed-size blocks per channel for serializing outgoing messages, so
+ * building a message doesn't allocate once the pool has warmed up.
+ *
+ * Each channel has its own block size (SetChannelBlockSize), which should be the
+ * largest message you ever send on that channel.  Blocks are only allocated when
+ * the free list for a channel is empty, which in steady state means never;
+ * use the NumPreallocate argument to avoid even the warm-up allocations.
+ *
+ * The pool must outlive every buffer acquired from it.  Not thread safe.
+ */
+class DISCORDGAME_API FDiscordNetSendBufferPool
+{
+public:
+	/**
+	 * @param InTransport Transport that submitted buffers are sent on
+	 * @param InDefaultBlockSize Block size in bytes for channels without their own
+	 */
+	explicit FDiscordNetSendBufferPool(const TSharedRef<IDiscordNetTransport>& InTransport, int32 InDefaultBlockSize = 1200);
+	~FDiscordNetSendBufferPool();
+
+	/**
+	 * Set the block size for a channel.
+	 *
+	 * Blocks already in the channel's free list are discarded if they are the wrong size.
+	 *
+	 * @param ChannelId Channel to configure
+	 * @param BlockSize Largest message in bytes that will be written on this channel
+	 * @param NumPreallocate Make sure at least this many blocks are ready in the free list
+	 */
+	void SetChannelBlockSize(uint8 ChannelId, int32 BlockSize, int32 NumPreallocate = 0);
+
+	/** @return An empty buffer for a message on this channel */
+	FDiscordNetSendBuffer Acquire(uint8 ChannelId);
+
+	/**
+	 * Send a buffer's contents to a peer on the buffer's channel, and recycle the buffer.
+	 * @return Result of the send, or InsufficientBuffer if the buffer overflowed
+	 */
+	discord::Result Submit(FDiscordNetSendBuffer&& Buffer, uint64 PeerId);
+
+	/**
+	 * Send a buffer's contents to several peers on the buffer's channel, and recycle the buffer.
+	 * @return Ok if every send succeeded, else the first error
+	 */
+	discord::Result Submit(FDiscordNetSendBuffer&& Buffer, TConstArrayView<uint64> PeerIds);
+
+	/** @return Number of blocks currently acquired and not yet returned */
+	int32 GetNumOutstanding() const { return NumOutstanding; }
+
+	/** @return Number of blocks ever allocated; stops growing once the pool has warmed up */
+	int32 GetNumAllocated() const { return NumAllocated; }
+
+private:
+	friend class FDiscordNetSendBuffer;
+
+	struct FChannelPool
+	{
+		/** Block size in bytes; 0 means use the default */
+		int32 BlockSize {0};
+
+		/** Blocks ready for reuse */
+		TArray<TUniquePtr<FBitWriter>> FreeBlocks;
+	};
+
+	/** @return Block size in bytes for a channel */
+	int32 GetBlockSize(uint8 ChannelId) const;
+
+	/** @return A new block for a channel */
+	TUniquePtr<FBitWriter> AllocateBlock(uint8 ChannelId);
+
+	/** Called by FDiscordNetSendBuffer to return a block */
+	void ReleaseBlock(uint8 ChannelId, FBitWriter* Block);
+
+	TSharedRef<IDiscordNetTransport> Transport;
+	int32 DefaultBlockSize {0};
+
+	FChannelPool Channels[256];
+
+	int32 NumOutstanding {0};
+	int32 NumAllocated {0};
+};
@@ -0,0 +1,289 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetSendScheduler.h"
+#include "DiscordGame.h"
+
+FDiscordNetSendScheduler::FDiscordNetSendScheduler(const TSharedRef<IDiscordNetTransport>& InInner, const FDiscordNetSchedulerSettings& InSettings)
+	: FDiscordNetTransportDecorator(InInner)
+	, Settings(InSettings)
+	, ReliableChannels(false, 256)
+{
+	for (EDiscordNetPriority& Priority : ChannelPriorities)
+	{
+		Priority = EDiscordNetPriority::Normal;
+	}
+
+	TotalTokens = Settings.TotalBurstBytes;
+}
+
+void FDiscordNetSendScheduler::SetSettings(const FDiscordNetSchedulerSettings& InSettings)
+{
+	const bool bWasLimitingPeers = Settings.PeerBytesPerSecond > 0;
+	const bool bWasLimitingTotal = Settings.TotalBytesPerSecond > 0;
+
+	Settings = InSettings;
+
+	// A newly enabled limit starts with a full bucket; an existing one keeps its debt but no more than the new burst
+	for (TPair<uint64, FPeerQueue>& It : Peers)
+	{
+		It.Value.Tokens = bWasLimitingPeers ? FMath::Min<double>(It.Value.Tokens, Settings.PeerBurstBytes) : Settings.PeerBurstBytes;
+	}
+	TotalTokens = bWasLimitingTotal ? FMath::Min<double>(TotalTokens, Settings.TotalBurstBytes) : Settings.TotalBurstBytes;
+}
+
+void FDiscordNetSendScheduler::SetChannelPriority(uint8 ChannelId, EDiscordNetPriority Priority)
+{
+	check(Priority < EDiscordNetPriority::Num);
+	ChannelPriorities[ChannelId] = Priority;
+}
+
+discord::Result FDiscordNetSendScheduler::SendMessageWithPriority(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength, EDiscordNetPriority Priority)
+{
+	check(Priority < EDiscordNetPriority::Num);
+
+	FPeerQueue* Peer = Peers.Find(PeerId);
+	if (!Peer)
+	{
+		// New peers start with a full bucket
+		Peer = &Peers.Add(PeerId);
+		Peer->Tokens = Settings.PeerBurstBytes;
+	}
+
+	// Critical messages are always accepted; anything else is rejected once the peer's queue is full
+	if (Priority != EDiscordNetPriority::Critical
+		&& Settings.MaxQueuedBytesPerPeer > 0
+		&& Peer->QueuedBytes + static_cast<int64>(DataLength) > Settings.MaxQueuedBytesPerPeer)
+	{
+		UE_LOG(LogDiscord, Verbose, TEXT("Send queue full for peer %llu; rejecting %u byte message on channel %u"), PeerId, DataLength, ChannelId);
+		++NumDroppedMessages;
+		return discord::Result::RateLimited;
+	}
+
+	FQueuedMessage& Message = Peer->Queues[static_cast<int32>(Priority)].Messages.AddDefaulted_GetRef();
+	if (SparePayloads.Num() > 0)
+	{
+		Message.Payload = SparePayloads.Pop(EAllowShrinking::No);
+	}
+	Message.Payload.Append(Data, DataLength);
+	Message.QueueTime = FPlatformTime::Seconds();
+	Message.ChannelId = ChannelId;
+
+	Peer->QueuedBytes += DataLength;
+
+	return discord::Result::Ok;
+}
+
+int32 FDiscordNetSendScheduler::GetQueuedBytes(uint64 PeerId) const
+{
+	const FPeerQueue* Peer = Peers.Find(PeerId);
+	return Peer ? Peer->QueuedBytes : 0;
+}
+
+discord::Result FDiscordNetSendScheduler::ClosePeer(uint64 PeerId)
+{
+	// Anything still queued for this peer can never be sent
+	if (FPeerQueue* Peer = Peers.Find(PeerId))
+	{
+		for (FMessageQueue& Queue : Peer->Queues)
+		{
+			NumDroppedMessages += Queue.Messages.Num() - Queue.Head;
+		}
+		Peers.Remove(PeerId);
+	}
+
+	return Super::ClosePeer(PeerId);
+}
+
+discord::Result FDiscordNetSendScheduler::OpenChannel(uint64 PeerId, uint8 ChannelId, bool bReliable)
+{
+	// Remember which channels are reliable so we never drop their messages
+	ReliableChannels[ChannelId] = bReliable;
+
+	return Super::OpenChannel(PeerId, ChannelId, bReliable);
+}
+
+discord::Result FDiscordNetSendScheduler::SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	return SendMessageWithPriority(PeerId, ChannelId, Data, DataLength, ChannelPriorities[ChannelId]);
+}
+
+discord::Result FDiscordNetSendScheduler::Flush()
+{
+	const double Now = FPlatformTime::Seconds();
+	const double DeltaTime = LastFlushTime > 0. ? Now - LastFlushTime : 0.;
+	LastFlushTime = Now;
+
+	Refill(TotalTokens, Settings.TotalBytesPerSecond, Settings.TotalBurstBytes, DeltaTime);
+
+	TArray<uint64, TInlineAllocator<16>> PeerIds;
+	for (TPair<uint64, FPeerQueue>& It : Peers)
+	{
+		Refill(It.Value.Tokens, Settings.PeerBytesPerSecond, Settings.PeerBurstBytes, DeltaTime);
+		DropExpired(It.Value, Now);
+
+		if (It.Value.HasQueuedMessages())
+		{
+			PeerIds.Add(It.Key);
+		}
+	}
+
+	const int32 NumPeers = PeerIds.Num();
+	const bool bLimitPeers = Settings.PeerBytesPerSecond > 0;
+	const bool bLimitTotal = Settings.TotalBytesPerSecond > 0;
+
+	// Each pass sends at most one message per peer, so peers share the total budget fairly.
+	// Keep passing over the peers until nobody can send anything else this frame.
+	bool bSentAny = NumPeers > 0;
+	while (bSentAny)
+	{
+		bSentAny = false;
+
+		for (int32 i = 0; i < NumPeers; ++i)
+		{
+			const uint64 PeerId = PeerIds[(i + RoundRobinOffset) % NumPeers];
+			FPeerQueue& Peer = Peers.FindChecked(PeerId);
+
+			const int32 QueueIndex = PickQueue(Peer, Now);
+			if (QueueIndex == INDEX_NONE)
+			{
+				continue;
+			}
+
+			// Buckets are allowed to go into debt, so a message larger than the burst size
+			// can still be sent as long as there are any tokens left at all.
+			const bool bCritical = QueueIndex == static_cast<int32>(EDiscordNetPriority::Critical);
+			if (!bCritical && ((bLimitPeers && Peer.Tokens <= 0.) || (bLimitTotal && TotalTokens <= 0.)))
+			{
+				continue;
+			}
+
+			FMessageQueue& Queue = Peer.Queues[QueueIndex];
+			FQueuedMessage& Message = Queue.Peek();
+			const int32 Size = Message.Payload.Num();
+
+			const discord::Result Result = Inner->SendMessage(PeerId, Message.ChannelId, Message.Payload.GetData(), Size);
+			if (Result != discord::Result::Ok)
+			{
+				UE_LOG(LogDiscord, Verbose, TEXT("Error(%i) Sending %i bytes to peer %llu on channel %u"), Result, Size, PeerId, Message.ChannelId);
+				++NumDroppedMessages;
+			}
+
+			// Only enabled buckets go into debt; a disabled one is refilled when it's enabled
+			if (bLimitPeers)
+			{
+				Peer.Tokens -= Size;
+			}
+			if (bLimitTotal)
+			{
+				TotalTokens -= Size;
+			}
+
+			PopHead(Peer, Queue);
+			bSentAny = true;
+		}
+	}
+
+	// Rotate who goes first next time
+	RoundRobinOffset = NumPeers > 0 ? (RoundRobinOffset + 1) % NumPeers : 0;
+
+	// Compact the queues now that we're done consuming from them
+	for (TPair<uint64, FPeerQueue>& It : Peers)
+	{
+		for (FMessageQueue& Queue : It.Value.Queues)
+		{
+			if (Queue.Head > 0)
+			{
+				Queue.Messages.RemoveAt(0, Queue.Head, EAllowShrinking::No);
+				Queue.Head = 0;
+			}
+		}
+	}
+
+	return Super::Flush();
+}
+
+int32 FDiscordNetSendScheduler::PickQueue(FPeerQueue& Peer, double Now)
+{
+	int32 BestQueue = INDEX_NONE;
+	int32 BestPriority = MAX_int32;
+
+	for (int32 QueueIndex = 0; QueueIndex < static_cast<int32>(EDiscordNetPriority::Num); ++QueueIndex)
+	{
+		FMessageQueue& Queue = Peer.Queues[QueueIndex];
+		if (Queue.IsEmpty())
+		{
+			continue;
+		}
+
+		// Messages that have waited too long are treated as if they had a higher priority
+		int32 EffectivePriority = QueueIndex;
+		if (Settings.PromoteAfterSeconds > 0.f)
+		{
+			const double Age = Now - Queue.Peek().QueueTime;
+			EffectivePriority = FMath::Max(0, QueueIndex - FMath::FloorToInt32(Age / Settings.PromoteAfterSeconds));
+		}
+
+		// Ties go to the queue with the higher base priority
+		if (EffectivePriority < BestPriority)
+		{
+			BestPriority = EffectivePriority;
+			BestQueue = QueueIndex;
+		}
+	}
+
+	if (BestQueue != INDEX_NONE && BestPriority < BestQueue)
+	{
+		FQueuedMessage& Message = Peer.Queues[BestQueue].Peek();
+		if (!Message.bPromoted)
+		{
+			Message.bPromoted = true;
+			++NumPromotions;
+		}
+	}
+
+	return BestQueue;
+}
+
+void FDiscordNetSendScheduler::DropExpired(FPeerQueue& Peer, double Now)
+{
+	if (Settings.UnreliableMaxQueueSeconds <= 0.f)
+	{
+		return;
+	}
+
+	for (FMessageQueue& Queue : Peer.Queues)
+	{
+		// Messages are queued in time order, so we only ever need to look at the head
+		while (!Queue.IsEmpty())
+		{
+			const FQueuedMessage& Message = Queue.Peek();
+			if (ReliableChannels[Message.ChannelId] || Now - Message.QueueTime <= Settings.UnreliableMaxQueueSeconds)
+			{
+				break;
+			}
+
+			++NumDroppedMessages;
+			PopHead(Peer, Queue);
+		}
+	}
+}
+
+void FDiscordNetSendScheduler::PopHead(FPeerQueue& Peer, FMessageQueue& Queue)
+{
+	FQueuedMessage& Message = Queue.Peek();
+	Peer.QueuedBytes -= Message.Payload.Num();
+
+	// Keep the payload allocation around for a future message
+	Message.Payload.Reset();
+	SparePayloads.Add(MoveTemp(Message.Payload));
+
+	++Queue.Head;
+}
+
+void FDiscordNetSendScheduler::Refill(double& Tokens, int32 BytesPerSecond, int32 BurstBytes, double DeltaTime)
+{
+	if (BytesPerSecond > 0)
+	{
+		Tokens = FMath::Min<double>(BurstBytes, Tokens + BytesPerSecond * DeltaTime);
+	}
+}
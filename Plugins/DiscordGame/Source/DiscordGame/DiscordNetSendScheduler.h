@@ -0,0 +1,201 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordNetTransport.h"
+
+/**
+ * Send priority classes, from most to least important.
+ */
+enum class EDiscordNetPriority : uint8
+{
+	/** Never waits for bandwidth; e.g. player input */
+	Critical,
+	/** e.g. gameplay events */
+	High,
+	/** Default priority */
+	Normal,
+	/** Large and/or deferrable; e.g. full state snapshots */
+	Bulk,
+
+	Num
+};
+
+/**
+ * Settings for FDiscordNetSendScheduler
+ */
+struct DISCORDGAME_API FDiscordNetSchedulerSettings
+{
+	/** Sustained bytes/second we may send to any single peer; <= 0 means unlimited */
+	int32 PeerBytesPerSecond {0};
+
+	/** Maximum bytes a single peer may burst above its sustained rate */
+	int32 PeerBurstBytes {16 * 1024};
+
+	/** Sustained bytes/second we may send to all peers combined; <= 0 means unlimited */
+	int32 TotalBytesPerSecond {0};
+
+	/** Maximum bytes all peers combined may burst above the sustained rate */
+	int32 TotalBurstBytes {64 * 1024};
+
+	/**
+	 * Starvation protection: a queued message is promoted one priority class
+	 * for every this many seconds it has been waiting.  <= 0 disables promotion.
+	 */
+	float PromoteAfterSeconds {0.1f};
+
+	/**
+	 * Messages on unreliable channels that have been queued longer than this are
+	 * dropped rather than sent late.  <= 0 means never drop.
+	 */
+	float UnreliableMaxQueueSeconds {0.5f};
+
+	/**
+	 * Maximum bytes that may be queued for any single peer.
+	 * Once reached, new non-Critical messages to that peer are rejected.
+	 */
+	int32 MaxQueuedBytesPerPeer {256 * 1024};
+};
+
+/**
+ * Discord Network Send Scheduler
+ *
+ * Transport decorator that queues outgoing messages per peer, and only
+ * passes them to the Inner transport's SendMessage at Flush() time.
+ *
+ * When a Flush() happens, each peer's messages are sent in priority order,
+ * limited by a per-peer token bucket and (optionally) a token bucket shared
+ * by all peers.  Peers are served round-robin, so one busy peer can't use
+ * up the shared budget before the others get a turn.
+ *
+ * Critical messages are never held back by bandwidth limits, though they do
+ * still consume tokens, so a burst of Critical traffic delays lower classes.
+ *
+ * Messages within a single priority class are always sent in the order they
+ * were queued.  Sending to the same channel with different priorities can
+ * reorder that channel's messages, so use SetChannelPriority and plain
+ * SendMessage for reliable channels where order matters.
+ */
+class DISCORDGAME_API FDiscordNetSendScheduler : public FDiscordNetTransportDecorator
+{
+	using Super = FDiscordNetTransportDecorator;
+
+public:
+	explicit FDiscordNetSendScheduler(const TSharedRef<IDiscordNetTransport>& InInner, const FDiscordNetSchedulerSettings& InSettings = FDiscordNetSchedulerSettings());
+
+	/** Replace the scheduler settings; takes effect at the next Flush() */
+	void SetSettings(const FDiscordNetSchedulerSettings& InSettings);
+
+	/** @return Current scheduler settings */
+	const FDiscordNetSchedulerSettings& GetSettings() const { return Settings; }
+
+	/**
+	 * Set the priority used for messages sent on this channel via SendMessage.
+	 * Channels default to EDiscordNetPriority::Normal.
+	 */
+	void SetChannelPriority(uint8 ChannelId, EDiscordNetPriority Priority);
+
+	/**
+	 * Queue a message to be sent at the next Flush() with an explicit priority.
+	 *
+	 * @return Ok if queued; RateLimited if this peer's queue is full
+	 */
+	discord::Result SendMessageWithPriority(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength, EDiscordNetPriority Priority);
+
+	/** @return Number of bytes currently queued for this peer */
+	int32 GetQueuedBytes(uint64 PeerId) const;
+
+	/** @return Total number of messages dropped or rejected since creation */
+	uint64 GetNumDroppedMessages() const { return NumDroppedMessages; }
+
+	/** @return Total number of starvation promotions since creation */
+	uint64 GetNumPromotions() const { return NumPromotions; }
+
+	//~IDiscordNetTransport interface
+	virtual discord::Result ClosePeer(uint64 PeerId) override;
+	virtual discord::Result OpenChannel(uint64 PeerId, uint8 ChannelId, bool bReliable) override;
+	virtual discord::Result SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) override;
+	virtual discord::Result Flush() override;
+	//~End of IDiscordNetTransport interface
+
+private:
+	struct FQueuedMessage
+	{
+		TArray<uint8> Payload;
+		double QueueTime {0.};
+		uint8 ChannelId {0};
+		bool bPromoted {false};
+	};
+
+	/** FIFO of messages for a single priority class; consumed from Head */
+	struct FMessageQueue
+	{
+		TArray<FQueuedMessage> Messages;
+		int32 Head {0};
+
+		bool IsEmpty() const { return Head >= Messages.Num(); }
+		FQueuedMessage& Peek() { return Messages[Head]; }
+	};
+
+	struct FPeerQueue
+	{
+		FMessageQueue Queues[static_cast<int32>(EDiscordNetPriority::Num)];
+		double Tokens {0.};
+		int32 QueuedBytes {0};
+
+		bool HasQueuedMessages() const
+		{
+			for (const FMessageQueue& Queue : Queues)
+			{
+				if (!Queue.IsEmpty())
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+	};
+
+	/**
+	 * Choose which of this peer's queues should send next, after applying
+	 * starvation promotion.
+	 * @return Index of the queue to send from, or INDEX_NONE if the peer has nothing queued
+	 */
+	int32 PickQueue(FPeerQueue& Peer, double Now);
+
+	/** Drop expired messages on unreliable channels from the head of the peer's queues */
+	void DropExpired(FPeerQueue& Peer, double Now);
+
+	/** Remove the head message from a queue and recycle its payload */
+	void PopHead(FPeerQueue& Peer, FMessageQueue& Queue);
+
+	/** Refill a token bucket for the elapsed time */
+	static void Refill(double& Tokens, int32 BytesPerSecond, int32 BurstBytes, double DeltaTime);
+
+	FDiscordNetSchedulerSettings Settings;
+
+	/** Queued messages for each peer */
+	TMap<uint64, FPeerQueue> Peers;
+
+	/** Priority for each channel, as set by SetChannelPriority */
+	EDiscordNetPriority ChannelPriorities[256];
+
+	/** Which channels were opened as reliable (messages on these are never dropped) */
+	TBitArray<> ReliableChannels;
+
+	/** Payload buffers of sent messages, kept to be reused by future messages */
+	TArray<TArray<uint8>> SparePayloads;
+
+	/** Tokens in the bucket shared by all peers */
+	double TotalTokens {0.};
+
+	/** Time of the previous Flush() */
+	double LastFlushTime {0.};
+
+	/** Index of the peer that gets served first at the next Flush() */
+	int32 RoundRobinOffset {0};
+
+	uint64 NumDroppedMessages {0};
+	uint64 NumPromotions {0};
+};
@@ -0,0 +1,124 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetSequencer.h"
+#include "DiscordGame.h"
+
+namespace DiscordNetSequencer
+{
+	/** Bytes of sequence number in front of every sequenced message */
+	static constexpr uint32 HeaderSize = 2;
+
+	/**
+	 * A message this far behind the newest is not late, the sender has restarted
+	 * its numbering (e.g. it reconnected), so we start over from it.
+	 */
+	static constexpr int32 ResyncDistance = 1024;
+}
+
+FDiscordNetSequencer::FDiscordNetSequencer(const TSharedRef<IDiscordNetTransport>& InInner)
+	: FDiscordNetTransportDecorator(InInner)
+	, SequencedChannels(false, 256)
+{
+}
+
+void FDiscordNetSequencer::SetChannelSequenced(uint8 ChannelId, bool bSequenced)
+{
+	SequencedChannels[ChannelId] = bSequenced;
+}
+
+discord::Result FDiscordNetSequencer::ClosePeer(uint64 PeerId)
+{
+	// A reopened peer starts over from sequence 0
+	for (auto It = SendSequences.CreateIterator(); It; ++It)
+	{
+		if (It.Key().Get<0>() == PeerId)
+		{
+			It.RemoveCurrent();
+		}
+	}
+	for (auto It = ReceiveStates.CreateIterator(); It; ++It)
+	{
+		if (It.Key().Get<0>() == PeerId)
+		{
+			It.RemoveCurrent();
+		}
+	}
+
+	return Super::ClosePeer(PeerId);
+}
+
+discord::Result FDiscordNetSequencer::SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	using namespace DiscordNetSequencer;
+
+	if (!SequencedChannels[ChannelId])
+	{
+		return Super::SendMessage(PeerId, ChannelId, Data, DataLength);
+	}
+
+	uint16& NextSequence = SendSequences.FindOrAdd(MakeTuple(PeerId, ChannelId), 0);
+
+	SendScratch.SetNumUninitialized(HeaderSize + DataLength, EAllowShrinking::No);
+	SendScratch[0] = static_cast<uint8>(NextSequence & 0xff);
+	SendScratch[1] = static_cast<uint8>(NextSequence >> 8);
+	FMemory::Memcpy(SendScratch.GetData() + HeaderSize, Data, DataLength);
+
+	const discord::Result Result = Super::SendMessage(PeerId, ChannelId, SendScratch.GetData(), SendScratch.Num());
+	if (Result == discord::Result::Ok)
+	{
+		++NextSequence;
+		++ChannelStats[ChannelId].NumSent;
+	}
+
+	return Result;
+}
+
+void FDiscordNetSequencer::HandleInnerMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	using namespace DiscordNetSequencer;
+
+	if (!SequencedChannels[ChannelId])
+	{
+		Super::HandleInnerMessage(PeerId, ChannelId, Data, DataLength);
+		return;
+	}
+
+	if (DataLength < HeaderSize)
+	{
+		UE_LOG(LogDiscord, Verbose, TEXT("Dropping message without sequence number from peer %llu on channel %u"), PeerId, ChannelId);
+		return;
+	}
+
+	const uint16 Sequence = static_cast<uint16>(Data[0] | (Data[1] << 8));
+	FDiscordNetSequenceStats& Stats = ChannelStats[ChannelId];
+	FReceiveState& State = ReceiveStates.FindOrAdd(MakeTuple(PeerId, ChannelId));
+
+	if (State.bHasLatest)
+	{
+		// Difference allowing for wraparound: positive is newer
+		const int32 Distance = static_cast<int16>(Sequence - State.Latest);
+
+		if (Distance == 0)
+		{
+			++Stats.NumDuplicates;
+			return;
+		}
+
+		if (Distance < 0 && Distance > -ResyncDistance)
+		{
+			++Stats.NumStale;
+			return;
+		}
+
+		if (Distance > 1)
+		{
+			Stats.NumMissing += Distance - 1;
+		}
+	}
+
+	State.Latest = Sequence;
+	State.bHasLatest = true;
+	++Stats.NumDelivered;
+
+	Super::HandleInnerMessage(PeerId, ChannelId, Data + HeaderSize, DataLength - HeaderSize);
+}
@@ -0,0 +1,86 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordNetTransport.h"
+
+/**
+ * Sequencing counters for one channel, across all peers
+ */
+struct DISCORDGAME_API FDiscordNetSequenceStats
+{
+	uint64 NumSent {0};
+	uint64 NumDelivered {0};
+
+	/** Arrived after a newer message, so dropped */
+	uint64 NumStale {0};
+
+	/** Arrived again, so dropped */
+	uint64 NumDuplicates {0};
+
+	/** Skipped over by a newer message; lost, or arriving late (and then counted as stale too) */
+	uint64 NumMissing {0};
+};
+
+/**
+ * Discord Network Sequencer
+ *
+ * Transport decorator that stamps every message on opted-in channels with a
+ * per-peer sequence number, and drops any message that arrives after a newer one
+ * on the same channel from the same peer, before it reaches OnMessage.
+ *
+ * Use it for unreliable channels carrying state where only the newest matters
+ * (e.g. snapshots), so consumers never waste time decoding obsolete data.
+ * Reliable channels are already ordered and don't need it.
+ *
+ * Both ends must opt in the same channels, since sequenced messages carry a
+ * two byte header.
+ */
+class DISCORDGAME_API FDiscordNetSequencer : public FDiscordNetTransportDecorator
+{
+	using Super = FDiscordNetTransportDecorator;
+
+public:
+	explicit FDiscordNetSequencer(const TSharedRef<IDiscordNetTransport>& InInner);
+
+	/** Start or stop sequencing a channel */
+	void SetChannelSequenced(uint8 ChannelId, bool bSequenced);
+
+	/** @return TRUE if the channel is sequenced */
+	bool IsChannelSequenced(uint8 ChannelId) const { return SequencedChannels[ChannelId]; }
+
+	/** @return Counters for a channel */
+	const FDiscordNetSequenceStats& GetChannelStats(uint8 ChannelId) const { return ChannelStats[ChannelId]; }
+
+	//~IDiscordNetTransport interface
+	virtual discord::Result ClosePeer(uint64 PeerId) override;
+	virtual discord::Result SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) override;
+	//~End of IDiscordNetTransport interface
+
+protected:
+	//~FDiscordNetTransportDecorator interface
+	virtual void HandleInnerMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) override;
+	//~End of FDiscordNetTransportDecorator interface
+
+private:
+	struct FReceiveState
+	{
+		uint16 Latest {0};
+		bool bHasLatest {false};
+	};
+
+	/** Which channels are sequenced */
+	TBitArray<> SequencedChannels;
+
+	FDiscordNetSequenceStats ChannelStats[256];
+
+	/** Next sequence number to send, per (PeerId, ChannelId) */
+	TMap<TTuple<uint64, uint8>, uint16> SendSequences;
+
+	/** Newest sequence number received, per (PeerId, ChannelId) */
+	TMap<TTuple<uint64, uint8>, FReceiveState> ReceiveStates;
+
+	/** Reused for every message we send */
+	TArray<uint8> SendScratch;
+};
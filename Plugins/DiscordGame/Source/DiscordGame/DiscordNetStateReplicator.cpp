@@ -0,0 +1,365 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetStateReplicator.h"
+#include "DiscordGame.h"
+
+namespace DiscordNetStateReplicator
+{
+	/** Deltas mark changes per chunk of this many bytes, then per byte within changed chunks */
+	static constexpr int32 ChunkBytes = 8;
+
+	/** Most header bits: state flag + sequence, ack flag + ack, delta flag + baseline */
+	static constexpr int64 MaxHeaderBits = 1 + 16 + 1 + 16 + 1 + 16;
+}
+
+//////////////////////////////////////////////////////////////////////
+// FDiscordNetStateReplicator::FStateHistory
+
+void FDiscordNetStateReplicator::FStateHistory::Init(int32 HistorySize, int32 StateSize)
+{
+	States.SetNumZeroed(HistorySize * StateSize);
+	Sequences.Init(INDEX_NONE, HistorySize);
+}
+
+const uint8* FDiscordNetStateReplicator::FStateHistory::Find(uint16 Sequence, int32 StateSize) const
+{
+	const int32 Slot = Sequence % Sequences.Num();
+	return Sequences[Slot] == Sequence ? States.GetData() + Slot * StateSize : nullptr;
+}
+
+uint8* FDiscordNetStateReplicator::FStateHistory::Store(uint16 Sequence, int32 StateSize)
+{
+	const int32 Slot = Sequence % Sequences.Num();
+	Sequences[Slot] = Sequence;
+	return States.GetData() + Slot * StateSize;
+}
+
+//////////////////////////////////////////////////////////////////////
+// FDiscordNetStateReplicator
+
+FDiscordNetStateReplicator::FDiscordNetStateReplicator(const TSharedRef<IDiscordNetTransport>& InTransport, uint8 InChannelId, int32 InStateSize, int32 InHistorySize)
+	: Transport(InTransport)
+	, ChannelId(InChannelId)
+	, StateSize(FMath::Max(InStateSize, 1))
+	// Sequence numbers are 16 bits, so the history must be much smaller than that to tell old from new,
+	// and a power of two so ring slots stay in step when the sequence wraps around
+	, HistorySize(FMath::RoundUpToPowerOfTwo(FMath::Clamp(InHistorySize, 2, 1024)))
+	// A full state plus header always fits; the writer may still grow for an unusually bad delta
+	, Writer(DiscordNetStateReplicator::MaxHeaderBits + StateSize * 8, true)
+{
+	LocalState.SetNumZeroed(StateSize);
+	Sent.Init(HistorySize, StateSize);
+
+	MessageHandle = Transport->OnMessage().AddRaw(this, &FDiscordNetStateReplicator::HandleMessage);
+}
+
+FDiscordNetStateReplicator::~FDiscordNetStateReplicator()
+{
+	Transport->OnMessage().Remove(MessageHandle);
+}
+
+void FDiscordNetStateReplicator::AddPeer(uint64 PeerId)
+{
+	FindOrAddPeer(PeerId);
+}
+
+void FDiscordNetStateReplicator::RemovePeer(uint64 PeerId)
+{
+	Peers.Remove(PeerId);
+}
+
+void FDiscordNetStateReplicator::SetLocalState(const void* Data)
+{
+	FMemory::Memcpy(LocalState.GetData(), Data, StateSize);
+	bHasLocalState = true;
+}
+
+void FDiscordNetStateReplicator::Tick()
+{
+	if (Peers.Num() == 0)
+	{
+		return;
+	}
+
+	if (!bHasLocalState)
+	{
+		// Peers sending to us still need our acks, or they'd send us the full state every time
+		SendAcks();
+		return;
+	}
+
+	// Everyone gets the same snapshot, so it only needs storing once
+	const uint16 Sequence = NextSequence++;
+	FMemory::Memcpy(Sent.Store(Sequence, StateSize), LocalState.GetData(), StateSize);
+
+	for (TPair<uint64, FPeerState>& It : Peers)
+	{
+		FPeerState& Peer = It.Value;
+
+		// Only use a baseline that is still in our history; otherwise the peer gets everything
+		uint16 BaselineSequence = Peer.AckedSequence.Get(0);
+		const uint8* Baseline = Peer.AckedSequence.IsSet() && BaselineSequence != Sequence ? Sent.Find(BaselineSequence, StateSize) : nullptr;
+
+		auto WriteHeader = [this, &Peer, Sequence](bool bIsDelta, uint16 InBaselineSequence)
+		{
+			Writer.Reset();
+
+			Writer.WriteBit(true);
+			uint16 MessageSequence = Sequence;
+			Writer << MessageSequence;
+
+			// Piggyback our ack of their newest state
+			WriteAck(Peer);
+
+			Writer.WriteBit(bIsDelta);
+			if (bIsDelta)
+			{
+				Writer << InBaselineSequence;
+			}
+		};
+
+		bool bSentDelta {false};
+		if (Baseline)
+		{
+			WriteHeader(true, BaselineSequence);
+			const int64 HeaderBits = Writer.GetNumBits();
+			WriteDelta(Baseline, LocalState.GetData());
+
+			// When nearly everything changed, the change masks make the delta bigger than the full state
+			bSentDelta = Writer.GetNumBits() - HeaderBits < StateSize * 8;
+		}
+
+		if (!bSentDelta)
+		{
+			WriteHeader(false, 0);
+			Writer.Serialize(LocalState.GetData(), StateSize);
+		}
+
+		const discord::Result Result = Transport->SendMessage(It.Key, ChannelId, Writer.GetData(), static_cast<uint32>(Writer.GetNumBytes()));
+		if (Result != discord::Result::Ok)
+		{
+			UE_LOG(LogDiscord, Verbose, TEXT("Error(%i) Sending state to peer %llu on channel %u"), Result, It.Key, ChannelId);
+			continue;
+		}
+
+		++(bSentDelta ? NumDeltasSent : NumFullSent);
+		NumBytesSent += Writer.GetNumBytes();
+	}
+}
+
+void FDiscordNetStateReplicator::SendAcks()
+{
+	for (TPair<uint64, FPeerState>& It : Peers)
+	{
+		FPeerState& Peer = It.Value;
+		if (!Peer.LatestReceived.IsSet() || Peer.LatestAcked == Peer.LatestReceived)
+		{
+			continue;
+		}
+
+		Writer.Reset();
+		Writer.WriteBit(false);
+		WriteAck(Peer);
+
+		const discord::Result Result = Transport->SendMessage(It.Key, ChannelId, Writer.GetData(), static_cast<uint32>(Writer.GetNumBytes()));
+		if (Result != discord::Result::Ok)
+		{
+			UE_LOG(LogDiscord, Verbose, TEXT("Error(%i) Sending state ack to peer %llu on channel %u"), Result, It.Key, ChannelId);
+			continue;
+		}
+
+		++NumAcksSent;
+		NumBytesSent += Writer.GetNumBytes();
+	}
+}
+
+void FDiscordNetStateReplicator::WriteAck(FPeerState& Peer)
+{
+	Writer.WriteBit(Peer.LatestReceived.IsSet());
+	if (Peer.LatestReceived.IsSet())
+	{
+		uint16 AckSequence = Peer.LatestReceived.GetValue();
+		Writer << AckSequence;
+	}
+
+	Peer.LatestAcked = Peer.LatestReceived;
+}
+
+const uint8* FDiscordNetStateReplicator::GetRemoteState(uint64 PeerId) const
+{
+	const FPeerState* Peer = Peers.Find(PeerId);
+	if (Peer && Peer->LatestReceived.IsSet())
+	{
+		return Peer->Received.Find(Peer->LatestReceived.GetValue(), StateSize);
+	}
+	return nullptr;
+}
+
+void FDiscordNetStateReplicator::HandleMessage(uint64 PeerId, uint8 MessageChannelId, const uint8* Data, uint32 DataLength)
+{
+	if (MessageChannelId != ChannelId)
+	{
+		return;
+	}
+
+	FPeerState& Peer = FindOrAddPeer(PeerId);
+
+	Reader.SetData(const_cast<uint8*>(Data), static_cast<int64>(DataLength) * 8);
+
+	// Peers without a state of their own only send acks
+	const bool bHasState = Reader.ReadBit() != 0;
+	uint16 Sequence {0};
+	if (bHasState)
+	{
+		Reader << Sequence;
+	}
+
+	if (Reader.ReadBit())
+	{
+		uint16 AckSequence {0};
+		Reader << AckSequence;
+
+		if (!Reader.IsError() && (!Peer.AckedSequence.IsSet() || IsNewer(AckSequence, Peer.AckedSequence.GetValue())))
+		{
+			Peer.AckedSequence = AckSequence;
+		}
+	}
+
+	if (!bHasState)
+	{
+		UE_CLOG(Reader.IsError(), LogDiscord, Verbose, TEXT("Dropping malformed state ack from peer %llu"), PeerId);
+		return;
+	}
+
+	const bool bIsDelta = Reader.ReadBit() != 0;
+	uint16 BaselineSequence {0};
+	if (bIsDelta)
+	{
+		Reader << BaselineSequence;
+	}
+
+	if (Reader.IsError())
+	{
+		UE_LOG(LogDiscord, Verbose, TEXT("Dropping malformed state message from peer %llu"), PeerId);
+		return;
+	}
+
+	// Out of order; we already have something newer (and the ack above still counted)
+	if (Peer.LatestReceived.IsSet() && !IsNewer(Sequence, Peer.LatestReceived.GetValue()))
+	{
+		++NumStale;
+		return;
+	}
+
+	const uint8* Baseline = nullptr;
+	if (bIsDelta)
+	{
+		Baseline = Peer.Received.Find(BaselineSequence, StateSize);
+		if (!Baseline)
+		{
+			// Only possible if the sender is misbehaving, since it only uses baselines we acked
+			++NumMissingBaseline;
+			UE_LOG(LogDiscord, Verbose, TEXT("Dropping state delta from peer %llu against unknown baseline %u"), PeerId, BaselineSequence);
+			return;
+		}
+	}
+
+	// The new state's slot can't be the baseline's: the sender never uses a baseline a whole history old
+	uint8* State = Peer.Received.Store(Sequence, StateSize);
+	if (Baseline)
+	{
+		FMemory::Memcpy(State, Baseline, StateSize);
+		ReadDelta(State);
+	}
+	else
+	{
+		Reader.Serialize(State, StateSize);
+	}
+
+	if (Reader.IsError())
+	{
+		// Forget the half-written state, so it's never used as a baseline
+		Peer.Received.Sequences[Sequence % Peer.Received.Sequences.Num()] = INDEX_NONE;
+		UE_LOG(LogDiscord, Verbose, TEXT("Dropping truncated state message from peer %llu"), PeerId);
+		return;
+	}
+
+	Peer.LatestReceived = Sequence;
+	++NumReceived;
+
+	RemoteStateEvent.Broadcast(PeerId, State, StateSize);
+}
+
+FDiscordNetStateReplicator::FPeerState& FDiscordNetStateReplicator::FindOrAddPeer(uint64 PeerId)
+{
+	if (FPeerState* Peer = Peers.Find(PeerId))
+	{
+		return *Peer;
+	}
+
+	FPeerState& Peer = Peers.Add(PeerId);
+	Peer.Received.Init(HistorySize, StateSize);
+	return Peer;
+}
+
+void FDiscordNetStateReplicator::WriteDelta(const uint8* Baseline, const uint8* Current)
+{
+	using namespace DiscordNetStateReplicator;
+
+	for (int32 ChunkStart = 0; ChunkStart < StateSize; ChunkStart += ChunkBytes)
+	{
+		const int32 ChunkLength = FMath::Min(ChunkBytes, StateSize - ChunkStart);
+
+		uint8 Mask {0};
+		for (int32 Index = 0; Index < ChunkLength; ++Index)
+		{
+			if (Baseline[ChunkStart + Index] != Current[ChunkStart + Index])
+			{
+				Mask |= 1 << Index;
+			}
+		}
+
+		Writer.WriteBit(Mask != 0);
+		if (Mask != 0)
+		{
+			Writer.SerializeBits(&Mask, ChunkLength);
+
+			for (int32 Index = 0; Index < ChunkLength; ++Index)
+			{
+				if (Mask & (1 << Index))
+				{
+					uint8 Value = Current[ChunkStart + Index];
+					Writer.SerializeBits(&Value, 8);
+				}
+			}
+		}
+	}
+}
+
+bool FDiscordNetStateReplicator::ReadDelta(uint8* State)
+{
+	using namespace DiscordNetStateReplicator;
+
+	for (int32 ChunkStart = 0; ChunkStart < StateSize && !Reader.IsError(); ChunkStart += ChunkBytes)
+	{
+		if (!Reader.ReadBit())
+		{
+			continue;
+		}
+
+		const int32 ChunkLength = FMath::Min(ChunkBytes, StateSize - ChunkStart);
+
+		uint8 Mask {0};
+		Reader.SerializeBits(&Mask, ChunkLength);
+
+		for (int32 Index = 0; Index < ChunkLength; ++Index)
+		{
+			if (Mask & (1 << Index))
+			{
+				Reader.SerializeBits(State + ChunkStart + Index, 8);
+			}
+		}
+	}
+
+	return !Reader.IsError();
+}
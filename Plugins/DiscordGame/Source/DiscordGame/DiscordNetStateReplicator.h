@@ -0,0 +1,145 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordNetTransport.h"
+#include "Serialization/BitReader.h"
+#include "Serialization/BitWriter.h"
+
+/** Broadcast when a newer state arrives from a peer: (PeerId, Data, DataLength) */
+DECLARE_MULTICAST_DELEGATE_ThreeParams(FOnDiscordNetRemoteState, uint64 /*PeerId*/, const uint8* /*Data*/, int32 /*DataLength*/);
+
+/**
+ * Discord Network State Replicator
+ *
+ * Replicates a fixed-size state blob (e.g. a POD player state struct) from this
+ * process to every peer, and receives every peer's blob in return, sending only
+ * what changed since the last state each peer acknowledged.
+ *
+ * Every Tick(), the current local state is sent to every peer as a bit-packed delta
+ * against the newest state that peer has acknowledged.  Acks ride along in the
+ * messages going the other way, so there's no extra ack traffic; only a peer with no
+ * state of its own (a spectator, or before its first SetLocalState) sends small ack-only
+ * messages instead.  If a peer hasn't acknowledged anything recent enough (startup,
+ * heavy loss) it gets the full state.
+ *
+ * Designed for an unreliable channel on a lobby (FDiscordLobbyNetTransport), where
+ * peers are member UserIds, but works on any transport.  Every peer must use the
+ * same ChannelId, StateSize and HistorySize, and open the channel (unreliable) themselves.
+ *
+ * The state is compared byte by byte, so keep it free of padding garbage
+ * (e.g. FMemory::Memzero it before filling it in).
+ */
+class DISCORDGAME_API FDiscordNetStateReplicator
+{
+public:
+	/**
+	 * @param InTransport Transport to send and receive on
+	 * @param InChannelId Channel reserved for state messages
+	 * @param InStateSize Size of the state blob in bytes
+	 * @param InHistorySize Number of recent states kept as possible baselines (rounded up to a power of two)
+	 */
+	FDiscordNetStateReplicator(const TSharedRef<IDiscordNetTransport>& InTransport, uint8 InChannelId, int32 InStateSize, int32 InHistorySize = 32);
+	~FDiscordNetStateReplicator();
+
+	/** Start replicating to a peer; peers we receive from are added automatically */
+	void AddPeer(uint64 PeerId);
+
+	/** Stop replicating to a peer, and forget its state */
+	void RemovePeer(uint64 PeerId);
+
+	/** Set the state to send at the next Tick; Data must be StateSize bytes */
+	void SetLocalState(const void* Data);
+
+	/** Send the local state (or without one, acks of new states) to every peer; call once per network tick, before Flush */
+	void Tick();
+
+	/** @return The newest state received from a peer (StateSize bytes), or nullptr if none yet */
+	const uint8* GetRemoteState(uint64 PeerId) const;
+
+	/** Event broadcast when a newer state arrives from a peer */
+	FOnDiscordNetRemoteState& OnRemoteState() { return RemoteStateEvent; }
+
+	/** @return Size of the state blob in bytes */
+	int32 GetStateSize() const { return StateSize; }
+
+	/** Counters since the replicator was created */
+	uint64 NumFullSent {0};
+	uint64 NumDeltasSent {0};
+	uint64 NumAcksSent {0};
+	uint64 NumBytesSent {0};
+	uint64 NumReceived {0};
+	uint64 NumStale {0};
+	uint64 NumMissingBaseline {0};
+
+private:
+	/** A ring of recent states, indexed by sequence number */
+	struct FStateHistory
+	{
+		TArray<uint8> States;
+		TArray<int32> Sequences;
+
+		void Init(int32 HistorySize, int32 StateSize);
+		const uint8* Find(uint16 Sequence, int32 StateSize) const;
+		uint8* Store(uint16 Sequence, int32 StateSize);
+	};
+
+	struct FPeerState
+	{
+		/** Newest of our states this peer has acknowledged */
+		TOptional<uint16> AckedSequence;
+
+		/** States received from this peer */
+		FStateHistory Received;
+
+		/** Newest state received from this peer, which we ack back */
+		TOptional<uint16> LatestReceived;
+
+		/** Newest state we've acked back, so ack-only messages are only sent for new states */
+		TOptional<uint16> LatestAcked;
+	};
+
+	/** Called by the transport for every message */
+	void HandleMessage(uint64 PeerId, uint8 MessageChannelId, const uint8* Data, uint32 DataLength);
+
+	/** Without a local state, ack new states to the peers that sent them */
+	void SendAcks();
+
+	/** Write our ack of a peer's newest state, if we have one */
+	void WriteAck(FPeerState& Peer);
+
+	/** @return State for a peer, added if new */
+	FPeerState& FindOrAddPeer(uint64 PeerId);
+
+	/** Write the changes from Baseline to Current */
+	void WriteDelta(const uint8* Baseline, const uint8* Current);
+
+	/** Apply changes read from Reader to State, which starts as a copy of the baseline */
+	bool ReadDelta(uint8* State);
+
+	/** @return TRUE if sequence A is newer than B, allowing for wraparound */
+	static bool IsNewer(uint16 A, uint16 B) { return static_cast<int16>(A - B) > 0; }
+
+	TSharedRef<IDiscordNetTransport> Transport;
+	uint8 ChannelId {0};
+	int32 StateSize {0};
+	int32 HistorySize {0};
+
+	/** State to send at the next Tick */
+	TArray<uint8> LocalState;
+	bool bHasLocalState {false};
+
+	/** States we have sent */
+	FStateHistory Sent;
+	uint16 NextSequence {0};
+
+	TMap<uint64, FPeerState> Peers;
+
+	/** Reused for every message */
+	FBitWriter Writer;
+	FBitReader Reader;
+
+	FOnDiscordNetRemoteState RemoteStateEvent;
+	FDelegateHandle MessageHandle;
+};
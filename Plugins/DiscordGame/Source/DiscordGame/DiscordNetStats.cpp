@@ -0,0 +1,359 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetStats.h"
+#include "DiscordGame.h"
+#include "HAL/IConsoleManager.h"
+#include "Stats/Stats.h"
+
+DECLARE_STATS_GROUP(TEXT("DiscordNet"), STATGROUP_DiscordNet, STATCAT_Advanced);
+
+DECLARE_DWORD_COUNTER_STAT(TEXT("Messages Sent"), STAT_DiscordNetMessagesSent, STATGROUP_DiscordNet);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Bytes Sent"), STAT_DiscordNetBytesSent, STATGROUP_DiscordNet);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Messages Received"), STAT_DiscordNetMessagesReceived, STATGROUP_DiscordNet);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Bytes Received"), STAT_DiscordNetBytesReceived, STATGROUP_DiscordNet);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Send Errors"), STAT_DiscordNetSendErrors, STATGROUP_DiscordNet);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Flushes"), STAT_DiscordNetFlushes, STATGROUP_DiscordNet);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Pings"), STAT_DiscordNetPings, STATGROUP_DiscordNet);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Max Send To Flush (ms)"), STAT_DiscordNetMaxSendToFlushMs, STATGROUP_DiscordNet);
+
+namespace DiscordNetStats
+{
+	/** Every FDiscordNetStats currently alive */
+	static TArray<FDiscordNetStats*>& GetRegistry()
+	{
+		static TArray<FDiscordNetStats*> Registry;
+		return Registry;
+	}
+
+	/** Size of a ping or pong: type byte + the ping sender's timestamp */
+	static constexpr uint32 PingMessageSize = 1 + sizeof(double);
+
+	/** Weight of each new RTT sample in the smoothed RTT, as in TCP (RFC 6298) */
+	static constexpr double RttSmoothing = 0.125;
+
+	static FAutoConsoleCommand CmdStats(
+		TEXT("Discord.Net.Stats"),
+		TEXT("Log per-peer, per-channel statistics for every Discord network transport with stats.\n")
+		TEXT("Usage: Discord.Net.Stats [Reset]"),
+		FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+		{
+			if (Args.Num() > 0 && Args[0] == TEXT("Reset"))
+			{
+				UDiscordNetStatsLibrary::ResetDiscordNetStats();
+				UE_LOG(LogDiscord, Display, TEXT("Reset %i Discord net stats"), GetRegistry().Num());
+				return;
+			}
+
+			if (GetRegistry().Num() == 0)
+			{
+				UE_LOG(LogDiscord, Display, TEXT("No Discord net stats are being collected"));
+				return;
+			}
+
+			for (const FDiscordNetStatsSnapshot& Snapshot : UDiscordNetStatsLibrary::GetDiscordNetStats())
+			{
+				UE_LOG(LogDiscord, Display, TEXT("%s: Flushes=%lld AvgFlushBytes=%.1f MaxFlushBytes=%lld Peers=%i"),
+					*Snapshot.Name, Snapshot.NumFlushes, Snapshot.AvgFlushBytes, Snapshot.MaxFlushBytes, Snapshot.Peers.Num());
+
+				for (const FDiscordNetPeerStats& Peer : Snapshot.Peers)
+				{
+					UE_LOG(LogDiscord, Display, TEXT("  Peer %llu: Rtt=%.1fms MinRtt=%.1fms"),
+						static_cast<uint64>(Peer.PeerId), Peer.RttMs, Peer.MinRttMs);
+
+					for (const FDiscordNetChannelStats& Channel : Peer.Channels)
+					{
+						UE_LOG(LogDiscord, Display, TEXT("    Channel %i: Sent=%lld (%lld bytes) Received=%lld (%lld bytes) Errors=%lld SendToFlush=%.2fms avg %.2fms max"),
+							Channel.ChannelId,
+							Channel.MessagesSent, Channel.BytesSent,
+							Channel.MessagesReceived, Channel.BytesReceived,
+							Channel.SendErrors,
+							Channel.AvgSendToFlushMs, Channel.MaxSendToFlushMs);
+					}
+				}
+			}
+		}));
+}
+
+//////////////////////////////////////////////////////////////////////
+// FDiscordNetStats
+
+FDiscordNetStats::FDiscordNetStats(const TSharedRef<IDiscordNetTransport>& InInner, const FString& InName)
+	: FDiscordNetTransportDecorator(InInner)
+	, Name(InName)
+{
+	DiscordNetStats::GetRegistry().Add(this);
+}
+
+FDiscordNetStats::~FDiscordNetStats()
+{
+	DiscordNetStats::GetRegistry().RemoveSingleSwap(this);
+}
+
+const TArray<FDiscordNetStats*>& FDiscordNetStats::GetAllStats()
+{
+	return DiscordNetStats::GetRegistry();
+}
+
+void FDiscordNetStats::EnablePing(uint8 InPingChannelId, float InPingIntervalSeconds)
+{
+	bPingEnabled = true;
+	PingChannelId = InPingChannelId;
+	PingIntervalSeconds = FMath::Max(InPingIntervalSeconds, 0.01f);
+}
+
+FDiscordNetStatsSnapshot FDiscordNetStats::GetSnapshot() const
+{
+	FDiscordNetStatsSnapshot Snapshot;
+	Snapshot.Name = Name;
+	Snapshot.NumFlushes = NumFlushes;
+	Snapshot.AvgFlushBytes = NumFlushes > 0 ? static_cast<float>(static_cast<double>(TotalFlushBytes) / NumFlushes) : 0.f;
+	Snapshot.MaxFlushBytes = MaxFlushBytes;
+
+	Snapshot.Peers.Reserve(Peers.Num());
+	for (const TPair<uint64, FPeerCounters>& PeerIt : Peers)
+	{
+		FDiscordNetPeerStats& Peer = Snapshot.Peers.AddDefaulted_GetRef();
+		Peer.PeerId = static_cast<int64>(PeerIt.Key);
+		Peer.RttMs = PeerIt.Value.SmoothedRtt >= 0. ? PeerIt.Value.SmoothedRtt * 1000. : -1.f;
+		Peer.MinRttMs = PeerIt.Value.MinRtt >= 0. ? PeerIt.Value.MinRtt * 1000. : -1.f;
+
+		Peer.Channels.Reserve(PeerIt.Value.Channels.Num());
+		for (const TPair<uint8, FChannelCounters>& ChannelIt : PeerIt.Value.Channels)
+		{
+			const FChannelCounters& Counters = ChannelIt.Value;
+
+			FDiscordNetChannelStats& Channel = Peer.Channels.AddDefaulted_GetRef();
+			Channel.ChannelId = ChannelIt.Key;
+			Channel.MessagesSent = Counters.MessagesSent;
+			Channel.BytesSent = Counters.BytesSent;
+			Channel.MessagesReceived = Counters.MessagesReceived;
+			Channel.BytesReceived = Counters.BytesReceived;
+			Channel.SendErrors = Counters.SendErrors;
+			Channel.AvgSendToFlushMs = Counters.FlushedMessages > 0 ? Counters.TotalSendToFlush * 1000. / Counters.FlushedMessages : 0.f;
+			Channel.MaxSendToFlushMs = Counters.MaxSendToFlush * 1000.;
+		}
+
+		Peer.Channels.Sort([](const FDiscordNetChannelStats& A, const FDiscordNetChannelStats& B) { return A.ChannelId < B.ChannelId; });
+	}
+
+	return Snapshot;
+}
+
+double FDiscordNetStats::GetRttSeconds(uint64 PeerId) const
+{
+	const FPeerCounters* Peer = Peers.Find(PeerId);
+	return Peer ? Peer->SmoothedRtt : -1.;
+}
+
+void FDiscordNetStats::Reset()
+{
+	for (TPair<uint64, FPeerCounters>& PeerIt : Peers)
+	{
+		for (TPair<uint8, FChannelCounters>& ChannelIt : PeerIt.Value.Channels)
+		{
+			// Keep anything still waiting for Flush, so its latency is measured correctly
+			const FChannelCounters Old = ChannelIt.Value;
+			ChannelIt.Value = FChannelCounters();
+			ChannelIt.Value.PendingMessages = Old.PendingMessages;
+			ChannelIt.Value.PendingSendTimeSum = Old.PendingSendTimeSum;
+			ChannelIt.Value.PendingOldestSendTime = Old.PendingOldestSendTime;
+		}
+
+		PeerIt.Value.MinRtt = PeerIt.Value.SmoothedRtt;
+	}
+
+	NumFlushes = 0;
+	TotalFlushBytes = 0;
+	MaxFlushBytes = 0;
+}
+
+discord::Result FDiscordNetStats::ClosePeer(uint64 PeerId)
+{
+	Peers.Remove(PeerId);
+
+	return Super::ClosePeer(PeerId);
+}
+
+discord::Result FDiscordNetStats::SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	const discord::Result Result = Super::SendMessage(PeerId, ChannelId, Data, DataLength);
+
+	FChannelCounters& Counters = Peers.FindOrAdd(PeerId).Channels.FindOrAdd(ChannelId);
+
+	if (Result != discord::Result::Ok)
+	{
+		++Counters.SendErrors;
+		INC_DWORD_STAT(STAT_DiscordNetSendErrors);
+		return Result;
+	}
+
+	const double Now = FPlatformTime::Seconds();
+
+	++Counters.MessagesSent;
+	Counters.BytesSent += DataLength;
+
+	if (Counters.PendingMessages++ == 0)
+	{
+		Counters.PendingOldestSendTime = Now;
+	}
+	Counters.PendingSendTimeSum += Now;
+
+	PendingFlushBytes += DataLength;
+
+	INC_DWORD_STAT(STAT_DiscordNetMessagesSent);
+	INC_DWORD_STAT_BY(STAT_DiscordNetBytesSent, DataLength);
+
+	return Result;
+}
+
+discord::Result FDiscordNetStats::Flush()
+{
+	const double Now = FPlatformTime::Seconds();
+
+	if (bPingEnabled)
+	{
+		SendPings(Now);
+	}
+
+	const discord::Result Result = Super::Flush();
+
+	// Everything sent since the last Flush has now left
+	double MaxSendToFlush {0.};
+	for (TPair<uint64, FPeerCounters>& PeerIt : Peers)
+	{
+		for (TPair<uint8, FChannelCounters>& ChannelIt : PeerIt.Value.Channels)
+		{
+			FChannelCounters& Counters = ChannelIt.Value;
+			if (Counters.PendingMessages > 0)
+			{
+				Counters.FlushedMessages += Counters.PendingMessages;
+				Counters.TotalSendToFlush += Counters.PendingMessages * Now - Counters.PendingSendTimeSum;
+				Counters.MaxSendToFlush = FMath::Max(Counters.MaxSendToFlush, Now - Counters.PendingOldestSendTime);
+				MaxSendToFlush = FMath::Max(MaxSendToFlush, Now - Counters.PendingOldestSendTime);
+
+				Counters.PendingMessages = 0;
+				Counters.PendingSendTimeSum = 0.;
+			}
+		}
+	}
+
+	++NumFlushes;
+	TotalFlushBytes += PendingFlushBytes;
+	MaxFlushBytes = FMath::Max(MaxFlushBytes, PendingFlushBytes);
+	PendingFlushBytes = 0;
+
+	INC_DWORD_STAT(STAT_DiscordNetFlushes);
+	SET_FLOAT_STAT(STAT_DiscordNetMaxSendToFlushMs, static_cast<float>(MaxSendToFlush * 1000.));
+
+	return Result;
+}
+
+void FDiscordNetStats::HandleInnerMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	FChannelCounters& Counters = Peers.FindOrAdd(PeerId).Channels.FindOrAdd(ChannelId);
+	++Counters.MessagesReceived;
+	Counters.BytesReceived += DataLength;
+
+	INC_DWORD_STAT(STAT_DiscordNetMessagesReceived);
+	INC_DWORD_STAT_BY(STAT_DiscordNetBytesReceived, DataLength);
+
+	// Only while pings are enabled is the channel ours; the other end must have enabled them on it too
+	if (bPingEnabled && ChannelId == PingChannelId)
+	{
+		HandlePingMessage(PeerId, Data, DataLength);
+		return;
+	}
+
+	Super::HandleInnerMessage(PeerId, ChannelId, Data, DataLength);
+}
+
+void FDiscordNetStats::SendPings(double Now)
+{
+	uint8 Message[DiscordNetStats::PingMessageSize];
+	Message[0] = static_cast<uint8>(EPingType::Ping);
+	FMemory::Memcpy(Message + 1, &Now, sizeof(double));
+
+	// Only ping peers we've actually exchanged something with; SendMessage may add to Peers, so collect first
+	TArray<uint64, TInlineAllocator<32>> PeersToPing;
+	for (TPair<uint64, FPeerCounters>& PeerIt : Peers)
+	{
+		if (Now - PeerIt.Value.LastPingTime >= PingIntervalSeconds)
+		{
+			PeerIt.Value.LastPingTime = Now;
+			PeersToPing.Add(PeerIt.Key);
+		}
+	}
+
+	for (const uint64 PeerId : PeersToPing)
+	{
+		SendMessage(PeerId, PingChannelId, Message, sizeof(Message));
+		INC_DWORD_STAT(STAT_DiscordNetPings);
+	}
+}
+
+void FDiscordNetStats::HandlePingMessage(uint64 PeerId, const uint8* Data, uint32 DataLength)
+{
+	if (DataLength != DiscordNetStats::PingMessageSize)
+	{
+		UE_LOG(LogDiscord, Verbose, TEXT("Ignoring malformed ping (%u bytes) from peer %llu"), DataLength, PeerId);
+		return;
+	}
+
+	switch (static_cast<EPingType>(Data[0]))
+	{
+	case EPingType::Ping:
+		{
+			// Echo it straight back; the timestamp is the sender's clock, so we never need to interpret it
+			uint8 Reply[DiscordNetStats::PingMessageSize];
+			FMemory::Memcpy(Reply, Data, DataLength);
+			Reply[0] = static_cast<uint8>(EPingType::Pong);
+			SendMessage(PeerId, PingChannelId, Reply, sizeof(Reply));
+		}
+		break;
+
+	case EPingType::Pong:
+		{
+			double SentTime;
+			FMemory::Memcpy(&SentTime, Data + 1, sizeof(double));
+
+			const double Rtt = FPlatformTime::Seconds() - SentTime;
+			if (Rtt < 0.)
+			{
+				break;
+			}
+
+			FPeerCounters& Peer = Peers.FindOrAdd(PeerId);
+			Peer.SmoothedRtt = Peer.SmoothedRtt < 0. ? Rtt : FMath::Lerp(Peer.SmoothedRtt, Rtt, DiscordNetStats::RttSmoothing);
+			Peer.MinRtt = Peer.MinRtt < 0. ? Rtt : FMath::Min(Peer.MinRtt, Rtt);
+		}
+		break;
+
+	default:
+		UE_LOG(LogDiscord, Verbose, TEXT("Ignoring unknown ping type %u from peer %llu"), Data[0], PeerId);
+		break;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// UDiscordNetStatsLibrary
+
+TArray<FDiscordNetStatsSnapshot> UDiscordNetStatsLibrary::GetDiscordNetStats()
+{
+	TArray<FDiscordNetStatsSnapshot> Snapshots;
+	Snapshots.Reserve(FDiscordNetStats::GetAllStats().Num());
+
+	for (const FDiscordNetStats* Stats : FDiscordNetStats::GetAllStats())
+	{
+		Snapshots.Add(Stats->GetSnapshot());
+	}
+
+	return Snapshots;
+}
+
+void UDiscordNetStatsLibrary::ResetDiscordNetStats()
+{
+	for (FDiscordNetStats* Stats : FDiscordNetStats::GetAllStats())
+	{
+		Stats->Reset();
+	}
+}
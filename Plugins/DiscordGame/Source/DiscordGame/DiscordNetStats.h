@@ -0,0 +1,241 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordNetTransport.h"
+#include "Kismet/BlueprintFunctionLibrary.h"
+#include "DiscordNetStats.generated.h"
+
+/**
+ * Traffic counters for one channel to/from one peer
+ */
+USTRUCT(BlueprintType)
+struct DISCORDGAME_API FDiscordNetChannelStats
+{
+	GENERATED_BODY()
+
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	int32 ChannelId {0};
+
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	int64 MessagesSent {0};
+
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	int64 BytesSent {0};
+
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	int64 MessagesReceived {0};
+
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	int64 BytesReceived {0};
+
+	/** Number of sends that the transport refused */
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	int64 SendErrors {0};
+
+	/** Average time between SendMessage and the Flush that sent it, in milliseconds */
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	float AvgSendToFlushMs {0.f};
+
+	/** Longest time between SendMessage and the Flush that sent it, in milliseconds */
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	float MaxSendToFlushMs {0.f};
+};
+
+/**
+ * Traffic counters for one peer
+ */
+USTRUCT(BlueprintType)
+struct DISCORDGAME_API FDiscordNetPeerStats
+{
+	GENERATED_BODY()
+
+	/** Discord peer id (or lobby member UserId) */
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	int64 PeerId {0};
+
+	/** Smoothed round trip time in milliseconds, or negative if unknown (pings are disabled) */
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	float RttMs {-1.f};
+
+	/** Lowest round trip time seen, in milliseconds, or negative if unknown */
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	float MinRttMs {-1.f};
+
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	TArray<FDiscordNetChannelStats> Channels;
+};
+
+/**
+ * Traffic counters for everything through one FDiscordNetStats
+ */
+USTRUCT(BlueprintType)
+struct DISCORDGAME_API FDiscordNetStatsSnapshot
+{
+	GENERATED_BODY()
+
+	/** Name given to the FDiscordNetStats when it was created */
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	FString Name;
+
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	int64 NumFlushes {0};
+
+	/** Average bytes sent per Flush */
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	float AvgFlushBytes {0.f};
+
+	/** Most bytes sent in a single Flush */
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	int64 MaxFlushBytes {0};
+
+	UPROPERTY(BlueprintReadOnly, Category="Discord|Net")
+	TArray<FDiscordNetPeerStats> Peers;
+};
+
+/**
+ * Discord Network Statistics
+ *
+ * Transport decorator that counts everything passing through it, per peer and
+ * per channel: messages and bytes in each direction, send errors, the delay
+ * between SendMessage and Flush, and the size of each Flush.
+ *
+ * If you enable pings, it also estimates the round trip time to each peer by
+ * exchanging small timestamped messages on a dedicated unreliable channel, which
+ * you must open to each peer yourself.  Both ends must enable pings on the same
+ * channel: only an FDiscordNetStats with pings enabled answers them, and it doesn't
+ * pass ping traffic on to OnMessage.  Without pings enabled, that channel is just
+ * another channel, and pings arriving on it are passed on unanswered.
+ *
+ * Every FDiscordNetStats in the process can be inspected with:
+ *
+ *   - `stat DiscordNet` (per-frame totals)
+ *   - The `Discord.Net.Stats` console command (full per-peer, per-channel dump)
+ *   - UDiscordNetStatsLibrary::GetDiscordNetStats in Blueprint
+ *
+ * Put this directly above the transport you want to measure; for example below
+ * an FDiscordNetSendScheduler, so it sees messages as they actually leave.
+ */
+class DISCORDGAME_API FDiscordNetStats : public FDiscordNetTransportDecorator
+{
+	using Super = FDiscordNetTransportDecorator;
+
+public:
+	/**
+	 * @param InInner Transport to measure
+	 * @param InName Name to identify these stats in console output and snapshots
+	 */
+	FDiscordNetStats(const TSharedRef<IDiscordNetTransport>& InInner, const FString& InName);
+	virtual ~FDiscordNetStats() override;
+
+	/**
+	 * Start measuring round trip times.
+	 *
+	 * @param InPingChannelId Channel to ping on; open it (unreliable) to each peer yourself, and enable pings on it at each peer
+	 * @param InPingIntervalSeconds How often to ping each peer that has any traffic
+	 */
+	void EnablePing(uint8 InPingChannelId, float InPingIntervalSeconds = 1.f);
+
+	/** Stop measuring round trip times */
+	void DisablePing() { bPingEnabled = false; }
+
+	/** @return Snapshot of all counters */
+	FDiscordNetStatsSnapshot GetSnapshot() const;
+
+	/** @return Smoothed round trip time to this peer in seconds, or negative if unknown */
+	double GetRttSeconds(uint64 PeerId) const;
+
+	/** Reset all counters to zero */
+	void Reset();
+
+	/** @return Every FDiscordNetStats currently alive */
+	static const TArray<FDiscordNetStats*>& GetAllStats();
+
+	//~IDiscordNetTransport interface
+	virtual discord::Result ClosePeer(uint64 PeerId) override;
+	virtual discord::Result SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) override;
+	virtual discord::Result Flush() override;
+	//~End of IDiscordNetTransport interface
+
+protected:
+	//~FDiscordNetTransportDecorator interface
+	virtual void HandleInnerMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) override;
+	//~End of FDiscordNetTransportDecorator interface
+
+private:
+	struct FChannelCounters
+	{
+		uint64 MessagesSent {0};
+		uint64 BytesSent {0};
+		uint64 MessagesReceived {0};
+		uint64 BytesReceived {0};
+		uint64 SendErrors {0};
+
+		/** Messages flushed, and their total/max send-to-flush delay */
+		uint64 FlushedMessages {0};
+		double TotalSendToFlush {0.};
+		double MaxSendToFlush {0.};
+
+		/** Messages sent since the last Flush, and the sum of their send times */
+		uint32 PendingMessages {0};
+		double PendingSendTimeSum {0.};
+		double PendingOldestSendTime {0.};
+	};
+
+	struct FPeerCounters
+	{
+		TMap<uint8, FChannelCounters> Channels;
+
+		double SmoothedRtt {-1.};
+		double MinRtt {-1.};
+		double LastPingTime {0.};
+	};
+
+	/** Ping message types */
+	enum class EPingType : uint8
+	{
+		Ping = 1,
+		Pong = 2,
+	};
+
+	/** Send pings to every peer that is due one */
+	void SendPings(double Now);
+
+	/** Handle a ping or pong from a peer */
+	void HandlePingMessage(uint64 PeerId, const uint8* Data, uint32 DataLength);
+
+	/** Name to identify these stats */
+	FString Name;
+
+	TMap<uint64, FPeerCounters> Peers;
+
+	uint64 NumFlushes {0};
+	uint64 TotalFlushBytes {0};
+	uint64 MaxFlushBytes {0};
+
+	/** Bytes sent since the last Flush */
+	uint64 PendingFlushBytes {0};
+
+	bool bPingEnabled {false};
+	uint8 PingChannelId {0};
+	float PingIntervalSeconds {1.f};
+};
+
+/**
+ * Blueprint access to Discord network statistics
+ */
+UCLASS()
+class DISCORDGAME_API UDiscordNetStatsLibrary : public UBlueprintFunctionLibrary
+{
+	GENERATED_BODY()
+
+public:
+	/** @return Snapshots of every FDiscordNetStats currently alive */
+	UFUNCTION(BlueprintPure, Category="Discord|Net")
+	static TArray<FDiscordNetStatsSnapshot> GetDiscordNetStats();
+
+	/** Reset every FDiscordNetStats currently alive */
+	UFUNCTION(BlueprintCallable, Category="Discord|Net")
+	static void ResetDiscordNetStats();
+};
@@ -0,0 +1,214 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordNetTransport.h"
+#include "DiscordGame.h"
+
+//////////////////////////////////////////////////////////////////////
+// FDiscordNetTransportDecorator
+
+FDiscordNetTransportDecorator::FDiscordNetTransportDecorator(const TSharedRef<IDiscordNetTransport>& InInner)
+	: Inner(InInner)
+{
+	InnerMessageHandle = Inner->OnMessage().AddRaw(this, &FDiscordNetTransportDecorator::HandleInnerMessage);
+	InnerRouteUpdateHandle = Inner->OnRouteUpdate().AddRaw(this, &FDiscordNetTransportDecorator::HandleInnerRouteUpdate);
+}
+
+FDiscordNetTransportDecorator::~FDiscordNetTransportDecorator()
+{
+	Inner->OnMessage().Remove(InnerMessageHandle);
+	Inner->OnRouteUpdate().Remove(InnerRouteUpdateHandle);
+}
+
+uint64 FDiscordNetTransportDecorator::GetLocalPeerId() const
+{
+	return Inner->GetLocalPeerId();
+}
+
+discord::Result FDiscordNetTransportDecorator::OpenPeer(uint64 PeerId, const FString& RouteData)
+{
+	return Inner->OpenPeer(PeerId, RouteData);
+}
+
+discord::Result FDiscordNetTransportDecorator::UpdatePeer(uint64 PeerId, const FString& RouteData)
+{
+	return Inner->UpdatePeer(PeerId, RouteData);
+}
+
+discord::Result FDiscordNetTransportDecorator::ClosePeer(uint64 PeerId)
+{
+	return Inner->ClosePeer(PeerId);
+}
+
+discord::Result FDiscordNetTransportDecorator::OpenChannel(uint64 PeerId, uint8 ChannelId, bool bReliable)
+{
+	return Inner->OpenChannel(PeerId, ChannelId, bReliable);
+}
+
+discord::Result FDiscordNetTransportDecorator::CloseChannel(uint64 PeerId, uint8 ChannelId)
+{
+	return Inner->CloseChannel(PeerId, ChannelId);
+}
+
+discord::Result FDiscordNetTransportDecorator::SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	return Inner->SendMessage(PeerId, ChannelId, Data, DataLength);
+}
+
+discord::Result FDiscordNetTransportDecorator::Flush()
+{
+	return Inner->Flush();
+}
+
+void FDiscordNetTransportDecorator::HandleInnerMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	MessageEvent.Broadcast(PeerId, ChannelId, Data, DataLength);
+}
+
+void FDiscordNetTransportDecorator::HandleInnerRouteUpdate(const FString& RouteData)
+{
+	RouteUpdateEvent.Broadcast(RouteData);
+}
+
+//////////////////////////////////////////////////////////////////////
+// FDiscordPeerNetTransport
+
+FDiscordPeerNetTransport::FDiscordPeerNetTransport(discord::Core& InCore)
+	: NetworkManager(InCore.NetworkManager())
+{
+	MessageToken = NetworkManager.OnMessage.Connect([this](discord::NetworkPeerId PeerId, discord::NetworkChannelId ChannelId, std::uint8_t* Data, std::uint32_t DataLength)
+	{
+		MessageEvent.Broadcast(PeerId, ChannelId, Data, DataLength);
+	});
+
+	RouteUpdateToken = NetworkManager.OnRouteUpdate.Connect([this](const char* RawRouteData)
+	{
+		const FString RouteData (UTF8_TO_TCHAR(RawRouteData));
+		RouteUpdateEvent.Broadcast(RouteData);
+	});
+}
+
+FDiscordPeerNetTransport::~FDiscordPeerNetTransport()
+{
+	NetworkManager.OnMessage.Disconnect(MessageToken);
+	NetworkManager.OnRouteUpdate.Disconnect(RouteUpdateToken);
+}
+
+uint64 FDiscordPeerNetTransport::GetLocalPeerId() const
+{
+	discord::NetworkPeerId PeerId {0};
+	NetworkManager.GetPeerId(&PeerId);
+	return PeerId;
+}
+
+discord::Result FDiscordPeerNetTransport::OpenPeer(uint64 PeerId, const FString& RouteData)
+{
+	return NetworkManager.OpenPeer(PeerId, TCHAR_TO_UTF8(*RouteData));
+}
+
+discord::Result FDiscordPeerNetTransport::UpdatePeer(uint64 PeerId, const FString& RouteData)
+{
+	return NetworkManager.UpdatePeer(PeerId, TCHAR_TO_UTF8(*RouteData));
+}
+
+discord::Result FDiscordPeerNetTransport::ClosePeer(uint64 PeerId)
+{
+	return NetworkManager.ClosePeer(PeerId);
+}
+
+discord::Result FDiscordPeerNetTransport::OpenChannel(uint64 PeerId, uint8 ChannelId, bool bReliable)
+{
+	return NetworkManager.OpenChannel(PeerId, ChannelId, bReliable);
+}
+
+discord::Result FDiscordPeerNetTransport::CloseChannel(uint64 PeerId, uint8 ChannelId)
+{
+	return NetworkManager.CloseChannel(PeerId, ChannelId);
+}
+
+discord::Result FDiscordPeerNetTransport::SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	// The SDK takes a mutable pointer, but it does not modify the data
+	return NetworkManager.SendMessage(PeerId, ChannelId, const_cast<uint8*>(Data), DataLength);
+}
+
+discord::Result FDiscordPeerNetTransport::Flush()
+{
+	return NetworkManager.Flush();
+}
+
+//////////////////////////////////////////////////////////////////////
+// FDiscordLobbyNetTransport
+
+FDiscordLobbyNetTransport::FDiscordLobbyNetTransport(discord::Core& InCore, discord::LobbyId InLobbyId)
+	: Core(InCore)
+	, LobbyId(InLobbyId)
+{
+	MessageToken = Core.LobbyManager().OnNetworkMessage.Connect([this](std::int64_t MessageLobbyId, std::int64_t UserId, std::uint8_t ChannelId, std::uint8_t* Data, std::uint32_t DataLength)
+	{
+		// The LobbyManager broadcasts messages for every lobby we're in; we only want ours
+		if (MessageLobbyId == LobbyId)
+		{
+			MessageEvent.Broadcast(static_cast<uint64>(UserId), ChannelId, Data, DataLength);
+		}
+	});
+}
+
+FDiscordLobbyNetTransport::~FDiscordLobbyNetTransport()
+{
+	Core.LobbyManager().OnNetworkMessage.Disconnect(MessageToken);
+}
+
+uint64 FDiscordLobbyNetTransport::GetLocalPeerId() const
+{
+	discord::User CurrentUser {};
+	if (Core.UserManager().GetCurrentUser(&CurrentUser) == discord::Result::Ok)
+	{
+		return static_cast<uint64>(CurrentUser.GetId());
+	}
+
+	// The current user isn't known until UserManager::OnCurrentUserUpdate has fired
+	UE_LOG(LogDiscord, Verbose, TEXT("Lobby(%lld) local peer id requested before current user is known"), LobbyId);
+	return 0;
+}
+
+discord::Result FDiscordLobbyNetTransport::OpenPeer(uint64 PeerId, const FString& RouteData)
+{
+	// The lobby connects its own members
+	return discord::Result::Ok;
+}
+
+discord::Result FDiscordLobbyNetTransport::UpdatePeer(uint64 PeerId, const FString& RouteData)
+{
+	// The lobby manages its own member routes
+	return discord::Result::Ok;
+}
+
+discord::Result FDiscordLobbyNetTransport::ClosePeer(uint64 PeerId)
+{
+	// The lobby disconnects its own members
+	return discord::Result::Ok;
+}
+
+discord::Result FDiscordLobbyNetTransport::OpenChannel(uint64 PeerId, uint8 ChannelId, bool bReliable)
+{
+	// Lobby channels are opened for every member at once, so PeerId is irrelevant here.
+	// Opening the same channel again for another member is harmless.
+	return Core.LobbyManager().OpenNetworkChannel(LobbyId, ChannelId, bReliable);
+}
+
+discord::Result FDiscordLobbyNetTransport::CloseChannel(uint64 PeerId, uint8 ChannelId)
+{
+	// The SDK has no way to close an individual lobby channel
+	return discord::Result::Ok;
+}
+
+discord::Result FDiscordLobbyNetTransport::SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength)
+{
+	// The SDK takes a mutable pointer, but it does not modify the data
+	return Core.LobbyManager().SendNetworkMessage(LobbyId, static_cast<discord::UserId>(PeerId), ChannelId, const_cast<uint8*>(Data), DataLength);
+}
+
+discord::Result FDiscordLobbyNetTransport::Flush()
+{
+	return Core.LobbyManager().FlushNetwork();
+}
@@ -0,0 +1,203 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "discord-cpp/discord.h"
+
+/** Broadcast for every message received from a peer: (PeerId, ChannelId, Data, DataLength) */
+DECLARE_MULTICAST_DELEGATE_FourParams(FOnDiscordNetMessage, uint64 /*PeerId*/, uint8 /*ChannelId*/, const uint8* /*Data*/, uint32 /*DataLength*/);
+
+/** Broadcast any time the local route data changes: (RouteData) */
+DECLARE_MULTICAST_DELEGATE_OneParam(FOnDiscordNetRouteUpdate, const FString& /*RouteData*/);
+
+/**
+ * Discord Network Transport
+ *
+ * Common interface over the two ways the Discord GameSDK lets us send messages
+ * between players:
+ *
+ *   - discord::NetworkManager (explicit peers, addressed by NetworkPeerId)
+ *   - discord::LobbyManager network functions (lobby members, addressed by UserId)
+ *
+ * Everything that sits between gameplay code and the SDK (scheduling, stats, etc)
+ * is written against this interface, so it works the same no matter which of the
+ * SDK send paths is actually underneath it.
+ *
+ * Peers are always identified by a uint64.  For the NetworkManager this is the
+ * NetworkPeerId, for a lobby this is the member's UserId.
+ *
+ * As with the underlying SDK, you are expected to call Flush() once per frame,
+ * after you have queued all of that frame's messages.
+ */
+class DISCORDGAME_API IDiscordNetTransport
+{
+public:
+	virtual ~IDiscordNetTransport() = default;
+
+	/** @return The id other peers use to address this process */
+	virtual uint64 GetLocalPeerId() const = 0;
+
+	/** Open a connection to a remote peer */
+	virtual discord::Result OpenPeer(uint64 PeerId, const FString& RouteData) = 0;
+
+	/** Update the route data for a connected peer */
+	virtual discord::Result UpdatePeer(uint64 PeerId, const FString& RouteData) = 0;
+
+	/** Close the connection to a remote peer */
+	virtual discord::Result ClosePeer(uint64 PeerId) = 0;
+
+	/** Open a message channel to a connected peer */
+	virtual discord::Result OpenChannel(uint64 PeerId, uint8 ChannelId, bool bReliable) = 0;
+
+	/** Close a message channel to a connected peer */
+	virtual discord::Result CloseChannel(uint64 PeerId, uint8 ChannelId) = 0;
+
+	/**
+	 * Send a message to a connected peer over an opened message channel.
+	 *
+	 * The data is copied (or sent) before this returns; the caller keeps ownership.
+	 */
+	virtual discord::Result SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) = 0;
+
+	/** Send pending network messages */
+	virtual discord::Result Flush() = 0;
+
+	/** Event broadcast for every message received on this transport */
+	FOnDiscordNetMessage& OnMessage() { return MessageEvent; }
+
+	/** Event broadcast when the local route data changes */
+	FOnDiscordNetRouteUpdate& OnRouteUpdate() { return RouteUpdateEvent; }
+
+protected:
+	/** Event broadcast for every message received on this transport */
+	FOnDiscordNetMessage MessageEvent;
+
+	/** Event broadcast when the local route data changes */
+	FOnDiscordNetRouteUpdate RouteUpdateEvent;
+};
+
+/**
+ * Discord Network Transport Decorator
+ *
+ * Base class for transports that wrap another transport to add some behavior.
+ * By default every call is forwarded to the Inner transport, and every message
+ * or route update received from the Inner transport is re-broadcast as our own.
+ *
+ * Derived classes override only the parts they care about.
+ */
+class DISCORDGAME_API FDiscordNetTransportDecorator : public IDiscordNetTransport
+{
+public:
+	explicit FDiscordNetTransportDecorator(const TSharedRef<IDiscordNetTransport>& InInner);
+	virtual ~FDiscordNetTransportDecorator() override;
+
+	//~IDiscordNetTransport interface
+	virtual uint64 GetLocalPeerId() const override;
+	virtual discord::Result OpenPeer(uint64 PeerId, const FString& RouteData) override;
+	virtual discord::Result UpdatePeer(uint64 PeerId, const FString& RouteData) override;
+	virtual discord::Result ClosePeer(uint64 PeerId) override;
+	virtual discord::Result OpenChannel(uint64 PeerId, uint8 ChannelId, bool bReliable) override;
+	virtual discord::Result CloseChannel(uint64 PeerId, uint8 ChannelId) override;
+	virtual discord::Result SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) override;
+	virtual discord::Result Flush() override;
+	//~End of IDiscordNetTransport interface
+
+	/** @return The transport we are wrapping */
+	IDiscordNetTransport& GetInner() const { return *Inner; }
+
+protected:
+	/**
+	 * Called for every message received from the Inner transport.
+	 *
+	 * The default implementation re-broadcasts it unmodified.
+	 */
+	virtual void HandleInnerMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength);
+
+	/**
+	 * Called for every route update received from the Inner transport.
+	 *
+	 * The default implementation re-broadcasts it unmodified.
+	 */
+	virtual void HandleInnerRouteUpdate(const FString& RouteData);
+
+	/** The transport we are wrapping */
+	TSharedRef<IDiscordNetTransport> Inner;
+
+private:
+	FDelegateHandle InnerMessageHandle;
+	FDelegateHandle InnerRouteUpdateHandle;
+};
+
+/**
+ * Discord Peer Network Transport
+ *
+ * Transport backed by discord::NetworkManager.
+ *
+ * This holds a reference into the DiscordCore, so you MUST destroy it
+ * no later than UDiscordGameSubsystem::NativeOnDiscordCoreReset.
+ */
+class DISCORDGAME_API FDiscordPeerNetTransport : public IDiscordNetTransport
+{
+public:
+	explicit FDiscordPeerNetTransport(discord::Core& InCore);
+	virtual ~FDiscordPeerNetTransport() override;
+
+	//~IDiscordNetTransport interface
+	virtual uint64 GetLocalPeerId() const override;
+	virtual discord::Result OpenPeer(uint64 PeerId, const FString& RouteData) override;
+	virtual discord::Result UpdatePeer(uint64 PeerId, const FString& RouteData) override;
+	virtual discord::Result ClosePeer(uint64 PeerId) override;
+	virtual discord::Result OpenChannel(uint64 PeerId, uint8 ChannelId, bool bReliable) override;
+	virtual discord::Result CloseChannel(uint64 PeerId, uint8 ChannelId) override;
+	virtual discord::Result SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) override;
+	virtual discord::Result Flush() override;
+	//~End of IDiscordNetTransport interface
+
+private:
+	discord::NetworkManager& NetworkManager;
+
+	int32 MessageToken {0};
+	int32 RouteUpdateToken {0};
+};
+
+/**
+ * Discord Lobby Network Transport
+ *
+ * Transport backed by the network functions of discord::LobbyManager,
+ * for a single lobby.  Peers are the UserIds of the lobby members.
+ *
+ * Lobbies manage their own peer connections, so OpenPeer/UpdatePeer/ClosePeer
+ * are no-ops, and channels are opened for the entire lobby rather than per peer.
+ *
+ * You must call discord::LobbyManager::ConnectNetwork for the lobby before use.
+ *
+ * This holds a reference into the DiscordCore, so you MUST destroy it
+ * no later than UDiscordGameSubsystem::NativeOnDiscordCoreReset.
+ */
+class DISCORDGAME_API FDiscordLobbyNetTransport : public IDiscordNetTransport
+{
+public:
+	FDiscordLobbyNetTransport(discord::Core& InCore, discord::LobbyId InLobbyId);
+	virtual ~FDiscordLobbyNetTransport() override;
+
+	/** @return The lobby this transport sends to */
+	discord::LobbyId GetLobbyId() const { return LobbyId; }
+
+	//~IDiscordNetTransport interface
+	virtual uint64 GetLocalPeerId() const override;
+	virtual discord::Result OpenPeer(uint64 PeerId, const FString& RouteData) override;
+	virtual discord::Result UpdatePeer(uint64 PeerId, const FString& RouteData) override;
+	virtual discord::Result ClosePeer(uint64 PeerId) override;
+	virtual discord::Result OpenChannel(uint64 PeerId, uint8 ChannelId, bool bReliable) override;
+	virtual discord::Result CloseChannel(uint64 PeerId, uint8 ChannelId) override;
+	virtual discord::Result SendMessage(uint64 PeerId, uint8 ChannelId, const uint8* Data, uint32 DataLength) override;
+	virtual discord::Result Flush() override;
+	//~End of IDiscordNetTransport interface
+
+private:
+	discord::Core& Core;
+	discord::LobbyId LobbyId;
+
+	int32 MessageToken {0};
+};
@@ -0,0 +1,477 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordSaveGameSystem.h"
+#include "DiscordGame.h"
+#include "HAL/FileManager.h"
+#include "Kismet/GameplayStatics.h"
+
+FDiscordSaveGameSystem::FDiscordSaveGameSystem(const FDiscordSaveGameSystemSettings& InSettings)
+	: Settings(InSettings)
+{
+}
+
+void FDiscordSaveGameSystem::SetStorage(const TSharedPtr<FDiscordStorage>& InStorage)
+{
+	if (Storage == InStorage)
+	{
+		return;
+	}
+
+	if (Storage.IsValid() && PendingSaves.Num() > 0)
+	{
+		// The old storage will never finish these writes, so whatever wasn't written is lost
+		UE_LOG(LogDiscord, Warning, TEXT("Discord storage went away with %i save slots not yet written"), PendingSaves.Num());
+
+		TMap<FString, FPendingSave> Abandoned = MoveTemp(PendingSaves);
+		PendingSaves.Reset();
+
+		for (TPair<FString, FPendingSave>& It : Abandoned)
+		{
+			for (const TPair<FPlatformUserId, FSaveGameAsyncOpCompleteCallback>& DeleteCallback : It.Value.DeleteCallbacks)
+			{
+				DeleteCallback.Value(It.Key, DeleteCallback.Key, false);
+			}
+		}
+	}
+
+	Storage = InStorage;
+	++StorageSerial;
+}
+
+void FDiscordSaveGameSystem::SaveObjectAsync(USaveGame* SaveGameObject, const FString& SlotName, FPlatformUserId PlatformUserId, FSaveGameAsyncOpCompleteCallback Callback)
+{
+	if (!Callback)
+	{
+		Callback = [](const FString&, FPlatformUserId, bool) {};
+	}
+
+	// Serializing the object has to happen on the game thread, but it's only into memory
+	TSharedPtr<TArray<uint8>> Buffer = AcquireBuffer();
+	if (!SaveGameObject || !UGameplayStatics::SaveGameToMemory(SaveGameObject, *Buffer))
+	{
+		UE_LOG(LogDiscord, Error, TEXT("Failed to serialize save game for slot \"%s\""), *SlotName);
+		ReleaseBuffer(MoveTemp(Buffer));
+		Callback(SlotName, PlatformUserId, false);
+		return;
+	}
+
+	PackAndWrite(SlotName, PlatformUserId, Buffer.ToSharedRef(), Buffer, MoveTemp(Callback));
+}
+
+bool FDiscordSaveGameSystem::DoesSaveGameExist(const TCHAR* Name, const int32 UserIndex)
+{
+	return DoesSaveGameExistWithResult(Name, UserIndex) == ESaveExistsResult::OK;
+}
+
+ISaveGameSystem::ESaveExistsResult FDiscordSaveGameSystem::DoesSaveGameExistWithResult(const TCHAR* Name, const int32 UserIndex)
+{
+	if (!CheckGameThread(TEXT("DoesSaveGameExist")))
+	{
+		return ESaveExistsResult::UnspecifiedError;
+	}
+
+	const FString SlotName(Name);
+	if (const FPendingSave* Pending = PendingSaves.Find(SlotName))
+	{
+		return Pending->bDeleted ? ESaveExistsResult::DoesNotExist : ESaveExistsResult::OK;
+	}
+
+	const FString FileName = GetFileName(SlotName);
+	if (!Storage.IsValid() || Storage->GetStoragePath().IsEmpty() || !FDiscordStorage::IsValidName(FileName))
+	{
+		return ESaveExistsResult::UnspecifiedError;
+	}
+
+	// The sync API leaves us no choice but to stat the file here
+	return IFileManager::Get().FileExists(*Storage->GetFilePath(FileName)) ? ESaveExistsResult::OK : ESaveExistsResult::DoesNotExist;
+}
+
+bool FDiscordSaveGameSystem::SaveGame(bool bAttemptToUseUI, const TCHAR* Name, const int32 UserIndex, const TArray<uint8>& Data)
+{
+	if (!CheckGameThread(TEXT("SaveGame")))
+	{
+		return false;
+	}
+
+	// Our caller keeps its array, so copy it into one of ours and save that in the background
+	TSharedRef<TArray<uint8>> Buffer = AcquireBuffer();
+	Buffer->Append(Data);
+
+	return PackAndWrite(Name, FPlatformMisc::GetPlatformUserForUserIndex(UserIndex), Buffer, Buffer, [](const FString& SlotName, FPlatformUserId, bool bSuccess)
+	{
+		UE_CLOG(!bSuccess, LogDiscord, Error, TEXT("Failed to save slot \"%s\""), *SlotName);
+	});
+}
+
+bool FDiscordSaveGameSystem::LoadGame(bool bAttemptToUseUI, const TCHAR* Name, const int32 UserIndex, TArray<uint8>& Data)
+{
+	Data.Reset();
+
+	if (!CheckGameThread(TEXT("LoadGame")))
+	{
+		return false;
+	}
+
+	++NumLoads;
+
+	const FString SlotName(Name);
+	if (const FPendingSave* Pending = PendingSaves.Find(SlotName))
+	{
+		++NumLoadHits;
+		if (Pending->bDeleted)
+		{
+			return false;
+		}
+
+		Data.Append(*Pending->Data);
+		return true;
+	}
+
+	if (!Storage.IsValid())
+	{
+		UE_LOG(LogDiscord, Warning, TEXT("Discord storage unavailable; can't load slot \"%s\""), *SlotName);
+		return false;
+	}
+
+	// The sync API has to return the data, so this blocks; AsyncLoadGameFromSlot doesn't
+	UE_LOG(LogDiscord, Verbose, TEXT("Blocking load of slot \"%s\"; prefer AsyncLoadGameFromSlot"), *SlotName);
+
+	TArray<uint8> Stored;
+	const discord::Result Result = Storage->ReadBlocking(GetFileName(SlotName), Stored);
+	if (Result != discord::Result::Ok)
+	{
+		UE_CLOG(Result != discord::Result::NotFound, LogDiscord, Error, TEXT("Error(%i) Loading slot \"%s\""), Result, *SlotName);
+		return false;
+	}
+
+	if (!FDiscordStorageContainer::IsContainer(Stored))
+	{
+		// Saved raw, e.g. before containers were turned on
+		Data = MoveTemp(Stored);
+		return true;
+	}
+
+	const discord::Result DecodeResult = FDiscordStorageContainer::Decode(Stored, Data);
+	UE_CLOG(DecodeResult != discord::Result::Ok, LogDiscord, Error, TEXT("Error(%i) Unpacking slot \"%s\""), DecodeResult, *SlotName);
+	return DecodeResult == discord::Result::Ok;
+}
+
+bool FDiscordSaveGameSystem::DeleteGame(bool bAttemptToUseUI, const TCHAR* Name, const int32 UserIndex)
+{
+	if (!CheckGameThread(TEXT("DeleteGame")))
+	{
+		return false;
+	}
+
+	if (!Storage.IsValid())
+	{
+		UE_LOG(LogDiscord, Warning, TEXT("Discord storage unavailable; can't delete slot \"%s\""), Name);
+		return false;
+	}
+
+	DeleteGameAsync(bAttemptToUseUI, Name, FPlatformMisc::GetPlatformUserForUserIndex(UserIndex), [](const FString& SlotName, FPlatformUserId, bool bSuccess)
+	{
+		UE_CLOG(!bSuccess, LogDiscord, Warning, TEXT("Failed to delete slot \"%s\""), *SlotName);
+	});
+	return true;
+}
+
+void FDiscordSaveGameSystem::DoesSaveGameExistAsync(const TCHAR* Name, FPlatformUserId PlatformUserId, FSaveGameAsyncExistsCallback Callback)
+{
+	const FString SlotName(Name);
+	if (const FPendingSave* Pending = PendingSaves.Find(SlotName))
+	{
+		Callback(SlotName, PlatformUserId, Pending->bDeleted ? ESaveExistsResult::DoesNotExist : ESaveExistsResult::OK);
+		return;
+	}
+
+	if (!Storage.IsValid())
+	{
+		Callback(SlotName, PlatformUserId, ESaveExistsResult::UnspecifiedError);
+		return;
+	}
+
+	Storage->Exists(GetFileName(SlotName)).Next([SlotName, PlatformUserId, Callback = MoveTemp(Callback)](bool bExists)
+	{
+		Callback(SlotName, PlatformUserId, bExists ? ESaveExistsResult::OK : ESaveExistsResult::DoesNotExist);
+	});
+}
+
+void FDiscordSaveGameSystem::SaveGameAsync(bool bAttemptToUseUI, const TCHAR* Name, FPlatformUserId PlatformUserId, TSharedRef<const TArray<uint8>> Data, FSaveGameAsyncOpCompleteCallback Callback)
+{
+	PackAndWrite(Name, PlatformUserId, Data, nullptr, MoveTemp(Callback));
+}
+
+void FDiscordSaveGameSystem::LoadGameAsync(bool bAttemptToUseUI, const TCHAR* Name, FPlatformUserId PlatformUserId, FSaveGameAsyncLoadCompleteCallback Callback)
+{
+	++NumLoads;
+
+	const FString SlotName(Name);
+	if (const FPendingSave* Pending = PendingSaves.Find(SlotName))
+	{
+		++NumLoadHits;
+
+		if (Pending->bDeleted)
+		{
+			Callback(SlotName, PlatformUserId, false, TArray<uint8>());
+			return;
+		}
+
+		// Hold on to the data; the callback may save again and replace it
+		const TSharedPtr<const TArray<uint8>> Data = Pending->Data;
+		Callback(SlotName, PlatformUserId, true, *Data);
+		return;
+	}
+
+	if (!Storage.IsValid())
+	{
+		UE_LOG(LogDiscord, Warning, TEXT("Discord storage unavailable; can't load slot \"%s\""), *SlotName);
+		Callback(SlotName, PlatformUserId, false, TArray<uint8>());
+		return;
+	}
+
+	Storage->Read(GetFileName(SlotName)).Next([WeakThis = AsWeak(), SlotName, PlatformUserId, Callback = MoveTemp(Callback)](FDiscordStorageReadResult&& ReadResult) mutable
+	{
+		if (ReadResult.Result != discord::Result::Ok)
+		{
+			UE_CLOG(ReadResult.Result != discord::Result::NotFound, LogDiscord, Error, TEXT("Error(%i) Loading slot \"%s\""), ReadResult.Result, *SlotName);
+			Callback(SlotName, PlatformUserId, false, TArray<uint8>());
+			return;
+		}
+
+		const TSharedPtr<FDiscordSaveGameSystem> This = WeakThis.Pin();
+		if (!This.IsValid() || !FDiscordStorageContainer::IsContainer(ReadResult.Data))
+		{
+			// Saved raw, e.g. before containers were turned on
+			Callback(SlotName, PlatformUserId, true, ReadResult.Data);
+			return;
+		}
+
+		using FUnpackResult = TTuple<discord::Result, TSharedPtr<TArray<uint8>>>;
+
+		FDiscordStorage::RunInBackground<FUnpackResult>(TEXT("DiscordSaveGame.Unpack"), [Unpacked = TSharedPtr<TArray<uint8>>(This->AcquireBuffer()), Stored = MoveTemp(ReadResult.Data)]() mutable
+		{
+			const discord::Result Result = FDiscordStorageContainer::Decode(Stored, *Unpacked);
+
+			// Hand the buffer over with the result, so the task doesn't keep a reference to it
+			return FUnpackResult(Result, MoveTemp(Unpacked));
+		})
+		.Next([WeakThis, SlotName, PlatformUserId, Callback = MoveTemp(Callback)](FUnpackResult&& UnpackResult)
+		{
+			const discord::Result Result = UnpackResult.Get<0>();
+			TSharedPtr<TArray<uint8>> Unpacked = MoveTemp(UnpackResult.Get<1>());
+
+			if (Result != discord::Result::Ok)
+			{
+				UE_LOG(LogDiscord, Error, TEXT("Error(%i) Unpacking slot \"%s\""), Result, *SlotName);
+				Unpacked->Reset();
+			}
+
+			Callback(SlotName, PlatformUserId, Result == discord::Result::Ok, *Unpacked);
+
+			if (const TSharedPtr<FDiscordSaveGameSystem> This = WeakThis.Pin())
+			{
+				This->ReleaseBuffer(MoveTemp(Unpacked));
+			}
+		});
+	});
+}
+
+void FDiscordSaveGameSystem::DeleteGameAsync(bool bAttemptToUseUI, const TCHAR* Name, FPlatformUserId PlatformUserId, FSaveGameAsyncOpCompleteCallback Callback)
+{
+	const FString SlotName(Name);
+
+	if (!Storage.IsValid())
+	{
+		UE_LOG(LogDiscord, Warning, TEXT("Discord storage unavailable; can't delete slot \"%s\""), *SlotName);
+		Callback(SlotName, PlatformUserId, false);
+		return;
+	}
+
+	TArray<TPair<FPlatformUserId, FSaveGameAsyncOpCompleteCallback>> Callbacks;
+	Callbacks.Emplace(PlatformUserId, MoveTemp(Callback));
+
+	if (FPendingSave* Pending = PendingSaves.Find(SlotName))
+	{
+		// A delete now could land before the write; delete once the writes are done instead
+		Pending->bDeleted = true;
+		Pending->Data.Reset();
+		Pending->DeleteCallbacks.Append(MoveTemp(Callbacks));
+		return;
+	}
+
+	DeleteNow(SlotName, MoveTemp(Callbacks));
+}
+
+bool FDiscordSaveGameSystem::PackAndWrite(const FString& SlotName, FPlatformUserId PlatformUserId, const TSharedRef<const TArray<uint8>>& Data, const TSharedPtr<TArray<uint8>>& DataBuffer, FSaveGameAsyncOpCompleteCallback&& Callback)
+{
+	const FString FileName = GetFileName(SlotName);
+	if (!Storage.IsValid() || !FDiscordStorage::IsValidName(FileName))
+	{
+		UE_LOG(LogDiscord, Warning, TEXT("Can't save slot \"%s\"; %s"), *SlotName, Storage.IsValid() ? TEXT("invalid slot name") : TEXT("Discord storage unavailable"));
+		Callback(SlotName, PlatformUserId, false);
+		return false;
+	}
+
+	++NumSaves;
+
+	// Until this is written, loads of this slot get it from memory
+	FPendingSave& Pending = PendingSaves.FindOrAdd(SlotName);
+	Pending.Data = Data;
+	++Pending.NumInFlight;
+
+	// This save replaces the file anyway, so deletes still waiting on earlier saves are done
+	TArray<TPair<FPlatformUserId, FSaveGameAsyncOpCompleteCallback>> SupersededDeletes = MoveTemp(Pending.DeleteCallbacks);
+	Pending.DeleteCallbacks.Reset();
+	Pending.bDeleted = false;
+
+	if (!Settings.bUseContainer)
+	{
+		Write(SlotName, PlatformUserId, StorageSerial, Data, nullptr, DataBuffer, MoveTemp(Callback));
+	}
+	else
+	{
+		PackPipe.Launch(TEXT("DiscordSaveGame.Pack"), [WeakThis = AsWeak(), SlotName, PlatformUserId, Serial = StorageSerial, Data = TSharedPtr<const TArray<uint8>>(Data), DataBuffer, Packed = TSharedPtr<TArray<uint8>>(AcquireBuffer()), ContainerSettings = Settings.ContainerSettings, Callback = MoveTemp(Callback)]() mutable
+		{
+			const bool bPacked = FDiscordStorageContainer::Encode(*Data, ContainerSettings, *Packed);
+
+			// Pass our references on rather than keeping them, so the buffers can go back to the pool
+			Data.Reset();
+
+			AsyncTask(ENamedThreads::GameThread, [WeakThis, SlotName, PlatformUserId, Serial, DataBuffer = MoveTemp(DataBuffer), Packed = MoveTemp(Packed), bPacked, Callback = MoveTemp(Callback)]() mutable
+			{
+				const TSharedPtr<FDiscordSaveGameSystem> This = WeakThis.Pin();
+				if (!This.IsValid())
+				{
+					Callback(SlotName, PlatformUserId, false);
+					return;
+				}
+
+				if (!bPacked)
+				{
+					UE_LOG(LogDiscord, Error, TEXT("Failed to pack slot \"%s\"; check the container settings"), *SlotName);
+					This->FinishSave(SlotName, Serial);
+					This->ReleaseBuffer(MoveTemp(Packed));
+					This->ReleaseBuffer(MoveTemp(DataBuffer));
+					Callback(SlotName, PlatformUserId, false);
+					return;
+				}
+
+				This->Write(SlotName, PlatformUserId, Serial, Packed.ToSharedRef(), Packed, DataBuffer, MoveTemp(Callback));
+			});
+		});
+	}
+
+	for (const TPair<FPlatformUserId, FSaveGameAsyncOpCompleteCallback>& DeleteCallback : SupersededDeletes)
+	{
+		DeleteCallback.Value(SlotName, DeleteCallback.Key, true);
+	}
+
+	return true;
+}
+
+void FDiscordSaveGameSystem::Write(const FString& SlotName, FPlatformUserId PlatformUserId, uint32 Serial, const TSharedRef<const TArray<uint8>>& Stored, const TSharedPtr<TArray<uint8>>& PackedBuffer, const TSharedPtr<TArray<uint8>>& DataBuffer, FSaveGameAsyncOpCompleteCallback&& Callback)
+{
+	if (Serial != StorageSerial)
+	{
+		// Discord went away while we were packing; SetStorage already gave up on this save
+		Callback(SlotName, PlatformUserId, false);
+		return;
+	}
+
+	const FString FileName = GetFileName(SlotName);
+	TFuture<discord::Result> Written = Settings.bAtomicWrites ? Storage->WriteAtomic(FileName, Stored) : Storage->Write(FileName, Stored);
+
+	Written.Next([WeakThis = AsWeak(), SlotName, PlatformUserId, Serial, PackedBuffer, DataBuffer, Callback = MoveTemp(Callback)](discord::Result Result) mutable
+	{
+		UE_CLOG(Result != discord::Result::Ok, LogDiscord, Error, TEXT("Error(%i) Writing slot \"%s\""), Result, *SlotName);
+
+		if (const TSharedPtr<FDiscordSaveGameSystem> This = WeakThis.Pin())
+		{
+			This->FinishSave(SlotName, Serial);
+
+			This->ReleaseBuffer(MoveTemp(PackedBuffer));
+			This->ReleaseBuffer(MoveTemp(DataBuffer));
+		}
+
+		Callback(SlotName, PlatformUserId, Result == discord::Result::Ok);
+	});
+}
+
+void FDiscordSaveGameSystem::FinishSave(const FString& SlotName, uint32 Serial)
+{
+	if (Serial != StorageSerial)
+	{
+		// Saved to a storage we've since let go of; its pending state is already gone
+		return;
+	}
+
+	FPendingSave* Pending = PendingSaves.Find(SlotName);
+	if (!Pending || --Pending->NumInFlight > 0)
+	{
+		return;
+	}
+
+	// Everything saved to this slot is written; from here on, loads go to storage
+	const bool bDeleted = Pending->bDeleted;
+	TArray<TPair<FPlatformUserId, FSaveGameAsyncOpCompleteCallback>> DeleteCallbacks = MoveTemp(Pending->DeleteCallbacks);
+	PendingSaves.Remove(SlotName);
+
+	if (bDeleted)
+	{
+		DeleteNow(SlotName, MoveTemp(DeleteCallbacks));
+	}
+}
+
+void FDiscordSaveGameSystem::DeleteNow(const FString& SlotName, TArray<TPair<FPlatformUserId, FSaveGameAsyncOpCompleteCallback>>&& Callbacks)
+{
+	if (!Storage.IsValid())
+	{
+		for (const TPair<FPlatformUserId, FSaveGameAsyncOpCompleteCallback>& Callback : Callbacks)
+		{
+			Callback.Value(SlotName, Callback.Key, false);
+		}
+		return;
+	}
+
+	Storage->Delete(GetFileName(SlotName)).Next([SlotName, Callbacks = MoveTemp(Callbacks)](discord::Result Result)
+	{
+		UE_CLOG(Result != discord::Result::Ok && Result != discord::Result::NotFound, LogDiscord, Error, TEXT("Error(%i) Deleting slot \"%s\""), Result, *SlotName);
+
+		for (const TPair<FPlatformUserId, FSaveGameAsyncOpCompleteCallback>& Callback : Callbacks)
+		{
+			Callback.Value(SlotName, Callback.Key, Result == discord::Result::Ok);
+		}
+	});
+}
+
+TSharedRef<TArray<uint8>> FDiscordSaveGameSystem::AcquireBuffer()
+{
+	if (FreeBuffers.Num() > 0)
+	{
+		++NumBufferReuses;
+		return FreeBuffers.Pop(EAllowShrinking::No);
+	}
+
+	return MakeShared<TArray<uint8>>();
+}
+
+void FDiscordSaveGameSystem::ReleaseBuffer(TSharedPtr<TArray<uint8>>&& Buffer)
+{
+	// A buffer still in use elsewhere (e.g. as the latest data of a slot) can't be reused yet
+	if (Buffer.IsValid() && Buffer.IsUnique() && FreeBuffers.Num() < Settings.MaxPooledBuffers)
+	{
+		Buffer->Reset();
+		FreeBuffers.Add(Buffer.ToSharedRef());
+	}
+}
+
+bool FDiscordSaveGameSystem::CheckGameThread(const TCHAR* Function) const
+{
+	if (!IsInGameThread())
+	{
+		UE_LOG(LogDiscord, Error, TEXT("FDiscordSaveGameSystem::%s must be called on the game thread"), Function);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,157 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordStorage.h"
+#include "DiscordStorageContainer.h"
+#include "SaveGameSystem.h"
+
+class USaveGame;
+
+/**
+ * Settings for FDiscordSaveGameSystem
+ */
+struct DISCORDGAME_API FDiscordSaveGameSystemSettings
+{
+	/** Pack saves into an FDiscordStorageContainer (checksummed, optionally compressed); FALSE writes them raw */
+	bool bUseContainer {true};
+
+	/** Container format for new saves */
+	FDiscordStorageContainerSettings ContainerSettings;
+
+	/** Write saves with FDiscordStorage::WriteAtomic, so a crash mid-save leaves the previous save intact */
+	bool bAtomicWrites {true};
+
+	/** How many idle serialization buffers to keep for reuse */
+	int32 MaxPooledBuffers {4};
+};
+
+/**
+ * Discord Save Game System
+ *
+ * ISaveGameSystem that keeps UGameplayStatics save games in Discord storage,
+ * as "<SlotName>.sav".  To use it, add this to DefaultEngine.ini:
+ *
+ *   [PlatformFeatures]
+ *   SaveGameSystemModule=DiscordGame
+ *
+ * The async calls (AsyncSaveGameToSlot, AsyncLoadGameFromSlot, ...) never touch
+ * the disk on the game thread: saves are packed into a container on a worker,
+ * in the order they were made, then written atomically (or with WriteAsync if
+ * bAtomicWrites is off); loads are read with
+ * ReadAsync and unpacked on a worker.  Packing and unpacking use pooled buffers,
+ * as does SaveObjectAsync, so steady autosaving doesn't allocate.
+ *
+ * Until a save is written, loads and exists checks of that slot are answered
+ * from memory, and deletes wait for it.
+ *
+ * The sync calls (SaveGameToSlot, ...) are supported for compatibility: SaveGame
+ * and DeleteGame queue the async version and return TRUE; LoadGame of a slot that
+ * isn't in memory has to block on StorageManager::Read, so prefer the async one.
+ *
+ * UDiscordGameSubsystem hands this its shared storage when Discord connects; while
+ * Discord isn't running every call fails.
+ */
+class DISCORDGAME_API FDiscordSaveGameSystem : public ISaveGameSystem, public TSharedFromThis<FDiscordSaveGameSystem>
+{
+public:
+	explicit FDiscordSaveGameSystem(const FDiscordSaveGameSystemSettings& InSettings = FDiscordSaveGameSystemSettings());
+
+	/** Set (or clear, with nullptr) the storage saves go to */
+	void SetStorage(const TSharedPtr<FDiscordStorage>& InStorage);
+
+	/** @return TRUE if Discord storage is available */
+	bool IsAvailable() const { return Storage.IsValid(); }
+
+	void SetSettings(const FDiscordSaveGameSystemSettings& InSettings) { Settings = InSettings; }
+	const FDiscordSaveGameSystemSettings& GetSettings() const { return Settings; }
+
+	/**
+	 * Serialize a save game object into a pooled buffer and save it asynchronously.
+	 * Same as UGameplayStatics::AsyncSaveGameToSlot, without allocating a new buffer per save.
+	 */
+	void SaveObjectAsync(USaveGame* SaveGameObject, const FString& SlotName, FPlatformUserId PlatformUserId, FSaveGameAsyncOpCompleteCallback Callback);
+
+	/** @return Storage file name for a save slot */
+	static FString GetFileName(const FString& SlotName) { return SlotName + TEXT(".sav"); }
+
+	//~ISaveGameSystem interface
+	virtual bool PlatformHasNativeUI() override { return false; }
+	virtual bool DoesSaveSystemSupportMultipleUsers() override { return false; }
+	virtual bool DoesSaveGameExist(const TCHAR* Name, const int32 UserIndex) override;
+	virtual ESaveExistsResult DoesSaveGameExistWithResult(const TCHAR* Name, const int32 UserIndex) override;
+	virtual bool SaveGame(bool bAttemptToUseUI, const TCHAR* Name, const int32 UserIndex, const TArray<uint8>& Data) override;
+	virtual bool LoadGame(bool bAttemptToUseUI, const TCHAR* Name, const int32 UserIndex, TArray<uint8>& Data) override;
+	virtual bool DeleteGame(bool bAttemptToUseUI, const TCHAR* Name, const int32 UserIndex) override;
+	virtual void DoesSaveGameExistAsync(const TCHAR* Name, FPlatformUserId PlatformUserId, FSaveGameAsyncExistsCallback Callback) override;
+	virtual void SaveGameAsync(bool bAttemptToUseUI, const TCHAR* Name, FPlatformUserId PlatformUserId, TSharedRef<const TArray<uint8>> Data, FSaveGameAsyncOpCompleteCallback Callback) override;
+	virtual void LoadGameAsync(bool bAttemptToUseUI, const TCHAR* Name, FPlatformUserId PlatformUserId, FSaveGameAsyncLoadCompleteCallback Callback) override;
+	virtual void DeleteGameAsync(bool bAttemptToUseUI, const TCHAR* Name, FPlatformUserId PlatformUserId, FSaveGameAsyncOpCompleteCallback Callback) override;
+	//~End of ISaveGameSystem interface
+
+	/** Saves made */
+	int32 NumSaves {0};
+
+	/** Buffers taken from the pool instead of allocated */
+	int32 NumBufferReuses {0};
+
+	/** Loads made, and how many of them were answered from memory */
+	int32 NumLoads {0};
+	int32 NumLoadHits {0};
+
+private:
+	/** A slot with saves not yet written */
+	struct FPendingSave
+	{
+		/** Latest saved data, as given to us (not packed) */
+		TSharedPtr<const TArray<uint8>> Data;
+
+		/** Saves of this slot not yet written */
+		int32 NumInFlight {0};
+
+		/** Deleted after the saves; deletes to run once they're written */
+		bool bDeleted {false};
+		TArray<TPair<FPlatformUserId, FSaveGameAsyncOpCompleteCallback>> DeleteCallbacks;
+	};
+
+	/**
+	 * Pack Data on the pack pipe (unless containers are off), then write it.
+	 * DataBuffer is Data again if it came from our pool, else nullptr.
+	 * @return FALSE if the save couldn't be queued; Callback has been called
+	 */
+	bool PackAndWrite(const FString& SlotName, FPlatformUserId PlatformUserId, const TSharedRef<const TArray<uint8>>& Data, const TSharedPtr<TArray<uint8>>& DataBuffer, FSaveGameAsyncOpCompleteCallback&& Callback);
+
+	/** Write packed data; the buffers go back to the pool when it's written */
+	void Write(const FString& SlotName, FPlatformUserId PlatformUserId, uint32 Serial, const TSharedRef<const TArray<uint8>>& Stored, const TSharedPtr<TArray<uint8>>& PackedBuffer, const TSharedPtr<TArray<uint8>>& DataBuffer, FSaveGameAsyncOpCompleteCallback&& Callback);
+
+	/** Done with one save of SlotName, made while StorageSerial was Serial, successful or not */
+	void FinishSave(const FString& SlotName, uint32 Serial);
+
+	/** Delete a slot's file now */
+	void DeleteNow(const FString& SlotName, TArray<TPair<FPlatformUserId, FSaveGameAsyncOpCompleteCallback>>&& Callbacks);
+
+	/** Get an empty buffer, reusing one from the pool if we have one */
+	TSharedRef<TArray<uint8>> AcquireBuffer();
+
+	/** Give a buffer back to the pool; it is just dropped if something else still references it */
+	void ReleaseBuffer(TSharedPtr<TArray<uint8>>&& Buffer);
+
+	/** Sync ISaveGameSystem calls are only supported on the game thread */
+	bool CheckGameThread(const TCHAR* Function) const;
+
+	FDiscordSaveGameSystemSettings Settings;
+	TSharedPtr<FDiscordStorage> Storage;
+
+	/** Bumped by SetStorage, so saves still in flight from an old storage are ignored */
+	uint32 StorageSerial {0};
+
+	/** Slots with saves not yet written, by slot name */
+	TMap<FString, FPendingSave> PendingSaves;
+
+	/** Idle buffers, Reset but with their capacity */
+	TArray<TSharedRef<TArray<uint8>>> FreeBuffers;
+
+	/** Packs saves one at a time, so they're written in the order they were made */
+	UE::Tasks::FPipe PackPipe {TEXT("DiscordSaveGamePack")};
+};
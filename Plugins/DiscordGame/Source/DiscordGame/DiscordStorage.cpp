@@ -0,0 +1,522 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordStorage.h"
+#include "DiscordGame.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformFileManager.h"
+#include "Misc/Crc.h"
+#include "Misc/FileHelper.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+
+namespace DiscordStorage
+{
+	/** WriteAtomic writes the new contents here first */
+	static const TCHAR* AtomicTempSuffix = TEXT(".atomic-tmp");
+
+	/** Once this exists next to a complete temp file, the write is committed */
+	static const TCHAR* AtomicCommitSuffix = TEXT(".atomic-commit");
+
+	/** "DSAC" */
+	static constexpr uint32 CommitMagic = 0x43415344;
+
+	/** Write a file and flush it all the way to disk */
+	static bool WriteFileDurably(const FString& Path, TConstArrayView<uint8> Data)
+	{
+		TUniquePtr<IFileHandle> Handle (FPlatformFileManager::Get().GetPlatformFile().OpenWrite(*Path));
+		return Handle.IsValid()
+			&& Handle->Write(Data.GetData(), Data.Num())
+			&& Handle->Flush(true);
+	}
+
+	/** Commit record: [magic][size][crc of the data][crc of the record so far] */
+	static TArray<uint8> MakeCommitRecord(TConstArrayView<uint8> Data)
+	{
+		TArray<uint8> Record;
+		FMemoryWriter Writer(Record);
+
+		uint32 Magic = CommitMagic;
+		uint64 Size = Data.Num();
+		uint32 DataCrc = FCrc::MemCrc32(Data.GetData(), Data.Num());
+		Writer << Magic << Size << DataCrc;
+
+		uint32 RecordCrc = FCrc::MemCrc32(Record.GetData(), Record.Num());
+		Writer << RecordCrc;
+		return Record;
+	}
+
+	/** @return FALSE if Record is not a complete commit record */
+	static bool ParseCommitRecord(const TArray<uint8>& Record, uint64& OutSize, uint32& OutDataCrc)
+	{
+		static constexpr int32 RecordSize = 4 + 8 + 4 + 4;
+		if (Record.Num() != RecordSize)
+		{
+			return false;
+		}
+
+		FMemoryReader Reader(Record);
+		uint32 Magic {0};
+		uint32 RecordCrc {0};
+		Reader << Magic << OutSize << OutDataCrc << RecordCrc;
+
+		return Magic == CommitMagic
+			&& RecordCrc == FCrc::MemCrc32(Record.GetData(), RecordSize - 4);
+	}
+}
+
+FDiscordStorage::FDiscordStorage(discord::Core& InCore)
+	: Core(InCore)
+	, Recovery(MakeShared<FRecoveryState>())
+{
+	char Path[4096];
+	const discord::Result Result = Core.StorageManager().GetPath(Path);
+	if (Result == discord::Result::Ok)
+	{
+		StoragePath = UTF8_TO_TCHAR(Path);
+	}
+	else
+	{
+		UE_LOG(LogDiscord, Error, TEXT("Error(%i) StorageManager GetPath; Stat/Exists/Delete will fail"), Result);
+		return;
+	}
+
+	// Finish any atomic writes a crash interrupted before anything can read or overwrite those files.
+	// Requests on the IO pipe queue up behind this on their own; SDK requests wait in AfterRecovery.
+	Recovery->bRecovering = true;
+
+	RunOnIoPipe<int32>(TEXT("DiscordStorage.Recover"), [Path = StoragePath]()
+	{
+		return RecoverAtomicWrites(Path);
+	})
+	.Next([Recovery = Recovery](int32 NumRecovered)
+	{
+		UE_CLOG(NumRecovered > 0, LogDiscord, Log, TEXT("Recovered %i interrupted storage writes"), NumRecovered);
+
+		Recovery->bRecovering = false;
+
+		TArray<TUniqueFunction<void()>> Waiting = MoveTemp(Recovery->Waiting);
+		for (TUniqueFunction<void()>& Work : Waiting)
+		{
+			Work();
+		}
+	});
+}
+
+FDiscordStorage::~FDiscordStorage()
+{
+	// Anything still waiting on recovery would call into us; it's never completed, like requests the SDK drops
+	Recovery->Waiting.Reset();
+
+	// A pipe must be empty when it's destroyed.  Its tasks only touch the file system and post
+	// their results to the game thread, never us, so finishing them here is safe.
+	IoPipe.WaitUntilEmpty();
+}
+
+void FDiscordStorage::AfterRecovery(TUniqueFunction<void()>&& Work)
+{
+	if (Recovery->bRecovering)
+	{
+		Recovery->Waiting.Add(MoveTemp(Work));
+	}
+	else
+	{
+		Work();
+	}
+}
+
+bool FDiscordStorage::IsValidName(const FString& Name)
+{
+	return !Name.IsEmpty()
+		&& !Name.Contains(TEXT("/"))
+		&& !Name.Contains(TEXT("\\"))
+		&& !Name.Contains(TEXT(":"))
+		&& Name != TEXT(".")
+		&& Name != TEXT("..");
+}
+
+bool FDiscordStorage::IsAtomicWriteFile(const FString& Name)
+{
+	return Name.EndsWith(DiscordStorage::AtomicTempSuffix) || Name.EndsWith(DiscordStorage::AtomicCommitSuffix);
+}
+
+TFuture<FDiscordStorageReadResult> FDiscordStorage::Read(const FString& Name)
+{
+	if (!IsValidName(Name))
+	{
+		return MakeFulfilledPromise<FDiscordStorageReadResult>(FDiscordStorageReadResult {discord::Result::InvalidFilename}).GetFuture();
+	}
+
+	TSharedRef<TPromise<FDiscordStorageReadResult>> Promise = MakeShared<TPromise<FDiscordStorageReadResult>>();
+	TFuture<FDiscordStorageReadResult> Future = Promise->GetFuture();
+
+	AfterRecovery([this, Name, Promise]()
+	{
+		// The SDK calls us back on the game thread, during RunCallbacks
+		Core.StorageManager().ReadAsync(TCHAR_TO_UTF8(*Name), [Promise](discord::Result Result, std::uint8_t* Data, std::uint32_t DataLength)
+		{
+			FDiscordStorageReadResult ReadResult;
+			ReadResult.Result = Result;
+			if (Result == discord::Result::Ok)
+			{
+				ReadResult.Data.Append(Data, DataLength);
+			}
+			Promise->SetValue(MoveTemp(ReadResult));
+		});
+	});
+
+	return Future;
+}
+
+TFuture<FDiscordStorageBatchReadResult> FDiscordStorage::ReadBatch(const TArray<FString>& Names)
+{
+	struct FBatch
+	{
+		TPromise<FDiscordStorageBatchReadResult> Promise;
+		FDiscordStorageBatchReadResult Result;
+		int32 NumRemaining {0};
+	};
+
+	TSharedRef<FBatch> Batch = MakeShared<FBatch>();
+	TFuture<FDiscordStorageBatchReadResult> Future = Batch->Promise.GetFuture();
+
+	Batch->Result.Names = Names;
+	Batch->Result.Files.SetNum(Names.Num());
+	Batch->NumRemaining = Names.Num();
+
+	if (Names.Num() == 0)
+	{
+		Batch->Promise.SetValue(MoveTemp(Batch->Result));
+		return Future;
+	}
+
+	// Everything is counted before the first read goes out, since invalid names complete right away
+	for (int32 Index = 0; Index < Names.Num(); ++Index)
+	{
+		Read(Names[Index]).Next([Batch, Index](FDiscordStorageReadResult&& ReadResult)
+		{
+			if (ReadResult.Result == discord::Result::Ok)
+			{
+				++Batch->Result.NumOk;
+			}
+			Batch->Result.Files[Index] = MoveTemp(ReadResult);
+
+			if (--Batch->NumRemaining == 0)
+			{
+				Batch->Promise.SetValue(MoveTemp(Batch->Result));
+			}
+		});
+	}
+
+	return Future;
+}
+
+void FDiscordStorage::ReadPartial(const FString& Name, uint64 Offset, uint64 Length, TUniqueFunction<void(discord::Result, TConstArrayView<uint8>)>&& Callback)
+{
+	if (!IsValidName(Name))
+	{
+		Callback(discord::Result::InvalidFilename, TConstArrayView<uint8>());
+		return;
+	}
+
+	// std::function must be copyable, so the callback rides along in a shared pointer
+	TSharedRef<TUniqueFunction<void(discord::Result, TConstArrayView<uint8>)>> SharedCallback = MakeShared<TUniqueFunction<void(discord::Result, TConstArrayView<uint8>)>>(MoveTemp(Callback));
+
+	AfterRecovery([this, Name, Offset, Length, SharedCallback]()
+	{
+		Core.StorageManager().ReadAsyncPartial(TCHAR_TO_UTF8(*Name), Offset, Length, [SharedCallback](discord::Result Result, std::uint8_t* Data, std::uint32_t DataLength)
+		{
+			(*SharedCallback)(Result, Result == discord::Result::Ok ? TConstArrayView<uint8>(Data, DataLength) : TConstArrayView<uint8>());
+		});
+	});
+}
+
+TFuture<discord::Result> FDiscordStorage::Write(const FString& Name, TArray<uint8>&& Data)
+{
+	if (!IsValidName(Name))
+	{
+		return MakeFulfilledPromise<discord::Result>(discord::Result::InvalidFilename).GetFuture();
+	}
+
+	return Write(Name, MakeShared<TArray<uint8>>(MoveTemp(Data)));
+}
+
+TFuture<discord::Result> FDiscordStorage::Write(const FString& Name, const TSharedRef<const TArray<uint8>>& Data)
+{
+	if (!IsValidName(Name))
+	{
+		return MakeFulfilledPromise<discord::Result>(discord::Result::InvalidFilename).GetFuture();
+	}
+
+	TSharedRef<TPromise<discord::Result>> Promise = MakeShared<TPromise<discord::Result>>();
+	TFuture<discord::Result> Future = Promise->GetFuture();
+
+	AfterRecovery([this, Name, Data, Promise]()
+	{
+		// The SDK doesn't promise to copy our data before the callback, so it lives in the callback until then.
+		// WriteAsync takes a non-const pointer but doesn't modify the data.
+		Core.StorageManager().WriteAsync(TCHAR_TO_UTF8(*Name), const_cast<uint8*>(Data->GetData()), Data->Num(), [Promise, Buffer = TSharedPtr<const TArray<uint8>>(Data)](discord::Result Result) mutable
+		{
+			// Let go of the data before completing, so the caller can reuse it in its continuation
+			Buffer.Reset();
+			Promise->SetValue(Result);
+		});
+	});
+
+	return Future;
+}
+
+TFuture<discord::Result> FDiscordStorage::WriteAtomic(const FString& Name, TArray<uint8>&& Data)
+{
+	return WriteAtomic(Name, MakeShared<TArray<uint8>>(MoveTemp(Data)));
+}
+
+TFuture<discord::Result> FDiscordStorage::WriteAtomic(const FString& Name, const TSharedRef<const TArray<uint8>>& Data)
+{
+	if (!IsValidName(Name) || StoragePath.IsEmpty())
+	{
+		return MakeFulfilledPromise<discord::Result>(discord::Result::InvalidFilename).GetFuture();
+	}
+
+	return RunOnIoPipe<discord::Result>(TEXT("DiscordStorage.WriteAtomic"), [Path = GetFilePath(Name), Buffer = TSharedPtr<const TArray<uint8>>(Data)]() mutable
+	{
+		const discord::Result Result = WriteFileAtomic(Path, *Buffer);
+
+		// Let go of the data before completing, so the caller can reuse it in its continuation
+		Buffer.Reset();
+		return Result;
+	});
+}
+
+discord::Result FDiscordStorage::WriteFileAtomic(const FString& Path, TConstArrayView<uint8> Data)
+{
+	using namespace DiscordStorage;
+
+	IFileManager& FileManager = IFileManager::Get();
+	const FString TempPath = Path + AtomicTempSuffix;
+	const FString CommitPath = Path + AtomicCommitSuffix;
+
+	// The new contents go aside first.  Until the commit record exists, a crash leaves the old file as it was.
+	if (!WriteFileDurably(TempPath, Data))
+	{
+		UE_LOG(LogDiscord, Error, TEXT("Error writing storage temp file \"%s\""), *TempPath);
+		FileManager.Delete(*TempPath, false, false, true);
+		return discord::Result::InternalError;
+	}
+
+	// Writing the commit record is the commit.  From here on, a crash is rolled forward by recovery.
+	if (!WriteFileDurably(CommitPath, MakeCommitRecord(Data)))
+	{
+		UE_LOG(LogDiscord, Error, TEXT("Error writing storage commit record \"%s\""), *CommitPath);
+		FileManager.Delete(*CommitPath, false, false, true);
+		FileManager.Delete(*TempPath, false, false, true);
+		return discord::Result::InternalError;
+	}
+
+	// On some platforms replacing is a delete and then a rename, which is why we need the commit record at all
+	if (!FileManager.Move(*Path, *TempPath, true, true, false, true))
+	{
+		if (FileManager.FileExists(*Path))
+		{
+			// The old file is still there; back out
+			UE_LOG(LogDiscord, Error, TEXT("Error replacing storage file \"%s\""), *Path);
+			FileManager.Delete(*CommitPath, false, false, true);
+			FileManager.Delete(*TempPath, false, false, true);
+		}
+		else
+		{
+			// The old file is gone; leave the committed write for recovery to finish
+			UE_LOG(LogDiscord, Error, TEXT("Error replacing storage file \"%s\"; recovery will finish it"), *Path);
+		}
+		return discord::Result::InternalError;
+	}
+
+	FileManager.Delete(*CommitPath, false, false, true);
+	return discord::Result::Ok;
+}
+
+int32 FDiscordStorage::RecoverAtomicWrites(const FString& Directory)
+{
+	using namespace DiscordStorage;
+
+	IFileManager& FileManager = IFileManager::Get();
+
+	TArray<FString> CommitPaths;
+	TArray<FString> TempPaths;
+	FileManager.IterateDirectory(*Directory, [&CommitPaths, &TempPaths](const TCHAR* FilenameOrDirectory, bool bIsDirectory)
+	{
+		if (!bIsDirectory)
+		{
+			const FString Path (FilenameOrDirectory);
+			if (Path.EndsWith(AtomicCommitSuffix))
+			{
+				CommitPaths.Add(Path);
+			}
+			else if (Path.EndsWith(AtomicTempSuffix))
+			{
+				TempPaths.Add(Path);
+			}
+		}
+		return true;
+	});
+
+	int32 NumRecovered {0};
+
+	for (const FString& CommitPath : CommitPaths)
+	{
+		const FString Path = CommitPath.LeftChop(FCString::Strlen(AtomicCommitSuffix));
+		const FString TempPath = Path + AtomicTempSuffix;
+
+		TArray<uint8> Record;
+		uint64 Size {0};
+		uint32 DataCrc {0};
+		if (!FFileHelper::LoadFileToArray(Record, *CommitPath, FILEREAD_Silent) || !ParseCommitRecord(Record, Size, DataCrc))
+		{
+			// Torn commit record: the write never committed, and the old file is intact
+			UE_LOG(LogDiscord, Warning, TEXT("Discarding uncommitted storage write of \"%s\""), *Path);
+		}
+		else if (FileManager.FileExists(*TempPath))
+		{
+			// Committed but not yet renamed; the temp file was flushed before the commit record, so it's complete
+			TArray<uint8> Temp;
+			const bool bIntact = FFileHelper::LoadFileToArray(Temp, *TempPath, FILEREAD_Silent)
+				&& static_cast<uint64>(Temp.Num()) == Size
+				&& FCrc::MemCrc32(Temp.GetData(), Temp.Num()) == DataCrc;
+
+			if (!bIntact)
+			{
+				UE_LOG(LogDiscord, Error, TEXT("Committed storage write of \"%s\" failed its checksum; discarding it"), *Path);
+			}
+			else if (FileManager.Move(*Path, *TempPath, true, true, false, true))
+			{
+				UE_LOG(LogDiscord, Log, TEXT("Finished interrupted storage write of \"%s\""), *Path);
+				++NumRecovered;
+			}
+			else
+			{
+				// Keep the commit record and temp file, and try again next time
+				UE_LOG(LogDiscord, Error, TEXT("Error finishing interrupted storage write of \"%s\""), *Path);
+				continue;
+			}
+		}
+		// else it was renamed already, and only the commit record was left
+
+		FileManager.Delete(*CommitPath, false, false, true);
+	}
+
+	// Temp files without a commit record were never committed; the files they were to replace are intact
+	for (const FString& TempPath : TempPaths)
+	{
+		const FString CommitPath = TempPath.LeftChop(FCString::Strlen(AtomicTempSuffix)) + AtomicCommitSuffix;
+		if (FileManager.FileExists(*TempPath) && !FileManager.FileExists(*CommitPath))
+		{
+			FileManager.Delete(*TempPath, false, false, true);
+		}
+	}
+
+	return NumRecovered;
+}
+
+discord::Result FDiscordStorage::WriteBlocking(const FString& Name, TConstArrayView<uint8> Data)
+{
+	if (!IsValidName(Name))
+	{
+		return discord::Result::InvalidFilename;
+	}
+
+	// Write takes a non-const pointer but doesn't modify the data
+	return Core.StorageManager().Write(TCHAR_TO_UTF8(*Name), const_cast<uint8*>(Data.GetData()), Data.Num());
+}
+
+discord::Result FDiscordStorage::ReadBlocking(const FString& Name, TArray<uint8>& OutData)
+{
+	OutData.Reset();
+
+	if (!IsValidName(Name) || StoragePath.IsEmpty())
+	{
+		return discord::Result::InvalidFilename;
+	}
+
+	// Read wants a buffer big enough for the whole file, so size it first
+	const int64 FileSize = IFileManager::Get().FileSize(*GetFilePath(Name));
+	if (FileSize < 0)
+	{
+		return discord::Result::NotFound;
+	}
+
+	OutData.SetNumUninitialized(FileSize);
+
+	std::uint32_t NumRead {0};
+	const discord::Result Result = Core.StorageManager().Read(TCHAR_TO_UTF8(*Name), OutData.GetData(), OutData.Num(), &NumRead);
+	OutData.SetNum(Result == discord::Result::Ok ? NumRead : 0, EAllowShrinking::No);
+	return Result;
+}
+
+discord::Result FDiscordStorage::PumpCallbacks()
+{
+	check(IsInGameThread());
+
+	return Core.RunCallbacks();
+}
+
+TFuture<FDiscordStorageStat> FDiscordStorage::Stat(const FString& Name)
+{
+	if (!IsValidName(Name) || StoragePath.IsEmpty())
+	{
+		return MakeFulfilledPromise<FDiscordStorageStat>(FDiscordStorageStat {discord::Result::InvalidFilename, Name}).GetFuture();
+	}
+
+	return RunOnIoPipe<FDiscordStorageStat>(TEXT("DiscordStorage.Stat"), [Name, Path = GetFilePath(Name)]()
+	{
+		FDiscordStorageStat Stat;
+		Stat.Name = Name;
+
+		const FFileStatData StatData = IFileManager::Get().GetStatData(*Path);
+		if (!StatData.bIsValid || StatData.bIsDirectory)
+		{
+			Stat.Result = discord::Result::NotFound;
+			return Stat;
+		}
+
+		Stat.Size = static_cast<uint64>(StatData.FileSize);
+		Stat.LastModified = static_cast<uint64>(StatData.ModificationTime.ToUnixTimestamp());
+		return Stat;
+	});
+}
+
+TFuture<bool> FDiscordStorage::Exists(const FString& Name)
+{
+	if (!IsValidName(Name) || StoragePath.IsEmpty())
+	{
+		return MakeFulfilledPromise<bool>(false).GetFuture();
+	}
+
+	return RunOnIoPipe<bool>(TEXT("DiscordStorage.Exists"), [Path = GetFilePath(Name)]()
+	{
+		return IFileManager::Get().FileExists(*Path);
+	});
+}
+
+TFuture<discord::Result> FDiscordStorage::Delete(const FString& Name)
+{
+	if (!IsValidName(Name) || StoragePath.IsEmpty())
+	{
+		return MakeFulfilledPromise<discord::Result>(discord::Result::InvalidFilename).GetFuture();
+	}
+
+	return RunOnIoPipe<discord::Result>(TEXT("DiscordStorage.Delete"), [Path = GetFilePath(Name)]()
+	{
+		IFileManager& FileManager = IFileManager::Get();
+		if (!FileManager.FileExists(*Path))
+		{
+			return discord::Result::NotFound;
+		}
+
+		if (!FileManager.Delete(*Path, false, false, true))
+		{
+			UE_LOG(LogDiscord, Warning, TEXT("Failed to delete storage file \"%s\""), *Path);
+			return discord::Result::InternalError;
+		}
+
+		return discord::Result::Ok;
+	});
+}
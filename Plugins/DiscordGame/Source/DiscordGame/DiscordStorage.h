@@ -0,0 +1,256 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Async/Async.h"
+#include "Async/Future.h"
+#include "Tasks/Pipe.h"
+#include "discord-cpp/discord.h"
+
+/**
+ * Result of FDiscordStorage::Read
+ */
+struct DISCORDGAME_API FDiscordStorageReadResult
+{
+	discord::Result Result {discord::Result::Ok};
+	TArray<uint8> Data;
+};
+
+/**
+ * Result of FDiscordStorage::ReadBatch
+ */
+struct DISCORDGAME_API FDiscordStorageBatchReadResult
+{
+	/** Names that were requested, in the order they were requested */
+	TArray<FString> Names;
+
+	/** Result for each name, in the same order */
+	TArray<FDiscordStorageReadResult> Files;
+
+	/** How many of the reads succeeded */
+	int32 NumOk {0};
+
+	/** @return TRUE if every read succeeded */
+	bool AllOk() const { return NumOk == Files.Num(); }
+
+	/** @return Result for Name, or nullptr if it wasn't requested */
+	const FDiscordStorageReadResult* Find(const FString& Name) const
+	{
+		const int32 Index = Names.IndexOfByKey(Name);
+		return Index != INDEX_NONE ? &Files[Index] : nullptr;
+	}
+};
+
+/**
+ * Result of FDiscordStorage::Stat
+ */
+struct DISCORDGAME_API FDiscordStorageStat
+{
+	discord::Result Result {discord::Result::Ok};
+	FString Name;
+	uint64 Size {0};
+
+	/** Unix timestamp (seconds), same as discord::FileStat */
+	uint64 LastModified {0};
+};
+
+/**
+ * Discord Storage
+ *
+ * Asynchronous facade over discord::StorageManager, so save code never blocks
+ * the game thread on disk.
+ *
+ *   - Read and Write use StorageManager::ReadAsync and WriteAsync
+ *   - Stat, Exists, Delete and WriteAtomic run on a dedicated IO pipe (one task
+ *     at a time, in the order they were requested) against the files in GetPath()
+ *
+ * WriteAtomic is crash safe: the new contents go to a temp file, then a small
+ * commit record, then the temp file is renamed over the old one.  A crash before
+ * the commit record leaves the old file; a crash after it is rolled forward by
+ * the recovery every FDiscordStorage runs when it's created, before any of its
+ * other requests.  Recovery must never run while another FDiscordStorage is
+ * writing, so don't create your own: share UDiscordGameSubsystem::GetStorage().
+ * ReadBlocking and WriteBlocking don't wait for recovery.
+ *
+ * Every future is fulfilled on the game thread, so continuations attached with
+ * Then/Next can safely touch game state.  Requests on the IO pipe are ordered
+ * with each other, but not with Read/Write; chain on the future if a Stat must
+ * see a Write.
+ *
+ * The GameSDK doesn't document StorageManager as thread safe, so the IO pipe
+ * never calls into it; it works on the storage directory directly.
+ *
+ * This holds a reference into the DiscordCore, so you MUST destroy it
+ * no later than UDiscordGameSubsystem::NativeOnDiscordCoreReset.
+ * Requests still waiting on the SDK at that point are never completed.
+ */
+class DISCORDGAME_API FDiscordStorage
+{
+public:
+	explicit FDiscordStorage(discord::Core& InCore);
+	~FDiscordStorage();
+
+	/** Read a whole file */
+	TFuture<FDiscordStorageReadResult> Read(const FString& Name);
+
+	/**
+	 * Read several whole files at once.  All the reads are issued right away,
+	 * so this takes about as long as the slowest one rather than the sum of them.
+	 * The future is set once, when every read is done, with a result per file.
+	 */
+	TFuture<FDiscordStorageBatchReadResult> ReadBatch(const TArray<FString>& Names);
+
+	/**
+	 * Read part of a file with StorageManager::ReadAsyncPartial.
+	 * Callback gets the data on the game thread; the view is only valid during the call.
+	 */
+	void ReadPartial(const FString& Name, uint64 Offset, uint64 Length, TUniqueFunction<void(discord::Result, TConstArrayView<uint8>)>&& Callback);
+
+	/** Write a whole file, replacing it if it exists */
+	TFuture<discord::Result> Write(const FString& Name, TArray<uint8>&& Data);
+
+	/**
+	 * Write a whole file from a shared buffer, which is kept alive until it is written.
+	 * Lets callers reuse the buffer afterwards instead of handing it over.
+	 */
+	TFuture<discord::Result> Write(const FString& Name, const TSharedRef<const TArray<uint8>>& Data);
+
+	/**
+	 * Read a whole file right now, on the game thread, with StorageManager::Read.
+	 * This blocks on disk; use it only where waiting is not an option.
+	 */
+	discord::Result ReadBlocking(const FString& Name, TArray<uint8>& OutData);
+
+	/**
+	 * Write a whole file so that a crash leaves either the old contents or the new,
+	 * never a mix or a truncated file.  Costs a small commit record and a rename
+	 * on top of the data, instead of a second copy of it.
+	 */
+	TFuture<discord::Result> WriteAtomic(const FString& Name, TArray<uint8>&& Data);
+
+	/** WriteAtomic from a shared buffer, which is let go before the future is set */
+	TFuture<discord::Result> WriteAtomic(const FString& Name, const TSharedRef<const TArray<uint8>>& Data);
+
+	/**
+	 * Write a whole file right now, on the game thread, with StorageManager::Write.
+	 * This blocks on disk; use it only where waiting is not an option, e.g. at shutdown.
+	 */
+	discord::Result WriteBlocking(const FString& Name, TConstArrayView<uint8> Data);
+
+	/**
+	 * Pump the DiscordCore's callbacks, so SDK requests in flight (Read, Write, ...)
+	 * can complete while the caller blocks.  IO pipe work is completed by game thread
+	 * tasks, which this doesn't run.  Only for blocking waits at shutdown; normally
+	 * the subsystem tick does this.
+	 *
+	 * MUST NOT be called from a Discord callback, which would re-enter RunCallbacks,
+	 * or from a game thread task (including any of our futures' continuations).
+	 *
+	 * @return Result of discord::Core::RunCallbacks
+	 */
+	discord::Result PumpCallbacks();
+
+	/** Get a file's size and modification time */
+	TFuture<FDiscordStorageStat> Stat(const FString& Name);
+
+	/** @return Future set to TRUE if the file exists */
+	TFuture<bool> Exists(const FString& Name);
+
+	/** Delete a file; NotFound if it didn't exist */
+	TFuture<discord::Result> Delete(const FString& Name);
+
+	/** @return Directory the StorageManager keeps its files in, or empty if unknown */
+	const FString& GetStoragePath() const { return StoragePath; }
+
+	/** @return Full path of a file in the storage directory */
+	FString GetFilePath(const FString& Name) const { return FPaths::Combine(StoragePath, Name); }
+
+	/**
+	 * Discord storage names are plain file names; this rejects anything that
+	 * could escape the storage directory.
+	 * @return TRUE if Name is a valid storage file name
+	 */
+	static bool IsValidName(const FString& Name);
+
+	/** @return TRUE if Name is a temp file or commit record of WriteAtomic, not a file of its own */
+	static bool IsAtomicWriteFile(const FString& Name);
+
+	/**
+	 * Atomically replace the file at Path, as WriteAtomic does.  Blocks on disk;
+	 * thread safe, meant for work already on the IO pipe.
+	 */
+	static discord::Result WriteFileAtomic(const FString& Path, TConstArrayView<uint8> Data);
+
+	/**
+	 * Finish or discard WriteAtomic calls interrupted by a crash.  Blocks on disk.
+	 * @return Number of files rolled forward to their new contents
+	 */
+	static int32 RecoverAtomicWrites(const FString& Directory);
+
+	/**
+	 * Run Work on the IO pipe, then fulfill the returned future with its result
+	 * on the game thread.  Work must not touch game state or the DiscordCore.
+	 */
+	template <typename ResultType>
+	TFuture<ResultType> RunOnIoPipe(const TCHAR* DebugName, TUniqueFunction<ResultType()>&& Work)
+	{
+		TSharedRef<TPromise<ResultType>> Promise = MakeShared<TPromise<ResultType>>();
+		TFuture<ResultType> Future = Promise->GetFuture();
+
+		IoPipe.Launch(DebugName, [Promise, Work = MoveTemp(Work)]() mutable
+		{
+			AsyncTask(ENamedThreads::GameThread, [Promise, Value = Work()]() mutable
+			{
+				Promise->SetValue(MoveTemp(Value));
+			});
+		});
+
+		return Future;
+	}
+
+	/**
+	 * Run CPU work (compression, checksums, ...) on a background task, then fulfill
+	 * the returned future with its result on the game thread.  Unlike RunOnIoPipe,
+	 * these run in parallel with each other and with IO.
+	 */
+	template <typename ResultType>
+	static TFuture<ResultType> RunInBackground(const TCHAR* DebugName, TUniqueFunction<ResultType()>&& Work)
+	{
+		TSharedRef<TPromise<ResultType>> Promise = MakeShared<TPromise<ResultType>>();
+		TFuture<ResultType> Future = Promise->GetFuture();
+
+		UE::Tasks::Launch(DebugName, [Promise, Work = MoveTemp(Work)]() mutable
+		{
+			AsyncTask(ENamedThreads::GameThread, [Promise, Value = Work()]() mutable
+			{
+				Promise->SetValue(MoveTemp(Value));
+			});
+		});
+
+		return Future;
+	}
+
+private:
+	/** Run Work now, or once startup recovery is done if it's still running */
+	void AfterRecovery(TUniqueFunction<void()>&& Work);
+
+	/** Startup recovery progress, shared with the recovery task */
+	struct FRecoveryState
+	{
+		bool bRecovering {false};
+
+		/** SDK requests made during recovery, to run once it's done */
+		TArray<TUniqueFunction<void()>> Waiting;
+	};
+
+	discord::Core& Core;
+
+	TSharedRef<FRecoveryState> Recovery;
+
+	/** Cached StorageManager::GetPath */
+	FString StoragePath;
+
+	/** Serializes all of our file system work onto one worker at a time */
+	UE::Tasks::FPipe IoPipe {TEXT("DiscordStorageIO")};
+};
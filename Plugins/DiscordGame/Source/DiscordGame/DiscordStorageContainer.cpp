@@ -0,0 +1,446 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordStorageContainer.h"
+#include "DiscordGame.h"
+#include "Misc/Crc.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+
+namespace DiscordStorageContainer
+{
+	/** "DSGC" */
+	static constexpr uint32 Magic = 0x43475344;
+	static constexpr uint16 Version = 1;
+
+	/** Magic, Version, FormatId, Reserved, BlockSize, NumBlocks, UncompressedSize, IndexCrc, HeaderCrc */
+	static constexpr uint32 HeaderSize = 4 + 2 + 1 + 1 + 4 + 4 + 8 + 4 + 4;
+
+	/** StoredSize, Crc */
+	static constexpr uint32 IndexEntrySize = 4 + 4;
+
+	/** Blocks bigger than this are surely corruption, not data */
+	static constexpr uint32 MaxBlockSize = 64 * 1024 * 1024;
+
+	struct FHeader
+	{
+		uint8 FormatId {0};
+		uint32 BlockSize {0};
+		uint32 NumBlocks {0};
+		uint64 UncompressedSize {0};
+		uint32 IndexCrc {0};
+	};
+
+	struct FBlock
+	{
+		/** Where the block is stored in the container */
+		uint64 Offset {0};
+		uint32 StoredSize {0};
+
+		/** Size of the block's data once decompressed */
+		uint32 RawSize {0};
+
+		/** CRC32 of the stored bytes */
+		uint32 Crc {0};
+	};
+
+	/** Formats by their id on disk; the id must never change */
+	static const FName Formats[] = {NAME_None, NAME_Zlib, NAME_Gzip, NAME_LZ4, NAME_Oodle};
+
+	static bool GetFormatId(FName Format, uint8& OutFormatId)
+	{
+		for (uint8 Id = 0; Id < UE_ARRAY_COUNT(Formats); ++Id)
+		{
+			if (Formats[Id] == Format)
+			{
+				OutFormatId = Id;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static void WriteHeader(uint8* Dest, const FHeader& Header)
+	{
+		TArray<uint8> Bytes;
+		FMemoryWriter Writer(Bytes);
+
+		uint32 MagicValue = Magic;
+		uint16 VersionValue = Version;
+		uint8 FormatId = Header.FormatId;
+		uint8 Reserved = 0;
+		uint32 BlockSize = Header.BlockSize;
+		uint32 NumBlocks = Header.NumBlocks;
+		uint64 UncompressedSize = Header.UncompressedSize;
+		uint32 IndexCrc = Header.IndexCrc;
+		Writer << MagicValue << VersionValue << FormatId << Reserved << BlockSize << NumBlocks << UncompressedSize << IndexCrc;
+
+		// The header checksums itself, minus the checksum
+		uint32 HeaderCrc = FCrc::MemCrc32(Bytes.GetData(), Bytes.Num());
+		Writer << HeaderCrc;
+
+		check(Bytes.Num() == HeaderSize);
+		FMemory::Memcpy(Dest, Bytes.GetData(), HeaderSize);
+	}
+
+	static bool ReadHeader(TConstArrayView<uint8> Data, FHeader& OutHeader)
+	{
+		if (Data.Num() < static_cast<int32>(HeaderSize))
+		{
+			return false;
+		}
+
+		FMemoryReaderView Reader(Data.Left(HeaderSize));
+		uint32 MagicValue;
+		uint16 VersionValue;
+		uint8 Reserved;
+		uint32 HeaderCrc;
+		Reader << MagicValue << VersionValue << OutHeader.FormatId << Reserved << OutHeader.BlockSize << OutHeader.NumBlocks << OutHeader.UncompressedSize << OutHeader.IndexCrc << HeaderCrc;
+
+		return MagicValue == Magic
+			&& VersionValue == Version
+			&& HeaderCrc == FCrc::MemCrc32(Data.GetData(), HeaderSize - sizeof(uint32))
+			&& OutHeader.FormatId < UE_ARRAY_COUNT(Formats)
+			&& OutHeader.BlockSize > 0 && OutHeader.BlockSize <= MaxBlockSize
+			&& OutHeader.NumBlocks == FMath::DivideAndRoundUp<uint64>(OutHeader.UncompressedSize, OutHeader.BlockSize);
+	}
+
+	/** @return Size of the index of a container */
+	static uint64 GetIndexSize(const FHeader& Header)
+	{
+		return static_cast<uint64>(Header.NumBlocks) * IndexEntrySize;
+	}
+
+	static bool ReadIndex(TConstArrayView<uint8> IndexData, const FHeader& Header, TArray<FBlock>& OutBlocks)
+	{
+		if (static_cast<uint64>(IndexData.Num()) < GetIndexSize(Header)
+			|| FCrc::MemCrc32(IndexData.GetData(), GetIndexSize(Header)) != Header.IndexCrc)
+		{
+			return false;
+		}
+
+		OutBlocks.SetNum(Header.NumBlocks);
+
+		FMemoryReaderView Reader(IndexData);
+		uint64 Offset = HeaderSize + GetIndexSize(Header);
+		uint64 Remaining = Header.UncompressedSize;
+		for (FBlock& Block : OutBlocks)
+		{
+			Reader << Block.StoredSize << Block.Crc;
+
+			Block.Offset = Offset;
+			Block.RawSize = static_cast<uint32>(FMath::Min<uint64>(Header.BlockSize, Remaining));
+			if (Block.StoredSize > Block.RawSize)
+			{
+				// We never store a block bigger than its raw data
+				return false;
+			}
+
+			Offset += Block.StoredSize;
+			Remaining -= Block.RawSize;
+		}
+
+		return true;
+	}
+
+	/** Verify a stored block and decompress it into Dest, which holds RawSize bytes */
+	static bool DecodeBlock(FName Format, const FBlock& Block, const uint8* Stored, uint8* Dest)
+	{
+		if (FCrc::MemCrc32(Stored, Block.StoredSize) != Block.Crc)
+		{
+			return false;
+		}
+
+		if (Block.StoredSize == Block.RawSize)
+		{
+			FMemory::Memcpy(Dest, Stored, Block.RawSize);
+			return true;
+		}
+
+		return FCompression::UncompressMemory(Format, Dest, Block.RawSize, Stored, Block.StoredSize);
+	}
+
+	/** State carried through the steps of a ReadRange */
+	struct FRangeRead
+	{
+		TSharedRef<FDiscordStorage> Storage;
+		FString Name;
+		uint64 Offset {0};
+		uint64 Length {0};
+
+		TSharedRef<TPromise<FDiscordStorageReadResult>> Promise;
+
+		FHeader Header;
+		TArray<FBlock> Blocks;
+
+		void Fail(discord::Result Result)
+		{
+			UE_LOG(LogDiscord, Warning, TEXT("Error(%i) Reading storage container \"%s\" range %llu+%llu"), Result, *Name, Offset, Length);
+			Promise->SetValue(FDiscordStorageReadResult {Result});
+		}
+	};
+}
+
+FDiscordStorageContainer::FDiscordStorageContainer(const TSharedRef<FDiscordStorage>& InStorage, const FDiscordStorageContainerSettings& InSettings)
+	: Storage(InStorage)
+	, Settings(InSettings)
+{
+}
+
+bool FDiscordStorageContainer::IsContainer(TConstArrayView<uint8> Data)
+{
+	using namespace DiscordStorageContainer;
+
+	FHeader Header;
+	return ReadHeader(Data, Header);
+}
+
+bool FDiscordStorageContainer::Encode(TConstArrayView<uint8> Data, const FDiscordStorageContainerSettings& Settings, TArray<uint8>& OutContainer)
+{
+	using namespace DiscordStorageContainer;
+
+	FHeader Header;
+	if (!GetFormatId(Settings.Format, Header.FormatId) || Settings.BlockSize <= 0 || static_cast<uint32>(Settings.BlockSize) > MaxBlockSize)
+	{
+		UE_LOG(LogDiscord, Error, TEXT("Invalid storage container settings (format %s, block size %i)"), *Settings.Format.ToString(), Settings.BlockSize);
+		return false;
+	}
+
+	Header.BlockSize = Settings.BlockSize;
+	Header.UncompressedSize = Data.Num();
+	Header.NumBlocks = static_cast<uint32>(FMath::DivideAndRoundUp<uint64>(Header.UncompressedSize, Header.BlockSize));
+
+	// Header and index are filled in once we know the block sizes
+	const int32 BlocksStart = HeaderSize + static_cast<int32>(GetIndexSize(Header));
+	OutContainer.SetNumUninitialized(BlocksStart, EAllowShrinking::No);
+
+	const int32 Bound = Header.FormatId != 0 ? FCompression::CompressMemoryBound(Settings.Format, Header.BlockSize) : 0;
+	TArray<uint8> Scratch;
+	Scratch.SetNumUninitialized(Bound);
+
+	TArray<uint8> Index;
+	FMemoryWriter IndexWriter(Index);
+
+	for (uint32 BlockIndex = 0; BlockIndex < Header.NumBlocks; ++BlockIndex)
+	{
+		const uint8* Raw = Data.GetData() + static_cast<int64>(BlockIndex) * Header.BlockSize;
+		const int32 RawSize = FMath::Min<int32>(Header.BlockSize, Data.Num() - static_cast<int32>(BlockIndex * Header.BlockSize));
+
+		// Keep the compressed block only if it's strictly smaller; equal size means raw when reading
+		int32 CompressedSize = Bound;
+		const bool bCompressed = Header.FormatId != 0
+			&& FCompression::CompressMemory(Settings.Format, Scratch.GetData(), CompressedSize, Raw, RawSize)
+			&& CompressedSize < RawSize;
+
+		const uint8* Stored = bCompressed ? Scratch.GetData() : Raw;
+		uint32 StoredSize = bCompressed ? CompressedSize : RawSize;
+		uint32 Crc = FCrc::MemCrc32(Stored, StoredSize);
+
+		OutContainer.Append(Stored, StoredSize);
+		IndexWriter << StoredSize << Crc;
+	}
+
+	Header.IndexCrc = FCrc::MemCrc32(Index.GetData(), Index.Num());
+	WriteHeader(OutContainer.GetData(), Header);
+	FMemory::Memcpy(OutContainer.GetData() + HeaderSize, Index.GetData(), Index.Num());
+
+	return true;
+}
+
+discord::Result FDiscordStorageContainer::Decode(TConstArrayView<uint8> Container, TArray<uint8>& OutData)
+{
+	using namespace DiscordStorageContainer;
+
+	FHeader Header;
+	TArray<FBlock> Blocks;
+	if (!ReadHeader(Container, Header)
+		|| !ReadIndex(Container.RightChop(HeaderSize), Header, Blocks))
+	{
+		return discord::Result::InvalidPayload;
+	}
+
+	const FName Format = Formats[Header.FormatId];
+	OutData.SetNumUninitialized(Header.UncompressedSize, EAllowShrinking::No);
+
+	uint8* Dest = OutData.GetData();
+	for (const FBlock& Block : Blocks)
+	{
+		if (Block.Offset + Block.StoredSize > static_cast<uint64>(Container.Num())
+			|| !DecodeBlock(Format, Block, Container.GetData() + Block.Offset, Dest))
+		{
+			OutData.Reset();
+			return discord::Result::InvalidPayload;
+		}
+		Dest += Block.RawSize;
+	}
+
+	return discord::Result::Ok;
+}
+
+TFuture<discord::Result> FDiscordStorageContainer::Write(const FString& Name, TArray<uint8>&& Data)
+{
+	TSharedRef<TPromise<discord::Result>> Promise = MakeShared<TPromise<discord::Result>>();
+	TFuture<discord::Result> Future = Promise->GetFuture();
+
+	// Compress in the background, then write from the game thread
+	FDiscordStorage::RunInBackground<TOptional<TArray<uint8>>>(TEXT("DiscordStorage.ContainerEncode"), [Data = MoveTemp(Data), Settings = Settings]()
+	{
+		TOptional<TArray<uint8>> Container(InPlace);
+		if (!Encode(Data, Settings, Container.GetValue()))
+		{
+			Container.Reset();
+		}
+		return Container;
+	})
+	.Next([Promise, Storage = Storage, Name](TOptional<TArray<uint8>>&& Container)
+	{
+		if (!Container.IsSet())
+		{
+			Promise->SetValue(discord::Result::InvalidPayload);
+			return;
+		}
+
+		Storage->Write(Name, MoveTemp(Container.GetValue())).Next([Promise](discord::Result Result)
+		{
+			Promise->SetValue(Result);
+		});
+	});
+
+	return Future;
+}
+
+TFuture<FDiscordStorageReadResult> FDiscordStorageContainer::Read(const FString& Name)
+{
+	TSharedRef<TPromise<FDiscordStorageReadResult>> Promise = MakeShared<TPromise<FDiscordStorageReadResult>>();
+	TFuture<FDiscordStorageReadResult> Future = Promise->GetFuture();
+
+	Storage->Read(Name).Next([Promise](FDiscordStorageReadResult&& ReadResult)
+	{
+		if (ReadResult.Result != discord::Result::Ok)
+		{
+			Promise->SetValue(MoveTemp(ReadResult));
+			return;
+		}
+
+		FDiscordStorage::RunInBackground<FDiscordStorageReadResult>(TEXT("DiscordStorage.ContainerDecode"), [Container = MoveTemp(ReadResult.Data)]()
+		{
+			FDiscordStorageReadResult Decoded;
+			Decoded.Result = Decode(Container, Decoded.Data);
+			return Decoded;
+		})
+		.Next([Promise](FDiscordStorageReadResult&& Decoded)
+		{
+			Promise->SetValue(MoveTemp(Decoded));
+		});
+	});
+
+	return Future;
+}
+
+TFuture<FDiscordStorageReadResult> FDiscordStorageContainer::ReadRange(const FString& Name, uint64 Offset, uint64 Length)
+{
+	using namespace DiscordStorageContainer;
+
+	TSharedRef<FRangeRead> Read = MakeShared<FRangeRead>(FRangeRead {Storage, Name, Offset, Length, MakeShared<TPromise<FDiscordStorageReadResult>>()});
+	TFuture<FDiscordStorageReadResult> Future = Read->Promise->GetFuture();
+
+	// 1. Header
+	Storage->ReadPartial(Name, 0, HeaderSize, [Read](discord::Result Result, TConstArrayView<uint8> HeaderData)
+	{
+		if (Result != discord::Result::Ok)
+		{
+			Read->Fail(Result);
+			return;
+		}
+
+		if (!ReadHeader(HeaderData, Read->Header))
+		{
+			Read->Fail(discord::Result::InvalidPayload);
+			return;
+		}
+
+		const FHeader& Header = Read->Header;
+		if (Read->Offset > Header.UncompressedSize)
+		{
+			Read->Fail(discord::Result::InvalidPayload);
+			return;
+		}
+
+		Read->Length = FMath::Min(Read->Length, Header.UncompressedSize - Read->Offset);
+		if (Read->Length == 0)
+		{
+			Read->Promise->SetValue(FDiscordStorageReadResult {discord::Result::Ok});
+			return;
+		}
+
+		// 2. Index
+		Read->Storage->ReadPartial(Read->Name, HeaderSize, GetIndexSize(Header), [Read](discord::Result Result, TConstArrayView<uint8> IndexData)
+		{
+			if (Result != discord::Result::Ok)
+			{
+				Read->Fail(Result);
+				return;
+			}
+
+			if (!ReadIndex(IndexData, Read->Header, Read->Blocks))
+			{
+				Read->Fail(discord::Result::InvalidPayload);
+				return;
+			}
+
+			// 3. Just the blocks covering the range, in one contiguous read
+			const uint32 FirstBlock = static_cast<uint32>(Read->Offset / Read->Header.BlockSize);
+			const uint32 LastBlock = static_cast<uint32>((Read->Offset + Read->Length - 1) / Read->Header.BlockSize);
+			const uint64 SpanStart = Read->Blocks[FirstBlock].Offset;
+			const uint64 SpanEnd = Read->Blocks[LastBlock].Offset + Read->Blocks[LastBlock].StoredSize;
+
+			Read->Storage->ReadPartial(Read->Name, SpanStart, SpanEnd - SpanStart, [Read, FirstBlock, LastBlock, SpanStart](discord::Result Result, TConstArrayView<uint8> SpanData)
+			{
+				if (Result != discord::Result::Ok)
+				{
+					Read->Fail(Result);
+					return;
+				}
+
+				// 4. Verify and decompress in the background; the span is only valid during this call, so it's copied
+				FDiscordStorage::RunInBackground<FDiscordStorageReadResult>(TEXT("DiscordStorage.ContainerDecodeRange"), [Read, FirstBlock, LastBlock, SpanStart, Span = TArray<uint8>(SpanData)]()
+				{
+					const FName Format = Formats[Read->Header.FormatId];
+					const uint64 BlockSize = Read->Header.BlockSize;
+
+					TArray<uint8> Raw;
+					Raw.SetNumUninitialized(static_cast<int64>(LastBlock - FirstBlock) * BlockSize + Read->Blocks[LastBlock].RawSize);
+
+					uint8* Dest = Raw.GetData();
+					for (uint32 BlockIndex = FirstBlock; BlockIndex <= LastBlock; ++BlockIndex)
+					{
+						const FBlock& Block = Read->Blocks[BlockIndex];
+						const uint64 SpanOffset = Block.Offset - SpanStart;
+						if (SpanOffset + Block.StoredSize > static_cast<uint64>(Span.Num())
+							|| !DecodeBlock(Format, Block, Span.GetData() + SpanOffset, Dest))
+						{
+							return FDiscordStorageReadResult {discord::Result::InvalidPayload};
+						}
+						Dest += Block.RawSize;
+					}
+
+					// Trim the blocks down to the range asked for
+					const uint64 RangeStart = Read->Offset - FirstBlock * BlockSize;
+					FDiscordStorageReadResult Decoded;
+					Decoded.Data.Append(Raw.GetData() + RangeStart, Read->Length);
+					return Decoded;
+				})
+				.Next([Read](FDiscordStorageReadResult&& Decoded)
+				{
+					if (Decoded.Result != discord::Result::Ok)
+					{
+						Read->Fail(Decoded.Result);
+						return;
+					}
+					Read->Promise->SetValue(MoveTemp(Decoded));
+				});
+			});
+		});
+	});
+
+	return Future;
+}
@@ -0,0 +1,72 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordStorage.h"
+
+/**
+ * Settings for FDiscordStorageContainer
+ */
+struct DISCORDGAME_API FDiscordStorageContainerSettings
+{
+	/** Compression format for new containers: NAME_Oodle, NAME_Zlib, NAME_Gzip, NAME_LZ4, or NAME_None */
+	FName Format {NAME_Oodle};
+
+	/** Uncompressed bytes per block; the unit of partial reads and of checksums */
+	int32 BlockSize {64 * 1024};
+};
+
+/**
+ * Discord Storage Container
+ *
+ * Optional file format for storage saves: data is split into fixed-size blocks,
+ * each compressed on its own and checksummed, behind a header and block index.
+ *
+ *   [Header: magic, version, format, block size, sizes, checksums]
+ *   [Index: compressed size + CRC32 per block]
+ *   [Block 0][Block 1]...
+ *
+ * Blocks that don't shrink are stored raw.  Every block's checksum is verified
+ * before it's decompressed, so corruption is reported as InvalidPayload on load
+ * instead of surfacing as a parse failure (or worse, bad data).
+ *
+ * ReadRange only fetches the header, the index and the blocks covering the
+ * requested range with ReadAsyncPartial, and only decompresses those blocks.
+ *
+ * Compression and decompression run on background tasks; every future is
+ * fulfilled on the game thread.
+ */
+class DISCORDGAME_API FDiscordStorageContainer
+{
+public:
+	FDiscordStorageContainer(const TSharedRef<FDiscordStorage>& InStorage, const FDiscordStorageContainerSettings& InSettings = FDiscordStorageContainerSettings());
+
+	/** Compress Data into a container and write it */
+	TFuture<discord::Result> Write(const FString& Name, TArray<uint8>&& Data);
+
+	/** Read a whole container, verify and decompress it */
+	TFuture<FDiscordStorageReadResult> Read(const FString& Name);
+
+	/** Read Length bytes at Offset of a container's uncompressed data, fetching and decompressing only the blocks needed */
+	TFuture<FDiscordStorageReadResult> ReadRange(const FString& Name, uint64 Offset, uint64 Length);
+
+	/**
+	 * Build a container.  Thread safe.
+	 * @return FALSE if the settings are invalid
+	 */
+	static bool Encode(TConstArrayView<uint8> Data, const FDiscordStorageContainerSettings& Settings, TArray<uint8>& OutContainer);
+
+	/**
+	 * Verify and decompress a whole container.  Thread safe.
+	 * @return Ok, or InvalidPayload if it is not a valid container or is corrupt
+	 */
+	static discord::Result Decode(TConstArrayView<uint8> Container, TArray<uint8>& OutData);
+
+	/** @return TRUE if Data starts with a container header */
+	static bool IsContainer(TConstArrayView<uint8> Data);
+
+private:
+	TSharedRef<FDiscordStorage> Storage;
+	FDiscordStorageContainerSettings Settings;
+};
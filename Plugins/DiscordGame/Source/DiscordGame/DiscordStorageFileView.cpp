@@ -0,0 +1,89 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordStorageFileView.h"
+#include "DiscordGame.h"
+#include "Async/MappedFileHandle.h"
+#include "HAL/PlatformFileManager.h"
+
+FDiscordStorageFileView::FDiscordStorageFileView(TArray<uint8>&& InCopy)
+	: Copy(MoveTemp(InCopy))
+	, Data(Copy)
+{
+}
+
+FDiscordStorageFileView::~FDiscordStorageFileView()
+{
+	// Unmap before closing the file
+	MappedRegion.Reset();
+	MappedHandle.Reset();
+}
+
+TSharedPtr<FDiscordStorageFileView> FDiscordStorageFileView::MapFile(const FString& Path)
+{
+	TUniquePtr<IMappedFileHandle> Handle(FPlatformFileManager::Get().GetPlatformFile().OpenMapped(*Path));
+	if (!Handle.IsValid() || Handle->GetFileSize() <= 0)
+	{
+		// Not supported here, or nothing to map (empty files can't be mapped)
+		return nullptr;
+	}
+
+	TUniquePtr<IMappedFileRegion> Region(Handle->MapRegion(0, Handle->GetFileSize()));
+	if (!Region.IsValid())
+	{
+		return nullptr;
+	}
+
+	TSharedPtr<FDiscordStorageFileView> View = MakeShareable(new FDiscordStorageFileView());
+	View->Data = TConstArrayView<uint8>(Region->GetMappedPtr(), Region->GetMappedSize());
+	View->MappedHandle = MoveTemp(Handle);
+	View->MappedRegion = MoveTemp(Region);
+	return View;
+}
+
+TFuture<FDiscordStorageFileViewResult> FDiscordStorageFileView::Open(const TSharedRef<FDiscordStorage>& Storage, const FString& Name)
+{
+	if (!FDiscordStorage::IsValidName(Name))
+	{
+		return MakeFulfilledPromise<FDiscordStorageFileViewResult>(FDiscordStorageFileViewResult {discord::Result::InvalidFilename}).GetFuture();
+	}
+
+	TSharedRef<TPromise<FDiscordStorageFileViewResult>> Promise = MakeShared<TPromise<FDiscordStorageFileViewResult>>();
+	TFuture<FDiscordStorageFileViewResult> Future = Promise->GetFuture();
+
+	TFuture<TSharedPtr<FDiscordStorageFileView>> Mapped;
+	if (Storage->GetStoragePath().IsEmpty())
+	{
+		Mapped = MakeFulfilledPromise<TSharedPtr<FDiscordStorageFileView>>(nullptr).GetFuture();
+	}
+	else
+	{
+		Mapped = Storage->RunOnIoPipe<TSharedPtr<FDiscordStorageFileView>>(TEXT("DiscordStorage.MapFile"), [Path = Storage->GetFilePath(Name)]()
+		{
+			return MapFile(Path);
+		});
+	}
+
+	// Storage is held until we know whether we need the fallback
+	Mapped.Next([Promise, Storage, Name](TSharedPtr<FDiscordStorageFileView> View)
+	{
+		if (View.IsValid())
+		{
+			Promise->SetValue(FDiscordStorageFileViewResult {discord::Result::Ok, MoveTemp(View)});
+			return;
+		}
+
+		UE_LOG(LogDiscord, Verbose, TEXT("Can't map storage file \"%s\"; reading a copy"), *Name);
+
+		Storage->Read(Name).Next([Promise](FDiscordStorageReadResult&& ReadResult)
+		{
+			FDiscordStorageFileViewResult Result {ReadResult.Result};
+			if (ReadResult.Result == discord::Result::Ok)
+			{
+				Result.View = MakeShared<FDiscordStorageFileView>(MoveTemp(ReadResult.Data));
+			}
+			Promise->SetValue(MoveTemp(Result));
+		});
+	});
+
+	return Future;
+}
@@ -0,0 +1,77 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordStorage.h"
+
+class IMappedFileHandle;
+class IMappedFileRegion;
+struct FDiscordStorageFileViewResult;
+
+/**
+ * Discord Storage File View
+ *
+ * Read-only view of a whole storage file, so large, read-mostly data (cached
+ * level data, replays, ...) can be parsed in place.
+ *
+ * Open() memory maps the file straight from the StorageManager's directory on
+ * the storage IO pipe: there is no copy, and the OS pages data in lazily as it's
+ * touched.  On platforms or files that can't be mapped, it falls back to reading
+ * a copy with FDiscordStorage::Read, behind the same interface.
+ *
+ * A mapped file stays open as long as its view lives, which on some platforms
+ * keeps it from being rewritten; release views promptly, and don't map files
+ * that are written often.
+ */
+class DISCORDGAME_API FDiscordStorageFileView
+{
+public:
+	/** View of a copy of the file, for when it can't be mapped */
+	explicit FDiscordStorageFileView(TArray<uint8>&& InCopy);
+	~FDiscordStorageFileView();
+
+	FDiscordStorageFileView(const FDiscordStorageFileView&) = delete;
+	FDiscordStorageFileView& operator=(const FDiscordStorageFileView&) = delete;
+
+	/** Open a view of a file, mapped if possible; the future is fulfilled on the game thread */
+	static TFuture<FDiscordStorageFileViewResult> Open(const TSharedRef<FDiscordStorage>& Storage, const FString& Name);
+
+	/**
+	 * Map a file in place.  Does file IO; don't call it on the game thread.
+	 * @return The view, or nullptr if the platform can't map this file
+	 */
+	static TSharedPtr<FDiscordStorageFileView> MapFile(const FString& Path);
+
+	/** @return The file contents; valid as long as this view lives */
+	TConstArrayView<uint8> GetData() const { return Data; }
+
+	/** @return Size of the file in bytes */
+	int64 GetSize() const { return Data.Num(); }
+
+	/** @return TRUE if the file is mapped rather than copied */
+	bool IsMapped() const { return MappedRegion.IsValid(); }
+
+private:
+	FDiscordStorageFileView() = default;
+
+	/** The mapped file, and our region of it */
+	TUniquePtr<IMappedFileHandle> MappedHandle;
+	TUniquePtr<IMappedFileRegion> MappedRegion;
+
+	/** The file contents when we couldn't map them */
+	TArray<uint8> Copy;
+
+	TConstArrayView<uint8> Data;
+};
+
+/**
+ * Result of FDiscordStorageFileView::Open
+ */
+struct DISCORDGAME_API FDiscordStorageFileViewResult
+{
+	discord::Result Result {discord::Result::Ok};
+
+	/** Set if Result is Ok */
+	TSharedPtr<FDiscordStorageFileView> View;
+};
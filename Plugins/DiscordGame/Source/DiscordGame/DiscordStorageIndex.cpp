@@ -0,0 +1,190 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordStorageIndex.h"
+#include "DiscordGame.h"
+#include "HAL/FileManager.h"
+
+FDiscordStorageIndex::FDiscordStorageIndex(const TSharedRef<FDiscordStorage>& InStorage)
+	: Storage(InStorage)
+{
+}
+
+void FDiscordStorageIndex::Refresh()
+{
+	if (bRefreshing)
+	{
+		// Changes may have happened after the running scan passed them; look again when it's done
+		bRefreshAgain = true;
+		return;
+	}
+
+	if (Storage->GetStoragePath().IsEmpty())
+	{
+		UE_LOG(LogDiscord, Warning, TEXT("Storage path unknown; can't refresh the storage index"));
+		return;
+	}
+
+	bRefreshing = true;
+	const uint64 ScanSerial = ChangeSerial;
+
+	Storage->RunOnIoPipe<TArray<FDiscordStorageStat>>(TEXT("DiscordStorage.Index"), [Path = Storage->GetStoragePath()]()
+	{
+		TArray<FDiscordStorageStat> Scan;
+		IFileManager::Get().IterateDirectoryStat(*Path, [&Scan](const TCHAR* FilenameOrDirectory, const FFileStatData& StatData)
+		{
+			// Leftovers of atomic writes in progress aren't files of their own
+			const FString Name = FPaths::GetCleanFilename(FilenameOrDirectory);
+			if (!StatData.bIsDirectory && !FDiscordStorage::IsAtomicWriteFile(Name))
+			{
+				FDiscordStorageStat& Stat = Scan.AddDefaulted_GetRef();
+				Stat.Name = Name;
+				Stat.Size = static_cast<uint64>(StatData.FileSize);
+				Stat.LastModified = static_cast<uint64>(StatData.ModificationTime.ToUnixTimestamp());
+			}
+			return true;
+		});
+		return Scan;
+	})
+	.Next([WeakThis = AsWeak(), ScanSerial](TArray<FDiscordStorageStat>&& Scan)
+	{
+		if (const TSharedPtr<FDiscordStorageIndex> This = WeakThis.Pin())
+		{
+			This->ApplyScan(MoveTemp(Scan), ScanSerial);
+		}
+	});
+}
+
+const FDiscordStorageStat* FDiscordStorageIndex::Find(const FString& Name) const
+{
+	const FEntry* Entry = Entries.Find(Name);
+	return Entry ? &Entry->Stat : nullptr;
+}
+
+void FDiscordStorageIndex::GetFilesByNewest(TArray<FDiscordStorageStat>& OutFiles) const
+{
+	OutFiles.Reset(Entries.Num());
+	for (const TPair<FString, FEntry>& It : Entries)
+	{
+		OutFiles.Add(It.Value.Stat);
+	}
+
+	OutFiles.Sort([](const FDiscordStorageStat& A, const FDiscordStorageStat& B)
+	{
+		return A.LastModified > B.LastModified;
+	});
+}
+
+TFuture<discord::Result> FDiscordStorageIndex::Write(const FString& Name, TArray<uint8>&& Data)
+{
+	const uint64 Size = Data.Num();
+
+	return Storage->Write(Name, MoveTemp(Data)).Next([WeakThis = AsWeak(), Name, Size](discord::Result Result)
+	{
+		const TSharedPtr<FDiscordStorageIndex> This = WeakThis.Pin();
+		if (This.IsValid() && Result == discord::Result::Ok)
+		{
+			This->NoteWritten(Name, Size);
+		}
+		return Result;
+	});
+}
+
+TFuture<discord::Result> FDiscordStorageIndex::Delete(const FString& Name)
+{
+	return Storage->Delete(Name).Next([WeakThis = AsWeak(), Name](discord::Result Result)
+	{
+		const TSharedPtr<FDiscordStorageIndex> This = WeakThis.Pin();
+		if (This.IsValid() && (Result == discord::Result::Ok || Result == discord::Result::NotFound))
+		{
+			This->NoteDeleted(Name);
+		}
+		return Result;
+	});
+}
+
+void FDiscordStorageIndex::NoteWritten(const FString& Name, uint64 Size)
+{
+	FEntry& Entry = Entries.FindOrAdd(Name);
+	Entry.Stat.Name = Name;
+	Entry.Stat.Size = Size;
+	Entry.Stat.LastModified = static_cast<uint64>(FDateTime::UtcNow().ToUnixTimestamp());
+	Entry.LocalSerial = ++ChangeSerial;
+
+	RecentDeletes.Remove(Name);
+}
+
+void FDiscordStorageIndex::NoteDeleted(const FString& Name)
+{
+	Entries.Remove(Name);
+	RecentDeletes.Add(Name, ++ChangeSerial);
+}
+
+void FDiscordStorageIndex::ApplyScan(TArray<FDiscordStorageStat>&& Scan, uint64 ScanSerial)
+{
+	bRefreshing = false;
+	bReady = true;
+	++NumRefreshes;
+
+	int32 NumChanges {0};
+	TSet<FString> Scanned;
+	Scanned.Reserve(Scan.Num());
+
+	for (FDiscordStorageStat& Stat : Scan)
+	{
+		Scanned.Add(Stat.Name);
+
+		const uint64* DeleteSerial = RecentDeletes.Find(Stat.Name);
+		if (DeleteSerial && *DeleteSerial > ScanSerial)
+		{
+			// We deleted it after the scan started; the scan is out of date
+			continue;
+		}
+
+		FEntry* Entry = Entries.Find(Stat.Name);
+		if (Entry && Entry->LocalSerial > ScanSerial)
+		{
+			// We wrote it after the scan started; ours is newer
+			continue;
+		}
+
+		if (Entry && Entry->Stat.Size == Stat.Size && Entry->Stat.LastModified == Stat.LastModified)
+		{
+			continue;
+		}
+
+		FEntry& Updated = Entry ? *Entry : Entries.Add(Stat.Name);
+		Updated.Stat = MoveTemp(Stat);
+		++NumChanges;
+	}
+
+	// Anything we have that the scan didn't see is gone, unless we wrote it after the scan started
+	for (auto It = Entries.CreateIterator(); It; ++It)
+	{
+		if (It.Value().LocalSerial <= ScanSerial && !Scanned.Contains(It.Key()))
+		{
+			It.RemoveCurrent();
+			++NumChanges;
+		}
+	}
+
+	// Deletes older than this scan are reflected in it now
+	for (auto It = RecentDeletes.CreateIterator(); It; ++It)
+	{
+		if (It.Value() <= ScanSerial)
+		{
+			It.RemoveCurrent();
+		}
+	}
+
+	NumRefreshChanges += NumChanges;
+	if (NumChanges > 0)
+	{
+		IndexChangedEvent.Broadcast();
+	}
+
+	if (bRefreshAgain)
+	{
+		bRefreshAgain = false;
+		Refresh();
+	}
+}
@@ -0,0 +1,101 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordStorage.h"
+
+/** Broadcast when a refresh changed the index */
+DECLARE_MULTICAST_DELEGATE(FOnDiscordStorageIndexChanged);
+
+/**
+ * Discord Storage Index
+ *
+ * In-memory index of every file in storage (name, size, modification time),
+ * so save browsers and existence checks don't go to disk each time with
+ * StorageManager::Count/StatAt/Stat/Exists.
+ *
+ *   - Lookups by name are a single map find
+ *   - Writes and deletes made through the index update it immediately
+ *   - Refresh() rescans the storage directory on the storage IO pipe, and
+ *     applies only the differences on the game thread
+ *
+ * A refresh never undoes our own changes made while it was scanning: those
+ * are newer than anything the scan could have seen.
+ *
+ * Create this with MakeShared, since storage completions hold weak references to it.
+ */
+class DISCORDGAME_API FDiscordStorageIndex : public TSharedFromThis<FDiscordStorageIndex>
+{
+public:
+	explicit FDiscordStorageIndex(const TSharedRef<FDiscordStorage>& InStorage);
+
+	/** Rescan storage in the background; call once at startup, and whenever files may have changed behind our back */
+	void Refresh();
+
+	/** @return TRUE once the first refresh has completed */
+	bool IsReady() const { return bReady; }
+
+	/** @return TRUE while a refresh is scanning */
+	bool IsRefreshing() const { return bRefreshing; }
+
+	/** @return A file's entry, or nullptr if it doesn't exist */
+	const FDiscordStorageStat* Find(const FString& Name) const;
+
+	/** @return TRUE if a file exists */
+	bool Exists(const FString& Name) const { return Find(Name) != nullptr; }
+
+	/** @return Number of files */
+	int32 Num() const { return Entries.Num(); }
+
+	/** Get every file, newest first */
+	void GetFilesByNewest(TArray<FDiscordStorageStat>& OutFiles) const;
+
+	/** Write a file through storage, and index it once written */
+	TFuture<discord::Result> Write(const FString& Name, TArray<uint8>&& Data);
+
+	/** Delete a file through storage, and drop it from the index */
+	TFuture<discord::Result> Delete(const FString& Name);
+
+	/** Record a write made without going through the index */
+	void NoteWritten(const FString& Name, uint64 Size);
+
+	/** Record a delete made without going through the index */
+	void NoteDeleted(const FString& Name);
+
+	/** Event broadcast when a refresh changed the index */
+	FOnDiscordStorageIndexChanged& OnIndexChanged() { return IndexChangedEvent; }
+
+	/** Counters since the index was created */
+	uint64 NumRefreshes {0};
+	uint64 NumRefreshChanges {0};
+
+private:
+	struct FEntry
+	{
+		FDiscordStorageStat Stat;
+
+		/** ChangeSerial of our last local change to this file */
+		uint64 LocalSerial {0};
+	};
+
+	/** Apply a finished scan on the game thread */
+	void ApplyScan(TArray<FDiscordStorageStat>&& Scan, uint64 ScanSerial);
+
+	TSharedRef<FDiscordStorage> Storage;
+
+	/** Every file, by name */
+	TMap<FString, FEntry> Entries;
+
+	/** Files we deleted, and the ChangeSerial when we did, so a scan in progress can't resurrect them */
+	TMap<FString, uint64> RecentDeletes;
+
+	/** Incremented by every local change */
+	uint64 ChangeSerial {0};
+
+	bool bReady {false};
+	bool bRefreshing {false};
+	bool bRefreshAgain {false};
+
+	FOnDiscordStorageIndexChanged IndexChangedEvent;
+};
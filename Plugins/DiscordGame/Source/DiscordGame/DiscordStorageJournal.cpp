@@ -0,0 +1,413 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordStorageJournal.h"
+#include "DiscordGame.h"
+#include "HAL/FileManager.h"
+#include "Misc/Crc.h"
+#include "Misc/FileHelper.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+
+namespace DiscordStorageJournal
+{
+	/** "DSJB" */
+	static constexpr uint32 BaseMagic = 0x424a5344;
+
+	/** "DSJR" */
+	static constexpr uint32 RecordMagic = 0x524a5344;
+
+	/** Magic, Sequence, Size */
+	static constexpr int32 BaseHeaderSize = 4 + 4 + 8;
+
+	/** Magic, Sequence, NewSize, BlockSize, NumBlocks */
+	static constexpr int32 RecordHeaderSize = 4 + 4 + 8 + 4 + 4;
+
+	/** BlockIndex, Length */
+	static constexpr int32 BlockHeaderSize = 4 + 4;
+
+	/** Trailing CRC32 of a base file or record */
+	static constexpr int32 CrcSize = 4;
+}
+
+struct FDiscordStorageJournal::FFileState
+{
+	FString BasePath;
+	FString JournalPath;
+	FDiscordStorageJournalSettings Settings;
+
+	/** TRUE once the files have been read */
+	bool bLoaded {false};
+
+	/** TRUE if there is a saved state at all */
+	bool bExists {false};
+
+	/** The state as last saved, to diff the next save against */
+	TArray<uint8> Saved;
+
+	/** Sequence of the last record written, and of the last one folded into the base */
+	uint32 Sequence {0};
+	uint32 BaseSequence {0};
+
+	int64 JournalBytes {0};
+	int32 JournalRecords {0};
+
+	/** Read the base and replay the journal into Saved */
+	discord::Result LoadFiles();
+
+	/** Append a record of the blocks that differ between Saved and State */
+	FDiscordStorageJournalSaveResult AppendRecord(TArray<uint8>&& State);
+
+	/** Write Saved as a new base file, and start a new journal */
+	FDiscordStorageJournalSaveResult WriteBase();
+
+	/** @return TRUE if the journal is due for compaction */
+	bool ShouldCompact() const
+	{
+		return JournalRecords >= Settings.MaxJournalRecords
+			|| JournalBytes > static_cast<int64>(Saved.Num() * Settings.MaxJournalRatio);
+	}
+};
+
+discord::Result FDiscordStorageJournal::FFileState::LoadFiles()
+{
+	using namespace DiscordStorageJournal;
+
+	// Until this succeeds, Save won't build on a state it doesn't know
+	bLoaded = false;
+	bExists = false;
+	Saved.Reset();
+	Sequence = BaseSequence = 0;
+	JournalBytes = 0;
+	JournalRecords = 0;
+
+	TArray<uint8> Base;
+	if (FFileHelper::LoadFileToArray(Base, *BasePath, FILEREAD_Silent))
+	{
+		uint32 Magic {0};
+		uint64 Size {0};
+		uint32 Crc {0};
+		if (Base.Num() >= BaseHeaderSize + CrcSize)
+		{
+			FMemoryReaderView Reader(Base);
+			Reader << Magic << BaseSequence << Size;
+			FMemory::Memcpy(&Crc, Base.GetData() + Base.Num() - CrcSize, CrcSize);
+		}
+
+		if (Magic != BaseMagic
+			|| Size != static_cast<uint64>(Base.Num() - BaseHeaderSize - CrcSize)
+			|| Crc != FCrc::MemCrc32(Base.GetData(), Base.Num() - CrcSize))
+		{
+			// A base is only ever replaced by rename, so this isn't a torn write; the file is damaged
+			UE_LOG(LogDiscord, Error, TEXT("Storage journal base \"%s\" is corrupt"), *BasePath);
+			return discord::Result::InvalidPayload;
+		}
+
+		Saved.Append(Base.GetData() + BaseHeaderSize, static_cast<int32>(Size));
+		Sequence = BaseSequence;
+		bExists = true;
+	}
+
+	TArray<uint8> Journal;
+	if (!FFileHelper::LoadFileToArray(Journal, *JournalPath, FILEREAD_Silent))
+	{
+		bLoaded = true;
+		return bExists ? discord::Result::Ok : discord::Result::NotFound;
+	}
+
+	int64 Offset {0};
+	while (Offset + RecordHeaderSize + CrcSize <= Journal.Num())
+	{
+		FMemoryReaderView Reader(TConstArrayView<uint8>(Journal).RightChop(Offset));
+		uint32 Magic, RecordSequence, BlockSize, NumBlocks;
+		uint64 NewSize;
+		Reader << Magic << RecordSequence << NewSize << BlockSize << NumBlocks;
+		if (Magic != RecordMagic || BlockSize == 0)
+		{
+			break;
+		}
+
+		// Find the record's end, checking every length against what's actually there
+		int64 End = Offset + RecordHeaderSize;
+		bool bValid = true;
+		for (uint32 Block = 0; Block < NumBlocks && bValid; ++Block)
+		{
+			uint32 BlockIndex {0}, Length {0};
+			if (End + BlockHeaderSize > Journal.Num())
+			{
+				bValid = false;
+				break;
+			}
+			FMemory::Memcpy(&BlockIndex, Journal.GetData() + End, 4);
+			FMemory::Memcpy(&Length, Journal.GetData() + End + 4, 4);
+			End += BlockHeaderSize + Length;
+			bValid = End <= Journal.Num() && Length <= BlockSize && static_cast<uint64>(BlockIndex) * BlockSize + Length <= NewSize;
+		}
+
+		uint32 Crc {0};
+		if (bValid && End + CrcSize <= Journal.Num())
+		{
+			FMemory::Memcpy(&Crc, Journal.GetData() + End, CrcSize);
+			bValid = Crc == FCrc::MemCrc32(Journal.GetData() + Offset, End - Offset);
+		}
+		else
+		{
+			bValid = false;
+		}
+
+		if (!bValid)
+		{
+			// A save that was cut short; everything from here on is garbage
+			UE_LOG(LogDiscord, Warning, TEXT("Storage journal \"%s\" has a torn record at %lld; ignoring the rest"), *JournalPath, Offset);
+			break;
+		}
+
+		// Records already folded into the base (we crashed between writing it and dropping the journal) are skipped
+		if (RecordSequence > BaseSequence)
+		{
+			Saved.SetNumZeroed(static_cast<int32>(NewSize));
+
+			int64 BlockOffset = Offset + RecordHeaderSize;
+			for (uint32 Block = 0; Block < NumBlocks; ++Block)
+			{
+				uint32 BlockIndex, Length;
+				FMemory::Memcpy(&BlockIndex, Journal.GetData() + BlockOffset, 4);
+				FMemory::Memcpy(&Length, Journal.GetData() + BlockOffset + 4, 4);
+				FMemory::Memcpy(Saved.GetData() + static_cast<int64>(BlockIndex) * BlockSize, Journal.GetData() + BlockOffset + BlockHeaderSize, Length);
+				BlockOffset += BlockHeaderSize + Length;
+			}
+
+			Sequence = RecordSequence;
+			bExists = true;
+		}
+
+		Offset = End + CrcSize;
+		++JournalRecords;
+	}
+
+	JournalBytes = Journal.Num();
+	bLoaded = true;
+
+	if (Offset < Journal.Num())
+	{
+		// Never append after garbage; fold what we have into a fresh base now
+		const FDiscordStorageJournalSaveResult Compacted = WriteBase();
+		if (Compacted.Result != discord::Result::Ok)
+		{
+			// The garbage is still there; don't let Save append after it
+			bLoaded = false;
+			return Compacted.Result;
+		}
+	}
+
+	return bExists ? discord::Result::Ok : discord::Result::NotFound;
+}
+
+FDiscordStorageJournalSaveResult FDiscordStorageJournal::FFileState::AppendRecord(TArray<uint8>&& State)
+{
+	using namespace DiscordStorageJournal;
+
+	FDiscordStorageJournalSaveResult SaveResult;
+
+	const int32 BlockSize = Settings.BlockSize;
+	const int32 NumBlocks = FMath::DivideAndRoundUp(State.Num(), BlockSize);
+
+	TArray<uint8> Record;
+	FMemoryWriter Writer(Record);
+
+	uint32 Magic = RecordMagic;
+	uint32 RecordSequence = Sequence + 1;
+	uint64 NewSize = State.Num();
+	uint32 RecordBlockSize = BlockSize;
+	uint32 NumChanged = 0;
+	Writer << Magic << RecordSequence << NewSize << RecordBlockSize << NumChanged;
+
+	for (int32 Block = 0; Block < NumBlocks; ++Block)
+	{
+		const int64 Start = static_cast<int64>(Block) * BlockSize;
+		const int32 Length = static_cast<int32>(FMath::Min<int64>(BlockSize, State.Num() - Start));
+
+		// Blocks past the end of the old state, or cut short by it, are always changed
+		const bool bUnchanged = Start + Length <= Saved.Num()
+			&& FMemory::Memcmp(State.GetData() + Start, Saved.GetData() + Start, Length) == 0;
+		if (bUnchanged)
+		{
+			continue;
+		}
+
+		uint32 BlockIndex = Block;
+		uint32 BlockLength = Length;
+		Writer << BlockIndex << BlockLength;
+		Writer.Serialize(State.GetData() + Start, Length);
+		++NumChanged;
+	}
+
+	if (NumChanged == 0 && State.Num() == Saved.Num() && bExists)
+	{
+		// Nothing to write
+		return SaveResult;
+	}
+
+	// Now that we know it, patch the block count into the header
+	FMemory::Memcpy(Record.GetData() + RecordHeaderSize - 4, &NumChanged, 4);
+
+	uint32 Crc = FCrc::MemCrc32(Record.GetData(), Record.Num());
+	Writer << Crc;
+
+	TUniquePtr<FArchive> File(IFileManager::Get().CreateFileWriter(*JournalPath, FILEWRITE_Append | FILEWRITE_AllowRead));
+	if (!File.IsValid())
+	{
+		UE_LOG(LogDiscord, Error, TEXT("Can't open storage journal \"%s\" for append"), *JournalPath);
+		SaveResult.Result = discord::Result::InternalError;
+		return SaveResult;
+	}
+
+	File->Serialize(Record.GetData(), Record.Num());
+	if (!File->Close())
+	{
+		UE_LOG(LogDiscord, Error, TEXT("Error appending to storage journal \"%s\""), *JournalPath);
+
+		// Part of the record may be in the journal now, and nothing may be appended after it.
+		// Reloading finds the torn tail and compacts it away before the next record goes in.
+		bLoaded = false;
+
+		SaveResult.Result = discord::Result::InternalError;
+		return SaveResult;
+	}
+
+	Saved = MoveTemp(State);
+	Sequence = RecordSequence;
+	JournalBytes += Record.Num();
+	++JournalRecords;
+	bExists = true;
+
+	SaveResult.BytesWritten = Record.Num();
+	return SaveResult;
+}
+
+FDiscordStorageJournalSaveResult FDiscordStorageJournal::FFileState::WriteBase()
+{
+	using namespace DiscordStorageJournal;
+
+	FDiscordStorageJournalSaveResult SaveResult;
+	SaveResult.bCompacted = true;
+
+	TArray<uint8> Base;
+	Base.Reserve(BaseHeaderSize + Saved.Num() + CrcSize);
+	FMemoryWriter Writer(Base);
+
+	uint32 Magic = BaseMagic;
+	uint32 BaseSeq = Sequence;
+	uint64 Size = Saved.Num();
+	Writer << Magic << BaseSeq << Size;
+	Writer.Serialize(Saved.GetData(), Saved.Num());
+	uint32 Crc = FCrc::MemCrc32(Base.GetData(), Base.Num());
+	Writer << Crc;
+
+	// Replace atomically, so the old base survives a crash mid-write
+	if (FDiscordStorage::WriteFileAtomic(BasePath, Base) != discord::Result::Ok)
+	{
+		UE_LOG(LogDiscord, Error, TEXT("Error writing storage journal base \"%s\""), *BasePath);
+		SaveResult.Result = discord::Result::InternalError;
+		return SaveResult;
+	}
+
+	// Every record is in the base now.  If we crash before this, they're skipped by sequence on load.
+	IFileManager::Get().Delete(*JournalPath, false, false, true);
+
+	BaseSequence = Sequence;
+	JournalBytes = 0;
+	JournalRecords = 0;
+	bExists = true;
+
+	SaveResult.BytesWritten = Base.Num();
+	return SaveResult;
+}
+
+FDiscordStorageJournal::FDiscordStorageJournal(const TSharedRef<FDiscordStorage>& InStorage, const FString& InName, const FDiscordStorageJournalSettings& InSettings)
+	: Storage(InStorage)
+	, Name(InName)
+	, FileState(MakeShared<FFileState>())
+{
+	FileState->BasePath = Storage->GetFilePath(Name);
+	FileState->JournalPath = Storage->GetFilePath(GetJournalName());
+	FileState->Settings = InSettings;
+	FileState->Settings.BlockSize = FMath::Max(FileState->Settings.BlockSize, 64);
+	FileState->Settings.MaxJournalRecords = FMath::Max(FileState->Settings.MaxJournalRecords, 1);
+}
+
+TFuture<FDiscordStorageReadResult> FDiscordStorageJournal::Load()
+{
+	if (!FDiscordStorage::IsValidName(Name) || Storage->GetStoragePath().IsEmpty())
+	{
+		return MakeFulfilledPromise<FDiscordStorageReadResult>(FDiscordStorageReadResult {discord::Result::InvalidFilename}).GetFuture();
+	}
+
+	return Storage->RunOnIoPipe<FDiscordStorageReadResult>(TEXT("DiscordStorage.JournalLoad"), [FileState = FileState]()
+	{
+		FDiscordStorageReadResult ReadResult;
+		ReadResult.Result = FileState->LoadFiles();
+		if (ReadResult.Result == discord::Result::Ok)
+		{
+			ReadResult.Data = FileState->Saved;
+		}
+		return ReadResult;
+	});
+}
+
+TFuture<FDiscordStorageJournalSaveResult> FDiscordStorageJournal::Save(TArray<uint8>&& State)
+{
+	if (!FDiscordStorage::IsValidName(Name) || Storage->GetStoragePath().IsEmpty())
+	{
+		return MakeFulfilledPromise<FDiscordStorageJournalSaveResult>(FDiscordStorageJournalSaveResult {discord::Result::InvalidFilename}).GetFuture();
+	}
+
+	return Storage->RunOnIoPipe<FDiscordStorageJournalSaveResult>(TEXT("DiscordStorage.JournalSave"), [FileState = FileState, State = MoveTemp(State)]() mutable
+	{
+		if (!FileState->bLoaded)
+		{
+			// We have to know what's on disk to know what changed
+			const discord::Result LoadResult = FileState->LoadFiles();
+			if (LoadResult != discord::Result::Ok && LoadResult != discord::Result::NotFound)
+			{
+				return FDiscordStorageJournalSaveResult {LoadResult};
+			}
+		}
+
+		FDiscordStorageJournalSaveResult SaveResult = FileState->AppendRecord(MoveTemp(State));
+		if (SaveResult.Result == discord::Result::Ok && FileState->ShouldCompact())
+		{
+			const FDiscordStorageJournalSaveResult Compacted = FileState->WriteBase();
+			SaveResult.Result = Compacted.Result;
+			SaveResult.BytesWritten += Compacted.BytesWritten;
+			SaveResult.bCompacted = true;
+		}
+		return SaveResult;
+	});
+}
+
+TFuture<FDiscordStorageJournalSaveResult> FDiscordStorageJournal::Compact()
+{
+	if (!FDiscordStorage::IsValidName(Name) || Storage->GetStoragePath().IsEmpty())
+	{
+		return MakeFulfilledPromise<FDiscordStorageJournalSaveResult>(FDiscordStorageJournalSaveResult {discord::Result::InvalidFilename}).GetFuture();
+	}
+
+	return Storage->RunOnIoPipe<FDiscordStorageJournalSaveResult>(TEXT("DiscordStorage.JournalCompact"), [FileState = FileState]()
+	{
+		if (!FileState->bLoaded)
+		{
+			const discord::Result LoadResult = FileState->LoadFiles();
+			if (LoadResult != discord::Result::Ok)
+			{
+				return FDiscordStorageJournalSaveResult {LoadResult};
+			}
+		}
+
+		if (FileState->JournalRecords == 0)
+		{
+			return FDiscordStorageJournalSaveResult {};
+		}
+
+		return FileState->WriteBase();
+	});
+}
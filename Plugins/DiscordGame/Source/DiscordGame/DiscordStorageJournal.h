@@ -0,0 +1,87 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordStorage.h"
+
+/**
+ * Settings for FDiscordStorageJournal
+ */
+struct DISCORDGAME_API FDiscordStorageJournalSettings
+{
+	/** Granularity of change detection; a changed byte costs one block in the journal */
+	int32 BlockSize {4 * 1024};
+
+	/** Compact once the journal is bigger than the state times this */
+	float MaxJournalRatio {1.f};
+
+	/** Compact once the journal has this many saves in it */
+	int32 MaxJournalRecords {256};
+};
+
+/**
+ * Result of FDiscordStorageJournal::Save
+ */
+struct DISCORDGAME_API FDiscordStorageJournalSaveResult
+{
+	discord::Result Result {discord::Result::Ok};
+
+	/** Bytes this save wrote to disk */
+	int64 BytesWritten {0};
+
+	/** TRUE if this save compacted the journal into the base file */
+	bool bCompacted {false};
+};
+
+/**
+ * Discord Storage Journal
+ *
+ * Incremental saves for a blob that is saved often but changes little between
+ * saves (e.g. progression with autosave).
+ *
+ * The state lives in two storage files: a base file with a full copy, and a
+ * journal ("<Name>.journal") of changes since.  Each Save compares the new state
+ * to the last one block by block, and appends just the changed blocks to the
+ * journal as one checksummed record.  Once the journal grows past a fraction of
+ * the state (or too many records), the full state is compacted into a new base
+ * file and the journal starts over.  Load replays the journal on top of the base.
+ *
+ * Crashes are tolerated at every step: a torn record at the end of the journal
+ * fails its checksum and is ignored (losing only that save), the base file is
+ * replaced with FDiscordStorage::WriteFileAtomic, and records already folded
+ * into the base are skipped by sequence number.
+ *
+ * StorageManager can't append to a file, so all journal IO is done on the storage
+ * IO pipe, directly against the files in the storage directory.  Saves and loads
+ * run there in the order they were requested; diffing happens there too, so the
+ * game thread only hands over the new state.
+ */
+class DISCORDGAME_API FDiscordStorageJournal
+{
+public:
+	FDiscordStorageJournal(const TSharedRef<FDiscordStorage>& InStorage, const FString& InName, const FDiscordStorageJournalSettings& InSettings = FDiscordStorageJournalSettings());
+
+	/** Load the latest saved state; NotFound if it was never saved */
+	TFuture<FDiscordStorageReadResult> Load();
+
+	/** Save a new state, writing only what changed since the last Save or Load */
+	TFuture<FDiscordStorageJournalSaveResult> Save(TArray<uint8>&& State);
+
+	/** Fold the journal into the base file now */
+	TFuture<FDiscordStorageJournalSaveResult> Compact();
+
+	/** @return Name of the base file */
+	const FString& GetName() const { return Name; }
+
+	/** @return Name of the journal file */
+	FString GetJournalName() const { return Name + TEXT(".journal"); }
+
+private:
+	/** What we know of the files; only ever touched from the IO pipe */
+	struct FFileState;
+
+	TSharedRef<FDiscordStorage> Storage;
+	FString Name;
+	TSharedRef<FFileState> FileState;
+};
@@ -0,0 +1,163 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordStorageStream.h"
+#include "DiscordGame.h"
+
+FDiscordStorageStreamReader::FDiscordStorageStreamReader(const TSharedRef<FDiscordStorage>& InStorage, const FString& InName, const FDiscordStorageStreamSettings& InSettings)
+	: Storage(InStorage)
+	, Name(InName)
+	, Settings(InSettings)
+{
+	Settings.ChunkSize = FMath::Max(Settings.ChunkSize, 1024);
+	Settings.WindowSize = FMath::Max(Settings.WindowSize, 1);
+}
+
+void FDiscordStorageStreamReader::Start()
+{
+	if (!ensureMsgf(!bStreaming && NextRequestChunk == 0, TEXT("Storage stream \"%s\" started twice"), *Name))
+	{
+		return;
+	}
+
+	bStreaming = true;
+
+	// We need the size up front to know how many chunks to ask for
+	Storage->Stat(Name).Next([WeakThis = AsWeak()](const FDiscordStorageStat& Stat)
+	{
+		if (const TSharedPtr<FDiscordStorageStreamReader> This = WeakThis.Pin())
+		{
+			This->HandleStat(Stat);
+		}
+	});
+}
+
+void FDiscordStorageStreamReader::Cancel()
+{
+	Finish(discord::Result::TransactionAborted);
+}
+
+void FDiscordStorageStreamReader::HandleStat(const FDiscordStorageStat& Stat)
+{
+	if (!bStreaming)
+	{
+		return;
+	}
+
+	if (Stat.Result != discord::Result::Ok)
+	{
+		Finish(Stat.Result);
+		return;
+	}
+
+	FileSize = Stat.Size;
+	NumChunks = FMath::DivideAndRoundUp<uint64>(FileSize, Settings.ChunkSize);
+
+	// Never more slots than chunks, so small files don't allocate a full window
+	const int32 NumSlots = static_cast<int32>(FMath::Min<uint64>(NumChunks, Settings.WindowSize));
+	Slots.SetNum(NumSlots);
+	for (FSlot& Slot : Slots)
+	{
+		Slot.Buffer.Reserve(Settings.ChunkSize);
+	}
+
+	while (bStreaming && NextRequestChunk < NumChunks && NextRequestChunk < static_cast<uint64>(NumSlots))
+	{
+		RequestChunk(NextRequestChunk++);
+	}
+
+	if (bStreaming && NumChunks == 0)
+	{
+		Finish(discord::Result::Ok);
+	}
+}
+
+void FDiscordStorageStreamReader::RequestChunk(uint64 Chunk)
+{
+	FSlot& Slot = Slots[Chunk % Slots.Num()];
+	Slot.Chunk = Chunk;
+	Slot.bReady = false;
+
+	const uint64 Offset = Chunk * Settings.ChunkSize;
+	const uint64 Length = FMath::Min<uint64>(Settings.ChunkSize, FileSize - Offset);
+
+	Storage->ReadPartial(Name, Offset, Length, [WeakThis = AsWeak(), Chunk](discord::Result Result, TConstArrayView<uint8> Data)
+	{
+		if (const TSharedPtr<FDiscordStorageStreamReader> This = WeakThis.Pin())
+		{
+			This->HandleChunk(Chunk, Result, Data);
+		}
+	});
+}
+
+void FDiscordStorageStreamReader::HandleChunk(uint64 Chunk, discord::Result Result, TConstArrayView<uint8> Data)
+{
+	if (!bStreaming)
+	{
+		// Cancelled while this was in flight
+		return;
+	}
+
+	if (Result != discord::Result::Ok)
+	{
+		UE_LOG(LogDiscord, Warning, TEXT("Error(%i) Reading storage file \"%s\" chunk %llu"), Result, *Name, Chunk);
+		Finish(Result);
+		return;
+	}
+
+	// The slot's buffer keeps its allocation from chunk to chunk
+	FSlot& Slot = Slots[Chunk % Slots.Num()];
+	check(Slot.Chunk == Chunk);
+	Slot.Buffer.Reset();
+	Slot.Buffer.Append(Data.GetData(), Data.Num());
+	Slot.bReady = true;
+
+	DeliverReadyChunks();
+}
+
+void FDiscordStorageStreamReader::DeliverReadyChunks()
+{
+	while (bStreaming && NextDeliverChunk < NumChunks)
+	{
+		FSlot& Slot = Slots[NextDeliverChunk % Slots.Num()];
+		if (!Slot.bReady || Slot.Chunk != NextDeliverChunk)
+		{
+			// Still waiting on the chunk at the front; later ones wait their turn
+			return;
+		}
+
+		OnChunk.ExecuteIfBound(NextDeliverChunk * Settings.ChunkSize, Slot.Buffer);
+		++NextDeliverChunk;
+
+		if (!bStreaming)
+		{
+			// OnChunk cancelled us, and the ring is gone
+			return;
+		}
+
+		Slot.bReady = false;
+		if (NextRequestChunk < NumChunks)
+		{
+			RequestChunk(NextRequestChunk++);
+		}
+	}
+
+	if (bStreaming && NextDeliverChunk == NumChunks)
+	{
+		Finish(discord::Result::Ok);
+	}
+}
+
+void FDiscordStorageStreamReader::Finish(discord::Result Result)
+{
+	if (!bStreaming)
+	{
+		return;
+	}
+
+	bStreaming = false;
+
+	// Nothing will be delivered anymore, don't hold on to the ring
+	Slots.Empty();
+
+	OnComplete.ExecuteIfBound(Result);
+}
@@ -0,0 +1,109 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordStorage.h"
+
+/** Executed for each chunk of a stream, in order: (Offset, Data); Data is only valid during the call */
+DECLARE_DELEGATE_TwoParams(FOnDiscordStorageStreamChunk, uint64 /*Offset*/, TConstArrayView<uint8> /*Data*/);
+
+/** Executed once when a stream ends: Ok after the last chunk, or the error that stopped it */
+DECLARE_DELEGATE_OneParam(FOnDiscordStorageStreamComplete, discord::Result /*Result*/);
+
+/**
+ * Settings for FDiscordStorageStreamReader
+ */
+struct DISCORDGAME_API FDiscordStorageStreamSettings
+{
+	/** Bytes per ReadAsyncPartial request */
+	int32 ChunkSize {256 * 1024};
+
+	/** Requests kept in flight at once; peak memory is ChunkSize * WindowSize */
+	int32 WindowSize {4};
+};
+
+/**
+ * Discord Storage Stream Reader
+ *
+ * Streams a large storage file (e.g. a replay) to a consumer chunk by chunk,
+ * instead of materializing the whole file like ReadAsync.
+ *
+ * WindowSize ReadAsyncPartial requests are kept in flight ahead of the consumer,
+ * each reading into its own slot of a small ring of reusable buffers.  Chunks
+ * may complete in any order, but are handed to OnChunk strictly in file order,
+ * and each delivered slot is immediately reused for the next request.  Peak
+ * memory is bounded by the window, not the file.
+ *
+ * Cancel() stops the stream; requests still in flight are ignored when they land.
+ *
+ * Create this with MakeShared, since storage completions hold weak references to it.
+ */
+class DISCORDGAME_API FDiscordStorageStreamReader : public TSharedFromThis<FDiscordStorageStreamReader>
+{
+public:
+	FDiscordStorageStreamReader(const TSharedRef<FDiscordStorage>& InStorage, const FString& InName, const FDiscordStorageStreamSettings& InSettings = FDiscordStorageStreamSettings());
+
+	/** Executed for each chunk, in order; bind before Start */
+	FOnDiscordStorageStreamChunk OnChunk;
+
+	/** Executed once when the stream ends; bind before Start */
+	FOnDiscordStorageStreamComplete OnComplete;
+
+	/** Start streaming; call once */
+	void Start();
+
+	/** Stop streaming; OnComplete is executed with TransactionAborted */
+	void Cancel();
+
+	/** @return TRUE between Start and the end of the stream */
+	bool IsStreaming() const { return bStreaming; }
+
+	/** @return Size of the file, once known */
+	uint64 GetFileSize() const { return FileSize; }
+
+	/** @return Bytes handed to OnChunk so far */
+	uint64 GetBytesDelivered() const { return FMath::Min<uint64>(NextDeliverChunk * Settings.ChunkSize, FileSize); }
+
+private:
+	struct FSlot
+	{
+		TArray<uint8> Buffer;
+
+		/** Chunk this slot is reading, or holding */
+		uint64 Chunk {0};
+
+		/** TRUE once the chunk's data is in Buffer */
+		bool bReady {false};
+	};
+
+	/** Called once the file size is known */
+	void HandleStat(const FDiscordStorageStat& Stat);
+
+	/** Issue the read for a chunk into its slot */
+	void RequestChunk(uint64 Chunk);
+
+	/** Called when a chunk's read lands */
+	void HandleChunk(uint64 Chunk, discord::Result Result, TConstArrayView<uint8> Data);
+
+	/** Hand every ready chunk at the front of the window to OnChunk, and refill the window */
+	void DeliverReadyChunks();
+
+	/** End the stream, once */
+	void Finish(discord::Result Result);
+
+	TSharedRef<FDiscordStorage> Storage;
+	FString Name;
+	FDiscordStorageStreamSettings Settings;
+
+	TArray<FSlot> Slots;
+
+	uint64 FileSize {0};
+	uint64 NumChunks {0};
+
+	/** Next chunk to request, and next chunk to hand to OnChunk */
+	uint64 NextRequestChunk {0};
+	uint64 NextDeliverChunk {0};
+
+	bool bStreaming {false};
+};
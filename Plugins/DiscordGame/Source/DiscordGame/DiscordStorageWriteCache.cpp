@@ -0,0 +1,327 @@
+// Copyright (c) 2024 xist.gg
+
+#include "DiscordStorageWriteCache.h"
+#include "DiscordGame.h"
+
+FDiscordStorageWriteCache::FDiscordStorageWriteCache(const TSharedRef<FDiscordStorage>& InStorage, const FDiscordStorageWriteCacheSettings& InSettings)
+	: Storage(InStorage)
+	, Settings(InSettings)
+{
+}
+
+void FDiscordStorageWriteCache::Write(const FString& Name, TArray<uint8>&& Data)
+{
+	if (!FDiscordStorage::IsValidName(Name))
+	{
+		// Would fail on every flush forever; better to say so once, now
+		UE_LOG(LogDiscord, Error, TEXT("Invalid storage file name \"%s\"; write dropped"), *Name);
+		return;
+	}
+
+	const double Now = FPlatformTime::Seconds();
+	++NumWrites;
+
+	FEntry& Entry = Entries.FindOrAdd(Name);
+	if (Entry.bDirty)
+	{
+		// The previous version never reached disk, and now never will
+		++NumWritesCoalesced;
+		DirtyBytes -= Entry.Data.Num();
+	}
+	else
+	{
+		Entry.bDirty = true;
+		Entry.FirstDirtyTime = Now;
+	}
+
+	Entry.Data = MoveTemp(Data);
+	Entry.LastWriteTime = Now;
+	DirtyBytes += Entry.Data.Num();
+
+	Entry.bDeleted = false;
+	if (Entry.PendingDeletes.Num() > 0)
+	{
+		// Written again before the delete happened; the delete is moot
+		for (const TSharedRef<TPromise<discord::Result>>& PendingDelete : Entry.PendingDeletes)
+		{
+			PendingDelete->SetValue(discord::Result::Ok);
+		}
+		Entry.PendingDeletes.Reset();
+	}
+
+	if (Settings.MaxDirtyBytes > 0 && DirtyBytes > Settings.MaxDirtyBytes)
+	{
+		Flush();
+	}
+}
+
+TFuture<FDiscordStorageReadResult> FDiscordStorageWriteCache::Read(const FString& Name)
+{
+	if (const FEntry* Entry = Entries.Find(Name))
+	{
+		++NumReadHits;
+
+		if (Entry->bDeleted)
+		{
+			return MakeFulfilledPromise<FDiscordStorageReadResult>(FDiscordStorageReadResult {discord::Result::NotFound}).GetFuture();
+		}
+
+		// Dirty or in flight, memory has the latest version
+		return MakeFulfilledPromise<FDiscordStorageReadResult>(FDiscordStorageReadResult {discord::Result::Ok, Entry->Data}).GetFuture();
+	}
+
+	return Storage->Read(Name);
+}
+
+TFuture<discord::Result> FDiscordStorageWriteCache::Delete(const FString& Name)
+{
+	if (!FDiscordStorage::IsValidName(Name))
+	{
+		// Fails right away; nothing to keep track of
+		return Storage->Delete(Name);
+	}
+
+	FEntry& Entry = Entries.FindOrAdd(Name);
+	if (Entry.bDirty)
+	{
+		DirtyBytes -= Entry.Data.Num();
+	}
+
+	Entry.Data.Empty();
+	Entry.bDirty = false;
+	Entry.bDeleted = true;
+
+	if (!Entry.bInFlight)
+	{
+		return StartDelete(Name);
+	}
+
+	// Deleting now would race the write in flight, which could then recreate the file
+	return Entry.PendingDeletes.Add_GetRef(MakeShared<TPromise<discord::Result>>())->GetFuture();
+}
+
+TFuture<discord::Result> FDiscordStorageWriteCache::StartDelete(const FString& Name)
+{
+	// The entry stays as a tombstone until the delete is done, so a later write of the file waits for it
+	++Entries.FindChecked(Name).NumDeletesInFlight;
+
+	TSharedRef<TPromise<discord::Result>> Promise = MakeShared<TPromise<discord::Result>>();
+	TFuture<discord::Result> Future = Promise->GetFuture();
+
+	// This may complete right here, and remove the entry
+	Storage->Delete(Name).Next([WeakThis = AsWeak(), Name, Promise](discord::Result Result)
+	{
+		if (const TSharedPtr<FDiscordStorageWriteCache> This = WeakThis.Pin())
+		{
+			This->HandleDeleteComplete(Name);
+		}
+		Promise->SetValue(Result);
+	});
+
+	return Future;
+}
+
+void FDiscordStorageWriteCache::Tick()
+{
+	const double Now = FPlatformTime::Seconds();
+
+	TArray<FString, TInlineAllocator<8>> Due;
+	for (const TPair<FString, FEntry>& It : Entries)
+	{
+		const FEntry& Entry = It.Value;
+		if (!Entry.bDirty || Entry.bInFlight || Entry.NumDeletesInFlight > 0)
+		{
+			continue;
+		}
+
+		if (Now - Entry.LastWriteTime >= Settings.IdleSeconds || Now - Entry.FirstDirtyTime >= Settings.MaxDelaySeconds)
+		{
+			Due.Add(It.Key);
+		}
+	}
+
+	FlushEntries(Due);
+}
+
+void FDiscordStorageWriteCache::Flush()
+{
+	TArray<FString, TInlineAllocator<8>> Due;
+	for (const TPair<FString, FEntry>& It : Entries)
+	{
+		if (It.Value.bDirty && !It.Value.bInFlight && It.Value.NumDeletesInFlight == 0)
+		{
+			Due.Add(It.Key);
+		}
+	}
+
+	FlushEntries(Due);
+}
+
+int32 FDiscordStorageWriteCache::FlushBlocking()
+{
+	int32 NumErrors {0};
+
+	// A blocking write must not race a write in flight, which could land after it with older contents.
+	// Wait for those first; their completions may start more, which we wait for too.
+	const auto HasWritesInFlight = [this]()
+	{
+		for (const TPair<FString, FEntry>& It : Entries)
+		{
+			if (It.Value.bInFlight)
+			{
+				return true;
+			}
+		}
+		return false;
+	};
+
+	const double Deadline = FPlatformTime::Seconds() + Settings.FlushBlockingTimeoutSeconds;
+	while (HasWritesInFlight())
+	{
+		if (FPlatformTime::Seconds() > Deadline)
+		{
+			UE_LOG(LogDiscord, Error, TEXT("Timed out waiting for storage writes in flight; files still being written won't be flushed"));
+			break;
+		}
+
+		const discord::Result Result = Storage->PumpCallbacks();
+		if (Result != discord::Result::Ok)
+		{
+			UE_LOG(LogDiscord, Error, TEXT("Error(%i) RunCallbacks while waiting for storage writes in flight; files still being written won't be flushed"), Result);
+			break;
+		}
+
+		FPlatformProcess::Sleep(0.001f);
+	}
+
+	for (TPair<FString, FEntry>& It : Entries)
+	{
+		FEntry& Entry = It.Value;
+		if (!Entry.bDirty)
+		{
+			continue;
+		}
+
+		if (Entry.bInFlight || Entry.NumDeletesInFlight > 0)
+		{
+			// Still in flight after all; writing over it could be undone by it.
+			// Deletes only complete in game thread tasks, which we can't wait for here.
+			UE_LOG(LogDiscord, Error, TEXT("Storage file \"%s\" is still being written or deleted; not flushed at shutdown"), *It.Key);
+			++NumErrors;
+			continue;
+		}
+
+		const discord::Result Result = Storage->WriteBlocking(It.Key, Entry.Data);
+		if (Result != discord::Result::Ok)
+		{
+			UE_LOG(LogDiscord, Error, TEXT("Error(%i) Writing storage file \"%s\" at shutdown"), Result, *It.Key);
+			++NumErrors;
+			continue;
+		}
+
+		++NumFlushes;
+		DirtyBytes -= Entry.Data.Num();
+		Entry.bDirty = false;
+	}
+
+	return NumErrors;
+}
+
+bool FDiscordStorageWriteCache::IsDirty(const FString& Name) const
+{
+	const FEntry* Entry = Entries.Find(Name);
+	return Entry && (Entry->bDirty || Entry->bInFlight);
+}
+
+void FDiscordStorageWriteCache::FlushEntries(TConstArrayView<FString> Names)
+{
+	// Names are collected first, since a write that fails immediately completes (and may remove its entry) right here
+	for (const FString& Name : Names)
+	{
+		FEntry* Entry = Entries.Find(Name);
+		if (!Entry || !Entry->bDirty || Entry->bInFlight || Entry->NumDeletesInFlight > 0)
+		{
+			continue;
+		}
+
+		// Keep our copy, to answer reads until the write lands
+		TArray<uint8> Data = Entry->Data;
+
+		DirtyBytes -= Entry->Data.Num();
+		Entry->bDirty = false;
+		Entry->bInFlight = true;
+		++NumFlushes;
+
+		Storage->Write(Name, MoveTemp(Data)).Next([WeakThis = AsWeak(), Name](discord::Result Result)
+		{
+			if (const TSharedPtr<FDiscordStorageWriteCache> This = WeakThis.Pin())
+			{
+				This->HandleFlushComplete(Name, Result);
+			}
+		});
+	}
+}
+
+void FDiscordStorageWriteCache::HandleFlushComplete(const FString& Name, discord::Result Result)
+{
+	FEntry* Entry = Entries.Find(Name);
+	if (!ensure(Entry))
+	{
+		return;
+	}
+
+	Entry->bInFlight = false;
+
+	if (Result != discord::Result::Ok)
+	{
+		UE_LOG(LogDiscord, Warning, TEXT("Error(%i) Writing storage file \"%s\""), Result, *Name);
+		++NumFlushErrors;
+	}
+
+	if (Entry->PendingDeletes.Num() > 0)
+	{
+		// Whatever happened to the write, the file is going away now
+		TArray<TSharedRef<TPromise<discord::Result>>> PendingDeletes = MoveTemp(Entry->PendingDeletes);
+
+		StartDelete(Name).Next([PendingDeletes](discord::Result DeleteResult)
+		{
+			for (const TSharedRef<TPromise<discord::Result>>& PendingDelete : PendingDeletes)
+			{
+				PendingDelete->SetValue(DeleteResult);
+			}
+		});
+		return;
+	}
+
+	if (Result != discord::Result::Ok && !Entry->bDirty)
+	{
+		// No newer version is waiting, so this one goes back in line to be retried
+		Entry->bDirty = true;
+		Entry->FirstDirtyTime = Entry->LastWriteTime = FPlatformTime::Seconds();
+		DirtyBytes += Entry->Data.Num();
+		return;
+	}
+
+	if (!Entry->bDirty && Entry->NumDeletesInFlight == 0)
+	{
+		// Disk is up to date; we're not a read cache, so let the memory go
+		Entries.Remove(Name);
+	}
+}
+
+void FDiscordStorageWriteCache::HandleDeleteComplete(const FString& Name)
+{
+	FEntry* Entry = Entries.Find(Name);
+	if (!ensure(Entry))
+	{
+		return;
+	}
+
+	--Entry->NumDeletesInFlight;
+
+	if (!Entry->bDirty && !Entry->bInFlight && Entry->NumDeletesInFlight == 0)
+	{
+		// Nothing was written meanwhile, so the tombstone can go; a write that was is due at the next Tick
+		Entries.Remove(Name);
+	}
+}
@@ -0,0 +1,142 @@
+// Copyright (c) 2024 xist.gg
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DiscordStorage.h"
+
+/**
+ * Settings for FDiscordStorageWriteCache
+ */
+struct DISCORDGAME_API FDiscordStorageWriteCacheSettings
+{
+	/** Flush a file once it hasn't been written for this long */
+	float IdleSeconds {1.f};
+
+	/** Flush a file that keeps being written at least this often */
+	float MaxDelaySeconds {10.f};
+
+	/** Flush everything once this many bytes are dirty; <= 0 means no limit */
+	int64 MaxDirtyBytes {4 * 1024 * 1024};
+
+	/** How long FlushBlocking waits for writes already in flight */
+	float FlushBlockingTimeoutSeconds {5.f};
+};
+
+/**
+ * Discord Storage Write Cache
+ *
+ * Write-behind layer in front of FDiscordStorage for files that are written
+ * far more often than they need to reach disk (settings, progression, ...).
+ *
+ * Write() just replaces the file's pending contents in memory; repeated writes
+ * of the same file coalesce into the latest version, and only that one is
+ * written, once the file has been idle for IdleSeconds (or dirty for
+ * MaxDelaySeconds).  Reads of a file with pending contents are answered from
+ * memory, so callers always see their latest write.
+ *
+ * Each file has at most one write or delete in flight; anything written meanwhile
+ * waits for it, so the disk never ends up with an older version than memory.
+ *
+ * Call Tick() once per frame, and FlushBlocking() before shutdown so nothing is
+ * lost, while the DiscordCore is still healthy.  By the time NativeOnDiscordCoreReset
+ * or OnDiscordCoreReset runs the core may already have failed, and a flush then
+ * would lose the writes.
+ *
+ * Create this with MakeShared, since storage completions hold weak references to it.
+ */
+class DISCORDGAME_API FDiscordStorageWriteCache : public TSharedFromThis<FDiscordStorageWriteCache>
+{
+public:
+	FDiscordStorageWriteCache(const TSharedRef<FDiscordStorage>& InStorage, const FDiscordStorageWriteCacheSettings& InSettings = FDiscordStorageWriteCacheSettings());
+
+	/** Replace a file's contents; it reaches disk later */
+	void Write(const FString& Name, TArray<uint8>&& Data);
+
+	/** Read a file, from memory if it has unwritten contents */
+	TFuture<FDiscordStorageReadResult> Read(const FString& Name);
+
+	/** Drop a file's unwritten contents and delete it from disk */
+	TFuture<discord::Result> Delete(const FString& Name);
+
+	/** Flush files that are due; call once per frame */
+	void Tick();
+
+	/** Start writing every dirty file now, without waiting for it to go idle */
+	void Flush();
+
+	/**
+	 * Write every dirty file synchronously.  Blocks the game thread; use at shutdown.
+	 * Writes already in flight are waited for first (pumping the SDK's callbacks, see
+	 * FDiscordStorage::PumpCallbacks), so a newer version is never overtaken by an older one.
+	 * Files still being written or deleted after FlushBlockingTimeoutSeconds are not written.
+	 *
+	 * MUST NOT be called from a Discord callback or a game thread task, including
+	 * continuations of storage futures.
+	 *
+	 * @return Number of files that failed to write
+	 */
+	int32 FlushBlocking();
+
+	/** @return TRUE if a file has contents that haven't reached disk yet */
+	bool IsDirty(const FString& Name) const;
+
+	/** @return Bytes waiting to be written */
+	int64 GetDirtyBytes() const { return DirtyBytes; }
+
+	/** Counters since the cache was created */
+	uint64 NumWrites {0};
+	uint64 NumWritesCoalesced {0};
+	uint64 NumFlushes {0};
+	uint64 NumFlushErrors {0};
+	uint64 NumReadHits {0};
+
+private:
+	struct FEntry
+	{
+		/** Latest contents, whether or not they've been written */
+		TArray<uint8> Data;
+
+		/** TRUE if Data hasn't been handed to storage yet */
+		bool bDirty {false};
+
+		/** TRUE while a write of this file is in flight */
+		bool bInFlight {false};
+
+		/** TRUE if the file was deleted since it was last written; reads say it's not found */
+		bool bDeleted {false};
+
+		/**
+		 * Deletes of this file in flight.  They run on the storage IO pipe, which isn't
+		 * ordered with our writes, so nothing is written until they're done.
+		 */
+		int32 NumDeletesInFlight {0};
+
+		double FirstDirtyTime {0.};
+		double LastWriteTime {0.};
+
+		/** Set if Delete was called while a write was in flight; the delete happens after it */
+		TArray<TSharedRef<TPromise<discord::Result>>> PendingDeletes;
+	};
+
+	/** Hand each named entry's dirty contents to storage */
+	void FlushEntries(TConstArrayView<FString> Names);
+
+	/** Called on the game thread when a flush finishes */
+	void HandleFlushComplete(const FString& Name, discord::Result Result);
+
+	/** Delete a file that has an entry and no write in flight; the entry stays until the delete is done */
+	TFuture<discord::Result> StartDelete(const FString& Name);
+
+	/** Called on the game thread when a delete finishes */
+	void HandleDeleteComplete(const FString& Name);
+
+	TSharedRef<FDiscordStorage> Storage;
+	FDiscordStorageWriteCacheSettings Settings;
+
+	/** Files with unwritten or in-flight contents */
+	TMap<FString, FEntry> Entries;
+
+	/** Total size of dirty entries */
+	int64 DirtyBytes {0};
+};